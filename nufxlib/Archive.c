@@ -53,7 +53,7 @@ static void Nu_CloseAndFree(NuArchive* pArchive);
 /*
  * Allocate and initialize a new NuArchive structure.
  */
-static NuError Nu_NuArchiveNew(NuArchive** ppArchive)
+NuError Nu_NuArchiveNew(NuArchive** ppArchive)
 {
     Assert(ppArchive != NULL);
 
@@ -66,6 +66,7 @@ static NuError Nu_NuArchiveNew(NuArchive** ppArchive)
         return kNuErrMalloc;
 
     (*ppArchive)->structMagic = kNuArchiveStructMagic;
+    (*ppArchive)->pAllocator = Nu_GetAllocator(NULL);
 
     (*ppArchive)->recordIdxSeed = 1000; /* could be a random number */
     (*ppArchive)->nextRecordIdx = (*ppArchive)->recordIdxSeed;
@@ -95,30 +96,57 @@ static NuError Nu_NuArchiveNew(NuArchive** ppArchive)
     (*ppArchive)->valJunkSkipMax = kDefaultJunkSkipMax;
     (*ppArchive)->valIgnoreLZW2Len = false;
     (*ppArchive)->valHandleBadMac = false;
+    (*ppArchive)->valWorkerThreads = 1;
+    (*ppArchive)->valDeflateLevel = 9;
+    (*ppArchive)->valDeflateStrategy = kNuDeflateStrategyDefault;
+    (*ppArchive)->valBzip2BlockSize = 8;
+    (*ppArchive)->valLZCBits = 16;
+    (*ppArchive)->valBestOfFormats = NuMakeFormatMask(kNuThreadFormatLZW2) |
+        NuMakeFormatMask(kNuThreadFormatDeflate) |
+        NuMakeFormatMask(kNuThreadFormatBzip2);
+    (*ppArchive)->valBestOfTimeLimit = 0;
+    (*ppArchive)->valCompressPolicy = false;
+    (*ppArchive)->valReadAhead = false;
+    (*ppArchive)->valWriteBehind = false;
+    (*ppArchive)->valCompactInPlace = false;
+    (*ppArchive)->valMemTempLimit = 0;
+    (*ppArchive)->valOutputQueueLimit = 0;
+    (*ppArchive)->valInputPrefetch = 0;
+    (*ppArchive)->valStatsTiming = false;
 
     (*ppArchive)->messageHandlerFunc = gNuGlobalErrorMessageHandler;
 
+    /* pick up codec state left behind by an earlier archive, if any */
+    Nu_CodecPoolAttach(*ppArchive);
+
     return kNuErrNone;
 }
 
 /*
  * Free up a NuArchive structure and its contents.
  */
-static NuError Nu_NuArchiveFree(NuArchive* pArchive)
+NuError Nu_NuArchiveFree(NuArchive* pArchive)
 {
+    int i;
+
     Assert(pArchive != NULL);
     Assert(pArchive->structMagic == kNuArchiveStructMagic);
 
-    (void) Nu_RecordSet_FreeAllRecords(pArchive, &pArchive->origRecordSet);
+    Nu_RecordSet_DiscardAllRecords(pArchive, &pArchive->origRecordSet);
     pArchive->haveToc = false;
-    (void) Nu_RecordSet_FreeAllRecords(pArchive, &pArchive->copyRecordSet);
-    (void) Nu_RecordSet_FreeAllRecords(pArchive, &pArchive->newRecordSet);
+    Nu_RecordSet_DiscardAllRecords(pArchive, &pArchive->copyRecordSet);
+    Nu_RecordSet_DiscardAllRecords(pArchive, &pArchive->newRecordSet);
+    Nu_ArenaDestroy(pArchive);
 
+    Nu_ReadAheadFree(pArchive);
     Nu_Free(NULL, pArchive->archivePathnameUNI);
     Nu_Free(NULL, pArchive->tmpPathnameUNI);
-    Nu_Free(NULL, pArchive->compBuf);
-    Nu_Free(NULL, pArchive->lzwCompressState);
-    Nu_Free(NULL, pArchive->lzwExpandState);
+    Nu_CodecPoolRelease(pArchive);
+    Nu_FreeCompressPolicy(pArchive);
+    for (i = 0; i < (int) NELEM(pArchive->bestOfScratch); i++) {
+        if (pArchive->bestOfScratch[i] != NULL)
+            (void) Nu_NuArchiveFree(pArchive->bestOfScratch[i]);
+    }
 
     /* mark it as deceased to prevent further use, then free it */
     pArchive->structMagic = kNuArchiveStructMagic ^ 0xffffffff;
@@ -206,9 +234,9 @@ NuError Nu_CopyWrapperToTemp(NuArchive* pArchive)
 
     Assert(pArchive->headerOffset);     /* no wrapper to copy?? */
 
-    err = Nu_FSeek(pArchive->archiveFp, 0, SEEK_SET);
+    err = Nu_FSeek(pArchive, pArchive->archiveFp, 0, SEEK_SET);
     BailError(err);
-    err = Nu_FSeek(pArchive->tmpFp, 0, SEEK_SET);
+    err = Nu_FSeek(pArchive, pArchive->tmpFp, 0, SEEK_SET);
     BailError(err);
     err = Nu_CopyFileSection(pArchive, pArchive->tmpFp,
             pArchive->archiveFp, pArchive->headerOffset);
@@ -272,7 +300,7 @@ NuError Nu_UpdateWrapper(NuArchive* pArchive, FILE* fp)
             goto bail;
     }
 
-    err = Nu_FSeek(fp, pArchive->junkOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, fp, pArchive->junkOffset, SEEK_SET);
     BailError(err);
 
     if (hasBinary2) {
@@ -294,31 +322,35 @@ NuError Nu_UpdateWrapper(NuArchive* pArchive, FILE* fp)
                         kNuBinary2BlockSize;
         archiveLen512 = (archiveLen + 511) / 512;
 
-        err = Nu_FSeek(fp, kNuBNYFileSizeLo - kNufileIDLen, SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuBNYFileSizeLo - kNufileIDLen, SEEK_CUR);
         BailError(err);
         Nu_WriteTwo(pArchive, fp, (uint16_t)(archiveLen512 & 0xffff));
 
-        err = Nu_FSeek(fp, kNuBNYFileSizeHi - (kNuBNYFileSizeLo+2), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuBNYFileSizeHi - (kNuBNYFileSizeLo+2),
+                SEEK_CUR);
         BailError(err);
         Nu_WriteTwo(pArchive, fp, (uint16_t)(archiveLen512 >> 16));
 
-        err = Nu_FSeek(fp, kNuBNYEOFLo - (kNuBNYFileSizeHi+2), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuBNYEOFLo - (kNuBNYFileSizeHi+2),
+                SEEK_CUR);
         BailError(err);
         Nu_WriteTwo(pArchive, fp, (uint16_t)(archiveLen & 0xffff));
         Nu_WriteOne(pArchive, fp, (uint8_t)((archiveLen >> 16) & 0xff));
 
-        err = Nu_FSeek(fp, kNuBNYEOFHi - (kNuBNYEOFLo+3), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuBNYEOFHi - (kNuBNYEOFLo+3), SEEK_CUR);
         BailError(err);
         Nu_WriteOne(pArchive, fp, (uint8_t)(archiveLen >> 24));
 
-        err = Nu_FSeek(fp, kNuBNYDiskSpace - (kNuBNYEOFHi+1), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuBNYDiskSpace - (kNuBNYEOFHi+1),
+                SEEK_CUR);
         BailError(err);
         Nu_WriteFour(pArchive, fp, archiveLen512);
 
         /* probably ought to update "modified when" date/time field */
 
         /* seek just past end of BNY wrapper */
-        err = Nu_FSeek(fp, kNuBinary2BlockSize - (kNuBNYDiskSpace+4), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuBinary2BlockSize - (kNuBNYDiskSpace+4),
+                SEEK_CUR);
         BailError(err);
 
         if ((err = Nu_HeaderIOFailed(pArchive, fp)) != kNuErrNone) {
@@ -342,20 +374,23 @@ NuError Nu_UpdateWrapper(NuArchive* pArchive, FILE* fp)
 
         archiveLen = pArchive->newMasterHeader.mhMasterEOF;
 
-        err = Nu_FSeek(fp, kNuSEAFunkySize - kNufileIDLen, SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuSEAFunkySize - kNufileIDLen, SEEK_CUR);
         BailError(err);
         Nu_WriteFour(pArchive, fp, archiveLen + kNuSEAFunkyAdjust);
 
-        err = Nu_FSeek(fp, kNuSEALength1 - (kNuSEAFunkySize+4), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuSEALength1 - (kNuSEAFunkySize+4),
+                SEEK_CUR);
         BailError(err);
         Nu_WriteTwo(pArchive, fp, (uint16_t)archiveLen);
 
-        err = Nu_FSeek(fp, kNuSEALength2 - (kNuSEALength1+2), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuSEALength2 - (kNuSEALength1+2),
+                SEEK_CUR);
         BailError(err);
         Nu_WriteTwo(pArchive, fp, (uint16_t)archiveLen);
 
         /* seek past end of SEA wrapper */
-        err = Nu_FSeek(fp, kNuSEAOffset - (kNuSEALength2+2), SEEK_CUR);
+        err = Nu_FSeek(pArchive, fp, kNuSEAOffset - (kNuSEALength2+2),
+                SEEK_CUR);
         BailError(err);
 
         if ((err = Nu_HeaderIOFailed(pArchive, fp)) != kNuErrNone) {
@@ -419,7 +454,7 @@ NuError Nu_AdjustWrapperPadding(NuArchive* pArchive, FILE* fp)
             goto bail;
     }
 
-    err = Nu_FSeek(fp, 0, SEEK_END);
+    err = Nu_FSeek(pArchive, fp, 0, SEEK_END);
     BailError(err);
 
     if (hasSea && pArchive->valMimicSHK) {
@@ -431,7 +466,7 @@ NuError Nu_AdjustWrapperPadding(NuArchive* pArchive, FILE* fp)
         /* pad out to the next 128-byte boundary */
         long curOffset;
 
-        err = Nu_FTell(fp, &curOffset);
+        err = Nu_FTell(pArchive, fp, &curOffset);
         BailError(err);
         curOffset -= pArchive->junkOffset;  /* don't factor junk into account */
 
@@ -743,7 +778,7 @@ NuError Nu_StreamOpenRO(FILE* infp, NuArchive** ppArchive)
 
     pArchive->openMode = kNuOpenStreamingRO;
     pArchive->archiveFp = infp;
-    pArchive->archivePathnameUNI = strdup("(stream)");
+    pArchive->archivePathnameUNI = Nu_Strdup(pArchive, "(stream)");
 
     err = Nu_ReadMasterHeader(pArchive);
     BailError(err);
@@ -791,7 +826,7 @@ NuError Nu_OpenRO(const UNICHAR* archivePathnameUNI, NuArchive** ppArchive)
     pArchive->openMode = kNuOpenRO;
     pArchive->archiveFp = fp;
     fp = NULL;
-    pArchive->archivePathnameUNI = strdup(archivePathnameUNI);
+    pArchive->archivePathnameUNI = Nu_Strdup(pArchive, archivePathnameUNI);
 
     err = Nu_ReadMasterHeader(pArchive);
     BailError(err);
@@ -993,7 +1028,7 @@ NuError Nu_OpenRW(const UNICHAR* archivePathnameUNI,
      * So, create a temp file whether we think we need one or not.  Won't
      * do any harm, and might save us some troubles later.
      */
-    tmpPathDup = strdup(tmpPathnameUNI);
+    tmpPathDup = Nu_Strdup(NULL, tmpPathnameUNI);
     BailNil(tmpPathDup);
     err = Nu_OpenTempFile(tmpPathDup, &tmpFp);
     if (err != kNuErrNone) {
@@ -1009,7 +1044,7 @@ NuError Nu_OpenRW(const UNICHAR* archivePathnameUNI,
 
     pArchive->openMode = kNuOpenRW;
     pArchive->newlyCreated = newlyCreated;
-    pArchive->archivePathnameUNI = strdup(archivePathnameUNI);
+    pArchive->archivePathnameUNI = Nu_Strdup(pArchive, archivePathnameUNI);
     pArchive->archiveFp = fp;
     fp = NULL;
     pArchive->tmpFp = tmpFp;
@@ -1020,6 +1055,10 @@ NuError Nu_OpenRW(const UNICHAR* archivePathnameUNI,
     if (archiveExists && !newlyCreated) {
         err = Nu_ReadMasterHeader(pArchive);
         BailError(err);
+
+        /* finish a compaction that was interrupted by a crash */
+        err = Nu_CompactRecover(pArchive);
+        BailError(err);
     } else {
         Nu_InitNewArchive(pArchive);
     }
@@ -1066,7 +1105,7 @@ NuError Nu_WriteMasterHeader(NuArchive* pArchive, FILE* fp,
     crc = 0;
 
     Nu_WriteBytes(pArchive, fp, pHeader->mhNufileID, kNufileIDLen);
-    err = Nu_FTell(fp, &crcOffset);
+    err = Nu_FTell(pArchive, fp, &crcOffset);
     BailError(err);
     Nu_WriteTwo(pArchive, fp, 0);
     Nu_WriteFourC(pArchive, fp, pHeader->mhTotalRecords, &crc);
@@ -1081,7 +1120,7 @@ NuError Nu_WriteMasterHeader(NuArchive* pArchive, FILE* fp,
     
     /* go back and write the CRC (sadly, the seek will flush the stdio buf) */
     pHeader->mhMasterCRC = crc;
-    err = Nu_FSeek(fp, crcOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, fp, crcOffset, SEEK_SET);
     BailError(err);
     Nu_WriteTwo(pArchive, fp, pHeader->mhMasterCRC);
 
@@ -1113,6 +1152,10 @@ bail:
  */
 static void Nu_CloseAndFree(NuArchive* pArchive)
 {
+    Nu_MemTempDiscard(pArchive);
+    Nu_OutQueueFree(pArchive);
+    Nu_DirCacheFlush(pArchive);
+
     if (pArchive->archiveFp != NULL) {
         DBUG(("--- Closing archive\n"));
         fclose(pArchive->archiveFp);
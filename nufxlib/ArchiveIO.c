@@ -34,6 +34,7 @@ uint8_t Nu_ReadOneC(NuArchive* pArchive, FILE* fp, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddRead(pArchive, 1);
     ic = getc(fp);
     *pCrc = Nu_UpdateCRC16((uint8_t)ic, *pCrc);
 
@@ -55,6 +56,7 @@ void Nu_WriteOneC(NuArchive* pArchive, FILE* fp, uint8_t val, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddWrite(pArchive, fp, 1);
     putc(val, fp);
 }
 
@@ -76,6 +78,7 @@ uint16_t Nu_ReadTwoC(NuArchive* pArchive, FILE* fp, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddRead(pArchive, 2);
     ic1 = getc(fp);
     *pCrc = Nu_UpdateCRC16((uint8_t)ic1, *pCrc);
     ic2 = getc(fp);
@@ -102,6 +105,7 @@ void Nu_WriteTwoC(NuArchive* pArchive, FILE* fp, uint16_t val, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddWrite(pArchive, fp, 2);
     ic1 = val & 0xff;
     *pCrc = Nu_UpdateCRC16((uint8_t)ic1, *pCrc);
     ic2 = val >> 8;
@@ -129,6 +133,7 @@ uint32_t Nu_ReadFourC(NuArchive* pArchive, FILE* fp, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddRead(pArchive, 4);
     ic1 = getc(fp);
     *pCrc = Nu_UpdateCRC16((uint8_t)ic1, *pCrc);
     ic2 = getc(fp);
@@ -159,6 +164,7 @@ void Nu_WriteFourC(NuArchive* pArchive, FILE* fp, uint32_t val, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddWrite(pArchive, fp, 4);
     ic1 = val & 0xff;
     *pCrc = Nu_UpdateCRC16((uint8_t)ic1, *pCrc);
     ic2 = (val >> 8) & 0xff;
@@ -197,6 +203,7 @@ NuDateTime Nu_ReadDateTimeC(NuArchive* pArchive, FILE* fp, uint16_t* pCrc)
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddRead(pArchive, 8);
     ic = getc(fp);
     *pCrc = Nu_UpdateCRC16((uint8_t)ic, *pCrc);
     temp.second = ic;
@@ -244,6 +251,7 @@ void Nu_WriteDateTimeC(NuArchive* pArchive, FILE* fp, NuDateTime dateTime,
     Assert(fp != NULL);
     Assert(pCrc != NULL);
 
+    Nu_StatsAddWrite(pArchive, fp, 8);
     ic = dateTime.second;
     *pCrc = Nu_UpdateCRC16((uint8_t)ic, *pCrc);
     putc(ic, fp);
@@ -292,6 +300,7 @@ void Nu_ReadBytesC(NuArchive* pArchive, FILE* fp, void* vbuffer, long count,
     Assert(buffer != NULL);
     Assert(count > 0);
 
+    Nu_StatsAddRead(pArchive, count);
     while (count--) {
         ic = getc(fp);
         *pCrc = Nu_UpdateCRC16((uint8_t)ic, *pCrc);
@@ -321,6 +330,7 @@ void Nu_WriteBytesC(NuArchive* pArchive, FILE* fp, const void* vbuffer,
     Assert(buffer != NULL);
     Assert(count > 0);
 
+    Nu_StatsAddWrite(pArchive, fp, count);
     while (count--) {
         ic = *buffer++;
         *pCrc = Nu_UpdateCRC16((uint8_t)ic, *pCrc);
@@ -368,12 +378,14 @@ NuError Nu_SeekArchive(NuArchive* pArchive, FILE* fp, long offset, int ptrname)
         Assert(offset >= 0);
 
         /* OPT: might be faster to fread a chunk at a time */
+        Nu_StatsAddRead(pArchive, offset);
         while (offset--)
             (void) getc(fp);
 
         if (ferror(fp) || feof(fp))
             return kNuErrFileSeek;
     } else {
+        pArchive->stats.fseekCalls++;
         if (fseek(fp, offset, ptrname) < 0)
             return kNuErrFileSeek;
     }
@@ -0,0 +1,323 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Storage for records.
+ *
+ * Reading a record header makes four or five small allocations: the
+ * NuRecord, its thread array, the filename, and maybe the option list and
+ * "extra" bytes.  Copying a record for a modification makes them all
+ * again, and closing the archive frees them one at a time.  With a million
+ * records that's a lot of trips through malloc() and free(), and the heap
+ * ends up full of little holes.
+ *
+ * Instead, the records, their contents, and their thread mods come out of
+ * a per-archive arena.  Small blocks are carved out of large chunks, with
+ * a free list for each size class so that freed blocks are reused for the
+ * next record of the same shape.  Larger blocks, which are rare, go to
+ * malloc() and are kept on a list.  When the archive is closed, the
+ * records don't have to be visited at all; the chunks are thrown away.
+ *
+ * Records move between the "orig", "copy", and "new" sets during a flush,
+ * so the arena belongs to the archive rather than to a record set.  It's
+ * only used from the thread that owns the archive.
+ *
+ * Data sources aren't allocated here.  The application creates them
+ * before they're attached to an archive, and may hold on to them after
+ * it's gone, so they stay with malloc() and their reference counts.
+ *
+ * With USE_DMALLOC defined, everything goes straight to malloc() so the
+ * checker sees each block.
+ */
+#include "NufxLibPriv.h"
+
+#ifndef USE_DMALLOC
+
+/* blocks are sized in multiples of this; the largest small block */
+#define kNuArenaGranule     16
+#define kNuArenaMaxSmall    256
+#define kNuArenaNumClasses  (kNuArenaMaxSmall / kNuArenaGranule)
+
+/* how much we ask malloc() for at a time */
+#define kNuArenaChunkSize   (64 * 1024)
+
+/*
+ * Every block is preceded by one of these.  Class zero means it's a
+ * large block.  The union keeps the payload aligned for anything we
+ * store in it.
+ */
+typedef union NuArenaHeader {
+    struct {
+        uint32_t    sizeClass;
+        uint32_t    size;           /* requested size, large blocks only */
+    } info;
+    double          align;
+} NuArenaHeader;
+
+/* a chunk that small blocks are carved from */
+typedef struct NuArenaChunk {
+    struct NuArenaChunk*    pNext;
+    NuArenaHeader           align;  /* (unused) keeps blocks aligned */
+} NuArenaChunk;
+
+/* a block too big for the size classes */
+typedef struct NuArenaLarge {
+    struct NuArenaLarge*    pPrev;
+    struct NuArenaLarge*    pNext;
+    NuArenaHeader           hdr;
+} NuArenaLarge;
+
+/* a freed small block, on its class's free list */
+typedef struct NuArenaFreeBlock {
+    struct NuArenaFreeBlock*    pNext;
+} NuArenaFreeBlock;
+
+struct NuArena {
+    NuArenaChunk*       pChunks;
+    uint8_t*            bumpPtr;        /* unused space in the first chunk */
+    uint8_t*            bumpEnd;
+
+    NuArenaFreeBlock*   freeLists[kNuArenaNumClasses];
+    NuArenaLarge*       pLarge;
+};
+
+
+/*
+ * Find the header for a block.
+ */
+static NuArenaHeader* Nu_ArenaHeaderOf(void* ptr)
+{
+    return (NuArenaHeader*) ptr - 1;
+}
+
+/*
+ * Get the arena, creating it if this is the first allocation.
+ */
+static NuArena* Nu_ArenaGet(NuArchive* pArchive)
+{
+    if (pArchive->pArena == NULL)
+        pArchive->pArena = Nu_Calloc(pArchive, sizeof(NuArena));
+    return pArchive->pArena;
+}
+
+/*
+ * Allocate a block bigger than kNuArenaMaxSmall.
+ */
+static void* Nu_ArenaAllocLarge(NuArchive* pArchive, NuArena* pArena,
+    size_t size)
+{
+    NuArenaLarge* pLarge;
+
+    pLarge = Nu_Malloc(pArchive, sizeof(*pLarge) + size);
+    if (pLarge == NULL)
+        return NULL;
+
+    pLarge->hdr.info.sizeClass = 0;
+    pLarge->hdr.info.size = (uint32_t) size;
+    pLarge->pPrev = NULL;
+    pLarge->pNext = pArena->pLarge;
+    if (pArena->pLarge != NULL)
+        pArena->pLarge->pPrev = pLarge;
+    pArena->pLarge = pLarge;
+
+    return pLarge +1;
+}
+
+/*
+ * Allocate a block of class "sizeClass", from the free list if there's
+ * something on it, or from the current chunk.
+ */
+static void* Nu_ArenaAllocSmall(NuArchive* pArchive, NuArena* pArena,
+    uint32_t sizeClass)
+{
+    NuArenaFreeBlock* pFree;
+    NuArenaHeader* pHdr;
+    NuArenaChunk* pChunk;
+    size_t blockSize;
+
+    pFree = pArena->freeLists[sizeClass-1];
+    if (pFree != NULL) {
+        pArena->freeLists[sizeClass-1] = pFree->pNext;
+        return pFree;
+    }
+
+    blockSize = sizeof(NuArenaHeader) + sizeClass * kNuArenaGranule;
+    if ((size_t) (pArena->bumpEnd - pArena->bumpPtr) < blockSize) {
+        /* whatever's left in the old chunk is wasted */
+        pChunk = Nu_Malloc(pArchive, kNuArenaChunkSize);
+        if (pChunk == NULL)
+            return NULL;
+        pChunk->pNext = pArena->pChunks;
+        pArena->pChunks = pChunk;
+        pArena->bumpPtr = (uint8_t*) (pChunk +1);
+        pArena->bumpEnd = (uint8_t*) pChunk + kNuArenaChunkSize;
+    }
+
+    pHdr = (NuArenaHeader*) pArena->bumpPtr;
+    pArena->bumpPtr += blockSize;
+    pHdr->info.size = 0;
+    pHdr->info.sizeClass = sizeClass;
+    return pHdr +1;
+}
+
+/*
+ * Allocate "size" bytes from the archive's arena.  Reports failures the
+ * way Nu_Malloc does.
+ */
+void* Nu_ArenaAlloc(NuArchive* pArchive, size_t size)
+{
+    NuArena* pArena;
+    void* ptr;
+
+    Assert(pArchive != NULL);
+    Assert(size > 0);
+
+    pArena = Nu_ArenaGet(pArchive);
+    if (pArena == NULL)
+        return NULL;
+
+    if (size > kNuArenaMaxSmall)
+        ptr = Nu_ArenaAllocLarge(pArchive, pArena, size);
+    else
+        ptr = Nu_ArenaAllocSmall(pArchive, pArena,
+                (uint32_t) ((size + kNuArenaGranule-1) / kNuArenaGranule));
+
+    if (ptr != NULL)
+        DebugFill(ptr, size);
+    return ptr;
+}
+
+/*
+ * Allocate "size" bytes of zeroed storage from the archive's arena.
+ */
+void* Nu_ArenaCalloc(NuArchive* pArchive, size_t size)
+{
+    void* ptr = Nu_ArenaAlloc(pArchive, size);
+
+    if (ptr != NULL)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+/*
+ * Return a block to the arena.  Small blocks go on their free list;
+ * large ones go back to malloc().
+ */
+void Nu_ArenaFree(NuArchive* pArchive, void* ptr)
+{
+    NuArena* pArena;
+    NuArenaHeader* pHdr;
+    NuArenaLarge* pLarge;
+    NuArenaFreeBlock* pFree;
+    uint32_t sizeClass;
+
+    if (ptr == NULL)
+        return;
+
+    pArena = pArchive->pArena;
+    Assert(pArena != NULL);
+
+    pHdr = Nu_ArenaHeaderOf(ptr);
+    sizeClass = pHdr->info.sizeClass;
+    if (sizeClass == 0) {
+        pLarge = (NuArenaLarge*) ptr - 1;
+        if (pLarge->pPrev != NULL)
+            pLarge->pPrev->pNext = pLarge->pNext;
+        else
+            pArena->pLarge = pLarge->pNext;
+        if (pLarge->pNext != NULL)
+            pLarge->pNext->pPrev = pLarge->pPrev;
+        Nu_Free(pArchive, pLarge);
+    } else {
+        Assert(sizeClass <= kNuArenaNumClasses);
+        pFree = ptr;
+        pFree->pNext = pArena->freeLists[sizeClass-1];
+        pArena->freeLists[sizeClass-1] = pFree;
+    }
+}
+
+/*
+ * Resize a block.  If the new size still fits, the block stays put.
+ */
+void* Nu_ArenaRealloc(NuArchive* pArchive, void* ptr, size_t size)
+{
+    NuArenaHeader* pHdr;
+    size_t oldSize;
+    void* newPtr;
+
+    Assert(ptr != NULL);     /* disallow this usage */
+    Assert(size > 0);       /* disallow this usage */
+
+    pHdr = Nu_ArenaHeaderOf(ptr);
+    if (pHdr->info.sizeClass == 0)
+        oldSize = pHdr->info.size;
+    else
+        oldSize = pHdr->info.sizeClass * kNuArenaGranule;
+    if (size <= oldSize)
+        return ptr;
+
+    newPtr = Nu_ArenaAlloc(pArchive, size);
+    if (newPtr == NULL)
+        return NULL;
+    memcpy(newPtr, ptr, size < oldSize ? size : oldSize);
+    Nu_ArenaFree(pArchive, ptr);
+    return newPtr;
+}
+
+/*
+ * Copy a string into the arena.
+ */
+char* Nu_ArenaStrdup(NuArchive* pArchive, const char* str)
+{
+    size_t len = strlen(str) +1;
+    char* copy;
+
+    copy = Nu_ArenaAlloc(pArchive, len);
+    if (copy != NULL)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+/*
+ * Throw away the arena and everything in it.  Anything that was allocated
+ * from it, including records that are still in a record set, is gone.
+ */
+void Nu_ArenaDestroy(NuArchive* pArchive)
+{
+    NuArena* pArena = pArchive->pArena;
+    NuArenaChunk* pChunk;
+    NuArenaLarge* pLarge;
+
+    if (pArena == NULL)
+        return;
+
+    while (pArena->pChunks != NULL) {
+        pChunk = pArena->pChunks;
+        pArena->pChunks = pChunk->pNext;
+        Nu_Free(pArchive, pChunk);
+    }
+    while (pArena->pLarge != NULL) {
+        pLarge = pArena->pLarge;
+        pArena->pLarge = pLarge->pNext;
+        Nu_Free(pArchive, pLarge);
+    }
+
+    Nu_Free(pArchive, pArena);
+    pArchive->pArena = NULL;
+}
+
+#else /*USE_DMALLOC*/
+
+char* Nu_ArenaStrdup(NuArchive* pArchive, const char* str)
+{
+    return strdup(str);
+}
+
+void Nu_ArenaDestroy(NuArchive* pArchive)
+{
+    (void) pArchive;
+}
+
+#endif /*USE_DMALLOC*/
@@ -18,20 +18,369 @@
 #ifdef ENABLE_BZIP2
 #include "bzlib.h"
 
-#define kBZBlockSize    8       /* use 800K blocks */
 #define kBZVerbosity    1       /* library verbosity level (0-4) */
 
 
+#define kNuBzip2CacheSize   8       /* compress uses 4 blocks, expand 2 */
+#define kNuBzip2BlockHdr    16      /* keeps malloc's alignment */
+
+/*
+ * Multi-threaded compression splits the input into chunks that are
+ * guaranteed to fit in one bzip2 block, even if the initial run-length
+ * encoding expands them by the worst-case 5/4.
+ */
+#define kNuBzip2ChunkSize(blockSize) ((100000 * (blockSize)) / 5 * 4 - 1024)
+
+/*
+ * Multi-threaded expansion holds the whole compressed thread in memory,
+ * and uses 32-bit bit offsets into it.
+ */
+#define kNuBzip2MinParallelExpand   (64 * 1024)
+#define kNuBzip2MaxParallelExpand   (256 * 1024 * 1024)
+
+/*
+ * No compressed block can be longer than this many bits.  A block holds
+ * at most one symbol per byte, plus an end-of-block symbol, and no code
+ * is longer than 20 bits.  The header, tables, and selectors fit in the
+ * last 256K bits with room to spare.
+ */
+#define kNuBzip2MaxBlockBits(blockSize) \
+    ((100000 * (blockSize) + 1) * 20 + 256 * 1024)
+
+/* 48-bit magic numbers that start a block and end the stream */
+#define kNuBzip2BlockMagicHi    0x314159
+#define kNuBzip2BlockMagicLo    0x265359
+#define kNuBzip2EndMagicHi      0x177245
+#define kNuBzip2EndMagicLo      0x385090
+#define kNuBzip2HeaderBits      32      /* "BZh" plus the block size digit */
+
+
+/*
+ * libbz2 has no equivalent of deflateReset, so every thread has to go
+ * through BZ2_bzCompressInit/End, which allocate and free several MB.
+ * We can't keep the stream, but we can keep the memory.  The archive
+ * holds one of these, and libbz2's frees go into a small cache that its
+ * allocs are served from.  The sizes are the same from one thread to
+ * the next, so after the first thread it's all cache hits.
+ *
+ * The blocks come from the allocator of the archive that created the
+ * state.  We hold on to that rather than the archive, because the state
+ * can outlive it in the codec pool.
+ */
+typedef struct NuBzip2State {
+    const NuAllocator* pAllocator;  /* where libbz2's blocks come from */
+    uint8_t*    outbuf;             /* kNuGenCompBufSize bytes */
+    int         numCached;
+    struct {
+        uint8_t*    block;          /* start of block, including header */
+        size_t      size;           /* size requested by libbz2 */
+    } cache[kNuBzip2CacheSize];
+} NuBzip2State;
+
 /*
- * Alloc and free functions provided to libbz2.
+ * Alloc and free functions provided to libbz2.  Each block is prefixed
+ * with its size, so we know where to file it when it comes back.
  */
 static void* Nu_bzalloc(void* opaque, int items, int size)
 {
-    return Nu_Malloc(opaque, items * size);
+    NuBzip2State* pState = opaque;
+    size_t len = (size_t) items * size;
+    uint8_t* block;
+    int i;
+
+    for (i = 0; i < pState->numCached; i++) {
+        if (pState->cache[i].size == len) {
+            block = pState->cache[i].block;
+            pState->cache[i] = pState->cache[--pState->numCached];
+            return block + kNuBzip2BlockHdr;
+        }
+    }
+
+    block = Nu_AllocatorMalloc(pState->pAllocator, len + kNuBzip2BlockHdr);
+    if (block == NULL)
+        return NULL;
+    *(size_t*) block = len;
+    return block + kNuBzip2BlockHdr;
 }
 static void Nu_bzfree(void* opaque, void* address)
 {
-    Nu_Free(opaque, address);
+    NuBzip2State* pState = opaque;
+    uint8_t* block;
+
+    if (address == NULL)
+        return;
+    block = (uint8_t*) address - kNuBzip2BlockHdr;
+
+    if (pState->numCached < kNuBzip2CacheSize) {
+        pState->cache[pState->numCached].block = block;
+        pState->cache[pState->numCached].size = *(size_t*) block;
+        pState->numCached++;
+    } else {
+        Nu_Free(NULL, block);
+    }
+}
+
+/*
+ * Get the archive's libbz2 state, allocating it if necessary.
+ */
+static NuError Nu_GetBzip2State(NuArchive* pArchive, NuBzip2State** ppState)
+{
+    NuBzip2State* pState = pArchive->bzip2State;
+
+    if (pState == NULL) {
+        pState = Nu_Calloc(pArchive, sizeof(*pState));
+        if (pState == NULL)
+            return kNuErrMalloc;
+        pState->pAllocator = Nu_GetAllocator(pArchive);
+        pState->outbuf = Nu_Malloc(pArchive, kNuGenCompBufSize);
+        if (pState->outbuf == NULL) {
+            Nu_Free(pArchive, pState);
+            return kNuErrMalloc;
+        }
+        pArchive->bzip2State = pState;
+    }
+
+    *ppState = pState;
+    return kNuErrNone;
+}
+
+/*
+ * Free the blocks in a state's allocation cache.
+ */
+static void Nu_Bzip2EmptyCache(NuBzip2State* pState)
+{
+    int i;
+
+    for (i = 0; i < pState->numCached; i++)
+        Nu_Free(NULL, pState->cache[i].block);
+    pState->numCached = 0;
+}
+
+/*
+ * Free the libbz2 state held by an archive.
+ */
+void Nu_FreeBzip2State(void* bzip2State)
+{
+    NuBzip2State* pState = bzip2State;
+
+    if (pState == NULL)
+        return;
+    Nu_Bzip2EmptyCache(pState);
+    Nu_Free(NULL, pState->outbuf);
+    Nu_Free(NULL, pState);
+}
+
+
+/*
+ * ===========================================================================
+ *      Block stitching
+ * ===========================================================================
+ */
+
+/*
+ * bzip2 blocks aren't byte-aligned, so assembling a stream from blocks
+ * that were compressed separately (or pulling a block out of a stream)
+ * means copying bits.  The stream format is a 32-bit header, the blocks,
+ * a 48-bit end-of-stream magic number, the 32-bit combined CRC, and zero
+ * bits to fill out the last byte.  Each block starts with a 48-bit magic
+ * number and its own 32-bit CRC.
+ *
+ * The combined CRC is computed by rotating left one bit and XORing in
+ * the next block CRC.
+ */
+
+/*
+ * Bits go into a buffer, which is written to a NuCompStream when it
+ * fills.  If there's no stream, filling the buffer is an error.
+ */
+typedef struct NuBitWriter {
+    uint8_t*        buf;
+    uint32_t        bufSize;
+    uint32_t        count;                  /* #of bytes in "buf" */
+    uint32_t        total;                  /* #of bytes written, total */
+    uint32_t        bits;                   /* bits waiting for a full byte */
+    int             numBits;
+    NuCompStream*   pStream;
+    NuError         err;
+} NuBitWriter;
+
+static void Nu_BitWriterInit(NuBitWriter* pWriter, uint8_t* buf,
+    uint32_t bufSize, NuCompStream* pStream)
+{
+    memset(pWriter, 0, sizeof(*pWriter));
+    pWriter->buf = buf;
+    pWriter->bufSize = bufSize;
+    pWriter->pStream = pStream;
+}
+
+/*
+ * Append a byte to the output.
+ */
+static void Nu_BitPutByte(NuBitWriter* pWriter, uint8_t val)
+{
+    if (pWriter->count == pWriter->bufSize) {
+        if (pWriter->err != kNuErrNone)
+            return;
+        if (pWriter->pStream == NULL) {
+            pWriter->err = kNuErrBufferOverrun;
+            return;
+        }
+        pWriter->err = Nu_CompStreamWrite(pWriter->pStream, pWriter->buf,
+                        pWriter->count);
+        pWriter->count = 0;
+    }
+    pWriter->buf[pWriter->count++] = val;
+    pWriter->total++;
+}
+
+/*
+ * Append up to 24 bits.
+ */
+static void Nu_BitPut(NuBitWriter* pWriter, uint32_t val, int numBits)
+{
+    Assert(numBits > 0 && numBits <= 24);
+
+    pWriter->bits = (pWriter->bits << numBits) |
+                    (val & ((1UL << numBits) - 1));
+    pWriter->numBits += numBits;
+    while (pWriter->numBits >= 8) {
+        pWriter->numBits -= 8;
+        Nu_BitPutByte(pWriter, (uint8_t) (pWriter->bits >> pWriter->numBits));
+    }
+    pWriter->bits &= (1UL << pWriter->numBits) - 1;
+}
+
+/*
+ * Append "numBits" bits from "src", starting at bit "startBit".
+ */
+static void Nu_BitCopy(NuBitWriter* pWriter, const uint8_t* src,
+    uint32_t startBit, uint32_t numBits)
+{
+    const uint8_t* ptr = src + startBit / 8;
+    int shift = startBit & 0x07;
+
+    if (shift == 0 && pWriter->numBits == 0) {
+        /* both byte-aligned */
+        for ( ; numBits >= 8; numBits -= 8)
+            Nu_BitPutByte(pWriter, *ptr++);
+    } else if (shift == 0) {
+        for ( ; numBits >= 8; numBits -= 8)
+            Nu_BitPut(pWriter, *ptr++, 8);
+    } else {
+        for ( ; numBits >= 8; numBits -= 8, ptr++)
+            Nu_BitPut(pWriter, (ptr[0] << shift) | (ptr[1] >> (8 - shift)), 8);
+    }
+
+    if (numBits != 0) {
+        uint32_t val = ptr[0] << 8;
+
+        if (shift + numBits > 8)
+            val |= ptr[1];
+        Nu_BitPut(pWriter, val >> (16 - shift - numBits), numBits);
+    }
+}
+
+/*
+ * Pad out the last byte and write anything that's buffered.
+ */
+static NuError Nu_BitFlush(NuBitWriter* pWriter)
+{
+    if (pWriter->numBits != 0)
+        Nu_BitPut(pWriter, 0, 8 - pWriter->numBits);
+    if (pWriter->err == kNuErrNone && pWriter->pStream != NULL &&
+        pWriter->count != 0)
+    {
+        pWriter->err = Nu_CompStreamWrite(pWriter->pStream, pWriter->buf,
+                        pWriter->count);
+        pWriter->count = 0;
+    }
+    return pWriter->err;
+}
+
+/*
+ * Get up to 24 bits from "src", starting at bit "startBit".  "srcLen"
+ * is the length of the buffer in bytes; we don't read past it.
+ */
+static uint32_t Nu_BitGet(const uint8_t* src, uint32_t srcLen,
+    uint32_t startBit, int numBits)
+{
+    uint32_t offset = startBit / 8;
+    uint32_t val = 0;
+    int i;
+
+    Assert(numBits > 0 && numBits <= 24);
+
+    for (i = 0; i < 4; i++) {
+        val <<= 8;
+        if (offset + i < srcLen)
+            val |= src[offset + i];
+    }
+    return (val >> (32 - (startBit & 0x07) - numBits)) &
+            ((1UL << numBits) - 1);
+}
+
+/*
+ * Get the 32-bit block CRC from the block that starts at "blockBit".
+ */
+static uint32_t Nu_Bzip2GetBlockCRC(const uint8_t* src, uint32_t srcLen,
+    uint32_t blockBit)
+{
+    return (Nu_BitGet(src, srcLen, blockBit + 48, 16) << 16) |
+            Nu_BitGet(src, srcLen, blockBit + 64, 16);
+}
+
+/*
+ * Find the end-of-stream marker in a complete bzip2 stream.  It's 80 bits
+ * (including the combined CRC) from the end, give or take the padding.
+ *
+ * On success, "*pEndBit" is set to the bit offset of the marker, and
+ * "*pStreamCRC" holds the combined CRC.
+ */
+static Boolean Nu_Bzip2FindEnd(const uint8_t* src, uint32_t srcLen,
+    uint32_t* pEndBit, uint32_t* pStreamCRC)
+{
+    int pad;
+
+    if (srcLen < (kNuBzip2HeaderBits + 80) / 8)
+        return false;
+
+    for (pad = 0; pad < 8; pad++) {
+        uint32_t endBit = srcLen * 8 - pad - 80;
+
+        if ((src[srcLen-1] & ((1 << pad) - 1)) != 0)
+            break;          /* padding bits are always zero */
+        if (endBit < kNuBzip2HeaderBits)
+            break;
+        if (Nu_BitGet(src, srcLen, endBit, 24) == kNuBzip2EndMagicHi &&
+            Nu_BitGet(src, srcLen, endBit + 24, 24) == kNuBzip2EndMagicLo)
+        {
+            *pEndBit = endBit;
+            *pStreamCRC = Nu_Bzip2GetBlockCRC(src, srcLen, endBit);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Add a block CRC to the combined CRC.
+ */
+static uint32_t Nu_Bzip2CombineCRC(uint32_t combinedCRC, uint32_t blockCRC)
+{
+    combinedCRC = ((combinedCRC << 1) | (combinedCRC >> 31)) & 0xffffffff;
+    return combinedCRC ^ blockCRC;
+}
+
+/*
+ * Write the end-of-stream marker and the combined CRC.
+ */
+static void Nu_Bzip2PutEnd(NuBitWriter* pWriter, uint32_t combinedCRC)
+{
+    Nu_BitPut(pWriter, kNuBzip2EndMagicHi, 24);
+    Nu_BitPut(pWriter, kNuBzip2EndMagicLo, 24);
+    Nu_BitPut(pWriter, combinedCRC >> 16, 16);
+    Nu_BitPut(pWriter, combinedCRC, 16);
 }
 
 
@@ -42,44 +391,258 @@ static void Nu_bzfree(void* opaque, void* address)
  */
 
 /*
- * Compress "srcLen" bytes from "pStraw" to "fp".
+ * One chunk of a multi-threaded compression.  Each chunk is compressed
+ * into a complete single-block bzip2 stream, and the block is then
+ * lifted out and added to the real output.
+ */
+typedef struct NuBzip2CompJob {
+    NuBzip2State    state;                  /* libbz2 allocations */
+    const uint8_t*  in;
+    uint32_t        inLen;
+    uint8_t*        out;                    /* single-block bzip2 stream */
+    uint32_t        outAlloc;
+    uint32_t        outLen;
+    uint16_t        crc;                    /* CRC-16 of input, zero seed */
+    int             blockSize;              /* 1-9, in units of 100K */
+    int             bzerr;                  /* BZ_OK unless something broke */
+    NuWorker        worker;
+} NuBzip2CompJob;
+
+/*
+ * Compress one chunk.  Runs on a worker thread.
+ */
+static void Nu_Bzip2CompJobRun(void* arg)
+{
+    NuBzip2CompJob* pJob = arg;
+    bz_stream bzstream;
+    int bzerr;
+
+    pJob->crc = Nu_CalcCRC16(0, pJob->in, pJob->inLen);
+
+    memset(&bzstream, 0, sizeof(bzstream));
+    bzstream.bzalloc = Nu_bzalloc;
+    bzstream.bzfree = Nu_bzfree;
+    bzstream.opaque = &pJob->state;
+
+    bzerr = BZ2_bzCompressInit(&bzstream, pJob->blockSize, 0, 0);
+    if (bzerr != BZ_OK)
+        goto bail;
+
+    bzstream.next_in = (char*) pJob->in;
+    bzstream.avail_in = pJob->inLen;
+    bzstream.next_out = (char*) pJob->out;
+    bzstream.avail_out = pJob->outAlloc;
+
+    do {
+        bzerr = BZ2_bzCompress(&bzstream, BZ_FINISH);
+    } while (bzerr == BZ_FINISH_OK && bzstream.avail_out != 0);
+
+    if (bzerr == BZ_STREAM_END)
+        bzerr = BZ_OK;
+    else if (bzerr == BZ_FINISH_OK)
+        bzerr = BZ_OUTBUFF_FULL;
+    pJob->outLen = (uint8_t*) bzstream.next_out - pJob->out;
+
+    BZ2_bzCompressEnd(&bzstream);
+
+bail:
+    pJob->bzerr = bzerr;
+}
+
+/*
+ * Compress "srcLen" bytes from "pStraw" to "pStream", using up to
+ * "numWorkers" threads.
+ *
+ * The output is a single bzip2 stream, with one block per chunk.  The
+ * blocks are bit-copied out of the per-chunk streams and the CRCs are
+ * recombined, so it looks exactly like something libbz2 produced, and
+ * Nu_ExpandBzip2 (or anything else) can read it.
+ */
+static NuError Nu_CompressBzip2Parallel(NuArchive* pArchive,
+    NuStraw* pStraw, NuCompStream* pStream, uint32_t srcLen,
+    uint32_t* pDstLen, uint16_t* pCrc, int numWorkers)
+{
+    NuError err = kNuErrNone;
+    NuBzip2State* pState;
+    NuBzip2CompJob* jobs = NULL;
+    uint8_t* inBuf = NULL;
+    NuBitWriter writer;
+    uint32_t combinedCRC = 0;
+    int blockSize = (int) pArchive->valBzip2BlockSize;
+    uint32_t chunkSize = kNuBzip2ChunkSize(blockSize);
+    int i, numJobs;
+
+    Assert(numWorkers > 1);
+
+    /* our state's output buffer is used to stage the stitched stream */
+    err = Nu_GetBzip2State(pArchive, &pState);
+    BailError(err);
+    Nu_BitWriterInit(&writer, pState->outbuf, kNuGenCompBufSize, pStream);
+
+    inBuf = Nu_Malloc(pArchive, numWorkers * chunkSize);
+    BailAlloc(inBuf);
+    jobs = Nu_Calloc(pArchive, numWorkers * sizeof(*jobs));
+    BailAlloc(jobs);
+    for (i = 0; i < numWorkers; i++) {
+        /* libbz2 says 1% + 600 bytes is enough for incompressible data */
+        jobs[i].state.pAllocator = Nu_GetAllocator(pArchive);
+        jobs[i].outAlloc = chunkSize + chunkSize / 100 + 600;
+        jobs[i].blockSize = blockSize;
+        jobs[i].out = Nu_Malloc(pArchive, jobs[i].outAlloc);
+        BailAlloc(jobs[i].out);
+    }
+
+    Nu_BitPut(&writer, 'B', 8);
+    Nu_BitPut(&writer, 'Z', 8);
+    Nu_BitPut(&writer, 'h', 8);
+    Nu_BitPut(&writer, '0' + blockSize, 8);
+
+    while (srcLen != 0) {
+        uint8_t* inPtr = inBuf;
+
+        /* read a chunk for each worker, or until we run out */
+        for (numJobs = 0; numJobs < numWorkers && srcLen != 0; numJobs++) {
+            uint32_t getSize;
+
+            getSize = (srcLen > chunkSize) ? chunkSize : srcLen;
+            err = Nu_StrawRead(pArchive, pStraw, inPtr, getSize);
+            if (err != kNuErrNone) {
+                Nu_ReportError(NU_BLOB, err, "bzip2 read failed");
+                goto bail;
+            }
+            srcLen -= getSize;
+
+            jobs[numJobs].in = inPtr;
+            jobs[numJobs].inLen = getSize;
+            inPtr += getSize;
+        }
+
+        for (i = 0; i < numJobs; i++)
+            Nu_WorkerStart(&jobs[i].worker, Nu_Bzip2CompJobRun, &jobs[i]);
+        for (i = 0; i < numJobs; i++) {
+            Nu_WorkerJoin(&jobs[i].worker);
+            Nu_StatsAddWorker(pArchive, &jobs[i].worker);
+        }
+
+        /* copy the blocks out, in order */
+        for (i = 0; i < numJobs; i++) {
+            NuBzip2CompJob* pJob = &jobs[i];
+            uint32_t blockCRC, streamCRC, endBit;
+
+            if (pJob->bzerr != BZ_OK) {
+                err = kNuErrInternal;
+                Nu_ReportError(NU_BLOB, err,
+                    "libbz2 compress call failed (bzerr=%d)", pJob->bzerr);
+                goto bail;
+            }
+
+            /* if the stream CRC matches the block CRC, it's one block */
+            blockCRC = Nu_Bzip2GetBlockCRC(pJob->out, pJob->outLen,
+                        kNuBzip2HeaderBits);
+            if (!Nu_Bzip2FindEnd(pJob->out, pJob->outLen, &endBit,
+                    &streamCRC) || streamCRC != blockCRC)
+            {
+                err = kNuErrInternal;
+                Nu_ReportError(NU_BLOB, err,
+                    "unexpected bzip2 stream layout in chunk");
+                goto bail;
+            }
+
+            Nu_BitCopy(&writer, pJob->out, kNuBzip2HeaderBits,
+                endBit - kNuBzip2HeaderBits);
+            if (writer.err != kNuErrNone) {
+                err = writer.err;
+                Nu_ReportError(NU_BLOB, err, "write failed in bzip2");
+                goto bail;
+            }
+            combinedCRC = Nu_Bzip2CombineCRC(combinedCRC, blockCRC);
+
+            *pCrc = Nu_CRC16Combine(*pCrc, pJob->crc, pJob->inLen);
+        }
+    }
+
+    Nu_Bzip2PutEnd(&writer, combinedCRC);
+    err = Nu_BitFlush(&writer);
+    if (err != kNuErrNone) {
+        Nu_ReportError(NU_BLOB, err, "write failed in bzip2");
+        goto bail;
+    }
+
+    *pDstLen = writer.total;
+
+bail:
+    if (jobs != NULL) {
+        for (i = 0; i < numWorkers; i++) {
+            Nu_Bzip2EmptyCache(&jobs[i].state);
+            Nu_Free(pArchive, jobs[i].out);
+        }
+        Nu_Free(pArchive, jobs);
+    }
+    Nu_Free(pArchive, inBuf);
+    return err;
+}
+
+/*
+ * Compress "srcLen" bytes from "pStraw" to "pStream".
+ *
+ * Large inputs are handed to Nu_CompressBzip2Parallel when the archive
+ * allows more than one worker thread.
  */
-NuError Nu_CompressBzip2(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+NuError Nu_CompressBzip2(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
+    NuBzip2State* pState;
     bz_stream bzstream;
     int bzerr;
-    uint8_t* outbuf = NULL;
+    uint32_t chunkSize;
+    uint8_t* outbuf;
 
     Assert(pArchive != NULL);
     Assert(pStraw != NULL);
-    Assert(fp != NULL);
+    Assert(pStream != NULL);
     Assert(srcLen > 0);
     Assert(pDstLen != NULL);
     Assert(pCrc != NULL);
 
+    chunkSize = kNuBzip2ChunkSize(pArchive->valBzip2BlockSize);
+    if (srcLen >= chunkSize * 2) {
+        int numWorkers = Nu_GetWorkerCount(pArchive);
+        uint32_t numChunks;
+
+        numChunks = (srcLen + chunkSize - 1) / chunkSize;
+        if ((uint32_t) numWorkers > numChunks)
+            numWorkers = (int) numChunks;
+        if (numWorkers > 1) {
+            return Nu_CompressBzip2Parallel(pArchive, pStraw, pStream,
+                    srcLen, pDstLen, pCrc, numWorkers);
+        }
+    }
+
     err = Nu_AllocCompressionBufferIFN(pArchive);
     if (err != kNuErrNone)
         return err;
 
-    /* allocate a similarly-sized buffer for the output */
-    outbuf = Nu_Malloc(pArchive, kNuGenCompBufSize);
-    BailAlloc(outbuf);
+    /* get our state, which has a similarly-sized buffer for the output */
+    err = Nu_GetBzip2State(pArchive, &pState);
+    if (err != kNuErrNone)
+        return err;
+    outbuf = pState->outbuf;
 
     /*
      * Initialize the bz2lib stream.
      */
     bzstream.bzalloc = Nu_bzalloc;
     bzstream.bzfree = Nu_bzfree;
-    bzstream.opaque = pArchive;
+    bzstream.opaque = pState;
     bzstream.next_in = NULL;
     bzstream.avail_in = 0;
     bzstream.next_out = outbuf;
     bzstream.avail_out = kNuGenCompBufSize;
 
     /* fourth arg is "workFactor"; set to zero for default (30) */
-    bzerr = BZ2_bzCompressInit(&bzstream, kBZBlockSize, kBZVerbosity, 0);
+    bzerr = BZ2_bzCompressInit(&bzstream, (int) pArchive->valBzip2BlockSize,
+                kBZVerbosity, 0);
     if (bzerr != BZ_OK) {
         err = kNuErrInternal;
         if (bzerr == BZ_CONFIG_ERROR) {
@@ -111,7 +674,8 @@ NuError Nu_CompressBzip2(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
 
             srcLen -= getSize;
 
-            *pCrc = Nu_CalcCRC16(*pCrc, pArchive->compBuf, getSize);
+            *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, pArchive->compBuf,
+                        getSize);
 
             bzstream.next_in = pArchive->compBuf;
             bzstream.avail_in = getSize;
@@ -137,9 +701,10 @@ NuError Nu_CompressBzip2(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
         {
             DBUG(("+++ writing %d bytes\n",
                 (uint8_t*)bzstream.next_out - outbuf));
-            err = Nu_FWrite(fp, outbuf, (uint8_t*)bzstream.next_out - outbuf);
+            err = Nu_CompStreamWrite(pStream, outbuf,
+                    (uint8_t*)bzstream.next_out - outbuf);
             if (err != kNuErrNone) {
-                Nu_ReportError(NU_BLOB, err, "fwrite failed in bzip2");
+                Nu_ReportError(NU_BLOB, err, "write failed in bzip2");
                 goto bz_bail;
             }
 
@@ -155,8 +720,6 @@ bz_bail:
     BZ2_bzCompressEnd(&bzstream);       /* free up any allocated structures */
 
 bail:
-    if (outbuf != NULL)
-        Nu_Free(NULL, outbuf);
     return err;
 }
 
@@ -168,12 +731,372 @@ bail:
  */
 
 /*
- * Expand from "infp" to "pFunnel".
+ * One block of a multi-threaded expansion.  The block is wrapped in a
+ * header and end-of-stream marker to make a single-block stream, which
+ * libbz2 expands (and checks the block CRC of) as usual.
+ */
+typedef struct NuBzip2ExpJob {
+    NuBzip2State    state;                  /* libbz2 allocations */
+    const uint8_t*  src;                    /* whole compressed thread */
+    uint32_t        srcLen;
+    uint32_t        startBit;               /* block magic */
+    uint32_t        endBit;                 /* next magic, or end marker */
+    uint32_t        blockCRC;
+    uint8_t*        stream;                 /* single-block stream */
+    uint32_t        streamAlloc;
+    uint8_t*        out;                    /* expanded data */
+    uint32_t        outAlloc;
+    uint32_t        outLen;
+    uint32_t        outMax;                 /* give up past this */
+    uint16_t        crc;                    /* CRC-16 of output, zero seed */
+    int             bzerr;                  /* BZ_OK unless something broke */
+    NuWorker        worker;
+} NuBzip2ExpJob;
+
+/*
+ * Expand one block.  Runs on a worker thread, or on the caller's thread
+ * when a block is retried.
+ *
+ * The block ends where the next one starts, but the block magic number
+ * can also turn up by accident in the compressed data.  If that happens
+ * we'll have chopped the block short, and libbz2 will complain about it.
+ * The caller deals with that by retrying with a later end point.
+ */
+static void Nu_Bzip2ExpJobRun(void* arg)
+{
+    NuBzip2ExpJob* pJob = arg;
+    NuBitWriter writer;
+    bz_stream bzstream;
+    uint32_t streamLen;
+    int bzerr;
+
+    pJob->outLen = 0;
+    pJob->crc = 0;
+
+    streamLen = (kNuBzip2HeaderBits + (pJob->endBit - pJob->startBit) + 80 +
+                    7) / 8;
+    if (streamLen > pJob->streamAlloc) {
+        Nu_Free(NULL, pJob->stream);
+        pJob->stream = Nu_AllocatorMalloc(pJob->state.pAllocator, streamLen);
+        pJob->streamAlloc = (pJob->stream != NULL) ? streamLen : 0;
+        if (pJob->stream == NULL) {
+            bzerr = BZ_MEM_ERROR;
+            goto bail;
+        }
+    }
+
+    pJob->blockCRC = Nu_Bzip2GetBlockCRC(pJob->src, pJob->srcLen,
+                        pJob->startBit);
+
+    Nu_BitWriterInit(&writer, pJob->stream, pJob->streamAlloc, NULL);
+    Nu_BitCopy(&writer, pJob->src, 0, kNuBzip2HeaderBits);
+    Nu_BitCopy(&writer, pJob->src, pJob->startBit,
+        pJob->endBit - pJob->startBit);
+    Nu_Bzip2PutEnd(&writer, pJob->blockCRC);
+    (void) Nu_BitFlush(&writer);
+    Assert(writer.err == kNuErrNone);
+
+    memset(&bzstream, 0, sizeof(bzstream));
+    bzstream.bzalloc = Nu_bzalloc;
+    bzstream.bzfree = Nu_bzfree;
+    bzstream.opaque = &pJob->state;
+
+    bzerr = BZ2_bzDecompressInit(&bzstream, 0, 0);
+    if (bzerr != BZ_OK)
+        goto bail;
+
+    bzstream.next_in = (char*) pJob->stream;
+    bzstream.avail_in = writer.total;
+
+    while (1) {
+        if (pJob->outLen == pJob->outAlloc) {
+            uint32_t newAlloc;
+            uint8_t* newOut;
+
+            /* leave room for one extra byte, so we can tell it overflowed */
+            if (pJob->outAlloc > pJob->outMax) {
+                bzerr = BZ_DATA_ERROR;      /* more than the thread holds */
+                break;
+            }
+            newAlloc = pJob->outAlloc ? pJob->outAlloc * 2 : kNuGenCompBufSize;
+            if (newAlloc > pJob->outMax)
+                newAlloc = pJob->outMax + 1;
+            if (pJob->out == NULL)
+                newOut = Nu_AllocatorMalloc(pJob->state.pAllocator, newAlloc);
+            else
+                newOut = Nu_Realloc(NULL, pJob->out, newAlloc);
+            if (newOut == NULL) {
+                bzerr = BZ_MEM_ERROR;
+                break;
+            }
+            pJob->out = newOut;
+            pJob->outAlloc = newAlloc;
+        }
+
+        bzstream.next_out = (char*) pJob->out + pJob->outLen;
+        bzstream.avail_out = pJob->outAlloc - pJob->outLen;
+        bzerr = BZ2_bzDecompress(&bzstream);
+        pJob->outLen = (uint8_t*) bzstream.next_out - pJob->out;
+
+        if (bzerr == BZ_STREAM_END) {
+            bzerr = BZ_OK;
+            break;
+        }
+        if (bzerr != BZ_OK)
+            break;
+        if (bzstream.avail_in == 0 && bzstream.avail_out != 0) {
+            bzerr = BZ_UNEXPECTED_EOF;
+            break;
+        }
+    }
+
+    BZ2_bzDecompressEnd(&bzstream);
+
+    if (bzerr == BZ_OK && pJob->outLen != 0)
+        pJob->crc = Nu_CalcCRC16(0, pJob->out, pJob->outLen);
+
+bail:
+    pJob->bzerr = bzerr;
+}
+
+/*
+ * Find the bit offsets of everything that looks like a block magic
+ * number, between the stream header and "endBit".  The list is
+ * terminated with "endBit".
+ */
+static NuError Nu_Bzip2FindBlocks(NuArchive* pArchive, const uint8_t* src,
+    uint32_t srcLen, uint32_t endBit, uint32_t** pCands, uint32_t* pNumCands)
+{
+    const uint64_t kMagic = ((uint64_t) kNuBzip2BlockMagicHi << 24) |
+                            kNuBzip2BlockMagicLo;
+    const uint64_t kMask = ((uint64_t) 1 << 48) - 1;
+    uint32_t* cands = NULL;
+    uint32_t numCands = 0, maxCands = 64;
+    uint64_t window = 0;
+    uint32_t i;
+    int shift;
+
+    cands = Nu_Malloc(pArchive, maxCands * sizeof(*cands));
+    if (cands == NULL)
+        return kNuErrMalloc;
+
+    /*
+     * After byte "i" goes into the window, a match "shift" bits up from
+     * the bottom started at bit (i+1)*8 - shift - 48.
+     */
+    for (i = 0; i < srcLen; i++) {
+        window = (window << 8) | src[i];
+        if (i < 6)
+            continue;
+
+        for (shift = 7; shift >= 0; shift--) {
+            uint32_t bitPos;
+
+            if (((window >> shift) & kMask) != kMagic)
+                continue;
+            bitPos = (i + 1) * 8 - shift - 48;
+            if (bitPos < kNuBzip2HeaderBits || bitPos + 48 > endBit)
+                continue;
+
+            if (numCands + 1 == maxCands) {
+                uint32_t* newCands;
+
+                maxCands *= 2;
+                newCands = Nu_Realloc(pArchive, cands,
+                            maxCands * sizeof(*cands));
+                if (newCands == NULL) {
+                    Nu_Free(pArchive, cands);
+                    return kNuErrMalloc;
+                }
+                cands = newCands;
+            }
+            cands[numCands++] = bitPos;
+        }
+    }
+
+    cands[numCands] = endBit;
+    *pCands = cands;
+    *pNumCands = numCands;
+    return kNuErrNone;
+}
+
+/*
+ * Expand from "pStream" to "pFunnel", using up to "numWorkers" threads.
+ *
+ * The whole compressed thread is read into memory and searched for block
+ * boundaries, then the blocks are expanded a batch at a time, and sent to
+ * the funnel in order.  This works on any bzip2 stream, not just the ones
+ * Nu_CompressBzip2Parallel produces, though a stream with just one block
+ * won't go any faster.
+ */
+static NuError Nu_ExpandBzip2Parallel(NuArchive* pArchive,
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc, int numWorkers)
+{
+    NuError err = kNuErrNone;
+    NuBzip2ExpJob* jobs = NULL;
+    uint8_t* src = NULL;
+    uint32_t srcLen = pThread->thCompThreadEOF;
+    uint32_t* cands = NULL;
+    uint32_t numCands, cand, endBit, streamCRC, maxBlockBits;
+    uint32_t combinedCRC = 0, totalOut = 0;
+    int i, numJobs;
+
+    Assert(numWorkers > 1);
+
+    src = Nu_Malloc(pArchive, srcLen);
+    BailAlloc(src);
+    err = Nu_CompStreamRead(pStream, src, srcLen);
+    if (err != kNuErrNone) {
+        Nu_ReportError(NU_BLOB, err, "bzip2 read failed");
+        goto bail;
+    }
+
+    if (srcLen < 4 || src[0] != 'B' || src[1] != 'Z' || src[2] != 'h' ||
+        src[3] < '1' || src[3] > '9')
+    {
+        err = kNuErrBadData;
+        Nu_ReportError(NU_BLOB, err, "bad bzip2 stream header");
+        goto bail;
+    }
+    maxBlockBits = kNuBzip2MaxBlockBits(src[3] - '0');
+    if (!Nu_Bzip2FindEnd(src, srcLen, &endBit, &streamCRC)) {
+        err = kNuErrBadData;
+        Nu_ReportError(NU_BLOB, err, "bzip2 end-of-stream marker not found");
+        goto bail;
+    }
+
+    err = Nu_Bzip2FindBlocks(pArchive, src, srcLen, endBit, &cands,
+            &numCands);
+    BailError(err);
+    if (numCands != 0 && cands[0] != kNuBzip2HeaderBits) {
+        err = kNuErrBadData;
+        Nu_ReportError(NU_BLOB, err, "bzip2 stream doesn't start with a block");
+        goto bail;
+    }
+
+    jobs = Nu_Calloc(pArchive, numWorkers * sizeof(*jobs));
+    BailAlloc(jobs);
+    for (i = 0; i < numWorkers; i++) {
+        jobs[i].state.pAllocator = Nu_GetAllocator(pArchive);
+        jobs[i].src = src;
+        jobs[i].srcLen = srcLen;
+        jobs[i].outMax = pThread->actualThreadEOF;
+    }
+
+    /* "cand" is always the index of the next real block */
+    cand = 0;
+    while (cand < numCands) {
+        for (numJobs = 0; numJobs < numWorkers && cand + numJobs < numCands;
+            numJobs++)
+        {
+            jobs[numJobs].startBit = cands[cand + numJobs];
+            jobs[numJobs].endBit = cands[cand + numJobs + 1];
+        }
+
+        for (i = 0; i < numJobs; i++)
+            Nu_WorkerStart(&jobs[i].worker, Nu_Bzip2ExpJobRun, &jobs[i]);
+        for (i = 0; i < numJobs; i++) {
+            Nu_WorkerJoin(&jobs[i].worker);
+            Nu_StatsAddWorker(pArchive, &jobs[i].worker);
+        }
+
+        /*
+         * Send the blocks down the funnel.  Where a block didn't expand,
+         * the next magic number was probably a false alarm, so extend
+         * the block to the one after that and try again.  The job that
+         * started at the false alarm will have failed too, so we skip it.
+         * Once the block is longer than any real one could be, it's just
+         * bad, and there's no point in looking further.
+         */
+        for (i = 0; i < numJobs; ) {
+            NuBzip2ExpJob* pJob = &jobs[i];
+            uint32_t next = cand + i + 1;
+
+            while (pJob->bzerr != BZ_OK && next < numCands &&
+                cands[next + 1] - pJob->startBit <= maxBlockBits)
+            {
+                DBUG(("--- bzip2 block at bit %u failed, extending\n",
+                    pJob->startBit));
+                next++;
+                pJob->endBit = cands[next];
+                Nu_Bzip2ExpJobRun(pJob);
+            }
+            if (pJob->bzerr != BZ_OK) {
+                err = kNuErrBadData;
+                Nu_ReportError(NU_BLOB, err,
+                    "bzip2 block at bit %u failed to expand (bzerr=%d)",
+                    pJob->startBit, pJob->bzerr);
+                goto bail;
+            }
+
+            if (pJob->outLen > pThread->actualThreadEOF - totalOut) {
+                err = kNuErrBadData;
+                Nu_ReportError(NU_BLOB, err,
+                    "bzip2 data expanded past end of thread (%u)",
+                    pThread->actualThreadEOF);
+                goto bail;
+            }
+            if (pJob->outLen != 0) {
+                err = Nu_FunnelWrite(pArchive, pFunnel, pJob->out,
+                        pJob->outLen);
+                if (err != kNuErrNone) {
+                    Nu_ReportError(NU_BLOB, err, "write failed in bzip2");
+                    goto bail;
+                }
+            }
+            totalOut += pJob->outLen;
+            combinedCRC = Nu_Bzip2CombineCRC(combinedCRC, pJob->blockCRC);
+            if (pCrc != NULL)
+                *pCrc = Nu_CRC16Combine(*pCrc, pJob->crc, pJob->outLen);
+
+            /* skip any jobs that started inside this block */
+            i = next - cand;
+        }
+        cand += i;
+    }
+
+    if (combinedCRC != streamCRC) {
+        err = kNuErrBadData;
+        Nu_ReportError(NU_BLOB, err,
+            "bzip2 stream CRC mismatch (0x%08x vs 0x%08x)",
+            combinedCRC, streamCRC);
+        goto bail;
+    }
+    if (totalOut != pThread->actualThreadEOF) {
+        err = kNuErrBadData;
+        Nu_ReportError(NU_BLOB, err,
+            "size mismatch on expanded bzip2 file (%u vs %u)",
+            totalOut, pThread->actualThreadEOF);
+        goto bail;
+    }
+
+bail:
+    if (jobs != NULL) {
+        for (i = 0; i < numWorkers; i++) {
+            Nu_Bzip2EmptyCache(&jobs[i].state);
+            Nu_Free(pArchive, jobs[i].stream);
+            Nu_Free(pArchive, jobs[i].out);
+        }
+        Nu_Free(pArchive, jobs);
+    }
+    Nu_Free(pArchive, cands);
+    Nu_Free(pArchive, src);
+    return err;
+}
+
+/*
+ * Expand from "pStream" to "pFunnel".
+ *
+ * Large threads are handed to Nu_ExpandBzip2Parallel when the archive
+ * allows more than one worker thread.
  */
 NuError Nu_ExpandBzip2(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc)
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
+    NuBzip2State* pState;
     bz_stream bzstream;
     int bzerr;
     uint32_t compRemaining;
@@ -181,16 +1104,26 @@ NuError Nu_ExpandBzip2(NuArchive* pArchive, const NuRecord* pRecord,
 
     Assert(pArchive != NULL);
     Assert(pThread != NULL);
-    Assert(infp != NULL);
+    Assert(pStream != NULL);
     Assert(pFunnel != NULL);
 
+    if (pThread->thCompThreadEOF >= kNuBzip2MinParallelExpand &&
+        pThread->thCompThreadEOF <= kNuBzip2MaxParallelExpand &&
+        Nu_GetWorkerCount(pArchive) > 1)
+    {
+        return Nu_ExpandBzip2Parallel(pArchive, pThread, pStream, pFunnel,
+                pCrc, Nu_GetWorkerCount(pArchive));
+    }
+
     err = Nu_AllocCompressionBufferIFN(pArchive);
     if (err != kNuErrNone)
         return err;
 
-    /* allocate a similarly-sized buffer for the output */
-    outbuf = Nu_Malloc(pArchive, kNuGenCompBufSize);
-    BailAlloc(outbuf);
+    /* get our state, which has a similarly-sized buffer for the output */
+    err = Nu_GetBzip2State(pArchive, &pState);
+    if (err != kNuErrNone)
+        return err;
+    outbuf = pState->outbuf;
 
     compRemaining = pThread->thCompThreadEOF;
 
@@ -199,7 +1132,7 @@ NuError Nu_ExpandBzip2(NuArchive* pArchive, const NuRecord* pRecord,
      */
     bzstream.bzalloc = Nu_bzalloc;
     bzstream.bzfree = Nu_bzfree;
-    bzstream.opaque = pArchive;
+    bzstream.opaque = pState;
     bzstream.next_in = NULL;
     bzstream.avail_in = 0;
     bzstream.next_out = outbuf;
@@ -231,7 +1164,7 @@ NuError Nu_ExpandBzip2(NuArchive* pArchive, const NuRecord* pRecord,
             DBUG(("+++ reading %ld bytes (%ld left)\n", getSize,
                 compRemaining));
 
-            err = Nu_FRead(infp, pArchive->compBuf, getSize);
+            err = Nu_CompStreamRead(pStream, pArchive->compBuf, getSize);
             if (err != kNuErrNone) {
                 Nu_ReportError(NU_BLOB, err, "bzip2 read failed");
                 goto bz_bail;
@@ -264,8 +1197,8 @@ NuError Nu_ExpandBzip2(NuArchive* pArchive, const NuRecord* pRecord,
             }
 
             if (pCrc != NULL)
-                *pCrc = Nu_CalcCRC16(*pCrc, outbuf,
-                                    (uint8_t*) bzstream.next_out - outbuf);
+                *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, outbuf,
+                            (uint8_t*) bzstream.next_out - outbuf);
 
             bzstream.next_out = outbuf;
             bzstream.avail_out = kNuGenCompBufSize;
@@ -288,8 +1221,6 @@ bz_bail:
     BZ2_bzDecompressEnd(&bzstream);     /* free up any allocated structures */
 
 bail:
-    if (outbuf != NULL)
-        Nu_Free(NULL, outbuf);
     return err;
 }
 
@@ -0,0 +1,202 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Buffer-to-buffer compression and expansion.
+ *
+ * These run the same compressors and expanders that are used on archive
+ * threads, but the input and output are blocks of memory.  This is handy
+ * for things like LZW/2 data embedded in disk images, where there's no
+ * archive and no reason to go through a temp file.
+ *
+ * The codecs keep their state (compression buffer, LZW tables) in a
+ * NuArchive, so a codec context is just a wrapper around an archive that
+ * never gets opened.  Holding on to a context lets the state be reused
+ * from one call to the next.
+ */
+#include "NufxLibPriv.h"
+
+
+/*
+ * Allocate a new codec context.
+ */
+NuError Nu_CreateCodecContext(NuCodecContext** ppContext)
+{
+    NuError err;
+    NuCodecContext* pContext = NULL;
+
+    Assert(ppContext != NULL);
+
+    pContext = Nu_Calloc(NULL, sizeof(*pContext));
+    if (pContext == NULL)
+        return kNuErrMalloc;
+
+    err = Nu_NuArchiveNew(&pContext->pArchive);
+    if (err != kNuErrNone) {
+        Nu_Free(NULL, pContext);
+        return err;
+    }
+
+    pContext->structMagic = kNuCodecContextStructMagic;
+    *ppContext = pContext;
+    return kNuErrNone;
+}
+
+/*
+ * Free a codec context, and any codec state it's holding on to.
+ */
+NuError Nu_FreeCodecContext(NuCodecContext* pContext)
+{
+    Assert(pContext != NULL);
+    Assert(pContext->structMagic == kNuCodecContextStructMagic);
+
+    (void) Nu_NuArchiveFree(pContext->pArchive);
+
+    pContext->structMagic = kNuCodecContextStructMagic ^ 0xffffffff;
+    Nu_Free(NULL, pContext);
+
+    return kNuErrNone;
+}
+
+
+/*
+ * Compress "srcLen" bytes from "srcBuf" into "dstBuf", using the
+ * compression format specified by "threadFormat".
+ *
+ * On success, "*pDstLen" holds the length of the compressed data, and
+ * "*pCrc" (if non-NULL) holds the CRC of the uncompressed data, computed
+ * the same way as the record version 3 thread CRC.
+ *
+ * Unlike the archive code, we don't fall back to storing the data if it
+ * didn't get smaller.  If the compressed output doesn't fit in
+ * "dstBufLen" bytes, kNuErrBufferOverrun is returned.
+ */
+NuError Nu_CompressBuffer(NuCodecContext* pContext,
+    NuThreadFormat threadFormat, const uint8_t* srcBuf, uint32_t srcLen,
+    uint8_t* dstBuf, uint32_t dstBufLen, uint32_t* pDstLen, uint16_t* pCrc)
+{
+    NuError err;
+    NuArchive* pArchive;
+    NuDataSource* pDataSource = NULL;
+    NuStraw* pStraw = NULL;
+    NuCompStream dstStream;
+    uint32_t dstLen = 0;
+    uint16_t crc;
+
+    Assert(pContext != NULL);
+    Assert(pDstLen != NULL);
+
+    pArchive = pContext->pArchive;
+    crc = kNuInitialThreadCRC;
+
+    /* the compressors don't deal with empty input; nothing to do anyway */
+    if (!srcLen) {
+        err = kNuErrNone;
+        goto done;
+    }
+
+    err = Nu_DataSourceBuffer_New(kNuThreadFormatUncompressed, 0, srcBuf,
+            0, srcLen, NULL, &pDataSource);
+    BailError(err);
+    err = Nu_StrawNew(pArchive, pDataSource, NULL, &pStraw);
+    BailError(err);
+
+    Nu_CompStreamInitBuffer(&dstStream, dstBuf, dstBufLen);
+
+    err = Nu_CompressToStream(pArchive, pStraw, &dstStream, threadFormat,
+            srcLen, &dstLen, &crc);
+    if (err == kNuErrNone)
+        err = Nu_CompStreamGetError(&dstStream);
+    BailError(err);
+    Assert(dstLen == dstStream.dataLen);
+
+done:
+    *pDstLen = dstLen;
+    if (pCrc != NULL)
+        *pCrc = crc;
+
+bail:
+    (void) Nu_StrawFree(pArchive, pStraw);
+    (void) Nu_DataSourceFree(pDataSource);
+    return err;
+}
+
+/*
+ * Expand "srcLen" bytes of data in "threadFormat" format from "srcBuf"
+ * into "dstBuf".  The data must expand to exactly "dstLen" bytes.
+ *
+ * If "pCrc" is non-NULL, the CRC of the expanded data is stored there.
+ * It's up to the caller to compare it against something.  (LZW/1 has
+ * a CRC embedded in the compressed data, which is always checked.)
+ */
+NuError Nu_ExpandBuffer(NuCodecContext* pContext, NuThreadFormat threadFormat,
+    const uint8_t* srcBuf, uint32_t srcLen, uint8_t* dstBuf, uint32_t dstLen,
+    uint16_t* pCrc)
+{
+    NuError err;
+    NuArchive* pArchive;
+    NuDataSink* pDataSink = NULL;
+    NuFunnel* pFunnel = NULL;
+    NuCompStream srcStream;
+    NuRecord fakeRecord;
+    NuThread fakeThread;
+    uint16_t crc;
+
+    Assert(pContext != NULL);
+
+    pArchive = pContext->pArchive;
+    crc = kNuInitialThreadCRC;
+
+    if (!dstLen) {
+        /* only a zero-length input can expand to nothing */
+        err = srcLen ? kNuErrInvalidArg : kNuErrNone;
+        goto done;
+    }
+
+    /*
+     * The expanders want to know about the record and thread they're
+     * working on.  Make up some plausible values.
+     */
+    memset(&fakeRecord, 0, sizeof(fakeRecord));
+    fakeRecord.recVersionNumber = kNuOurRecordVersion;
+    memset(&fakeThread, 0, sizeof(fakeThread));
+    fakeThread.thThreadClass = kNuThreadClassData;
+    fakeThread.thThreadFormat = threadFormat;
+    fakeThread.thThreadKind = kNuThreadKindDataFork;
+    fakeThread.thThreadEOF = dstLen;
+    fakeThread.thCompThreadEOF = srcLen;
+    fakeThread.actualThreadEOF = dstLen;
+
+    err = Nu_DataSinkBuffer_New(true, kNuConvertOff, dstBuf, dstLen,
+            &pDataSink);
+    BailError(err);
+    err = Nu_FunnelNew(pArchive, pDataSink, kNuConvertOff, kNuEOLUnknown,
+            NULL, &pFunnel);
+    BailError(err);
+
+    Nu_CompStreamInitReadBuffer(&srcStream, srcBuf, srcLen);
+
+    err = Nu_ExpandFromStream(pArchive, &fakeRecord, &fakeThread, &srcStream,
+            pFunnel, &crc);
+    BailError(err);
+    err = Nu_FunnelFlush(pArchive, pFunnel);
+    BailError(err);
+
+    if (Nu_DataSinkGetOutCount(pDataSink) != dstLen) {
+        err = kNuErrBadData;
+        Nu_ReportError(NU_BLOB, err, "expanded to %u bytes, expected %u",
+            Nu_DataSinkGetOutCount(pDataSink), dstLen);
+        goto bail;
+    }
+
+done:
+    if (pCrc != NULL)
+        *pCrc = crc;
+
+bail:
+    (void) Nu_FunnelFree(pArchive, pFunnel);
+    (void) Nu_DataSinkFree(pDataSink);
+    return err;
+}
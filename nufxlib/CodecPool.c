@@ -0,0 +1,189 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Codec state that outlives an archive.
+ *
+ * Each archive hangs on to the buffers, tables, and library streams that
+ * its compressors and expanders use, so they get set up once per archive
+ * instead of once per thread.  Programs that open lots of small archives
+ * (e.g. a server) would still pay the setup cost every time, so the state
+ * can be parked here when an archive is freed, and handed to the next
+ * archive that gets created.
+ *
+ * The pool is disabled by default, because the parked state can be a
+ * few megabytes (mostly libbz2) per entry.  Use NuSetCodecPoolLimit to
+ * turn it on.
+ */
+#include "NufxLibPriv.h"
+
+/* most entries we'll hold on to */
+#define kNuCodecPoolMaxLimit    16
+
+/*
+ * One archive's worth of codec state.
+ */
+typedef struct NuCodecSet {
+    uint8_t*        compBuf;
+    void*           lzwCompressState;
+    void*           lzwExpandState;
+    void*           lzcState;
+    void*           deflateState;
+    void*           inflateState;
+    void*           bzip2State;
+} NuCodecSet;
+
+static NuMutex gNuCodecPoolLock = kNuMutexInitializer;
+static NuCodecSet gNuCodecPool[kNuCodecPoolMaxLimit];
+static int gNuCodecPoolCount = 0;
+static int gNuCodecPoolLimit = 0;
+
+
+/*
+ * Move the codec state out of an archive, leaving the archive's fields
+ * empty.  Returns "false" if the archive didn't have any.
+ */
+static Boolean Nu_CodecSetTakeFromArchive(NuCodecSet* pSet,
+    NuArchive* pArchive)
+{
+    pSet->compBuf = pArchive->compBuf;
+    pSet->lzwCompressState = pArchive->lzwCompressState;
+    pSet->lzwExpandState = pArchive->lzwExpandState;
+    pSet->lzcState = pArchive->lzcState;
+    pSet->deflateState = pArchive->deflateState;
+    pSet->inflateState = pArchive->inflateState;
+    pSet->bzip2State = pArchive->bzip2State;
+
+    pArchive->compBuf = NULL;
+    pArchive->lzwCompressState = pArchive->lzwExpandState = NULL;
+    pArchive->lzcState = NULL;
+    pArchive->deflateState = pArchive->inflateState = NULL;
+    pArchive->bzip2State = NULL;
+
+    return (pSet->compBuf != NULL || pSet->lzwCompressState != NULL ||
+            pSet->lzwExpandState != NULL || pSet->lzcState != NULL ||
+            pSet->deflateState != NULL || pSet->inflateState != NULL ||
+            pSet->bzip2State != NULL);
+}
+
+/*
+ * Hand a set of codec state to an archive.  The archive must not have
+ * any state of its own.
+ */
+static void Nu_CodecSetGiveToArchive(const NuCodecSet* pSet,
+    NuArchive* pArchive)
+{
+    Assert(pArchive->compBuf == NULL);
+    Assert(pArchive->lzwCompressState == NULL);
+    Assert(pArchive->lzwExpandState == NULL);
+    Assert(pArchive->lzcState == NULL);
+    Assert(pArchive->deflateState == NULL);
+    Assert(pArchive->inflateState == NULL);
+    Assert(pArchive->bzip2State == NULL);
+
+    pArchive->compBuf = pSet->compBuf;
+    pArchive->lzwCompressState = pSet->lzwCompressState;
+    pArchive->lzwExpandState = pSet->lzwExpandState;
+    pArchive->lzcState = pSet->lzcState;
+    pArchive->deflateState = pSet->deflateState;
+    pArchive->inflateState = pSet->inflateState;
+    pArchive->bzip2State = pSet->bzip2State;
+}
+
+/*
+ * Free everything in a set of codec state.
+ */
+static void Nu_CodecSetFree(NuCodecSet* pSet)
+{
+    Nu_Free(NULL, pSet->compBuf);
+    Nu_Free(NULL, pSet->lzwCompressState);
+    Nu_Free(NULL, pSet->lzwExpandState);
+#ifdef ENABLE_LZC
+    Nu_FreeLZCState(pSet->lzcState);
+#endif
+#ifdef ENABLE_DEFLATE
+    Nu_FreeDeflateState(pSet->deflateState);
+    Nu_FreeInflateState(pSet->inflateState);
+#endif
+#ifdef ENABLE_BZIP2
+    Nu_FreeBzip2State(pSet->bzip2State);
+#endif
+    memset(pSet, 0, sizeof(*pSet));
+}
+
+
+/*
+ * Give a newly-created archive some codec state from the pool, if there
+ * is any.
+ */
+void Nu_CodecPoolAttach(NuArchive* pArchive)
+{
+    Assert(pArchive != NULL);
+
+    Nu_MutexLock(&gNuCodecPoolLock);
+    if (gNuCodecPoolCount > 0) {
+        gNuCodecPoolCount--;
+        Nu_CodecSetGiveToArchive(&gNuCodecPool[gNuCodecPoolCount], pArchive);
+        memset(&gNuCodecPool[gNuCodecPoolCount], 0, sizeof(NuCodecSet));
+    }
+    Nu_MutexUnlock(&gNuCodecPoolLock);
+}
+
+/*
+ * Take the codec state away from an archive that's about to be freed.
+ * It goes into the pool if there's room, and is freed otherwise.
+ */
+void Nu_CodecPoolRelease(NuArchive* pArchive)
+{
+    NuCodecSet set;
+
+    Assert(pArchive != NULL);
+
+    if (!Nu_CodecSetTakeFromArchive(&set, pArchive))
+        return;
+
+    /*
+     * If the application gave the archive its own allocator, the state
+     * may be in memory that goes away when the archive does.
+     */
+    Nu_MutexLock(&gNuCodecPoolLock);
+    if (gNuCodecPoolCount < gNuCodecPoolLimit &&
+        Nu_UsesGlobalAllocator(pArchive))
+    {
+        gNuCodecPool[gNuCodecPoolCount++] = set;
+        memset(&set, 0, sizeof(set));
+    }
+    Nu_MutexUnlock(&gNuCodecPoolLock);
+
+    Nu_CodecSetFree(&set);      /* no-op if it went into the pool */
+}
+
+/*
+ * Set the maximum number of entries the pool will hold.  Setting it to
+ * zero disables the pool and frees anything that's in it.
+ */
+NuError Nu_SetCodecPoolLimit(long limit)
+{
+    NuCodecSet excess[kNuCodecPoolMaxLimit];
+    int i, numExcess = 0;
+
+    if (limit < 0 || limit > kNuCodecPoolMaxLimit)
+        return kNuErrInvalidArg;
+
+    Nu_MutexLock(&gNuCodecPoolLock);
+    gNuCodecPoolLimit = (int) limit;
+    while (gNuCodecPoolCount > gNuCodecPoolLimit) {
+        gNuCodecPoolCount--;
+        excess[numExcess++] = gNuCodecPool[gNuCodecPoolCount];
+        memset(&gNuCodecPool[gNuCodecPoolCount], 0, sizeof(NuCodecSet));
+    }
+    Nu_MutexUnlock(&gNuCodecPoolLock);
+
+    /* free outside the lock; tearing down library streams isn't free */
+    for (i = 0; i < numExcess; i++)
+        Nu_CodecSetFree(&excess[i]);
+
+    return kNuErrNone;
+}
@@ -0,0 +1,249 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Implementation of NuCompStream, the compressed-data side of the codecs.
+ *
+ * The compressors write their output, and the expanders read their input,
+ * through one of these.  Most of the time it's just a thin wrapper around
+ * the archive or temp file FILE*, but it can also point at a block of
+ * memory, which lets the codecs run without touching the filesystem.  When
+ * extracting, it can also be fed by a read-ahead thread (ReadAhead.c),
+ * which Nu_ReadAheadOpenThread sets up, and when flushing it can feed a
+ * write-behind thread (WriteBehind.c) set up by Nu_WriteBehindOpenThread.
+ */
+#include "NufxLibPriv.h"
+
+
+/*
+ * Set up a stream that reads from or writes to an open file.  The file
+ * should already be positioned at the start of the compressed data.
+ * The I/O is counted in pArchive's stats.
+ */
+void Nu_CompStreamInitFile(NuArchive* pArchive, NuCompStream* pStream,
+    FILE* fp)
+{
+    Assert(pArchive != NULL);
+    Assert(pStream != NULL);
+    Assert(fp != NULL);
+
+    memset(pStream, 0, sizeof(*pStream));
+    pStream->type = kNuCompStreamFile;
+    pStream->fp = fp;
+    pStream->pArchive = pArchive;
+}
+
+/*
+ * Set up a stream that writes into a fixed-size buffer.  Attempts to
+ * write past "bufLen" bytes will fail with kNuErrBufferOverrun.
+ */
+void Nu_CompStreamInitBuffer(NuCompStream* pStream, uint8_t* buffer,
+    uint32_t bufLen)
+{
+    Assert(pStream != NULL);
+    Assert(buffer != NULL || bufLen == 0);
+
+    memset(pStream, 0, sizeof(*pStream));
+    pStream->type = kNuCompStreamBuffer;
+    pStream->buffer = buffer;
+    pStream->bufLen = bufLen;
+}
+
+/*
+ * Set up a stream that reads "dataLen" bytes of compressed data from
+ * a buffer.  The buffer is not modified.
+ */
+void Nu_CompStreamInitReadBuffer(NuCompStream* pStream, const uint8_t* buffer,
+    uint32_t dataLen)
+{
+    Nu_CompStreamInitBuffer(pStream, (uint8_t*) buffer, dataLen);
+    pStream->dataLen = dataLen;
+}
+
+
+/*
+ * Read "len" bytes from the stream.  Running off the end of a buffer is
+ * treated like a short read on a file.
+ */
+NuError Nu_CompStreamRead(NuCompStream* pStream, void* buf, uint32_t len)
+{
+    Assert(pStream != NULL);
+    Assert(buf != NULL);
+
+    if (pStream->type == kNuCompStreamFile)
+        return Nu_FRead(pStream->pArchive, pStream->fp, buf, len);
+    if (pStream->type == kNuCompStreamReadAhead)
+        return Nu_ReadAheadRead(pStream->pReadAhead, buf, len);
+
+    Assert(pStream->type == kNuCompStreamBuffer);
+    if (len > pStream->dataLen - pStream->offset) {
+        pStream->offset = pStream->dataLen;
+        return kNuErrFileRead;
+    }
+    memcpy(buf, pStream->buffer + pStream->offset, len);
+    pStream->offset += len;
+    return kNuErrNone;
+}
+
+/*
+ * Write "len" bytes to the stream.
+ *
+ * Overflowing a buffer sets a "sticky" error, the way a FILE* would, so
+ * code that writes with Nu_CompStreamPutc can check for it at the end.
+ */
+NuError Nu_CompStreamWrite(NuCompStream* pStream, const void* buf,
+    uint32_t len)
+{
+    Assert(pStream != NULL);
+    Assert(buf != NULL);
+
+    if (pStream->type == kNuCompStreamFile)
+        return Nu_FWrite(pStream->pArchive, pStream->fp, buf, len);
+    if (pStream->type == kNuCompStreamWriteBehind)
+        return Nu_WriteBehindWrite(pStream->pWriteBehind, buf, len);
+
+    Assert(pStream->type == kNuCompStreamBuffer);
+    if (len > pStream->bufLen - pStream->offset) {
+        pStream->stickyErr = kNuErrBufferOverrun;
+        return kNuErrBufferOverrun;
+    }
+    memcpy(pStream->buffer + pStream->offset, buf, len);
+    pStream->offset += len;
+    if (pStream->offset > pStream->dataLen)
+        pStream->dataLen = pStream->offset;
+    return kNuErrNone;
+}
+
+/*
+ * Read a single byte.  Returns EOF when there's nothing left, like getc().
+ */
+int Nu_CompStreamGetc(NuCompStream* pStream)
+{
+    int ic;
+
+    Assert(pStream != NULL);
+
+    if (pStream->type == kNuCompStreamFile) {
+        ic = getc(pStream->fp);
+        if (ic != EOF)
+            Nu_StatsAddRead(pStream->pArchive, 1);
+        return ic;
+    }
+    if (pStream->type == kNuCompStreamReadAhead)
+        return Nu_ReadAheadGetc(pStream->pReadAhead);
+
+    if (pStream->offset >= pStream->dataLen)
+        return EOF;
+    return pStream->buffer[pStream->offset++];
+}
+
+/*
+ * Write a single byte.  Errors are sticky; see Nu_CompStreamGetError.
+ */
+void Nu_CompStreamPutc(NuCompStream* pStream, int val)
+{
+    Assert(pStream != NULL);
+
+    if (pStream->type == kNuCompStreamFile) {
+        if (putc(val, pStream->fp) != EOF)
+            Nu_StatsAddWrite(pStream->pArchive, pStream->fp, 1);
+        return;
+    }
+    if (pStream->type == kNuCompStreamWriteBehind) {
+        Nu_WriteBehindPutc(pStream->pWriteBehind, val);
+        return;
+    }
+
+    if (pStream->offset >= pStream->bufLen) {
+        pStream->stickyErr = kNuErrBufferOverrun;
+        return;
+    }
+    pStream->buffer[pStream->offset++] = (uint8_t) val;
+    if (pStream->offset > pStream->dataLen)
+        pStream->dataLen = pStream->offset;
+}
+
+/*
+ * Get the current position.  For buffers, this is the offset from the
+ * start of the buffer.
+ */
+NuError Nu_CompStreamTell(NuCompStream* pStream, long* pOffset)
+{
+    Assert(pStream != NULL);
+    Assert(pOffset != NULL);
+
+    if (pStream->type == kNuCompStreamFile)
+        return Nu_FTell(pStream->pArchive, pStream->fp, pOffset);
+    if (pStream->type == kNuCompStreamReadAhead) {
+        *pOffset = Nu_ReadAheadTell(pStream->pReadAhead);
+        return kNuErrNone;
+    }
+    if (pStream->type == kNuCompStreamWriteBehind) {
+        *pOffset = Nu_WriteBehindTell(pStream->pWriteBehind);
+        return kNuErrNone;
+    }
+
+    *pOffset = (long) pStream->offset;
+    return kNuErrNone;
+}
+
+/*
+ * Seek to a new position.  Buffers can't be positioned past the end of
+ * the data they hold.
+ */
+NuError Nu_CompStreamSeek(NuCompStream* pStream, long offset, int ptrname)
+{
+    long newOffset;
+
+    Assert(pStream != NULL);
+
+    if (pStream->type == kNuCompStreamFile)
+        return Nu_FSeek(pStream->pArchive, pStream->fp, offset, ptrname);
+    if (pStream->type == kNuCompStreamReadAhead) {
+        /* read-ahead only goes forward */
+        Assert(0);
+        return kNuErrFileSeek;
+    }
+    if (pStream->type == kNuCompStreamWriteBehind)
+        return Nu_WriteBehindSeek(pStream->pArchive, pStream->pWriteBehind,
+                offset, ptrname);
+
+    switch (ptrname) {
+    case SEEK_SET:
+        newOffset = offset;
+        break;
+    case SEEK_CUR:
+        newOffset = (long) pStream->offset + offset;
+        break;
+    case SEEK_END:
+        newOffset = (long) pStream->dataLen + offset;
+        break;
+    default:
+        Assert(0);
+        return kNuErrInvalidArg;
+    }
+
+    if (newOffset < 0 || newOffset > (long) pStream->dataLen)
+        return kNuErrFileSeek;
+    pStream->offset = (uint32_t) newOffset;
+    return kNuErrNone;
+}
+
+/*
+ * Return the stream's error state.  For files this is the stdio error
+ * flag, for buffers it's the sticky overrun error, and for write-behind
+ * it's the writer's first failure.
+ */
+NuError Nu_CompStreamGetError(NuCompStream* pStream)
+{
+    Assert(pStream != NULL);
+
+    if (pStream->type == kNuCompStreamFile)
+        return ferror(pStream->fp) ? kNuErrFileWrite : kNuErrNone;
+    if (pStream->type == kNuCompStreamWriteBehind)
+        return Nu_WriteBehindGetError(pStream->pWriteBehind);
+
+    return pStream->stickyErr;
+}
@@ -0,0 +1,774 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Delete and rewrite records by compacting the archive in place.
+ *
+ * Normally, deleting a record from an archive, or adding or removing a
+ * thread in one, means copying everything into the temp file and renaming
+ * it over the original.  For a large archive that's a lot of I/O for a
+ * small change.  When kNuValueModifyOrig and kNuValueCompactInPlace are
+ * both set, the records that come after each gap are slid down over it
+ * instead, the master header is rewritten, and the file is truncated.
+ *
+ * Records that need to be rebuilt are first written past the end of the
+ * archive, where they don't disturb anything (see Nu_StageChangedRecords
+ * in Deferred.c).  Their old copies are then squeezed out like deleted
+ * records, so rebuilt records end up at the end of the archive.
+ *
+ * Moving records down in the same file destroys the original as we go, so
+ * a crash part way through would leave a mess.  To avoid that, the moves
+ * are recorded in a journal file ("<archive>-journal") before anything in
+ * the archive is touched.  The journal holds:
+ *
+ *  - A header with the new record count, the new end of the archive, and
+ *    the list of extents to move, protected by a CRC.  It also has the
+ *    length of the archive and the CRC and EOF from its master header,
+ *    from before anything was moved.
+ *  - Two "progress" slots, used alternately.  Before each chunk of data is
+ *    written to its new home, a copy of it is written to the next slot,
+ *    with a sequence number and a CRC.  Since the source and destination
+ *    can overlap, the copy is what makes it safe to redo the write.
+ *
+ * The journal is synced to the disk before each write to the archive, and
+ * the archive is synced before the next slot is overwritten.  When
+ * everything has been moved, the master header is rewritten and the file
+ * truncated, and then the journal is removed.
+ *
+ * NuOpenRW checks for a leftover journal.  If its header is damaged, the
+ * crash happened before any records were moved, and the journal is simply
+ * removed.  Otherwise, the newest intact slot is written out again, the
+ * remaining moves are made, and the compaction is finished normally.
+ *
+ * A journal is only replayed if the archive still looks the way it did
+ * when the journal was written.  If the new master header made it out,
+ * all that's left is the truncation.  Anything else means the archive
+ * has changed since (say, the journal couldn't be removed, and the
+ * archive was updated later), so the journal is thrown away unused.
+ *
+ * Archives with a BXY or SEA wrapper still go through the temp file.
+ */
+#include "NufxLibPriv.h"
+
+/* where to find things in the master header */
+#define kNuMasterCRCOffset      6
+#define kNuMasterEOFOffset      38
+
+/* size of the chunks we move the records in */
+#define kNuCompactChunkSize     (256 * 1024)
+
+/* journal file identification */
+static const char kNuCompactJournalSuffix[] = "-journal";
+static const uint8_t kNuCompactMagic[4] = { 'N', 'u', 'C', 'J' };
+#define kNuCompactVersion       2
+
+/*
+ * Fixed part of the header: magic, version, #of records, end, original
+ * length, master header CRC and EOF, #of extents.
+ */
+#define kNuCompactHeaderLen     (4 + 2 + 4 + 4 + 4 + 2 + 4 + 4)
+#define kNuCompactExtentLen     (4 + 4 + 4)
+/* fixed part of a slot: sequence, extent index, offset, length, CRC */
+#define kNuCompactSlotHeaderLen (4 + 4 + 4 + 4 + 2)
+#define kNuCompactSlotLen       (kNuCompactSlotHeaderLen + kNuCompactChunkSize)
+
+/*
+ * A contiguous run of kept records that needs to move down.
+ */
+typedef struct NuCompactExtent {
+    uint32_t        srcOffset;
+    uint32_t        dstOffset;
+    uint32_t        length;
+} NuCompactExtent;
+
+/*
+ * Everything we need to do (or finish) a compaction.
+ */
+typedef struct NuCompactPlan {
+    uint32_t        numRecords;     /* records left in the archive */
+    uint32_t        compactEnd;     /* new length of the archive file */
+    uint32_t        origLength;     /* archive as it was before we started */
+    uint16_t        origMasterCRC;
+    uint32_t        origMasterEOF;
+    uint32_t        numExtents;
+    NuCompactExtent* extents;
+    long            slotBase;       /* journal offset of the first slot */
+} NuCompactPlan;
+
+
+/*
+ * Allocate a string with the pathname of the journal for this archive.
+ */
+static UNICHAR* Nu_CompactJournalPath(NuArchive* pArchive)
+{
+    UNICHAR* journalPathUNI;
+
+    Assert(pArchive->archivePathnameUNI != NULL);
+
+    journalPathUNI = Nu_Malloc(pArchive,
+                        strlen(pArchive->archivePathnameUNI) +
+                        sizeof(kNuCompactJournalSuffix));
+    if (journalPathUNI == NULL)
+        return NULL;
+    strcpy(journalPathUNI, pArchive->archivePathnameUNI);
+    strcat(journalPathUNI, kNuCompactJournalSuffix);
+    return journalPathUNI;
+}
+
+/*
+ * Sync a file, ignoring the "can't do that here" result.
+ */
+static NuError Nu_CompactSync(FILE* fp)
+{
+    NuError err;
+
+    err = Nu_SyncOpenFile(fp);
+    if (err == kNuErrInternal)
+        err = kNuErrNone;
+    return err;
+}
+
+/*
+ * Get the things that tell us whether the archive is the one a journal
+ * was written for: its length, and the CRC and EOF from the master
+ * header.  These are read from the file, not pArchive->masterHeader.
+ * The file position is preserved.
+ */
+static NuError Nu_CompactGetIdentity(NuArchive* pArchive, uint32_t* pLength,
+    uint16_t* pMasterCRC, uint32_t* pMasterEOF)
+{
+    NuError err;
+    FILE* fp = pArchive->archiveFp;
+    long oldPos, length;
+
+    err = Nu_FTell(pArchive, fp, &oldPos);
+    BailError(err);
+    err = Nu_GetFileLength(pArchive, fp, &length);
+    BailError(err);
+    *pLength = (uint32_t) length;
+
+    err = Nu_FSeek(pArchive, fp,
+            pArchive->headerOffset + kNuMasterCRCOffset, SEEK_SET);
+    BailError(err);
+    *pMasterCRC = Nu_ReadTwo(pArchive, fp);
+    err = Nu_FSeek(pArchive, fp,
+            pArchive->headerOffset + kNuMasterEOFOffset, SEEK_SET);
+    BailError(err);
+    *pMasterEOF = Nu_ReadFour(pArchive, fp);
+    err = Nu_HeaderIOFailed(pArchive, fp);
+    BailError(err);
+
+    err = Nu_FSeek(pArchive, fp, oldPos, SEEK_SET);
+
+bail:
+    return err;
+}
+
+
+/*
+ * ===========================================================================
+ *      Journal I/O
+ * ===========================================================================
+ */
+
+/*
+ * Write the journal header, and push it out to the disk.
+ */
+static NuError Nu_CompactWriteJournal(NuArchive* pArchive, FILE* jfp,
+    const NuCompactPlan* pPlan)
+{
+    NuError err;
+    uint16_t crc = 0;
+    uint32_t idx;
+
+    Nu_WriteBytesC(pArchive, jfp, kNuCompactMagic, sizeof(kNuCompactMagic),
+        &crc);
+    Nu_WriteTwoC(pArchive, jfp, kNuCompactVersion, &crc);
+    Nu_WriteFourC(pArchive, jfp, pPlan->numRecords, &crc);
+    Nu_WriteFourC(pArchive, jfp, pPlan->compactEnd, &crc);
+    Nu_WriteFourC(pArchive, jfp, pPlan->origLength, &crc);
+    Nu_WriteTwoC(pArchive, jfp, pPlan->origMasterCRC, &crc);
+    Nu_WriteFourC(pArchive, jfp, pPlan->origMasterEOF, &crc);
+    Nu_WriteFourC(pArchive, jfp, pPlan->numExtents, &crc);
+    for (idx = 0; idx < pPlan->numExtents; idx++) {
+        Nu_WriteFourC(pArchive, jfp, pPlan->extents[idx].srcOffset, &crc);
+        Nu_WriteFourC(pArchive, jfp, pPlan->extents[idx].dstOffset, &crc);
+        Nu_WriteFourC(pArchive, jfp, pPlan->extents[idx].length, &crc);
+    }
+    Nu_WriteTwo(pArchive, jfp, crc);
+
+    err = Nu_HeaderIOFailed(pArchive, jfp);
+    BailError(err);
+    err = Nu_CompactSync(jfp);
+
+bail:
+    return err;
+}
+
+/*
+ * Read the journal header.  Returns kNuErrBadData if it's incomplete or
+ * damaged.  On success, the caller must free pPlan->extents.
+ */
+static NuError Nu_CompactReadJournal(NuArchive* pArchive, FILE* jfp,
+    NuCompactPlan* pPlan)
+{
+    NuError err;
+    uint8_t magic[sizeof(kNuCompactMagic)];
+    uint16_t crc = 0;
+    uint16_t version;
+    long journalLen;
+    uint32_t idx;
+
+    memset(pPlan, 0, sizeof(*pPlan));
+
+    err = Nu_GetFileLength(NULL, jfp, &journalLen);
+    BailError(err);
+    if (journalLen < kNuCompactHeaderLen + 2) {
+        err = kNuErrBadData;
+        goto bail;
+    }
+
+    Nu_ReadBytesC(pArchive, jfp, magic, sizeof(magic), &crc);
+    version = Nu_ReadTwoC(pArchive, jfp, &crc);
+    pPlan->numRecords = Nu_ReadFourC(pArchive, jfp, &crc);
+    pPlan->compactEnd = Nu_ReadFourC(pArchive, jfp, &crc);
+    pPlan->origLength = Nu_ReadFourC(pArchive, jfp, &crc);
+    pPlan->origMasterCRC = Nu_ReadTwoC(pArchive, jfp, &crc);
+    pPlan->origMasterEOF = Nu_ReadFourC(pArchive, jfp, &crc);
+    pPlan->numExtents = Nu_ReadFourC(pArchive, jfp, &crc);
+    if (Nu_HeaderIOFailed(pArchive, jfp) != kNuErrNone ||
+        memcmp(magic, kNuCompactMagic, sizeof(magic)) != 0 ||
+        version != kNuCompactVersion ||
+        pPlan->numExtents >
+            (uint32_t) (journalLen - kNuCompactHeaderLen - 2) /
+                kNuCompactExtentLen)
+    {
+        err = kNuErrBadData;
+        goto bail;
+    }
+
+    if (pPlan->numExtents) {
+        pPlan->extents = Nu_Malloc(pArchive,
+                            pPlan->numExtents * sizeof(NuCompactExtent));
+        BailAlloc(pPlan->extents);
+    }
+    for (idx = 0; idx < pPlan->numExtents; idx++) {
+        pPlan->extents[idx].srcOffset = Nu_ReadFourC(pArchive, jfp, &crc);
+        pPlan->extents[idx].dstOffset = Nu_ReadFourC(pArchive, jfp, &crc);
+        pPlan->extents[idx].length = Nu_ReadFourC(pArchive, jfp, &crc);
+    }
+    if (Nu_ReadTwo(pArchive, jfp) != crc ||
+        Nu_HeaderIOFailed(pArchive, jfp) != kNuErrNone)
+    {
+        err = kNuErrBadData;
+        goto bail;
+    }
+
+    pPlan->slotBase = kNuCompactHeaderLen +
+                        pPlan->numExtents * kNuCompactExtentLen + 2;
+
+bail:
+    if (err != kNuErrNone) {
+        Nu_Free(pArchive, pPlan->extents);
+        pPlan->extents = NULL;
+    }
+    return err;
+}
+
+/*
+ * Record the chunk we're about to write, and push it out to the disk.
+ */
+static NuError Nu_CompactWriteSlot(NuArchive* pArchive, FILE* jfp,
+    const NuCompactPlan* pPlan, uint32_t seq, uint32_t extIdx,
+    uint32_t extOffset, const uint8_t* buf, uint32_t len)
+{
+    NuError err;
+    uint16_t crc = 0;
+
+    err = Nu_FSeek(pArchive, jfp,
+            pPlan->slotBase + (long) (seq & 1) * kNuCompactSlotLen, SEEK_SET);
+    BailError(err);
+
+    Nu_WriteFourC(pArchive, jfp, seq, &crc);
+    Nu_WriteFourC(pArchive, jfp, extIdx, &crc);
+    Nu_WriteFourC(pArchive, jfp, extOffset, &crc);
+    Nu_WriteFourC(pArchive, jfp, len, &crc);
+    crc = Nu_CalcCRC16(crc, buf, len);
+    Nu_WriteTwo(pArchive, jfp, crc);
+    err = Nu_FWrite(pArchive, jfp, buf, len);
+    BailError(err);
+
+    err = Nu_HeaderIOFailed(pArchive, jfp);
+    BailError(err);
+    err = Nu_CompactSync(jfp);
+
+bail:
+    return err;
+}
+
+/*
+ * Read one of the progress slots into "buf".  Returns kNuErrBadData if
+ * the slot was never written, or was only partly written.
+ */
+static NuError Nu_CompactReadSlot(NuArchive* pArchive, FILE* jfp,
+    const NuCompactPlan* pPlan, int slot, uint32_t* pSeq, uint32_t* pExtIdx,
+    uint32_t* pExtOffset, uint8_t* buf, uint32_t* pLen)
+{
+    NuError err;
+    uint16_t crc = 0;
+    uint16_t storedCrc;
+
+    err = Nu_FSeek(pArchive, jfp,
+            pPlan->slotBase + (long) slot * kNuCompactSlotLen, SEEK_SET);
+    BailError(err);
+
+    *pSeq = Nu_ReadFourC(pArchive, jfp, &crc);
+    *pExtIdx = Nu_ReadFourC(pArchive, jfp, &crc);
+    *pExtOffset = Nu_ReadFourC(pArchive, jfp, &crc);
+    *pLen = Nu_ReadFourC(pArchive, jfp, &crc);
+    storedCrc = Nu_ReadTwo(pArchive, jfp);
+    if (Nu_HeaderIOFailed(pArchive, jfp) != kNuErrNone ||
+        (*pSeq & 1) != (uint32_t) slot ||
+        *pExtIdx >= pPlan->numExtents ||
+        *pLen == 0 || *pLen > kNuCompactChunkSize ||
+        *pExtOffset > pPlan->extents[*pExtIdx].length ||
+        *pLen > pPlan->extents[*pExtIdx].length - *pExtOffset)
+    {
+        err = kNuErrBadData;
+        goto bail;
+    }
+
+    if (Nu_FRead(pArchive, jfp, buf, *pLen) != kNuErrNone ||
+        Nu_CalcCRC16(crc, buf, *pLen) != storedCrc)
+    {
+        err = kNuErrBadData;
+        goto bail;
+    }
+
+bail:
+    return err;
+}
+
+
+/*
+ * ===========================================================================
+ *      Compaction
+ * ===========================================================================
+ */
+
+/*
+ * Move the records, starting with the chunk at "extOffset" in extent
+ * "extIdx".  "seq" is the sequence number of the last chunk written.
+ */
+static NuError Nu_CompactMove(NuArchive* pArchive, FILE* jfp,
+    const NuCompactPlan* pPlan, uint32_t extIdx, uint32_t extOffset,
+    uint32_t seq, uint8_t* buf)
+{
+    NuError err = kNuErrNone;
+    FILE* fp = pArchive->archiveFp;
+
+    for ( ; extIdx < pPlan->numExtents; extIdx++, extOffset = 0) {
+        const NuCompactExtent* pExtent = &pPlan->extents[extIdx];
+
+        while (extOffset < pExtent->length) {
+            uint32_t len = pExtent->length - extOffset;
+
+            if (len > kNuCompactChunkSize)
+                len = kNuCompactChunkSize;
+
+            err = Nu_FSeek(pArchive, fp, pExtent->srcOffset + extOffset,
+                    SEEK_SET);
+            BailError(err);
+            err = Nu_FRead(pArchive, fp, buf, len);
+            BailError(err);
+
+            seq++;
+            err = Nu_CompactWriteSlot(pArchive, jfp, pPlan, seq, extIdx,
+                    extOffset, buf, len);
+            BailError(err);
+
+            err = Nu_FSeek(pArchive, fp, pExtent->dstOffset + extOffset,
+                    SEEK_SET);
+            BailError(err);
+            err = Nu_FWrite(pArchive, fp, buf, len);
+            BailError(err);
+            err = Nu_CompactSync(fp);
+            BailError(err);
+
+            pArchive->stats.bytesCopied += len;
+            extOffset += len;
+        }
+    }
+
+bail:
+    return err;
+}
+
+/*
+ * Write the new master header, then cut off whatever is left past the
+ * last record.  The header goes first, so that a crash in between leaves
+ * a valid archive with some junk on the end.
+ */
+static NuError Nu_CompactFinish(NuArchive* pArchive,
+    const NuCompactPlan* pPlan)
+{
+    NuError err;
+    NuMasterHeader* pHeader = &pArchive->masterHeader;
+    FILE* fp = pArchive->archiveFp;
+
+    pHeader->mhTotalRecords = pPlan->numRecords;
+    pHeader->mhMasterEOF = pPlan->compactEnd - pArchive->headerOffset;
+    pHeader->mhMasterVersion = kNuOurMHVersion;
+    Nu_SetCurrentDateTime(&pHeader->mhArchiveModWhen);
+
+    err = Nu_FSeek(pArchive, fp, pArchive->headerOffset, SEEK_SET);
+    BailError(err);
+    err = Nu_WriteMasterHeader(pArchive, fp, pHeader);
+    BailError(err);
+    err = Nu_CompactSync(fp);
+    BailError(err);
+
+    err = Nu_TruncateOpenFile(fp, pPlan->compactEnd);
+    if (err == kNuErrInternal) {
+        /* can't truncate here; the master header says where to stop */
+        err = kNuErrNone;
+    } else if (err != kNuErrNone) {
+        Nu_ReportError(NU_BLOB, err, "failed truncating compacted archive");
+        goto bail;
+    }
+    err = Nu_CompactSync(fp);
+
+bail:
+    return err;
+}
+
+/*
+ * Decide whether the pending changes can be made by compacting the
+ * original archive.  There must be some deleted records, or records
+ * with changes Nu_UpdateInOriginal can't handle.
+ */
+Boolean Nu_CanCompactInPlace(NuArchive* pArchive)
+{
+    const NuRecord* pRecord;
+    long count;
+
+    if (!pArchive->valModifyOrig || !pArchive->valCompactInPlace)
+        return false;
+    if (!Nu_RecordSet_GetLoaded(&pArchive->copyRecordSet))
+        return false;
+
+    /* can't slide the archive around inside a wrapper */
+    if (pArchive->headerOffset != 0)
+        return false;
+
+    /* if nothing is left, let the usual code handle it */
+    count = Nu_RecordSet_GetNumRecords(&pArchive->copyRecordSet);
+    if (count == 0)
+        return false;
+    if (count < (long) Nu_RecordSet_GetNumRecords(&pArchive->origRecordSet))
+        return true;
+
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->copyRecordSet);
+    while (count--) {
+        Assert(pRecord != NULL);
+        if (Nu_RecordNeedsRebuild(pRecord))
+            return true;
+        pRecord = pRecord->pNext;
+    }
+
+    return false;
+}
+
+/*
+ * Slide the records in the "copy" set down over the holes left by the
+ * deleted or rebuilt ones, rewrite the master header, and truncate the
+ * archive.  The record and thread offsets in the "copy" set are updated
+ * to match, and pArchive->masterHeader reflects the new archive.
+ *
+ * If this fails part way through, the journal is left behind, and the
+ * next NuOpenRW will finish the job.
+ */
+NuError Nu_CompactInPlace(NuArchive* pArchive)
+{
+    NuError err;
+    NuCompactPlan plan;
+    NuRecord* pRecord;
+    UNICHAR* journalPathUNI = NULL;
+    FILE* jfp = NULL;
+    uint8_t* buf = NULL;
+    uint32_t expected;
+    long count;
+
+    Assert(pArchive->headerOffset == 0);
+
+    memset(&plan, 0, sizeof(plan));
+    count = Nu_RecordSet_GetNumRecords(&pArchive->copyRecordSet);
+    plan.numRecords = count;
+    plan.extents = Nu_Malloc(pArchive, count * sizeof(NuCompactExtent));
+    BailAlloc(plan.extents);
+
+    /*
+     * Figure out where everything goes.  The "copy" set is in file order,
+     * so each record moves down by the total size of the deleted records
+     * in front of it.  Adjacent records that move by the same amount are
+     * merged into one extent.
+     */
+    expected = pArchive->headerOffset + kNuMasterHeaderSize;
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->copyRecordSet);
+    while (pRecord != NULL) {
+        uint32_t srcOffset = (uint32_t) pRecord->fileOffset;
+        uint32_t length = pRecord->recHeaderLength + pRecord->totalCompLength;
+
+        Assert(srcOffset >= expected);
+        if (srcOffset != expected) {
+            NuCompactExtent* pPrev = NULL;
+
+            if (plan.numExtents)
+                pPrev = &plan.extents[plan.numExtents-1];
+            if (pPrev != NULL &&
+                pPrev->srcOffset + pPrev->length == srcOffset &&
+                pPrev->dstOffset + pPrev->length == expected)
+            {
+                pPrev->length += length;
+            } else {
+                plan.extents[plan.numExtents].srcOffset = srcOffset;
+                plan.extents[plan.numExtents].dstOffset = expected;
+                plan.extents[plan.numExtents].length = length;
+                plan.numExtents++;
+            }
+        }
+        expected += length;
+        pRecord = pRecord->pNext;
+    }
+    plan.compactEnd = expected;
+    plan.slotBase = kNuCompactHeaderLen +
+                        plan.numExtents * kNuCompactExtentLen + 2;
+
+    DBUG(("--- Compacting in place: %ld records, %u extents, end=%u\n",
+        count, plan.numExtents, plan.compactEnd));
+
+    /*
+     * If only records at the end went away, there's nothing to move, and
+     * Nu_CompactFinish can't leave the archive in a bad state.
+     */
+    if (plan.numExtents) {
+        /* anything staged past the end must be on the disk first */
+        err = Nu_CompactSync(pArchive->archiveFp);
+        BailError(err);
+        err = Nu_CompactGetIdentity(pArchive, &plan.origLength,
+                &plan.origMasterCRC, &plan.origMasterEOF);
+        BailError(err);
+
+        journalPathUNI = Nu_CompactJournalPath(pArchive);
+        BailAlloc(journalPathUNI);
+        buf = Nu_Malloc(pArchive, kNuCompactChunkSize);
+        BailAlloc(buf);
+
+        jfp = fopen(journalPathUNI, kNuFileOpenReadWriteCreat);
+        if (jfp == NULL) {
+            err = errno ? errno : kNuErrFileOpen;
+            Nu_ReportError(NU_BLOB, err,
+                "Unable to create compaction journal '%s'", journalPathUNI);
+            goto bail;
+        }
+        err = Nu_CompactWriteJournal(pArchive, jfp, &plan);
+        if (err == kNuErrNone) {
+            /* make sure the journal can be found after a crash */
+            err = Nu_SyncParentDir(pArchive, journalPathUNI);
+            if (err == kNuErrInternal)
+                err = kNuErrNone;
+        }
+        if (err != kNuErrNone) {
+            Nu_ReportError(NU_BLOB, err,
+                "Failed writing compaction journal '%s'", journalPathUNI);
+            goto bail;
+        }
+
+        err = Nu_CompactMove(pArchive, jfp, &plan, 0, 0, 0, buf);
+        if (err != kNuErrNone) {
+            Nu_ReportError(NU_BLOB, err, "Failed while compacting archive");
+            goto bail;
+        }
+    }
+
+    err = Nu_CompactFinish(pArchive, &plan);
+    BailError(err);
+
+    /* the records are where we said they'd be; update the offsets */
+    expected = pArchive->headerOffset + kNuMasterHeaderSize;
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->copyRecordSet);
+    while (pRecord != NULL) {
+        long delta = (long) expected - pRecord->fileOffset;
+        uint32_t idx;
+
+        pRecord->fileOffset += delta;
+        for (idx = 0; idx < pRecord->recTotalThreads; idx++)
+            Nu_GetThread(pRecord, (int) idx)->fileOffset += delta;
+
+        expected += pRecord->recHeaderLength + pRecord->totalCompLength;
+        pRecord = pRecord->pNext;
+    }
+
+    /*
+     * The archive is done.  If the journal won't go away, it no longer
+     * matches the archive, so it won't be replayed; just say something.
+     */
+    if (jfp != NULL) {
+        NuError delErr;
+
+        fclose(jfp);
+        jfp = NULL;
+        delErr = Nu_DeleteFile(journalPathUNI);
+        if (delErr != kNuErrNone) {
+            Nu_ReportError(NU_BLOB, delErr,
+                "Unable to remove compaction journal '%s'", journalPathUNI);
+        }
+    }
+
+bail:
+    if (jfp != NULL)
+        fclose(jfp);
+    Nu_Free(pArchive, journalPathUNI);
+    Nu_Free(pArchive, buf);
+    Nu_Free(pArchive, plan.extents);
+    return err;
+}
+
+/*
+ * Finish a compaction that was interrupted.  Called from NuOpenRW after
+ * the master header has been read; leaves the archive positioned just
+ * past the master header.
+ */
+NuError Nu_CompactRecover(NuArchive* pArchive)
+{
+    NuError err = kNuErrNone;
+    NuCompactPlan plan;
+    UNICHAR* journalPathUNI = NULL;
+    FILE* jfp = NULL;
+    uint8_t* buf = NULL;
+    uint32_t seq, extIdx, extOffset, len;
+    uint32_t bestSeq, bestExtIdx, bestExtOffset, bestLen;
+    uint32_t curLength, curMasterEOF;
+    uint16_t curMasterCRC;
+    Boolean haveSlot = false;
+    int slot;
+
+    memset(&plan, 0, sizeof(plan));
+
+    journalPathUNI = Nu_CompactJournalPath(pArchive);
+    BailAlloc(journalPathUNI);
+    jfp = fopen(journalPathUNI, kNuFileOpenReadWrite);
+    if (jfp == NULL)
+        goto bail;      /* no journal, nothing to do */
+
+    err = Nu_CompactReadJournal(pArchive, jfp, &plan);
+    if (err == kNuErrBadData) {
+        /* journal never made it to the disk, so the archive is untouched */
+        DBUG(("--- Discarding incomplete compaction journal\n"));
+        err = kNuErrNone;
+        goto discard;
+    }
+    BailError(err);
+
+    err = Nu_CompactGetIdentity(pArchive, &curLength, &curMasterCRC,
+            &curMasterEOF);
+    BailError(err);
+    if (curLength != plan.origLength || curMasterCRC != plan.origMasterCRC ||
+        curMasterEOF != plan.origMasterEOF)
+    {
+        if (curMasterEOF == plan.compactEnd - pArchive->headerOffset &&
+            pArchive->masterHeader.mhTotalRecords == plan.numRecords &&
+            curLength >= plan.compactEnd)
+        {
+            /* got as far as the new master header; finish the truncate */
+            DBUG(("--- Compaction finished, truncating to %u\n",
+                plan.compactEnd));
+            err = Nu_TruncateOpenFile(pArchive->archiveFp, plan.compactEnd);
+            if (err == kNuErrInternal)
+                err = kNuErrNone;
+            BailError(err);
+        } else {
+            Nu_ReportError(NU_BLOB, kNuErrNone,
+                "Ignoring compaction journal '%s', which doesn't match "
+                "the archive", journalPathUNI);
+        }
+        goto discard;
+    }
+
+    Nu_ReportError(NU_BLOB, kNuErrNone,
+        "Finishing interrupted compaction of '%s'",
+        pArchive->archivePathnameUNI);
+
+    buf = Nu_Malloc(pArchive, kNuCompactChunkSize);
+    BailAlloc(buf);
+
+    /*
+     * Find the newest slot that's intact, and write it out again; the
+     * write to the archive may not have finished.
+     */
+    bestSeq = bestExtIdx = bestExtOffset = bestLen = 0;
+    for (slot = 0; slot < 2; slot++) {
+        if (Nu_CompactReadSlot(pArchive, jfp, &plan, slot, &seq, &extIdx,
+                &extOffset, buf, &len) != kNuErrNone)
+        {
+            continue;
+        }
+        if (!haveSlot || seq > bestSeq) {
+            haveSlot = true;
+            bestSeq = seq;
+            bestExtIdx = extIdx;
+            bestExtOffset = extOffset;
+            bestLen = len;
+        }
+    }
+
+    if (haveSlot) {
+        /* re-read the winner, since the other one may be in "buf" now */
+        err = Nu_CompactReadSlot(pArchive, jfp, &plan, bestSeq & 1, &seq,
+                &extIdx, &extOffset, buf, &len);
+        BailError(err);
+
+        DBUG(("--- Replaying compaction chunk %u (extent %u +%u)\n",
+            bestSeq, bestExtIdx, bestExtOffset));
+        err = Nu_FSeek(pArchive, pArchive->archiveFp,
+                plan.extents[bestExtIdx].dstOffset + bestExtOffset, SEEK_SET);
+        BailError(err);
+        err = Nu_FWrite(pArchive, pArchive->archiveFp, buf, bestLen);
+        BailError(err);
+        err = Nu_CompactSync(pArchive->archiveFp);
+        BailError(err);
+
+        bestExtOffset += bestLen;
+    }
+
+    err = Nu_CompactMove(pArchive, jfp, &plan, bestExtIdx, bestExtOffset,
+            bestSeq, buf);
+    BailError(err);
+    err = Nu_CompactFinish(pArchive, &plan);
+    BailError(err);
+
+discard:
+    fclose(jfp);
+    jfp = NULL;
+    err = Nu_DeleteFile(journalPathUNI);
+    if (err != kNuErrNone) {
+        Nu_ReportError(NU_BLOB, err,
+            "Unable to remove compaction journal '%s'", journalPathUNI);
+        goto bail;
+    }
+
+    err = Nu_FSeek(pArchive, pArchive->archiveFp,
+            pArchive->headerOffset + kNuMasterHeaderSize, SEEK_SET);
+
+bail:
+    if (err != kNuErrNone)
+        Nu_ReportError(NU_BLOB, err, "Unable to finish compaction");
+    if (jfp != NULL)
+        fclose(jfp);
+    Nu_Free(pArchive, journalPathUNI);
+    Nu_Free(pArchive, buf);
+    Nu_Free(pArchive, plan.extents);
+    return err;
+}
@@ -8,15 +8,15 @@
  */
 #include "NufxLibPriv.h"
 
-/* for ShrinkIt-mimic mode, don't compress files under 512 bytes */
-#define kNuSHKLZWThreshold  512
+/* best-of candidates for inputs smaller than this run one at a time */
+#define kNuBestOfMinParallel    (64 * 1024)
 
 
 /*
  * "Compress" an uncompressed thread.
  */
 static NuError Nu_CompressUncompressed(NuArchive* pArchive, NuStraw* pStraw,
-    FILE* fp, uint32_t srcLen, uint32_t* pDstLen, uint16_t *pCrc)
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t *pCrc)
 {
     NuError err = kNuErrNone;
     /*uint8_t* buffer = NULL;*/
@@ -24,7 +24,7 @@ static NuError Nu_CompressUncompressed(NuArchive* pArchive, NuStraw* pStraw,
 
     Assert(pArchive != NULL);
     Assert(pStraw != NULL);
-    Assert(fp != NULL);
+    Assert(pStream != NULL);
     Assert(srcLen > 0);
 
     *pDstLen = srcLen;  /* get this over with */
@@ -42,8 +42,9 @@ static NuError Nu_CompressUncompressed(NuArchive* pArchive, NuStraw* pStraw,
         err = Nu_StrawRead(pArchive, pStraw, pArchive->compBuf, getsize);
         BailError(err);
         if (pCrc != NULL)
-            *pCrc = Nu_CalcCRC16(*pCrc, pArchive->compBuf, getsize);
-        err = Nu_FWrite(fp, pArchive->compBuf, getsize);
+            *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, pArchive->compBuf,
+                        getsize);
+        err = Nu_CompStreamWrite(pStream, pArchive->compBuf, getsize);
         BailError(err);
 
         count -= getsize;
@@ -55,6 +56,418 @@ bail:
 }
 
 
+/*
+ * Compress "srcLen" bytes from "pStraw" to "pStream", using "targetFormat".
+ *
+ * This just picks the right compressor.  It doesn't try to decide if
+ * the result is worth keeping; that's up to the caller.
+ *
+ * Every attempt is counted in the archive's stats, including ones that
+ * fail or are abandoned, since they took time.  The output size is only
+ * counted for the ones that finished.
+ */
+NuError Nu_CompressToStream(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, NuThreadFormat targetFormat, uint32_t srcLen,
+    uint32_t* pDstLen, uint16_t* pCrc)
+{
+    NuError err;
+    NuStatsTimer timer;
+
+    Nu_StatsCodecStart(pArchive, &timer);
+
+    switch (targetFormat) {
+    case kNuThreadFormatUncompressed:
+        err = Nu_CompressUncompressed(pArchive, pStraw, pStream, srcLen,
+                pDstLen, pCrc);
+        break;
+    #ifdef ENABLE_SQ
+    case kNuThreadFormatHuffmanSQ:
+        err = Nu_CompressHuffmanSQ(pArchive, pStraw, pStream, srcLen,
+                pDstLen, pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_LZW
+    case kNuThreadFormatLZW1:
+        err = Nu_CompressLZW1(pArchive, pStraw, pStream, srcLen, pDstLen,
+                pCrc);
+        break;
+    case kNuThreadFormatLZW2:
+        err = Nu_CompressLZW2(pArchive, pStraw, pStream, srcLen, pDstLen,
+                pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_LZC
+    case kNuThreadFormatLZC12:
+        err = Nu_CompressLZC12(pArchive, pStraw, pStream, srcLen, pDstLen,
+                pCrc);
+        break;
+    case kNuThreadFormatLZC16:
+        err = Nu_CompressLZC16(pArchive, pStraw, pStream, srcLen, pDstLen,
+                pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_DEFLATE
+    case kNuThreadFormatDeflate:
+        err = Nu_CompressDeflate(pArchive, pStraw, pStream, srcLen, pDstLen,
+                pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_BZIP2
+    case kNuThreadFormatBzip2:
+        err = Nu_CompressBzip2(pArchive, pStraw, pStream, srcLen, pDstLen,
+                pCrc);
+        break;
+    #endif
+    default:
+        /* should've been blocked in Value.c */
+        err = kNuErrBadFormat;
+        break;
+    }
+
+    if (targetFormat < kNuStatsNumFormats) {
+        Nu_StatsCodecStop(pArchive, &timer,
+            &pArchive->stats.compress[targetFormat], srcLen,
+            err == kNuErrNone ? *pDstLen : 0);
+    }
+
+    return err;
+}
+
+
+/*
+ * ===========================================================================
+ *      Best-of compression
+ * ===========================================================================
+ */
+
+/*
+ * Best-of mode (kNuCompressBest) runs each of the formats named by
+ * kNuValueBestOfFormats over the same input, and keeps whichever one
+ * came out smallest.  The input is held in memory, and each candidate
+ * compresses into its own buffer, so this costs roughly (N+1) times the
+ * size of the input.
+ *
+ * Candidates run on worker threads, up to kNuValueWorkerThreads at a
+ * time.  The codecs keep their state in the archive, so each format gets
+ * a scratch archive of its own, which is kept around for the next thread.
+ *
+ * If kNuValueBestOfTimeLimit is set, candidates that are still running
+ * when the time is up give up at their next read, so long as at least
+ * one candidate has finished.  The jobs share a flag that says whether
+ * any of them has, guarded by a mutex.
+ */
+typedef struct NuBestOfShared {
+    NuMutex         lock;
+    Boolean         anyDone;                /* a candidate has finished */
+} NuBestOfShared;
+
+typedef struct NuBestOfJob {
+    NuArchive*      pScratch;               /* holds the codec state */
+    NuThreadFormat  format;
+    const uint8_t*  srcBuf;
+    uint32_t        srcLen;
+    uint8_t*        dstBuf;                 /* srcLen bytes */
+    uint32_t        dstLen;
+    uint32_t        deadline;               /* tick count; 0 if none */
+    NuBestOfShared* pShared;                /* shared by all jobs */
+    NuError         err;
+    NuWorker        worker;
+} NuBestOfJob;
+
+/*
+ * Scratch archives get their messages swallowed, because they may be
+ * running on a worker thread.  Failures are reported from the main
+ * thread instead.
+ */
+static NuResult Nu_ScratchMessageHandler(NuArchive* pArchive,
+    void* vErrorMessage)
+{
+    return kNuOK;
+}
+
+/*
+ * Create a scratch archive.  These exist only to hold codec state for
+ * compression or expansion done on a worker thread.
+ */
+NuError Nu_ScratchArchiveNew(NuArchive** ppScratch)
+{
+    NuError err;
+
+    err = Nu_NuArchiveNew(ppScratch);
+    if (err == kNuErrNone)
+        (*ppScratch)->messageHandlerFunc = Nu_ScratchMessageHandler;
+    return err;
+}
+
+/*
+ * Copy the codec settings and allocator from "pArchive" into a scratch
+ * archive.
+ */
+void Nu_ScratchArchiveSync(const NuArchive* pArchive, NuArchive* pScratch)
+{
+    pScratch->valDeflateLevel = pArchive->valDeflateLevel;
+    pScratch->valDeflateStrategy = pArchive->valDeflateStrategy;
+    pScratch->valBzip2BlockSize = pArchive->valBzip2BlockSize;
+    pScratch->valLZCBits = pArchive->valLZCBits;
+    pScratch->valStatsTiming = pArchive->valStatsTiming;
+    pScratch->pAllocator = pArchive->pAllocator;
+    if (pArchive->ownAllocator)
+        pScratch->ownAllocator = true;
+}
+
+/*
+ * Returns "true" if this format can be used as a best-of candidate.
+ */
+static Boolean Nu_BestOfFormatAvailable(NuThreadFormat format)
+{
+    switch (format) {
+    #ifdef ENABLE_SQ
+    case kNuThreadFormatHuffmanSQ:
+    #endif
+    #ifdef ENABLE_LZW
+    case kNuThreadFormatLZW1:
+    case kNuThreadFormatLZW2:
+    #endif
+    #ifdef ENABLE_LZC
+    case kNuThreadFormatLZC12:
+    case kNuThreadFormatLZC16:
+    #endif
+    #ifdef ENABLE_DEFLATE
+    case kNuThreadFormatDeflate:
+    #endif
+    #ifdef ENABLE_BZIP2
+    case kNuThreadFormatBzip2:
+    #endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Get the scratch archive for "format", creating it if necessary, and
+ * copy the compression settings into it.
+ */
+static NuError Nu_GetBestOfScratch(NuArchive* pArchive, NuThreadFormat format,
+    NuArchive** ppScratch)
+{
+    NuError err;
+    NuArchive* pScratch;
+
+    Assert(format < NELEM(pArchive->bestOfScratch));
+
+    pScratch = pArchive->bestOfScratch[format];
+    if (pScratch == NULL) {
+        err = Nu_ScratchArchiveNew(&pScratch);
+        BailError(err);
+        pArchive->bestOfScratch[format] = pScratch;
+    }
+
+    Nu_ScratchArchiveSync(pArchive, pScratch);
+    pScratch->valWorkerThreads = 1;     /* already on a worker */
+
+    *ppScratch = pScratch;
+    err = kNuErrNone;
+
+bail:
+    return err;
+}
+
+/*
+ * Straw abort function.  Gives up once the time limit has passed, but
+ * only if somebody else has something to show for it.
+ */
+static Boolean Nu_BestOfShouldAbort(void* arg)
+{
+    const NuBestOfJob* pJob = arg;
+    Boolean anyDone;
+
+    if (pJob->deadline == 0 ||
+        (int32_t) (Nu_GetTickCount() - pJob->deadline) < 0)
+    {
+        return false;
+    }
+
+    Nu_MutexLock(&pJob->pShared->lock);
+    anyDone = pJob->pShared->anyDone;
+    Nu_MutexUnlock(&pJob->pShared->lock);
+    return anyDone;
+}
+
+/*
+ * Compress the input with one candidate format.  May run on a worker
+ * thread, so it only touches the job's scratch archive.
+ */
+static void Nu_BestOfJobRun(void* arg)
+{
+    NuBestOfJob* pJob = arg;
+    NuError err;
+    NuArchive* pScratch = pJob->pScratch;
+    NuDataSource* pDataSource = NULL;
+    NuStraw* pStraw = NULL;
+    NuCompStream stream;
+    uint16_t crc;
+
+    err = Nu_DataSourceBuffer_New(kNuThreadFormatUncompressed, 0,
+            pJob->srcBuf, 0, pJob->srcLen, NULL, &pDataSource);
+    BailError(err);
+    err = Nu_StrawNew(pScratch, pDataSource, NULL, &pStraw);
+    BailError(err);
+    pStraw->abortFunc = Nu_BestOfShouldAbort;
+    pStraw->abortArg = pJob;
+
+    /* no point in keeping anything that doesn't get smaller */
+    Nu_CompStreamInitBuffer(&stream, pJob->dstBuf, pJob->srcLen - 1);
+
+    err = Nu_CompressToStream(pScratch, pStraw, &stream, pJob->format,
+            pJob->srcLen, &pJob->dstLen, &crc);
+    if (err == kNuErrNone)
+        err = Nu_CompStreamGetError(&stream);
+    BailError(err);
+
+    Nu_MutexLock(&pJob->pShared->lock);
+    pJob->pShared->anyDone = true;
+    Nu_MutexUnlock(&pJob->pShared->lock);
+
+bail:
+    pJob->err = err;
+    (void) Nu_StrawFree(pScratch, pStraw);
+    (void) Nu_DataSourceFree(pDataSource);
+}
+
+/*
+ * Compress "srcLen" bytes from "pStraw" to "pStream" with each of the
+ * best-of candidates, and write out the smallest.  The format that won
+ * is returned in "*pFormat".  If nothing got smaller, the data is stored
+ * uncompressed.
+ */
+static NuError Nu_CompressBestOf(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen,
+    uint16_t* pCrc, NuThreadFormat* pFormat)
+{
+    NuError err = kNuErrNone;
+    NuBestOfJob jobs[kNuThreadFormatBzip2 + 1];
+    NuBestOfShared shared;
+    uint8_t* srcBuf = NULL;
+    uint32_t count, getsize, deadline = 0;
+    int numJobs, numWorkers, first, i, best;
+    NuThreadFormat format;
+
+    Assert(pArchive != NULL);
+    Assert(pStraw != NULL);
+    Assert(pStream != NULL);
+    Assert(srcLen > 0);
+
+    memset(jobs, 0, sizeof(jobs));
+    Nu_MutexInit(&shared.lock);
+    shared.anyDone = false;
+
+    /*
+     * Pull the whole input in through the straw, so the application sees
+     * the usual progress updates.
+     */
+    srcBuf = Nu_Malloc(pArchive, srcLen);
+    BailAlloc(srcBuf);
+    *pCrc = kNuInitialThreadCRC;
+    for (count = 0; count < srcLen; count += getsize) {
+        getsize = srcLen - count;
+        if (getsize > kNuGenCompBufSize)
+            getsize = kNuGenCompBufSize;
+        err = Nu_StrawRead(pArchive, pStraw, srcBuf + count, getsize);
+        BailError(err);
+    }
+    *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, srcBuf, srcLen);
+
+    if (pArchive->valBestOfTimeLimit != 0) {
+        deadline = Nu_GetTickCount() + (uint32_t) pArchive->valBestOfTimeLimit;
+        if (deadline == 0)
+            deadline = 1;
+    }
+
+    numJobs = 0;
+    for (format = 0; format < NELEM(jobs); format++) {
+        NuBestOfJob* pJob = &jobs[numJobs];
+
+        if (!(pArchive->valBestOfFormats & NuMakeFormatMask(format)) ||
+            !Nu_BestOfFormatAvailable(format))
+        {
+            continue;
+        }
+
+        err = Nu_GetBestOfScratch(pArchive, format, &pJob->pScratch);
+        BailError(err);
+        pJob->format = format;
+        pJob->srcBuf = srcBuf;
+        pJob->srcLen = srcLen;
+        pJob->dstBuf = Nu_Malloc(pArchive, srcLen);
+        BailAlloc(pJob->dstBuf);
+        pJob->deadline = deadline;
+        pJob->pShared = &shared;
+        numJobs++;
+    }
+
+    numWorkers = Nu_GetWorkerCount(pArchive);
+    if (srcLen < kNuBestOfMinParallel)
+        numWorkers = 1;
+
+    for (first = 0; first < numJobs; first += numWorkers) {
+        int last = first + numWorkers;
+
+        if (last > numJobs)
+            last = numJobs;
+        if (numWorkers == 1) {
+            Nu_BestOfJobRun(&jobs[first]);
+            continue;
+        }
+        for (i = first; i < last; i++)
+            Nu_WorkerStart(&jobs[i].worker, Nu_BestOfJobRun, &jobs[i]);
+        for (i = first; i < last; i++)
+            Nu_WorkerJoin(&jobs[i].worker);
+    }
+
+    best = -1;
+    for (i = 0; i < numJobs; i++) {
+        const NuBestOfJob* pJob = &jobs[i];
+
+        if (pJob->err == kNuErrNone) {
+            DBUG(("--- best-of: format %d got %u -> %u\n", pJob->format,
+                srcLen, pJob->dstLen));
+            if (best < 0 || pJob->dstLen < jobs[best].dstLen)
+                best = i;
+        } else if (pJob->err != kNuErrBufferOverrun &&
+                   pJob->err != kNuErrAborted)
+        {
+            /* not fatal, since the others might have worked */
+            Nu_ReportError(NU_BLOB, pJob->err,
+                "best-of compression with format %d failed", pJob->format);
+        }
+    }
+
+    if (best >= 0) {
+        err = Nu_CompStreamWrite(pStream, jobs[best].dstBuf,
+                jobs[best].dstLen);
+        BailError(err);
+        *pDstLen = jobs[best].dstLen;
+        *pFormat = jobs[best].format;
+    } else {
+        err = Nu_CompStreamWrite(pStream, srcBuf, srcLen);
+        BailError(err);
+        *pDstLen = srcLen;
+        *pFormat = kNuThreadFormatUncompressed;
+    }
+
+bail:
+    for (i = 0; i < (int) NELEM(jobs); i++) {
+        if (jobs[i].pScratch != NULL)
+            Nu_StatsMerge(pArchive, jobs[i].pScratch);
+        Nu_Free(pArchive, jobs[i].dstBuf);
+    }
+    Nu_Free(pArchive, srcBuf);
+    Nu_MutexDestroy(&shared.lock);
+    return err;
+}
+
+
 /*
  * Compress from a data source to an archive.
  *
@@ -85,16 +498,19 @@ bail:
  *
  * On exit, the output file will be positioned after the last byte of the
  * output.  (For a pre-sized buffer, this may not be the desired result.)
+ * If the flush has a write-behind thread for "dstFp", the output goes
+ * through that, and has all been written by the time we return.
  */
 NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
     NuThreadID threadID, NuThreadFormat sourceFormat,
     NuThreadFormat targetFormat, NuProgressData* pProgressData, FILE* dstFp,
     NuThread* pThread)
 {
-    NuError err;
+    NuError err, err2;
     long origOffset;
     NuStraw* pStraw = NULL;
     NuDataSink* pDataSink = NULL;
+    NuCompStream dstStream;
     uint32_t srcLen = 0, dstLen = 0;
     uint16_t threadCrc;
 
@@ -104,8 +520,10 @@ NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
     Assert(dstFp != NULL);
     Assert(pThread != NULL);
 
+    Nu_WriteBehindOpenThread(pArchive, dstFp, &dstStream);
+
     /* remember file offset, so we can back up if compression fails */
-    err = Nu_FTell(dstFp, &origOffset);
+    err = Nu_CompStreamTell(&dstStream, &origOffset);
     BailError(err);
     Assert(origOffset == pThread->fileOffset);  /* can get rid of ftell? */
 
@@ -166,66 +584,48 @@ NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
         if (pArchive->valMimicSHK && srcLen < kNuSHKLZWThreshold)
             targetFormat = kNuThreadFormatUncompressed;
 
-        if (pProgressData != NULL) {
-            if (targetFormat != kNuThreadFormatUncompressed)
-                Nu_StrawSetProgressState(pStraw, kNuProgressCompressing);
-            else
-                Nu_StrawSetProgressState(pStraw, kNuProgressStoring);
-        }
-        err = Nu_ProgressDataCompressPrep(pArchive, pStraw, targetFormat,
-                srcLen);
-        BailError(err);
+        if (targetFormat == kNuThreadFormatBestOf) {
+            /*
+             * The format isn't known until the candidates have run, so
+             * the input is read in as "analyzing", with the length but
+             * not the format filled in.
+             */
+            if (pProgressData != NULL) {
+                Nu_StrawSetProgressState(pStraw, kNuProgressAnalyzing);
+                pProgressData->uncompressedLength = srcLen;
+            }
+            err = Nu_CompressBestOf(pArchive, pStraw, &dstStream, srcLen,
+                    &dstLen, &threadCrc, &targetFormat);
+            if (err == kNuErrNone) {
+                if (pProgressData != NULL) {
+                    if (targetFormat != kNuThreadFormatUncompressed)
+                        Nu_StrawSetProgressState(pStraw,
+                            kNuProgressCompressing);
+                    else
+                        Nu_StrawSetProgressState(pStraw, kNuProgressStoring);
+                }
+                err = Nu_ProgressDataCompressPrep(pArchive, pStraw,
+                        targetFormat, srcLen);
+            }
+        } else {
+            if (pProgressData != NULL) {
+                if (targetFormat != kNuThreadFormatUncompressed)
+                    Nu_StrawSetProgressState(pStraw, kNuProgressCompressing);
+                else
+                    Nu_StrawSetProgressState(pStraw, kNuProgressStoring);
+            }
+            err = Nu_ProgressDataCompressPrep(pArchive, pStraw, targetFormat,
+                    srcLen);
+            BailError(err);
 
-        switch (targetFormat) {
-        case kNuThreadFormatUncompressed:
-            err = Nu_CompressUncompressed(pArchive, pStraw, dstFp, srcLen,
-                    &dstLen, &threadCrc);
-            break;
-        #ifdef ENABLE_SQ
-        case kNuThreadFormatHuffmanSQ:
-            err = Nu_CompressHuffmanSQ(pArchive, pStraw, dstFp, srcLen,
-                    &dstLen, &threadCrc);
-            break;
-        #endif
-        #ifdef ENABLE_LZW
-        case kNuThreadFormatLZW1:
-            err = Nu_CompressLZW1(pArchive, pStraw, dstFp, srcLen, &dstLen,
-                    &threadCrc);
-            break;
-        case kNuThreadFormatLZW2:
-            err = Nu_CompressLZW2(pArchive, pStraw, dstFp, srcLen, &dstLen,
-                    &threadCrc);
-            break;
-        #endif
-        #ifdef ENABLE_LZC
-        case kNuThreadFormatLZC12:
-            err = Nu_CompressLZC12(pArchive, pStraw, dstFp, srcLen, &dstLen,
-                    &threadCrc);
-            break;
-        case kNuThreadFormatLZC16:
-            err = Nu_CompressLZC16(pArchive, pStraw, dstFp, srcLen, &dstLen,
-                    &threadCrc);
-            break;
-        #endif
-        #ifdef ENABLE_DEFLATE
-        case kNuThreadFormatDeflate:
-            err = Nu_CompressDeflate(pArchive, pStraw, dstFp, srcLen, &dstLen,
-                    &threadCrc);
-            break;
-        #endif
-        #ifdef ENABLE_BZIP2
-        case kNuThreadFormatBzip2:
-            err = Nu_CompressBzip2(pArchive, pStraw, dstFp, srcLen, &dstLen,
-                    &threadCrc);
-            break;
-        #endif
-        default:
+            err = Nu_CompressToStream(pArchive, pStraw, &dstStream,
+                    targetFormat, srcLen, &dstLen, &threadCrc);
+        }
+        if (err == kNuErrBadFormat) {
             /* should've been blocked in Value.c */
             Assert(0);
             err = kNuErrInternal;
-            goto bail;
         }
-
         BailError(err);
 
         pThread->thThreadCRC = threadCrc;   /* CRC of uncompressed data */
@@ -239,7 +639,7 @@ NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
             pThread->thThreadFormat = targetFormat;
         } else {
             /* got bigger, store it uncompressed */
-            err = Nu_FSeek(dstFp, origOffset, SEEK_SET);
+            err = Nu_CompStreamSeek(&dstStream, origOffset, SEEK_SET);
             BailError(err);
             err = Nu_StrawRewind(pArchive, pStraw);
             BailError(err);
@@ -251,8 +651,8 @@ NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
 
             DBUG(("--- compression (%d) failed (%ld vs %ld), storing\n",
                 targetFormat, dstLen, srcLen));
-            err = Nu_CompressUncompressed(pArchive, pStraw, dstFp, srcLen,
-                    &dstLen, &threadCrc);
+            err = Nu_CompressToStream(pArchive, pStraw, &dstStream,
+                    kNuThreadFormatUncompressed, srcLen, &dstLen, &threadCrc);
             BailError(err);
 
             /*
@@ -280,7 +680,7 @@ NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
                 kNuThreadFormatUncompressed, srcLen);
         BailError(err);
 
-        err = Nu_CompressUncompressed(pArchive, pStraw, dstFp, srcLen,
+        err = Nu_CompressUncompressed(pArchive, pStraw, &dstStream, srcLen,
                 &dstLen, NULL);
         BailError(err);
 
@@ -303,6 +703,10 @@ done:
     }
 
 bail:
+    /* the output has to be on disk before the headers are written */
+    err2 = Nu_WriteBehindCloseThread(&dstStream);
+    if (err == kNuErrNone)
+        err = err2;
     (void) Nu_StrawFree(pArchive, pStraw);
     (void) Nu_DataSinkFree(pDataSink);
     return err;
@@ -364,18 +768,19 @@ NuError Nu_CopyPresizedToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
 
         err = Nu_StrawRead(pArchive, pStraw, pArchive->compBuf, getsize);
         BailError(err);
-        err = Nu_FWrite(dstFp, pArchive->compBuf, getsize);
+        err = Nu_FWrite(pArchive, dstFp, pArchive->compBuf, getsize);
         BailError(err);
 
         if (ppSavedCopy != NULL && *ppSavedCopy == NULL) {
             /*
              * Grab a copy of the filename for our own use.  This assumes
              * that the filename fits in kNuGenCompBufSize, which is a
-             * pretty safe thing to assume.
+             * pretty safe thing to assume.  It's going into a record, so
+             * it comes from the arena.
              */
             Assert(threadID == kNuThreadIDFilename);
             Assert(count == getsize);
-            *ppSavedCopy = Nu_Malloc(pArchive, getsize+1);
+            *ppSavedCopy = Nu_ArenaAlloc(pArchive, getsize+1);
             BailAlloc(*ppSavedCopy);
             memcpy(*ppSavedCopy, pArchive->compBuf, getsize);
             (*ppSavedCopy)[getsize] = '\0'; /* make sure it's terminated */
@@ -105,3 +105,46 @@ uint16_t Nu_CalcCRC16(uint16_t seed, const uint8_t* ptr, int count)
     return (CRC);
 }
 
+
+/*
+ * Multiply two polynomials modulo the CRC generator polynomial.
+ */
+static uint16_t Nu_CRC16MulMod(uint16_t a, uint16_t b)
+{
+    uint16_t prod = 0;
+    int i;
+
+    for (i = 15; i >= 0; i--) {
+        prod = (prod & 0x8000) ? (uint16_t) ((prod << 1) ^ 0x1021) :
+                                 (uint16_t) (prod << 1);
+        if (b & (1 << i))
+            prod ^= a;
+    }
+    return prod;
+}
+
+/*
+ * Combine CRCs of two adjacent regions.  "crc1" is the CRC of the first
+ * region, computed with whatever seed the caller wants.  "crc2" is the
+ * CRC of the following "len2" bytes, computed with a seed of zero.  The
+ * result is the CRC of both regions, as if they had been run through
+ * Nu_CalcCRC16 in one piece.
+ *
+ * The CRC has no final XOR, so running crc1 through len2 zero bytes and
+ * XORing in crc2 gives the answer.  Feeding a zero byte multiplies by
+ * x^8, so we raise that to the len2 power by repeated squaring.
+ */
+uint16_t Nu_CRC16Combine(uint16_t crc1, uint16_t crc2, uint32_t len2)
+{
+    uint16_t shift = 0x0001;        /* x^0 */
+    uint16_t base = 0x0100;         /* x^8 */
+
+    while (len2 != 0) {
+        if (len2 & 1)
+            shift = Nu_CRC16MulMod(shift, base);
+        base = Nu_CRC16MulMod(base, base);
+        len2 >>= 1;
+    }
+
+    return Nu_CRC16MulMod(crc1, shift) ^ crc2;
+}
@@ -196,7 +196,7 @@ static void Nu_DebugDumpRecord(NuArchive* pArchive, const NuRecord* pRecord,
         pXrefRecord != NULL && pXrefRecord->pThreadMods != NULL ? "[MOD] " : "",
         filenameUNI == NULL ? "<not specified>" : filenameUNI,
         pRecord->recordIdx);
-    free(filenameUNI);
+    Nu_Free(NULL, filenameUNI);
     printf("%sHeaderID: '%.4s'  VersionNumber: 0x%04x  HeaderCRC: 0x%04x\n",
         kInd,
         pRecord->recNufxID, pRecord->recVersionNumber, pRecord->recHeaderCRC);
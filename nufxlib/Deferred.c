@@ -30,9 +30,10 @@ NuError Nu_ThreadModAdd_New(NuArchive* pArchive, NuThreadID threadID,
     Assert(ppThreadMod != NULL);
     Assert(pDataSource != NULL);
 
-    *ppThreadMod = Nu_Calloc(pArchive, sizeof(**ppThreadMod));
+    *ppThreadMod = Nu_ArenaCalloc(pArchive, sizeof(**ppThreadMod));
     if (*ppThreadMod == NULL)
         return kNuErrMalloc;
+    pArchive->numThreadMods++;
 
     (*ppThreadMod)->entry.kind = kNuThreadModAdd;
     (*ppThreadMod)->entry.add.used = false;
@@ -58,9 +59,10 @@ NuError Nu_ThreadModUpdate_New(NuArchive* pArchive, NuThreadIdx threadIdx,
     Assert(ppThreadMod != NULL);
     Assert(pDataSource != NULL);
 
-    *ppThreadMod = Nu_Calloc(pArchive, sizeof(**ppThreadMod));
+    *ppThreadMod = Nu_ArenaCalloc(pArchive, sizeof(**ppThreadMod));
     if (*ppThreadMod == NULL)
         return kNuErrMalloc;
+    pArchive->numThreadMods++;
 
     (*ppThreadMod)->entry.kind = kNuThreadModUpdate;
     (*ppThreadMod)->entry.update.used = false;
@@ -81,9 +83,10 @@ NuError Nu_ThreadModDelete_New(NuArchive* pArchive, NuThreadIdx threadIdx,
 {
     Assert(ppThreadMod != NULL);
 
-    *ppThreadMod = Nu_Calloc(pArchive, sizeof(**ppThreadMod));
+    *ppThreadMod = Nu_ArenaCalloc(pArchive, sizeof(**ppThreadMod));
     if (*ppThreadMod == NULL)
         return kNuErrMalloc;
+    pArchive->numThreadMods++;
 
     (*ppThreadMod)->entry.kind = kNuThreadModDelete;
     (*ppThreadMod)->entry.delete.used = false;
@@ -112,7 +115,9 @@ void Nu_ThreadModFree(NuArchive* pArchive, NuThreadMod* pThreadMod)
         break;
     }
 
-    Nu_Free(pArchive, pThreadMod);
+    Nu_ArenaFree(pArchive, pThreadMod);
+    Assert(pArchive->numThreadMods > 0);
+    pArchive->numThreadMods--;
 }
 
 
@@ -250,7 +255,7 @@ static NuError Nu_NewThreads_New(NuArchive* pArchive,
     (*ppNewThreads)->numThreads = numThreads;
     (*ppNewThreads)->nextSlot = 0;
     (*ppNewThreads)->pThreads =
-        Nu_Malloc(pArchive, numThreads * sizeof(NuThread));
+        Nu_ArenaAlloc(pArchive, numThreads * sizeof(NuThread));
     BailAlloc((*ppNewThreads)->pThreads);
 
 bail:
@@ -263,7 +268,7 @@ bail:
 static void Nu_NewThreads_Free(NuArchive* pArchive, NuNewThreads* pNewThreads)
 {
     if (pNewThreads != NULL) {
-        Nu_Free(pArchive, pNewThreads->pThreads);
+        Nu_ArenaFree(pArchive, pNewThreads->pThreads);
         Nu_Free(pArchive, pNewThreads);
     }
 }
@@ -365,7 +370,7 @@ static NuError Nu_CopyArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
     long outputOffset;
     int i;
 
-    err = Nu_FTell(pArchive->tmpFp, &outputOffset);
+    err = Nu_FTell(pArchive, pArchive->tmpFp, &outputOffset);
     BailError(err);
     offsetAdjust = outputOffset - pRecord->fileOffset;
 
@@ -373,7 +378,8 @@ static NuError Nu_CopyArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
         outputOffset, offsetAdjust));
 
     /* seek to the start point in the source file, and copy the whole thing */
-    err = Nu_FSeek(pArchive->archiveFp, pRecord->fileOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, pArchive->archiveFp, pRecord->fileOffset,
+            SEEK_SET);
     BailError(err);
     err = Nu_CopyFileSection(pArchive, pArchive->tmpFp, pArchive->archiveFp,
             pRecord->recHeaderLength + pRecord->totalCompLength);
@@ -522,7 +528,7 @@ static Boolean Nu_VerifyAllTouched(NuArchive* pArchive, const NuRecord* pRecord)
  * This call should only be made after an "add" or "update" threadMod has
  * successfully completed.
  *
- * "newName" must be allocated storage, Mac OS Roman charset.
+ * "newName" must come from the archive's arena, Mac OS Roman charset.
  */
 static void Nu_SetNewThreadFilename(NuArchive* pArchive, NuRecord* pRecord,
     char* newNameMOR)
@@ -530,7 +536,7 @@ static void Nu_SetNewThreadFilename(NuArchive* pArchive, NuRecord* pRecord,
     Assert(pRecord != NULL);
     Assert(newNameMOR != NULL);
 
-    Nu_Free(pArchive, pRecord->threadFilenameMOR);
+    Nu_ArenaFree(pArchive, pRecord->threadFilenameMOR);
     pRecord->threadFilenameMOR = newNameMOR;
     pRecord->filenameMOR = pRecord->threadFilenameMOR;
 }
@@ -776,7 +782,7 @@ static NuError Nu_HandleAddThreadMods(NuArchive* pArchive, NuRecord* pRecord,
             /* (the threadIdx is set by GetNext) */
             pNewThread = Nu_NewThreads_GetNext(pNewThreads, pArchive);
             pNewThread->threadIdx = pThreadMod->entry.add.threadIdx;
-            err = Nu_FTell(dstFp, &pNewThread->fileOffset);
+            err = Nu_FTell(pArchive, dstFp, &pNewThread->fileOffset);
             BailError(err);
 
             /* this returns kNuErrSkipped if user elects to skip */
@@ -854,14 +860,32 @@ static NuError Nu_HandleAddThreadMods(NuArchive* pArchive, NuRecord* pRecord,
                 /* fall through with err */
 
             } else {
-                /* compress (possibly by just copying) the source to dstFp */
-                err = Nu_CompressToArchive(pArchive,
-                        pThreadMod->entry.add.pDataSource,
+                NuThreadFormat targetFormat;
+                Boolean written;
+                int ruleIdx;
+
+                /* the compression policy gets the final say */
+                targetFormat = Nu_PolicyChooseFormat(pArchive, pRecord,
                         pThreadMod->entry.add.threadID,
-                        Nu_DataSourceGetThreadFormat(
-                            pThreadMod->entry.add.pDataSource),
-                        pThreadMod->entry.add.threadFormat,
-                        pProgressData, dstFp, pNewThread);
+                        pThreadMod->entry.add.pDataSource,
+                        pThreadMod->entry.add.threadFormat, &ruleIdx);
+
+                /* use the worker threads' output if they have it */
+                err = Nu_FlushPoolWriteThread(pArchive, pThreadMod,
+                        targetFormat, pProgressData, dstFp, pNewThread,
+                        &written);
+
+                /* compress (possibly by just copying) the source to dstFp */
+                if (err == kNuErrNone && !written) {
+                    err = Nu_CompressToArchive(pArchive,
+                            pThreadMod->entry.add.pDataSource,
+                            pThreadMod->entry.add.threadID,
+                            Nu_DataSourceGetThreadFormat(
+                                pThreadMod->entry.add.pDataSource),
+                            targetFormat, pProgressData, dstFp, pNewThread);
+                }
+                if (err == kNuErrNone)
+                    Nu_PolicyAddStats(pArchive, ruleIdx, pNewThread);
                 /* fall through with err */
             }
 
@@ -960,7 +984,8 @@ static NuError Nu_ConstructArchiveThreads(NuArchive* pArchive,
                     Nu_CopyThreadContents(pNewThread, pThread);
 
                     /* set the thread's file offset */
-                    err = Nu_FTell(pArchive->tmpFp, &pNewThread->fileOffset);
+                    err = Nu_FTell(pArchive, pArchive->tmpFp,
+                            &pNewThread->fileOffset);
                     BailError(err);
 
                     err = Nu_ConstructArchiveUpdate(pArchive, pArchive->tmpFp,
@@ -999,10 +1024,10 @@ static NuError Nu_ConstructArchiveThreads(NuArchive* pArchive,
                  */
                 DBUG(("+++  just copying threadIdx=%ld\n",
                     pThread->threadIdx));
-                err = Nu_FSeek(pArchive->archiveFp, pThread->fileOffset,
-                        SEEK_SET);
+                err = Nu_FSeek(pArchive, pArchive->archiveFp,
+                        pThread->fileOffset, SEEK_SET);
                 BailError(err);
-                err = Nu_FTell(pArchive->tmpFp, &pThread->fileOffset);
+                err = Nu_FTell(pArchive, pArchive->tmpFp, &pThread->fileOffset);
                 BailError(err);
                 err = Nu_CopyFileSection(pArchive, pArchive->tmpFp,
                         pArchive->archiveFp, pThread->thCompThreadEOF);
@@ -1058,7 +1083,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
 
     DBUG(("--- Reconstructing '%s'\n", pRecord->filename));
 
-    err = Nu_FTell(pArchive->tmpFp, &initialOffset);
+    err = Nu_FTell(pArchive, pArchive->tmpFp, &initialOffset);
     BailError(err);
     Assert(initialOffset != 0);
 
@@ -1091,7 +1116,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
             pRecord->threadFilenameMOR));
         if (pRecord->filenameMOR == pRecord->threadFilenameMOR)
             pRecord->filenameMOR = NULL;    /* don't point at freed memory! */
-        Nu_Free(pArchive, pRecord->threadFilenameMOR);
+        Nu_ArenaFree(pArchive, pRecord->threadFilenameMOR);
         pRecord->threadFilenameMOR = NULL;
 
         /* I don't think this is possible, but check it anyway */
@@ -1116,7 +1141,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
         newHeaderSize += pRecord->recFilenameLength;
 
     DBUG(("+++ new header size = %d\n", newHeaderSize));
-    err = Nu_FSeek(pArchive->tmpFp, newHeaderSize, SEEK_CUR);
+    err = Nu_FSeek(pArchive, pArchive->tmpFp, newHeaderSize, SEEK_CUR);
     BailError(err);
 
     /*
@@ -1177,7 +1202,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
 
     /* verify that file displacement is where it should be */
     threadDisp = (long)Nu_NewThreads_TotalCompThreadEOF(pNewThreads);
-    err = Nu_FTell(pArchive->tmpFp, &finalOffset);
+    err = Nu_FTell(pArchive, pArchive->tmpFp, &finalOffset);
     BailError(err);
     Assert(finalOffset > initialOffset);
     if (finalOffset - (initialOffset + newHeaderSize) != threadDisp) {
@@ -1193,7 +1218,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
      * Free existing Threads and ThreadMods, and move the list from
      * pNewThreads over.
      */
-    Nu_Free(pArchive, pRecord->pThreads);
+    Nu_ArenaFree(pArchive, pRecord->pThreads);
     Nu_FreeThreadMods(pArchive, pRecord);
     pRecord->pThreads = Nu_NewThreads_DonateThreads(pNewThreads);
     pRecord->recTotalThreads = Nu_NewThreads_GetNumThreads(pNewThreads);
@@ -1201,7 +1226,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
     /*
      * Now, seek back and write the record header.
      */
-    err = Nu_FSeek(pArchive->tmpFp, initialOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, pArchive->tmpFp, initialOffset, SEEK_SET);
     BailError(err);
     err = Nu_WriteRecordHeader(pArchive, pRecord, pArchive->tmpFp);
     BailError(err);
@@ -1212,7 +1237,7 @@ static NuError Nu_ConstructArchiveRecord(NuArchive* pArchive, NuRecord* pRecord)
      * Seek forward once again, so we are positioned at the correct
      * place to write the next record.
      */
-    err = Nu_FSeek(pArchive->tmpFp, finalOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, pArchive->tmpFp, finalOffset, SEEK_SET);
     BailError(err);
 
     /* update the record's fileOffset to reflect its new position */
@@ -1227,7 +1252,7 @@ bail:
          * keep going otherwise.  We need to back up in the file so the
          * original copy of the record can go here.
          */
-        err = Nu_FSeek(pArchive->tmpFp, initialOffset, SEEK_SET);
+        err = Nu_FSeek(pArchive, pArchive->tmpFp, initialOffset, SEEK_SET);
         if (err == kNuErrNone)
             err = kNuErrSkipped;    /* tell the caller we skipped it */
     }
@@ -1265,7 +1290,7 @@ static NuError Nu_ConstructNewRecord(NuArchive* pArchive, NuRecord* pRecord,
 
     DBUG(("--- Constructing '%s'\n", pRecord->filename));
 
-    err = Nu_FTell(fp, &initialOffset);
+    err = Nu_FTell(pArchive, fp, &initialOffset);
     BailError(err);
     Assert(initialOffset != 0);
 
@@ -1309,7 +1334,8 @@ static NuError Nu_ConstructNewRecord(NuArchive* pArchive, NuRecord* pRecord,
          * filename.  If somehow it didn't, assign a default.
          */
         if (pRecord->filenameMOR == NULL) {
-            pRecord->newFilenameMOR = strdup(kNuDefaultRecordName);
+            pRecord->newFilenameMOR =
+                        Nu_ArenaStrdup(pArchive, kNuDefaultRecordName);
             pRecord->filenameMOR = pRecord->newFilenameMOR;
         }
 
@@ -1361,7 +1387,7 @@ static NuError Nu_ConstructNewRecord(NuArchive* pArchive, NuRecord* pRecord,
     DBUG(("+++ new header size = %d\n", newHeaderSize));
 
     /* leave a hole */
-    err = Nu_FSeek(fp, newHeaderSize, SEEK_CUR);
+    err = Nu_FSeek(pArchive, fp, newHeaderSize, SEEK_CUR);
     BailError(err);
 
     /*
@@ -1404,7 +1430,7 @@ static NuError Nu_ConstructNewRecord(NuArchive* pArchive, NuRecord* pRecord,
 
     /* verify that file displacement is where it should be */
     threadDisp = Nu_NewThreads_TotalCompThreadEOF(pNewThreads);
-    err = Nu_FTell(fp, &finalOffset);
+    err = Nu_FTell(pArchive, fp, &finalOffset);
     BailError(err);
     Assert(finalOffset > initialOffset);
     if (finalOffset - (initialOffset + newHeaderSize) != threadDisp) {
@@ -1434,7 +1460,7 @@ static NuError Nu_ConstructNewRecord(NuArchive* pArchive, NuRecord* pRecord,
     /*
      * Now, seek back and write the record header.
      */
-    err = Nu_FSeek(fp, initialOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, fp, initialOffset, SEEK_SET);
     BailError(err);
     err = Nu_WriteRecordHeader(pArchive, pRecord, fp);
     BailError(err);
@@ -1443,7 +1469,7 @@ static NuError Nu_ConstructNewRecord(NuArchive* pArchive, NuRecord* pRecord,
      * Seek forward once again, so we are positioned at the correct
      * place to write the next record.
      */
-    err = Nu_FSeek(fp, finalOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, fp, finalOffset, SEEK_SET);
     BailError(err);
 
     /*
@@ -1458,7 +1484,7 @@ bail:
          * keep going otherwise.  We need to back up in the file so the
          * next record can go here.
          */
-        err = Nu_FSeek(fp, initialOffset, SEEK_SET);
+        err = Nu_FSeek(pArchive, fp, initialOffset, SEEK_SET);
         if (err == kNuErrNone)
             err = kNuErrSkipped;    /* tell the caller we skipped it */
     }
@@ -1497,7 +1523,8 @@ static NuError Nu_UpdateRecordInOriginal(NuArchive* pArchive, NuRecord* pRecord)
         BailError(err);     /* should never happen */
 
         /* seek to the appropriate spot */
-        err = Nu_FSeek(pArchive->archiveFp, pThread->fileOffset, SEEK_SET);
+        err = Nu_FSeek(pArchive, pArchive->archiveFp, pThread->fileOffset,
+                SEEK_SET);
         BailError(err);
 
         /* do the update; this updates "pThread" with the new info */
@@ -1518,7 +1545,8 @@ static NuError Nu_UpdateRecordInOriginal(NuArchive* pArchive, NuRecord* pRecord)
      * tweaked some of our threads around, and we need to rewrite the
      * thread headers (which updates the record header CRC, and so on).
      */
-    err = Nu_FSeek(pArchive->archiveFp, pRecord->fileOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, pArchive->archiveFp, pRecord->fileOffset,
+            SEEK_SET);
     BailError(err);
     err = Nu_WriteRecordHeader(pArchive, pRecord, pArchive->archiveFp);
     BailError(err);
@@ -1583,7 +1611,7 @@ static NuError Nu_CreateTempFromOriginal(NuArchive* pArchive)
      * header gunk.
      */
     Assert(!pArchive->valDiscardWrapper || pArchive->headerOffset == 0);
-    err = Nu_FSeek(pArchive->tmpFp,
+    err = Nu_FSeek(pArchive, pArchive->tmpFp,
             pArchive->headerOffset + kNuMasterHeaderSize, SEEK_SET);
     BailError(err);
 
@@ -1686,7 +1714,7 @@ static NuError Nu_UpdateInOriginal(NuArchive* pArchive)
 
 done:
     /* seek to the end of the archive */
-    err = Nu_FSeek(pArchive->archiveFp,
+    err = Nu_FSeek(pArchive, pArchive->archiveFp,
             pArchive->headerOffset + pArchive->masterHeader.mhMasterEOF,
             SEEK_SET);
     BailError(err);
@@ -1696,6 +1724,95 @@ bail:
 }
 
 
+/*
+ * Rebuild the records in the "copy" set that have changes we can't make
+ * in place, and append them to the original archive past its current
+ * end, where they don't disturb anything.  The rebuilt records are moved
+ * to the end of the "copy" set, with offsets that match where they were
+ * put, so Nu_CompactInPlace can squeeze out their old copies along with
+ * any deleted records.
+ *
+ * The reconstruction code reads the original archive while it writes, so
+ * the records are assembled in the temp file first.  Only the changed
+ * records go there, not the whole archive.
+ */
+static NuError Nu_StageChangedRecords(NuArchive* pArchive)
+{
+    NuError err = kNuErrNone;
+    NuRecord* pRecord;
+    NuRecord* pNextRecord;
+    long tmpStart, tmpEnd, stageOffset, offsetAdjust;
+    long count;
+    int i;
+
+    Assert(pArchive->tmpFp != NULL);
+    Assert(ftell(pArchive->tmpFp) == 0);    /* should be empty as well */
+
+    tmpStart = pArchive->headerOffset + kNuMasterHeaderSize;
+    err = Nu_FSeek(pArchive, pArchive->tmpFp, tmpStart, SEEK_SET);
+    BailError(err);
+    err = Nu_GetFileLength(pArchive, pArchive->archiveFp, &stageOffset);
+    BailError(err);
+    offsetAdjust = stageOffset - tmpStart;
+
+    /*
+     * Walk the records that were in the set when we started.  Rebuilt
+     * records are moved behind them, so grab "pNext" first.
+     */
+    count = Nu_RecordSet_GetNumRecords(&pArchive->copyRecordSet);
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->copyRecordSet);
+    while (count--) {
+        Assert(pRecord != NULL);
+        pNextRecord = pRecord->pNext;
+
+        if (Nu_RecordNeedsRebuild(pRecord)) {
+            err = Nu_ConstructArchiveRecord(pArchive, pRecord);
+            if (err == kNuErrSkipped) {
+                /* keep the original, which stays where it is */
+                DBUG(("--- Skipping, keeping %ld instead\n",
+                    pRecord->recordIdx));
+                err = Nu_RecordSet_ReplaceRecord(pArchive,
+                        &pArchive->copyRecordSet, pRecord,
+                        &pArchive->origRecordSet, &pRecord);
+                BailError(err);
+            } else {
+                BailError(err);
+
+                pRecord->fileOffset += offsetAdjust;
+                for (i = 0; i < (int)pRecord->recTotalThreads; i++)
+                    Nu_GetThread(pRecord, i)->fileOffset += offsetAdjust;
+
+                err = Nu_RecordSet_MoveRecordToTail(&pArchive->copyRecordSet,
+                        pRecord);
+                BailError(err);
+            }
+        }
+
+        pRecord = pNextRecord;
+    }
+
+    /*
+     * Copy the rebuilt records to the end of the archive.
+     */
+    err = Nu_FTell(pArchive, pArchive->tmpFp, &tmpEnd);
+    BailError(err);
+    DBUG(("--- Staging %ld bytes of rebuilt records at %ld\n",
+        tmpEnd - tmpStart, stageOffset));
+    if (tmpEnd > tmpStart) {
+        err = Nu_FSeek(pArchive, pArchive->tmpFp, tmpStart, SEEK_SET);
+        BailError(err);
+        err = Nu_FSeek(pArchive, pArchive->archiveFp, stageOffset, SEEK_SET);
+        BailError(err);
+        err = Nu_CopyFileSection(pArchive, pArchive->archiveFp,
+                pArchive->tmpFp, tmpEnd - tmpStart);
+        BailError(err);
+    }
+
+bail:
+    return err;
+}
+
+
 /*
  * Create new records for all items in the "new" list, writing them to
  * "fp" at the current offset.
@@ -1707,9 +1824,19 @@ static NuError Nu_CreateNewRecords(NuArchive* pArchive, FILE* fp)
     NuError err = kNuErrNone;
     NuRecord* pRecord;
 
+    /* get the worker threads started on the compression */
+    err = Nu_FlushPoolBegin(pArchive);
+    BailError(err);
+
+    /* start reading the input files into the page cache */
+    Nu_PrefetchBegin(pArchive);
+
     pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
     while (pRecord != NULL) {
+        Nu_PrefetchAdvance(pArchive, pRecord);
         err = Nu_ConstructNewRecord(pArchive, pRecord, fp);
+        Nu_FlushPoolRecordDone(pArchive, pRecord);
+        Nu_PrefetchRecordDone(pArchive);
         if (err == kNuErrSkipped) {
             /*
              * We decided to skip this record, so delete it from "new".
@@ -1732,6 +1859,8 @@ static NuError Nu_CreateNewRecords(NuArchive* pArchive, FILE* fp)
     }
 
 bail:
+    Nu_PrefetchEnd(pArchive);
+    Nu_FlushPoolEnd(pArchive);
     return err;
 }
 
@@ -1742,6 +1871,26 @@ bail:
  * ===========================================================================
  */
 
+/*
+ * Returns "true" if the record has thread mods other than updates to
+ * pre-sized threads, which means it has to be rebuilt rather than
+ * updated in place.
+ */
+Boolean Nu_RecordNeedsRebuild(const NuRecord* pRecord)
+{
+    const NuThreadMod* pThreadMod;
+
+    for (pThreadMod = pRecord->pThreadMods; pThreadMod != NULL;
+        pThreadMod = pThreadMod->pNext)
+    {
+        /* the only acceptable kind is "update" */
+        if (pThreadMod->entry.kind != kNuThreadModUpdate)
+            return true;
+    }
+
+    return false;
+}
+
 /*
  * Determine if any "heavy updates" have been made.  A "heavy" update is
  * one that requires us to create and rename a temp file.
@@ -1782,18 +1931,10 @@ static Boolean Nu_NoHeavyUpdates(NuArchive* pArchive)
     count = Nu_RecordSet_GetNumRecords(&pArchive->copyRecordSet);
     pRecord = Nu_RecordSet_GetListHead(&pArchive->copyRecordSet);
     while (count--) {
-        const NuThreadMod* pThreadMod;
-
         Assert(pRecord != NULL);
 
-        pThreadMod = pRecord->pThreadMods;
-        while (pThreadMod != NULL) {
-            /* the only acceptable kind is "update" */
-            if (pThreadMod->entry.kind != kNuThreadModUpdate)
-                return false;
-
-            pThreadMod = pThreadMod->pNext;
-        }
+        if (Nu_RecordNeedsRebuild(pRecord))
+            return false;
 
         pRecord = pRecord->pNext;
     }
@@ -1908,6 +2049,9 @@ static NuError Nu_ResetTempFile(NuArchive* pArchive)
     Assert(pArchive != NULL);
     Assert(pArchive->tmpPathnameUNI != NULL);
 
+    /* drop the memory file, if we were using one */
+    Nu_MemTempDiscard(pArchive);
+
 #if 0   /* keep the temp file around for examination */
 if (pArchive->tmpFp != NULL) {
     DBUG(("--- NOT Resetting temp file\n"));
@@ -1934,7 +2078,7 @@ if (pArchive->tmpFp != NULL) {
         /*
          * Truncate the temp file.
          */
-        err = Nu_FSeek(pArchive->tmpFp, 0, SEEK_SET);
+        err = Nu_FSeek(pArchive, pArchive->tmpFp, 0, SEEK_SET);
         BailError(err);
         err = Nu_TruncateOpenFile(pArchive->tmpFp, 0);
         if (err == kNuErrInternal) {
@@ -2124,6 +2268,7 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
     NuError err = kNuErrNone;
     Boolean canAbort = true;
     Boolean writeToTemp = true;
+    Boolean compactInPlace = false;
     Boolean deleteAll = false;
     long initialEOF, finalOffset;
 
@@ -2228,15 +2373,30 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
      * Step 4: decide if we want to make changes in place, or write to
      * a temp file.  Any deletions or additions to existing records will
      * require writing to a temp file.  Additions of new records and
-     * updates to pre-sized threads can be done in place.
+     * updates to pre-sized threads can be done in place.  If enabled,
+     * everything else can be too, by rebuilding changed records past the
+     * end and then compacting the original (see Compact.c).
      */
     writeToTemp = true;
-    if (pArchive->valModifyOrig && Nu_NoHeavyUpdates(pArchive))
+    if (pArchive->valModifyOrig && Nu_NoHeavyUpdates(pArchive)) {
         writeToTemp = false;
+    } else if (Nu_CanCompactInPlace(pArchive)) {
+        writeToTemp = false;
+        compactInPlace = true;
+    }
     /* discard the wrapper, if desired */
     if (writeToTemp && pArchive->valDiscardWrapper)
         pArchive->headerOffset = 0;
 
+    /* small archives can be built in memory */
+    if (writeToTemp)
+        Nu_MemTempBegin(pArchive);
+
+    /* compressed output can be written on a separate thread */
+    err = Nu_WriteBehindBegin(pArchive,
+            writeToTemp ? pArchive->tmpFp : pArchive->archiveFp);
+    BailError(err);
+
     /*
      * Step 5: handle updates to existing records.
      */
@@ -2245,9 +2405,26 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
          * Step 5a: modifying in place, process all UPDATE ThreadMods now.
          */
         DBUG(("--- No heavy updates found, updating in place\n"));
+        if (compactInPlace) {
+            /* only writes past the end, so we can still back out */
+            err = Nu_StageChangedRecords(pArchive);
+            if (err != kNuErrNone) {
+                DBUG(("--- Staging changed records failed\n"));
+                goto bail;
+            }
+        }
         if (Nu_RecordSet_GetLoaded(&pArchive->copyRecordSet))
             canAbort = false;   /* modifying original, can't cleanly abort */
 
+        if (compactInPlace) {
+            DBUG(("--- Compacting original to remove old records\n"));
+            err = Nu_CompactInPlace(pArchive);
+            if (err != kNuErrNone) {
+                Nu_ReportError(NU_BLOB, err, "in-place compaction failed");
+                goto bail;
+            }
+        }
+
         err = Nu_UpdateInOriginal(pArchive);
         if (err == kNuErrDamaged)
             *pStatusFlags |= kNuFlushCorrupted;
@@ -2284,6 +2461,13 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
         err = Nu_CreateNewRecords(pArchive, pArchive->archiveFp);
     BailError(err);
 
+    /* that's all of the compressing; make sure it all made it to disk */
+    err = Nu_WriteBehindEnd(pArchive);
+    if (err != kNuErrNone) {
+        Nu_ReportError(NU_BLOB, err, "background write failed");
+        goto bail;
+    }
+
     /* on completion, tmpFp (or archiveFp) points to current archive EOF */
 
     /*
@@ -2296,11 +2480,11 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
      * so we just ignore the result.
      */
     if (writeToTemp) {
-        err = Nu_FTell(pArchive->tmpFp, &finalOffset);
+        err = Nu_FTell(pArchive, pArchive->tmpFp, &finalOffset);
         BailError(err);
         (void) Nu_TruncateOpenFile(pArchive->tmpFp, finalOffset);
     } else {
-        err = Nu_FTell(pArchive->archiveFp, &finalOffset);
+        err = Nu_FTell(pArchive, pArchive->archiveFp, &finalOffset);
         BailError(err);
         (void) Nu_TruncateOpenFile(pArchive->archiveFp, finalOffset);
     }
@@ -2312,13 +2496,15 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
      */
     Assert(!pArchive->newMasterHeader.isValid);
     if (writeToTemp) {
-        err = Nu_FSeek(pArchive->tmpFp, pArchive->headerOffset, SEEK_SET);
+        err = Nu_FSeek(pArchive, pArchive->tmpFp, pArchive->headerOffset,
+                SEEK_SET);
         BailError(err);
         err = Nu_UpdateMasterHeader(pArchive, pArchive->tmpFp,
                 finalOffset - pArchive->headerOffset);
         /* fall through with err */
     } else {
-        err = Nu_FSeek(pArchive->archiveFp, pArchive->headerOffset, SEEK_SET);
+        err = Nu_FSeek(pArchive, pArchive->archiveFp, pArchive->headerOffset,
+                SEEK_SET);
         BailError(err);
         err = Nu_UpdateMasterHeader(pArchive, pArchive->archiveFp,
                 finalOffset - pArchive->headerOffset);
@@ -2387,6 +2573,10 @@ NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags)
      * operating systems you can't do certain things with open files.
      */
     if (writeToTemp) {
+        /* if we built it in memory, it has to reach the disk first */
+        err = Nu_MemTempCommit(pArchive);
+        BailError(err);
+
         canAbort = false;   /* no going back */
         *pStatusFlags |= kNuFlushSucceeded;     /* temp file is fully valid */
 
@@ -2497,6 +2687,7 @@ flushed:
     }
 
 bail:
+    (void) Nu_WriteBehindEnd(pArchive);
     if (err != kNuErrNone) {
         if (canAbort) {
             (void) Nu_Abort(pArchive);
@@ -19,19 +19,220 @@
 #ifdef ENABLE_DEFLATE
 #include "zlib.h"
 
-#define kNuDeflateLevel 9       /* use maximum compression */
+/*
+ * Inputs at least this big are split into blocks and compressed on
+ * worker threads, if the application asked for more than one.  Each
+ * block is primed with the preceding kNuDeflateDictSize bytes of input,
+ * so the compression ratio is close to what a single stream gets.
+ *
+ * The block stitching needs adler32_combine, which appeared in 1.2.2.
+ */
+#if defined(ZLIB_VERNUM) && ZLIB_VERNUM >= 0x1220
+# define NU_PARALLEL_DEFLATE
+#endif
+#define kNuDeflateBlockSize     (128 * 1024)
+#define kNuDeflateDictSize      32768
+#define kNuDeflateMinParallel   (kNuDeflateBlockSize * 2)
 
 
 /*
- * Alloc and free functions provided to zlib.
+ * Alloc and free functions provided to zlib.  "opaque" is the allocator
+ * of the archive that set up the stream, rather than the archive itself,
+ * because the stream can outlive it in the codec pool.
  */
 static voidpf Nu_zalloc(voidpf opaque, uInt items, uInt size)
 {
-    return Nu_Malloc(opaque, items * size);
+    return Nu_AllocatorMalloc((const NuAllocator*) opaque, items * size);
 }
 static void Nu_zfree(voidpf opaque, voidpf address)
 {
-    Nu_Free(opaque, address);
+    Nu_Free(NULL, address);
+}
+
+
+/*
+ * A zlib stream and its output buffer.  These are kept in the archive
+ * (one for deflate, one for inflate) and reset between threads, rather
+ * than being torn down and rebuilt every time.
+ */
+typedef struct NuZStream {
+    z_stream    zstream;
+    Bytef*      outbuf;             /* kNuGenCompBufSize bytes */
+    int         level;              /* deflate only: current settings */
+    int         strategy;
+} NuZStream;
+
+/*
+ * Convert the archive's kNuValueDeflateStrategy to a zlib strategy.  The
+ * newer strategies fall back to the default with an old zlib.
+ */
+static int Nu_GetZStrategy(const NuArchive* pArchive)
+{
+    switch (pArchive->valDeflateStrategy) {
+    case kNuDeflateStrategyFiltered:    return Z_FILTERED;
+    case kNuDeflateStrategyHuffman:     return Z_HUFFMAN_ONLY;
+#ifdef Z_RLE
+    case kNuDeflateStrategyRLE:         return Z_RLE;
+#endif
+#ifdef Z_FIXED
+    case kNuDeflateStrategyFixed:       return Z_FIXED;
+#endif
+    default:                            return Z_DEFAULT_STRATEGY;
+    }
+}
+
+/*
+ * Report a failed deflateInit or inflateInit.
+ */
+static NuError Nu_ReportZInitError(NuArchive* pArchive, int zerr,
+    const char* which)
+{
+    NuError err = kNuErrInternal;
+
+    if (zerr == Z_VERSION_ERROR) {
+        Nu_ReportError(NU_BLOB, err,
+            "installed zlib is not compatible with linked version (%s)",
+            ZLIB_VERSION);
+    } else {
+        Nu_ReportError(NU_BLOB, err,
+            "call to %s failed (zerr=%d)", which, zerr);
+    }
+    return err;
+}
+
+/*
+ * Allocate a NuZStream.  The z_stream is not initialized.
+ *
+ * The zlib allocator doesn't get an archive pointer, because the stream
+ * can be handed from one archive to another by the codec pool.
+ */
+static NuZStream* Nu_ZStreamNew(NuArchive* pArchive)
+{
+    NuZStream* pZStream;
+
+    pZStream = Nu_Calloc(pArchive, sizeof(*pZStream));
+    if (pZStream == NULL)
+        return NULL;
+    pZStream->outbuf = Nu_Malloc(pArchive, kNuGenCompBufSize);
+    if (pZStream->outbuf == NULL) {
+        Nu_Free(pArchive, pZStream);
+        return NULL;
+    }
+
+    pZStream->zstream.zalloc = Nu_zalloc;
+    pZStream->zstream.zfree = Nu_zfree;
+    pZStream->zstream.opaque = (voidpf) Nu_GetAllocator(pArchive);
+    pZStream->zstream.data_type = Z_UNKNOWN;
+    return pZStream;
+}
+
+/*
+ * Get the archive's deflate stream, ready for use.
+ */
+static NuError Nu_GetDeflateStream(NuArchive* pArchive, NuZStream** ppZStream)
+{
+    NuZStream* pZStream = pArchive->deflateState;
+    int level = (int) pArchive->valDeflateLevel;
+    int strategy = Nu_GetZStrategy(pArchive);
+    int zerr;
+
+    if (pZStream != NULL) {
+        zerr = deflateReset(&pZStream->zstream);
+        if (zerr == Z_OK &&
+            (pZStream->level != level || pZStream->strategy != strategy))
+        {
+            /* nothing has been compressed yet, so this takes effect now */
+            zerr = deflateParams(&pZStream->zstream, level, strategy);
+            pZStream->level = level;
+            pZStream->strategy = strategy;
+        }
+        if (zerr != Z_OK) {
+            Nu_ReportError(NU_BLOB, kNuErrInternal,
+                "call to deflateReset failed (zerr=%d)", zerr);
+            return kNuErrInternal;
+        }
+    } else {
+        pZStream = Nu_ZStreamNew(pArchive);
+        if (pZStream == NULL)
+            return kNuErrMalloc;
+
+        zerr = deflateInit2(&pZStream->zstream, level, Z_DEFLATED,
+                MAX_WBITS, 8, strategy);
+        if (zerr != Z_OK) {
+            Nu_Free(pArchive, pZStream->outbuf);
+            Nu_Free(pArchive, pZStream);
+            return Nu_ReportZInitError(pArchive, zerr, "deflateInit2");
+        }
+        pZStream->level = level;
+        pZStream->strategy = strategy;
+        pArchive->deflateState = pZStream;
+    }
+
+    *ppZStream = pZStream;
+    return kNuErrNone;
+}
+
+/*
+ * Get the archive's inflate stream, ready for use.
+ */
+static NuError Nu_GetInflateStream(NuArchive* pArchive, NuZStream** ppZStream)
+{
+    NuZStream* pZStream = pArchive->inflateState;
+    int zerr;
+
+    if (pZStream != NULL) {
+        zerr = inflateReset(&pZStream->zstream);
+        if (zerr != Z_OK) {
+            Nu_ReportError(NU_BLOB, kNuErrInternal,
+                "call to inflateReset failed (zerr=%d)", zerr);
+            return kNuErrInternal;
+        }
+    } else {
+        pZStream = Nu_ZStreamNew(pArchive);
+        if (pZStream == NULL)
+            return kNuErrMalloc;
+
+        pZStream->zstream.next_in = NULL;
+        pZStream->zstream.avail_in = 0;
+        zerr = inflateInit(&pZStream->zstream);
+        if (zerr != Z_OK) {
+            Nu_Free(pArchive, pZStream->outbuf);
+            Nu_Free(pArchive, pZStream);
+            return Nu_ReportZInitError(pArchive, zerr, "inflateInit");
+        }
+        pArchive->inflateState = pZStream;
+    }
+
+    *ppZStream = pZStream;
+    return kNuErrNone;
+}
+
+/*
+ * Free the deflate stream held by an archive.
+ */
+void Nu_FreeDeflateState(void* deflateState)
+{
+    NuZStream* pZStream = deflateState;
+
+    if (pZStream == NULL)
+        return;
+    deflateEnd(&pZStream->zstream);
+    Nu_Free(NULL, pZStream->outbuf);
+    Nu_Free(NULL, pZStream);
+}
+
+/*
+ * Free the inflate stream held by an archive.
+ */
+void Nu_FreeInflateState(void* inflateState)
+{
+    NuZStream* pZStream = inflateState;
+
+    if (pZStream == NULL)
+        return;
+    inflateEnd(&pZStream->zstream);
+    Nu_Free(NULL, pZStream->outbuf);
+    Nu_Free(NULL, pZStream);
 }
 
 
@@ -41,57 +242,302 @@ static void Nu_zfree(voidpf opaque, voidpf address)
  * ===========================================================================
  */
 
+#ifdef NU_PARALLEL_DEFLATE
+/*
+ * One block of a multi-threaded compression.
+ *
+ * Each block is compressed as raw deflate data, without the zlib header
+ * and trailer.  All but the last end with a sync flush, which pads the
+ * output to a byte boundary, so the blocks can simply be laid end to end
+ * between a zlib header and trailer that we generate ourselves.
+ */
+typedef struct NuDeflateJob {
+    z_stream        zstream;                /* raw deflate stream */
+    Boolean         zinit;                  /* set if zstream needs End */
+    const Bytef*    dict;                   /* preceding input, or NULL */
+    uInt            dictLen;
+    const Bytef*    in;                     /* input for this block */
+    uInt            inLen;
+    Boolean         last;                   /* finish the stream? */
+    Bytef*          out;                    /* compressed output */
+    uLong           outAlloc;
+    uLong           outLen;
+    uint16_t        crc;                    /* CRC-16 of input, zero seed */
+    uLong           adler;                  /* Adler-32 of input */
+    int             zerr;                   /* Z_OK unless something broke */
+    NuWorker        worker;
+} NuDeflateJob;
+
 /*
- * Compress "srcLen" bytes from "pStraw" to "fp".
+ * Compress one block.  Runs on a worker thread, so it mustn't touch the
+ * archive (that includes error reporting).
  */
-NuError Nu_CompressDeflate(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+static void Nu_DeflateJobRun(void* arg)
+{
+    NuDeflateJob* pJob = arg;
+    z_stream* pz = &pJob->zstream;
+    int zerr;
+
+    pJob->crc = Nu_CalcCRC16(0, pJob->in, pJob->inLen);
+    pJob->adler = adler32(adler32(0L, Z_NULL, 0), pJob->in, pJob->inLen);
+
+    zerr = deflateReset(pz);
+    if (zerr == Z_OK && pJob->dict != NULL)
+        zerr = deflateSetDictionary(pz, pJob->dict, pJob->dictLen);
+    if (zerr != Z_OK)
+        goto bail;
+
+    pz->next_in = (Bytef*) pJob->in;
+    pz->avail_in = pJob->inLen;
+    pz->next_out = pJob->out;
+    pz->avail_out = (uInt) pJob->outAlloc;
+
+    /* output buffer is big enough to do this in one shot */
+    zerr = deflate(pz, pJob->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (pJob->last) {
+        if (zerr == Z_STREAM_END)
+            zerr = Z_OK;
+        else if (zerr == Z_OK)
+            zerr = Z_BUF_ERROR;
+    } else if (zerr == Z_OK && (pz->avail_in != 0 || pz->avail_out == 0)) {
+        zerr = Z_BUF_ERROR;     /* flush may not have completed */
+    }
+    pJob->outLen = pz->next_out - pJob->out;
+
+bail:
+    pJob->zerr = zerr;
+}
+
+/*
+ * Compress "srcLen" bytes from "pStraw" to "pStream", using up to
+ * "numWorkers" threads.  The output is an ordinary zlib stream.
+ *
+ * Input is read a batch at a time, one block per worker, and the batch
+ * is compressed while the main thread waits.  The tail of the batch is
+ * kept at the front of the input buffer to prime the next one.
+ *
+ * The per-thread streams are set up on every call rather than being kept
+ * in the archive, since this is only used for large inputs, where the
+ * setup cost is lost in the noise.
+ */
+static NuError Nu_CompressDeflateParallel(NuArchive* pArchive,
+    NuStraw* pStraw, NuCompStream* pStream, uint32_t srcLen,
+    uint32_t* pDstLen, uint16_t* pCrc, int numWorkers)
+{
+    NuError err = kNuErrNone;
+    NuDeflateJob* jobs = NULL;
+    Bytef* inBuf = NULL;
+    uLong adler;
+    uint32_t dictAvail = 0;
+    uint32_t dstLen;
+    uint8_t wrapBuf[4];                     /* zlib header or trailer */
+    uint16_t header;
+    int level = (int) pArchive->valDeflateLevel;
+    int strategy = Nu_GetZStrategy(pArchive);
+    int i, numJobs, zerr;
+
+    Assert(numWorkers > 1);
+
+    inBuf = Nu_Malloc(pArchive,
+                kNuDeflateDictSize + numWorkers * kNuDeflateBlockSize);
+    BailAlloc(inBuf);
+    jobs = Nu_Calloc(pArchive, numWorkers * sizeof(*jobs));
+    BailAlloc(jobs);
+
+    for (i = 0; i < numWorkers; i++) {
+        NuDeflateJob* pJob = &jobs[i];
+
+        pJob->zstream.zalloc = Nu_zalloc;
+        pJob->zstream.zfree = Nu_zfree;
+        pJob->zstream.opaque = (voidpf) Nu_GetAllocator(pArchive);
+        zerr = deflateInit2(&pJob->zstream, level, Z_DEFLATED,
+                -MAX_WBITS, 8, strategy);
+        if (zerr != Z_OK) {
+            err = Nu_ReportZInitError(pArchive, zerr, "deflateInit2");
+            goto bail;
+        }
+        pJob->zinit = true;
+
+        /* a bit of slack for the sync flush marker */
+        pJob->outAlloc = deflateBound(&pJob->zstream, kNuDeflateBlockSize) +
+                            16;
+        pJob->out = Nu_Malloc(pArchive, pJob->outAlloc);
+        BailAlloc(pJob->out);
+    }
+
+    /*
+     * zlib header, matching what deflateInit2 would write: 32K window,
+     * level flag derived the same way zlib does it, no preset dictionary.
+     */
+    header = (Z_DEFLATED + ((MAX_WBITS - 8) << 4)) << 8;
+    if (strategy >= Z_HUFFMAN_ONLY || level < 2)
+        header |= 0 << 6;
+    else if (level < 6)
+        header |= 1 << 6;
+    else if (level == 6)
+        header |= 2 << 6;
+    else
+        header |= 3 << 6;
+    header += 31 - (header % 31);
+    wrapBuf[0] = (uint8_t) (header >> 8);
+    wrapBuf[1] = (uint8_t) header;
+    err = Nu_CompStreamWrite(pStream, wrapBuf, 2);
+    BailError(err);
+    dstLen = 2;
+
+    adler = adler32(0L, Z_NULL, 0);
+
+    while (srcLen != 0) {
+        Bytef* inPtr = inBuf + kNuDeflateDictSize;
+
+        /* read a block for each worker, or until we run out */
+        for (numJobs = 0; numJobs < numWorkers && srcLen != 0; numJobs++) {
+            NuDeflateJob* pJob = &jobs[numJobs];
+            uint32_t getSize;
+
+            getSize = (srcLen > kNuDeflateBlockSize) ?
+                        kNuDeflateBlockSize : srcLen;
+            err = Nu_StrawRead(pArchive, pStraw, inPtr, getSize);
+            if (err != kNuErrNone) {
+                Nu_ReportError(NU_BLOB, err, "deflate read failed");
+                goto bail;
+            }
+            srcLen -= getSize;
+
+            if (numJobs == 0) {
+                pJob->dict = dictAvail ? inPtr - dictAvail : NULL;
+                pJob->dictLen = dictAvail;
+            } else {
+                pJob->dict = inPtr - kNuDeflateDictSize;
+                pJob->dictLen = kNuDeflateDictSize;
+            }
+            pJob->in = inPtr;
+            pJob->inLen = getSize;
+            pJob->last = (srcLen == 0);
+            inPtr += getSize;
+        }
+
+        for (i = 0; i < numJobs; i++)
+            Nu_WorkerStart(&jobs[i].worker, Nu_DeflateJobRun, &jobs[i]);
+        for (i = 0; i < numJobs; i++) {
+            Nu_WorkerJoin(&jobs[i].worker);
+            Nu_StatsAddWorker(pArchive, &jobs[i].worker);
+        }
+
+        /* write the blocks in order */
+        for (i = 0; i < numJobs; i++) {
+            NuDeflateJob* pJob = &jobs[i];
+
+            if (pJob->zerr != Z_OK) {
+                err = kNuErrInternal;
+                Nu_ReportError(NU_BLOB, err,
+                    "zlib deflate call failed (zerr=%d)", pJob->zerr);
+                goto bail;
+            }
+
+            err = Nu_CompStreamWrite(pStream, pJob->out,
+                    (uint32_t) pJob->outLen);
+            if (err != kNuErrNone) {
+                Nu_ReportError(NU_BLOB, err, "write failed in deflate");
+                goto bail;
+            }
+            dstLen += (uint32_t) pJob->outLen;
+
+            *pCrc = Nu_CRC16Combine(*pCrc, pJob->crc, pJob->inLen);
+            adler = adler32_combine(adler, pJob->adler, pJob->inLen);
+        }
+
+        /*
+         * Keep the end of the batch for the next one.  If there's more to
+         * come, every block in this batch was full-sized.
+         */
+        if (srcLen != 0) {
+            Assert(kNuDeflateBlockSize >= kNuDeflateDictSize);
+            memmove(inBuf, inPtr - kNuDeflateDictSize, kNuDeflateDictSize);
+            dictAvail = kNuDeflateDictSize;
+        }
+    }
+
+    /* zlib trailer is the big-endian Adler-32 of the uncompressed data */
+    wrapBuf[0] = (uint8_t) (adler >> 24);
+    wrapBuf[1] = (uint8_t) (adler >> 16);
+    wrapBuf[2] = (uint8_t) (adler >> 8);
+    wrapBuf[3] = (uint8_t) adler;
+    err = Nu_CompStreamWrite(pStream, wrapBuf, 4);
+    BailError(err);
+    dstLen += 4;
+
+    *pDstLen = dstLen;
+
+bail:
+    if (jobs != NULL) {
+        for (i = 0; i < numWorkers; i++) {
+            if (jobs[i].zinit)
+                deflateEnd(&jobs[i].zstream);
+            Nu_Free(pArchive, jobs[i].out);
+        }
+        Nu_Free(pArchive, jobs);
+    }
+    Nu_Free(pArchive, inBuf);
+    return err;
+}
+#endif /*NU_PARALLEL_DEFLATE*/
+
+/*
+ * Compress "srcLen" bytes from "pStraw" to "pStream".
+ *
+ * Large inputs are handed to Nu_CompressDeflateParallel when the archive
+ * allows more than one worker thread.
+ */
+NuError Nu_CompressDeflate(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
-    z_stream zstream;
+    NuZStream* pZStream = NULL;
+    z_stream* pz;
     int zerr;
-    Bytef* outbuf = NULL;
+    Bytef* outbuf;
 
     Assert(pArchive != NULL);
     Assert(pStraw != NULL);
-    Assert(fp != NULL);
+    Assert(pStream != NULL);
     Assert(srcLen > 0);
     Assert(pDstLen != NULL);
     Assert(pCrc != NULL);
 
+#ifdef NU_PARALLEL_DEFLATE
+    if (srcLen >= kNuDeflateMinParallel) {
+        int numWorkers = Nu_GetWorkerCount(pArchive);
+        uint32_t numBlocks;
+
+        numBlocks = (srcLen + kNuDeflateBlockSize - 1) / kNuDeflateBlockSize;
+        if ((uint32_t) numWorkers > numBlocks)
+            numWorkers = (int) numBlocks;
+        if (numWorkers > 1) {
+            return Nu_CompressDeflateParallel(pArchive, pStraw, pStream,
+                    srcLen, pDstLen, pCrc, numWorkers);
+        }
+    }
+#endif
+
     err = Nu_AllocCompressionBufferIFN(pArchive);
     if (err != kNuErrNone)
         return err;
 
-    /* allocate a similarly-sized buffer for the output */
-    outbuf = Nu_Malloc(pArchive, kNuGenCompBufSize);
-    BailAlloc(outbuf);
-
     /*
-     * Initialize the zlib stream.
+     * Get the zlib stream, which comes with a similarly-sized buffer
+     * for the output.
      */
-    zstream.zalloc = Nu_zalloc;
-    zstream.zfree = Nu_zfree;
-    zstream.opaque = pArchive;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = outbuf;
-    zstream.avail_out = kNuGenCompBufSize;
-    zstream.data_type = Z_UNKNOWN;
-
-    zerr = deflateInit(&zstream, kNuDeflateLevel);
-    if (zerr != Z_OK) {
-        err = kNuErrInternal;
-        if (zerr == Z_VERSION_ERROR) {
-            Nu_ReportError(NU_BLOB, err,
-                "installed zlib is not compatible with linked version (%s)",
-                ZLIB_VERSION);
-        } else {
-            Nu_ReportError(NU_BLOB, err,
-                "call to deflateInit failed (zerr=%d)", zerr);
-        }
-        goto bail;
-    }
+    err = Nu_GetDeflateStream(pArchive, &pZStream);
+    if (err != kNuErrNone)
+        return err;
+    pz = &pZStream->zstream;
+    outbuf = pZStream->outbuf;
+
+    pz->next_in = NULL;
+    pz->avail_in = 0;
+    pz->next_out = outbuf;
+    pz->avail_out = kNuGenCompBufSize;
 
     /*
      * Loop while we have data.
@@ -101,22 +547,23 @@ NuError Nu_CompressDeflate(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
         int flush;
 
         /* should be able to read a full buffer every time */
-        if (zstream.avail_in == 0 && srcLen) {
+        if (pz->avail_in == 0 && srcLen) {
             getSize = (srcLen > kNuGenCompBufSize) ? kNuGenCompBufSize : srcLen;
             DBUG(("+++ reading %ld bytes\n", getSize));
 
             err = Nu_StrawRead(pArchive, pStraw, pArchive->compBuf, getSize);
             if (err != kNuErrNone) {
                 Nu_ReportError(NU_BLOB, err, "deflate read failed");
-                goto z_bail;
+                goto bail;
             }
 
             srcLen -= getSize;
 
-            *pCrc = Nu_CalcCRC16(*pCrc, pArchive->compBuf, getSize);
+            *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, pArchive->compBuf,
+                        getSize);
 
-            zstream.next_in = pArchive->compBuf;
-            zstream.avail_in = getSize;
+            pz->next_in = pArchive->compBuf;
+            pz->avail_in = getSize;
         }
 
         if (srcLen == 0)
@@ -124,40 +571,36 @@ NuError Nu_CompressDeflate(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
         else
             flush = Z_NO_FLUSH;     /* more to come! */
 
-        zerr = deflate(&zstream, flush);
+        zerr = deflate(pz, flush);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
             err = kNuErrInternal;
             Nu_ReportError(NU_BLOB, err, "zlib deflate call failed (zerr=%d)",
                 zerr);
-            goto z_bail;
+            goto bail;
         }
 
         /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != kNuGenCompBufSize))
+        if (pz->avail_out == 0 ||
+            (zerr == Z_STREAM_END && pz->avail_out != kNuGenCompBufSize))
         {
-            DBUG(("+++ writing %d bytes\n", zstream.next_out - outbuf));
-            err = Nu_FWrite(fp, outbuf, zstream.next_out - outbuf);
+            DBUG(("+++ writing %d bytes\n", pz->next_out - outbuf));
+            err = Nu_CompStreamWrite(pStream, outbuf,
+                    pz->next_out - outbuf);
             if (err != kNuErrNone) {
-                Nu_ReportError(NU_BLOB, err, "fwrite failed in deflate");
-                goto z_bail;
+                Nu_ReportError(NU_BLOB, err, "write failed in deflate");
+                goto bail;
             }
 
-            zstream.next_out = outbuf;
-            zstream.avail_out = kNuGenCompBufSize;
+            pz->next_out = outbuf;
+            pz->avail_out = kNuGenCompBufSize;
         }
     } while (zerr == Z_OK);
 
     Assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
-    *pDstLen = zstream.total_out;
-
-z_bail:
-    deflateEnd(&zstream);        /* free up any allocated structures */
+    *pDstLen = pz->total_out;
 
 bail:
-    if (outbuf != NULL)
-        free(outbuf);
     return err;
 }
 
@@ -169,57 +612,44 @@ bail:
  */
 
 /*
- * Expand from "infp" to "pFunnel".
+ * Expand from "pStream" to "pFunnel".
  */
 NuError Nu_ExpandDeflate(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc)
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
-    z_stream zstream;
+    NuZStream* pZStream = NULL;
+    z_stream* pz;
     int zerr;
     uint32_t compRemaining;
     Bytef* outbuf;
 
     Assert(pArchive != NULL);
     Assert(pThread != NULL);
-    Assert(infp != NULL);
+    Assert(pStream != NULL);
     Assert(pFunnel != NULL);
 
     err = Nu_AllocCompressionBufferIFN(pArchive);
     if (err != kNuErrNone)
         return err;
 
-    /* allocate a similarly-sized buffer for the output */
-    outbuf = Nu_Malloc(pArchive, kNuGenCompBufSize);
-    BailAlloc(outbuf);
+    /*
+     * Get the zlib stream, which comes with a similarly-sized buffer
+     * for the output.
+     */
+    err = Nu_GetInflateStream(pArchive, &pZStream);
+    if (err != kNuErrNone)
+        return err;
+    pz = &pZStream->zstream;
+    outbuf = pZStream->outbuf;
 
     compRemaining = pThread->thCompThreadEOF;
 
-    /*
-     * Initialize the zlib stream.
-     */
-    zstream.zalloc = Nu_zalloc;
-    zstream.zfree = Nu_zfree;
-    zstream.opaque = pArchive;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
-    zstream.next_out = outbuf;
-    zstream.avail_out = kNuGenCompBufSize;
-    zstream.data_type = Z_UNKNOWN;
-
-    zerr = inflateInit(&zstream);
-    if (zerr != Z_OK) {
-        err = kNuErrInternal;
-        if (zerr == Z_VERSION_ERROR) {
-            Nu_ReportError(NU_BLOB, err,
-                "installed zlib is not compatible with linked version (%s)",
-                ZLIB_VERSION);
-        } else {
-            Nu_ReportError(NU_BLOB, err,
-                "call to inflateInit failed (zerr=%d)", zerr);
-        }
-        goto bail;
-    }
+    pz->next_in = NULL;
+    pz->avail_in = 0;
+    pz->next_out = outbuf;
+    pz->avail_out = kNuGenCompBufSize;
 
     /*
      * Loop while we have data.
@@ -228,67 +658,63 @@ NuError Nu_ExpandDeflate(NuArchive* pArchive, const NuRecord* pRecord,
         uint32_t getSize;
 
         /* read as much as we can */
-        if (zstream.avail_in == 0) {
+        if (pz->avail_in == 0) {
             getSize = (compRemaining > kNuGenCompBufSize) ?
                         kNuGenCompBufSize : compRemaining;
             DBUG(("+++ reading %ld bytes (%ld left)\n", getSize,
                 compRemaining));
 
-            err = Nu_FRead(infp, pArchive->compBuf, getSize);
+            err = Nu_CompStreamRead(pStream, pArchive->compBuf, getSize);
             if (err != kNuErrNone) {
                 Nu_ReportError(NU_BLOB, err, "inflate read failed");
-                goto z_bail;
+                goto bail;
             }
 
             compRemaining -= getSize;
 
-            zstream.next_in = pArchive->compBuf;
-            zstream.avail_in = getSize;
+            pz->next_in = pArchive->compBuf;
+            pz->avail_in = getSize;
         }
 
         /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
+        zerr = inflate(pz, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
             err = kNuErrInternal;
             Nu_ReportError(NU_BLOB, err, "zlib inflate call failed (zerr=%d)",
                 zerr);
-            goto z_bail;
+            goto bail;
         }
 
         /* write every time there's anything (buffer will usually be full) */
-        if (zstream.avail_out != kNuGenCompBufSize) {
-            DBUG(("+++ writing %d bytes\n", zstream.next_out - outbuf));
+        if (pz->avail_out != kNuGenCompBufSize) {
+            DBUG(("+++ writing %d bytes\n", pz->next_out - outbuf));
             err = Nu_FunnelWrite(pArchive, pFunnel, outbuf,
-                    zstream.next_out - outbuf);
+                    pz->next_out - outbuf);
             if (err != kNuErrNone) {
                 Nu_ReportError(NU_BLOB, err, "write failed in inflate");
-                goto z_bail;
+                goto bail;
             }
 
             if (pCrc != NULL)
-                *pCrc = Nu_CalcCRC16(*pCrc, outbuf, zstream.next_out - outbuf);
+                *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, outbuf,
+                            pz->next_out - outbuf);
 
-            zstream.next_out = outbuf;
-            zstream.avail_out = kNuGenCompBufSize;
+            pz->next_out = outbuf;
+            pz->avail_out = kNuGenCompBufSize;
         }
     } while (zerr == Z_OK);
 
     Assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
 
-    if (zstream.total_out != pThread->actualThreadEOF) {
+    if (pz->total_out != pThread->actualThreadEOF) {
         err = kNuErrBadData;
         Nu_ReportError(NU_BLOB, err,
             "size mismatch on inflated file (%ld vs %u)",
-            zstream.total_out, pThread->actualThreadEOF);
-        goto z_bail;
+            pz->total_out, pThread->actualThreadEOF);
+        goto bail;
     }
 
-z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
-
 bail:
-    if (outbuf != NULL)
-        free(outbuf);
     return err;
 }
 
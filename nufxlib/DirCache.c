@@ -0,0 +1,284 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Cache of open directories, for extraction.
+ *
+ * Extracting a file normally means a stat() on the full pathname, a walk
+ * up the path to see which directories need creating, an fopen(), and
+ * then utime() and chmod() on the pathname again after it's closed.  The
+ * kernel resolves every component of the path each time.  For archives
+ * with lots of small files that adds up to more than the data.
+ *
+ * Instead, we keep the directories we've extracted into open, keyed by
+ * the directory part of the pathname.  Files are looked up and created
+ * with fstatat() and openat() relative to the directory, missing
+ * directories are made with mkdirat() relative to their parent, and the
+ * dates and access are set on the open file with futimens()/fchmod().
+ *
+ * Relative pathnames are resolved against the current directory at the
+ * time the directory is opened, so the cache is flushed at the end of
+ * each extract call in case the application changes directory between
+ * calls.  The directories in it can also be renamed or removed by
+ * something else while they're open; that's no different from the
+ * pathname-based approach, except that we'd keep writing into the
+ * renamed directory.
+ *
+ * This only works when the filename separator is '/', which is what
+ * the system uses.  With anything else, FileIO.c uses the pathnames.
+ */
+#include "NufxLibPriv.h"
+
+#ifdef NU_DIR_FDS
+
+#include <fcntl.h>
+
+/* how many directories to keep open */
+#define kNuDirCacheSize     16
+
+typedef struct NuDirCacheEntry {
+    UNICHAR*        pathUNI;            /* directory name; NULL if unused */
+    size_t          pathLen;
+    int             fd;
+    uint32_t        lastUse;            /* for LRU replacement */
+} NuDirCacheEntry;
+
+struct NuDirCache {
+    NuDirCacheEntry entries[kNuDirCacheSize];
+    uint32_t        useCounter;
+};
+
+
+/*
+ * Look for a directory in the cache.  Returns the fd, or -1 if it's not
+ * there.
+ */
+static int Nu_DirCacheFind(NuDirCache* pCache, const UNICHAR* pathUNI,
+    size_t pathLen)
+{
+    NuDirCacheEntry* pEntry;
+    int i;
+
+    for (i = 0; i < kNuDirCacheSize; i++) {
+        pEntry = &pCache->entries[i];
+        if (pEntry->pathUNI != NULL && pEntry->pathLen == pathLen &&
+            memcmp(pEntry->pathUNI, pathUNI, pathLen) == 0)
+        {
+            pEntry->lastUse = ++pCache->useCounter;
+            return pEntry->fd;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Add an open directory to the cache, closing whatever was used least
+ * recently if the cache is full.  The cache takes ownership of "fd".
+ *
+ * If we can't allocate memory for the name, the fd is closed and -1 is
+ * returned.
+ */
+static int Nu_DirCacheAdd(NuArchive* pArchive, NuDirCache* pCache,
+    const UNICHAR* pathUNI, size_t pathLen, int fd)
+{
+    NuDirCacheEntry* pEntry;
+    UNICHAR* copyUNI;
+    int i;
+
+    copyUNI = Nu_Malloc(pArchive, pathLen +1);
+    if (copyUNI == NULL) {
+        close(fd);
+        return -1;
+    }
+    memcpy(copyUNI, pathUNI, pathLen);
+    copyUNI[pathLen] = '\0';
+
+    pEntry = &pCache->entries[0];
+    for (i = 1; i < kNuDirCacheSize; i++) {
+        if (pEntry->pathUNI == NULL)
+            break;
+        if (pCache->entries[i].pathUNI == NULL ||
+            pCache->entries[i].lastUse < pEntry->lastUse)
+        {
+            pEntry = &pCache->entries[i];
+        }
+    }
+
+    if (pEntry->pathUNI != NULL) {
+        DBUG(("--- dir cache: dropping '%s'\n", pEntry->pathUNI));
+        close(pEntry->fd);
+        Nu_Free(pArchive, pEntry->pathUNI);
+    }
+
+    pEntry->pathUNI = copyUNI;
+    pEntry->pathLen = pathLen;
+    pEntry->fd = fd;
+    pEntry->lastUse = ++pCache->useCounter;
+    return fd;
+}
+
+/*
+ * Get an fd for the first "pathLen" characters of "pathUNI", which name
+ * a directory.  If "create" is set, the directory and its parents are
+ * created if they don't exist.
+ *
+ * The fd belongs to the cache, and stays valid until the next call.
+ *
+ * Returns kNuErrFileNotFound if the directory doesn't exist and we weren't
+ * asked to create it.
+ */
+static NuError Nu_DirCacheOpenDir(NuArchive* pArchive, NuDirCache* pCache,
+    const UNICHAR* pathUNI, size_t pathLen, Boolean create, int* pFd)
+{
+    NuError err = kNuErrNone;
+    UNICHAR* dirUNI = NULL;
+    const UNICHAR* nameUNI;
+    size_t parentLen;
+    int parentFd, fd;
+
+    fd = Nu_DirCacheFind(pCache, pathUNI, pathLen);
+    if (fd >= 0)
+        goto done;
+
+    dirUNI = Nu_Malloc(pArchive, pathLen +1);
+    BailAlloc(dirUNI);
+    memcpy(dirUNI, pathUNI, pathLen);
+    dirUNI[pathLen] = '\0';
+
+    /* the common case: the directory exists, so let the kernel walk it */
+    fd = openat(AT_FDCWD, dirUNI, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            err = (errno == ENOTDIR) ? kNuErrNotDir : kNuErrFileStat;
+            goto bail;
+        }
+        if (!create) {
+            err = kNuErrFileNotFound;
+            goto bail;
+        }
+
+        /*
+         * Find the parent.  "a/b" has parent "a", "/a" has parent "/",
+         * and "a" has the current directory.
+         */
+        parentLen = pathLen;
+        while (parentLen > 0 && dirUNI[parentLen-1] != '/')
+            parentLen--;
+        nameUNI = dirUNI + parentLen;
+        while (parentLen > 1 && dirUNI[parentLen-1] == '/')
+            parentLen--;
+
+        if (parentLen == 0) {
+            parentFd = AT_FDCWD;
+        } else {
+            err = Nu_DirCacheOpenDir(pArchive, pCache, dirUNI, parentLen,
+                    true, &parentFd);
+            BailErrorQuiet(err);
+        }
+
+        if (mkdirat(parentFd, nameUNI,
+                S_IRWXU | S_IRGRP|S_IXGRP | S_IROTH|S_IXOTH) < 0 &&
+            errno != EEXIST)
+        {
+            err = kNuErrDirCreate;
+            goto bail;
+        }
+        fd = openat(parentFd, nameUNI, O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            err = (errno == ENOTDIR) ? kNuErrNotDir : kNuErrFileStat;
+            goto bail;
+        }
+    }
+
+    fd = Nu_DirCacheAdd(pArchive, pCache, pathUNI, pathLen, fd);
+    if (fd < 0) {
+        err = kNuErrMalloc;
+        goto bail;
+    }
+
+done:
+    *pFd = fd;
+bail:
+    Nu_Free(pArchive, dirUNI);
+    return err;
+}
+
+/*
+ * Find the directory that "pathnameUNI" lives in, creating it if "create"
+ * is set and it doesn't exist.  On success, "*pDirFd" is an fd for the
+ * directory (or AT_FDCWD), and "*pLeafUNI" points at the filename part
+ * of "pathnameUNI".
+ *
+ * The fd belongs to the cache, and is valid until the next call.
+ *
+ * Returns kNuErrFileNotFound if the directory doesn't exist and "create"
+ * isn't set.  Other failures aren't reported; the caller should fall back
+ * on the pathname, which will report them if they're real.
+ */
+NuError Nu_DirCacheGet(NuArchive* pArchive, const UNICHAR* pathnameUNI,
+    Boolean create, int* pDirFd, const UNICHAR** pLeafUNI)
+{
+    const UNICHAR* sepUNI;
+    size_t dirLen;
+
+    Assert(pArchive != NULL);
+    Assert(pathnameUNI != NULL);
+    Assert(pDirFd != NULL);
+    Assert(pLeafUNI != NULL);
+
+    sepUNI = strrchr(pathnameUNI, '/');
+    if (sepUNI == NULL) {
+        *pDirFd = AT_FDCWD;
+        *pLeafUNI = pathnameUNI;
+        return kNuErrNone;
+    }
+    *pLeafUNI = sepUNI +1;
+    if (**pLeafUNI == '\0')
+        return kNuErrInvalidArg;    /* not expecting "foo/bar/" */
+
+    /* "/foo" lives in "/"; "foo//bar" lives in "foo" */
+    dirLen = sepUNI - pathnameUNI;
+    while (dirLen > 0 && pathnameUNI[dirLen-1] == '/')
+        dirLen--;
+    if (dirLen == 0)
+        dirLen = 1;
+
+    if (pArchive->pDirCache == NULL) {
+        pArchive->pDirCache = Nu_Calloc(pArchive, sizeof(NuDirCache));
+        if (pArchive->pDirCache == NULL)
+            return kNuErrMalloc;
+    }
+
+    return Nu_DirCacheOpenDir(pArchive, pArchive->pDirCache, pathnameUNI,
+            dirLen, create, pDirFd);
+}
+
+#endif /*NU_DIR_FDS*/
+
+/*
+ * Close all cached directories.
+ */
+void Nu_DirCacheFlush(NuArchive* pArchive)
+{
+#ifdef NU_DIR_FDS
+    NuDirCache* pCache = pArchive->pDirCache;
+    int i;
+
+    if (pCache == NULL)
+        return;
+
+    for (i = 0; i < kNuDirCacheSize; i++) {
+        if (pCache->entries[i].pathUNI != NULL) {
+            close(pCache->entries[i].fd);
+            Nu_Free(pArchive, pCache->entries[i].pathUNI);
+        }
+    }
+    Nu_Free(pArchive, pCache);
+    pArchive->pDirCache = NULL;
+#else
+    (void) pArchive;
+#endif
+}
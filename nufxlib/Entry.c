@@ -347,6 +347,22 @@ NUFXLIB_API NuError NuAddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
     return err;
 }
 
+NUFXLIB_API NuError NuAddFiles(NuArchive* pArchive,
+    const NuAddFileEntry* pEntries, uint32_t numEntries,
+    NuRecordIdx* pRecordIdxs, NuError* pResults)
+{
+    NuError err;
+
+    if ((err = Nu_ValidateNuArchive(pArchive)) == kNuErrNone) {
+        Nu_SetBusy(pArchive);
+        err = Nu_AddFiles(pArchive, pEntries, numEntries, pRecordIdxs,
+                pResults);
+        Nu_ClearBusy(pArchive);
+    }
+
+    return err;
+}
+
 NUFXLIB_API NuError NuRename(NuArchive* pArchive, NuRecordIdx recordIdx,
     const char* pathnameMOR, char fssep)
 {
@@ -485,6 +501,17 @@ NUFXLIB_API NuError NuSetExtraData(NuArchive* pArchive, void* pData)
     return err;
 }
 
+NUFXLIB_API NuError NuSetAllocator(NuArchive* pArchive,
+    const NuAllocator* pAllocator)
+{
+    NuError err;
+
+    if ((err = Nu_PartiallyValidateNuArchive(pArchive)) == kNuErrNone)
+        err = Nu_SetAllocator(pArchive, pAllocator);
+
+    return err;
+}
+
 NUFXLIB_API NuError NuGetValue(NuArchive* pArchive, NuValueID ident,
     NuValue* pValue)
 {
@@ -518,6 +545,48 @@ NUFXLIB_API NuError NuGetAttr(NuArchive* pArchive, NuAttrID ident,
     return err;
 }
 
+NUFXLIB_API NuError NuSetCompressPolicy(NuArchive* pArchive,
+    const NuPolicyRule* pRules, uint32_t numRules)
+{
+    NuError err;
+
+    if ((err = Nu_PartiallyValidateNuArchive(pArchive)) == kNuErrNone)
+        return Nu_SetCompressPolicy(pArchive, pRules, numRules);
+
+    return err;
+}
+
+NUFXLIB_API NuError NuGetCompressPolicyStats(NuArchive* pArchive,
+    uint32_t idx, NuPolicyRule* pRule, NuPolicyStats* pStats)
+{
+    NuError err;
+
+    if ((err = Nu_PartiallyValidateNuArchive(pArchive)) == kNuErrNone)
+        return Nu_GetCompressPolicyStats(pArchive, idx, pRule, pStats);
+
+    return err;
+}
+
+NUFXLIB_API NuError NuGetStats(NuArchive* pArchive, NuStats* pStats)
+{
+    NuError err;
+
+    if ((err = Nu_PartiallyValidateNuArchive(pArchive)) == kNuErrNone)
+        return Nu_GetStats(pArchive, pStats);
+
+    return err;
+}
+
+NUFXLIB_API NuError NuResetStats(NuArchive* pArchive)
+{
+    NuError err;
+
+    if ((err = Nu_PartiallyValidateNuArchive(pArchive)) == kNuErrNone)
+        return Nu_ResetStats(pArchive);
+
+    return err;
+}
+
 NUFXLIB_API NuError NuDebugDumpArchive(NuArchive* pArchive)
 {
 #if defined(DEBUG_MSGS)
@@ -613,6 +682,96 @@ NUFXLIB_API NuError NuDataSinkGetOutCount(NuDataSink* pDataSink,
 }
 
 
+/*
+ * ===========================================================================
+ *      Buffer-to-buffer compression
+ * ===========================================================================
+ */
+
+/*
+ * Validate the NuCodecContext argument passed in to us.
+ *
+ * A context may be used by one thread at a time.  We don't try to detect
+ * concurrent use.
+ */
+static NuError Nu_ValidateCodecContext(const NuCodecContext* pContext)
+{
+    if (pContext == NULL)
+        return kNuErrInvalidArg;
+    if (pContext->structMagic != kNuCodecContextStructMagic)
+        return kNuErrBadStruct;
+    Assert(pContext->pArchive != NULL);
+
+    return kNuErrNone;
+}
+
+NUFXLIB_API NuError NuCreateCodecContext(NuCodecContext** ppContext)
+{
+    if (ppContext == NULL)
+        return kNuErrInvalidArg;
+
+    return Nu_CreateCodecContext(ppContext);
+}
+
+NUFXLIB_API NuError NuFreeCodecContext(NuCodecContext* pContext)
+{
+    NuError err;
+
+    if ((err = Nu_ValidateCodecContext(pContext)) == kNuErrNone)
+        err = Nu_FreeCodecContext(pContext);
+
+    return err;
+}
+
+NUFXLIB_API NuError NuSetCodecValue(NuCodecContext* pContext,
+    NuValueID ident, NuValue value)
+{
+    NuError err;
+
+    if ((err = Nu_ValidateCodecContext(pContext)) == kNuErrNone)
+        err = Nu_SetValue(pContext->pArchive, ident, value);
+
+    return err;
+}
+
+NUFXLIB_API NuError NuCompressBuffer(NuCodecContext* pContext,
+    NuThreadFormat threadFormat, const uint8_t* srcBuf, uint32_t srcLen,
+    uint8_t* dstBuf, uint32_t dstBufLen, uint32_t* pDstLen, uint16_t* pCrc)
+{
+    NuError err;
+
+    if ((srcBuf == NULL && srcLen != 0) || (dstBuf == NULL && dstBufLen != 0) ||
+        pDstLen == NULL)
+    {
+        return kNuErrInvalidArg;
+    }
+
+    if ((err = Nu_ValidateCodecContext(pContext)) == kNuErrNone) {
+        err = Nu_CompressBuffer(pContext, threadFormat, srcBuf, srcLen,
+                dstBuf, dstBufLen, pDstLen, pCrc);
+    }
+
+    return err;
+}
+
+NUFXLIB_API NuError NuExpandBuffer(NuCodecContext* pContext,
+    NuThreadFormat threadFormat, const uint8_t* srcBuf, uint32_t srcLen,
+    uint8_t* dstBuf, uint32_t dstLen, uint16_t* pCrc)
+{
+    NuError err;
+
+    if ((srcBuf == NULL && srcLen != 0) || (dstBuf == NULL && dstLen != 0))
+        return kNuErrInvalidArg;
+
+    if ((err = Nu_ValidateCodecContext(pContext)) == kNuErrNone) {
+        err = Nu_ExpandBuffer(pContext, threadFormat, srcBuf, srcLen,
+                dstBuf, dstLen, pCrc);
+    }
+
+    return err;
+}
+
+
 /*
  * ===========================================================================
  *      Non-archive operations
@@ -631,6 +790,16 @@ NUFXLIB_API NuError NuGetVersion(int32_t* pMajorVersion, int32_t* pMinorVersion,
             ppBuildDate, ppBuildFlags);
 }
 
+NUFXLIB_API NuError NuSetCodecPoolLimit(long maxEntries)
+{
+    return Nu_SetCodecPoolLimit(maxEntries);
+}
+
+NUFXLIB_API NuError NuSetGlobalAllocator(const NuAllocator* pAllocator)
+{
+    return Nu_SetGlobalAllocator(pAllocator);
+}
+
 NUFXLIB_API NuError NuTestFeature(NuFeature feature)
 {
     NuError err = kNuErrUnsupFeature;
@@ -690,7 +859,8 @@ NUFXLIB_API NuError NuRecordCopyThreads(const NuRecord* pNuRecord,
 
     Assert(pNuRecord->pThreads != NULL);
 
-    *ppThreads = Nu_Malloc(NULL, pNuRecord->recTotalThreads * sizeof(NuThread));
+    /* the application frees this with free(), so it can't come from us */
+    *ppThreads = malloc(pNuRecord->recTotalThreads * sizeof(NuThread));
     if (*ppThreads == NULL)
         return kNuErrMalloc;
 
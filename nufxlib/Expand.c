@@ -13,7 +13,7 @@
  * "Expand" an uncompressed thread.
  */
 static NuError Nu_ExpandUncompressed(NuArchive* pArchive,
-    const NuRecord* pRecord, const NuThread* pThread, FILE* infp,
+    const NuRecord* pRecord, const NuThread* pThread, NuCompStream* pStream,
     NuFunnel* pFunnel, uint16_t* pCrc)
 {
     NuError err;
@@ -22,7 +22,7 @@ static NuError Nu_ExpandUncompressed(NuArchive* pArchive,
 
     Assert(pArchive != NULL);
     Assert(pThread != NULL);
-    Assert(infp != NULL);
+    Assert(pStream != NULL);
     Assert(pFunnel != NULL);
 
     /* doesn't have to be same size as funnel, but it's not a bad idea */
@@ -41,10 +41,11 @@ static NuError Nu_ExpandUncompressed(NuArchive* pArchive,
     while (count) {
         getsize = (count > kNuGenCompBufSize) ? kNuGenCompBufSize : count;
 
-        err = Nu_FRead(infp, pArchive->compBuf, getsize);
+        err = Nu_CompStreamRead(pStream, pArchive->compBuf, getsize);
         BailError(err);
         if (pCrc != NULL)
-            *pCrc = Nu_CalcCRC16(*pCrc, pArchive->compBuf, getsize);
+            *pCrc = Nu_StatsCalcCRC16(pArchive, *pCrc, pArchive->compBuf,
+                        getsize);
         err = Nu_FunnelWrite(pArchive, pFunnel, pArchive->compBuf, getsize);
         BailError(err);
 
@@ -64,7 +65,7 @@ bail:
  * this reads up to "thCompThreadEOF", and doesn't even try to compute a CRC.
  */
 static NuError Nu_ExpandRaw(NuArchive* pArchive, const NuThread* pThread,
-    FILE* infp, NuFunnel* pFunnel)
+    NuCompStream* pStream, NuFunnel* pFunnel)
 {
     NuError err;
     /*uint8_t* buffer = NULL;*/
@@ -72,7 +73,7 @@ static NuError Nu_ExpandRaw(NuArchive* pArchive, const NuThread* pThread,
 
     Assert(pArchive != NULL);
     Assert(pThread != NULL);
-    Assert(infp != NULL);
+    Assert(pStream != NULL);
     Assert(pFunnel != NULL);
 
     /* doesn't have to be same size as funnel, but it's not a bad idea */
@@ -86,7 +87,7 @@ static NuError Nu_ExpandRaw(NuArchive* pArchive, const NuThread* pThread,
     while (count) {
         getsize = (count > kNuGenCompBufSize) ? kNuGenCompBufSize : count;
 
-        err = Nu_FRead(infp, pArchive->compBuf, getsize);
+        err = Nu_CompStreamRead(pStream, pArchive->compBuf, getsize);
         BailError(err);
         err = Nu_FunnelWrite(pArchive, pFunnel, pArchive->compBuf, getsize);
         BailError(err);
@@ -103,6 +104,78 @@ bail:
 }
 
 
+/*
+ * Expand compressed data from "pStream" to "pFunnel", using the
+ * compression and stream length specified by "pThread".
+ *
+ * This just picks the right expander.  The caller is responsible for
+ * flushing the funnel and checking the CRC.
+ *
+ * The time spent here is counted in the archive's stats, and includes
+ * writing the output.
+ */
+NuError Nu_ExpandFromStream(NuArchive* pArchive, const NuRecord* pRecord,
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc)
+{
+    NuError err;
+    NuStatsTimer timer;
+
+    Nu_StatsCodecStart(pArchive, &timer);
+
+    switch (pThread->thThreadFormat) {
+    case kNuThreadFormatUncompressed:
+        Nu_FunnelSetProgressState(pFunnel, kNuProgressCopying);
+        err = Nu_ExpandUncompressed(pArchive, pRecord, pThread, pStream,
+                pFunnel, pCrc);
+        break;
+    #ifdef ENABLE_SQ
+    case kNuThreadFormatHuffmanSQ:
+        err = Nu_ExpandHuffmanSQ(pArchive, pRecord, pThread, pStream, pFunnel,
+                pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_LZW
+    case kNuThreadFormatLZW1:
+    case kNuThreadFormatLZW2:
+        err = Nu_ExpandLZW(pArchive, pRecord, pThread, pStream, pFunnel, pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_LZC
+    case kNuThreadFormatLZC12:
+    case kNuThreadFormatLZC16:
+        err = Nu_ExpandLZC(pArchive, pRecord, pThread, pStream, pFunnel, pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_DEFLATE
+    case kNuThreadFormatDeflate:
+        err = Nu_ExpandDeflate(pArchive, pRecord, pThread, pStream, pFunnel,
+                pCrc);
+        break;
+    #endif
+    #ifdef ENABLE_BZIP2
+    case kNuThreadFormatBzip2:
+        err = Nu_ExpandBzip2(pArchive, pRecord, pThread, pStream, pFunnel,
+                pCrc);
+        break;
+    #endif
+    default:
+        err = kNuErrBadFormat;
+        Nu_ReportError(NU_BLOB, err,
+            "compression format %u not supported", pThread->thThreadFormat);
+        break;
+    }
+
+    if (pThread->thThreadFormat < kNuStatsNumFormats) {
+        Nu_StatsCodecStop(pArchive, &timer,
+            &pArchive->stats.expand[pThread->thThreadFormat],
+            pThread->thCompThreadEOF,
+            err == kNuErrNone ? pThread->actualThreadEOF : 0);
+    }
+
+    return err;
+}
+
 /*
  * Expand a thread from "infp" to "pFunnel", using the compression
  * and stream length specified by "pThread".
@@ -111,14 +184,20 @@ NuError Nu_ExpandStream(NuArchive* pArchive, const NuRecord* pRecord,
     const NuThread* pThread, FILE* infp, NuFunnel* pFunnel)
 {
     NuError err = kNuErrNone;
+    NuCompStream srcStream;
     uint16_t calcCrc;
     uint16_t* pCalcCrc;
 
+    Nu_CompStreamInitFile(pArchive, &srcStream, infp);
+
     if (!pThread->thThreadEOF && !pThread->thCompThreadEOF) {
         /* somebody stored an empty file! */
         goto done;
     }
 
+    err = Nu_ReadAheadOpenThread(pArchive, pThread, infp, &srcStream);
+    BailError(err);
+
     /*
      * A brief history of the "threadCRC" field in the thread header:
      *  record versions 0 and 1 didn't use the threadCRC field
@@ -147,54 +226,14 @@ NuError Nu_ExpandStream(NuArchive* pArchive, const NuRecord* pRecord,
      */
     if (!Nu_FunnelGetDoExpand(pFunnel)) {
         Nu_FunnelSetProgressState(pFunnel, kNuProgressCopying);
-        err = Nu_ExpandRaw(pArchive, pThread, infp, pFunnel);
+        err = Nu_ExpandRaw(pArchive, pThread, &srcStream, pFunnel);
         BailError(err);
         goto done;
     }
 
     Nu_FunnelSetProgressState(pFunnel, kNuProgressExpanding);
-    switch (pThread->thThreadFormat) {
-    case kNuThreadFormatUncompressed:
-        Nu_FunnelSetProgressState(pFunnel, kNuProgressCopying);
-        err = Nu_ExpandUncompressed(pArchive, pRecord, pThread, infp, pFunnel,
-                pCalcCrc);
-        break;
-    #ifdef ENABLE_SQ
-    case kNuThreadFormatHuffmanSQ:
-        err = Nu_ExpandHuffmanSQ(pArchive, pRecord, pThread, infp, pFunnel,
-                pCalcCrc);
-        break;
-    #endif
-    #ifdef ENABLE_LZW
-    case kNuThreadFormatLZW1:
-    case kNuThreadFormatLZW2:
-        err = Nu_ExpandLZW(pArchive, pRecord, pThread, infp, pFunnel, pCalcCrc);
-        break;
-    #endif
-    #ifdef ENABLE_LZC
-    case kNuThreadFormatLZC12:
-    case kNuThreadFormatLZC16:
-        err = Nu_ExpandLZC(pArchive, pRecord, pThread, infp, pFunnel, pCalcCrc);
-        break;
-    #endif
-    #ifdef ENABLE_DEFLATE
-    case kNuThreadFormatDeflate:
-        err = Nu_ExpandDeflate(pArchive, pRecord, pThread, infp, pFunnel,
-                pCalcCrc);
-        break;
-    #endif
-    #ifdef ENABLE_BZIP2
-    case kNuThreadFormatBzip2:
-        err = Nu_ExpandBzip2(pArchive, pRecord, pThread, infp, pFunnel,
-                pCalcCrc);
-        break;
-    #endif
-    default:
-        err = kNuErrBadFormat;
-        Nu_ReportError(NU_BLOB, err,
-            "compression format %u not supported", pThread->thThreadFormat);
-        break;
-    }
+    err = Nu_ExpandFromStream(pArchive, pRecord, pThread, &srcStream,
+            pFunnel, pCalcCrc);
     BailError(err);
 
     err = Nu_FunnelFlush(pArchive, pFunnel);
@@ -223,6 +262,7 @@ done:
     BailError(err);
 
 bail:
+    Nu_ReadAheadCloseThread(pArchive, &srcStream);
     return err;
 }
 
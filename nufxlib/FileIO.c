@@ -21,6 +21,9 @@
 #ifdef MAC_LIKE
 # include <sys/xattr.h>
 #endif
+#if defined(NU_DIR_FDS) || (defined(HAVE_FSYNC) && defined(UNIX_LIKE))
+# include <fcntl.h>
+#endif
 
 /*
  * For systems (e.g. Visual C++ 6.0) that don't have these standard values.
@@ -279,7 +282,8 @@ static const char kMacRsrcPath[] = "/..namedfork/rsrc";
  *
  * The caller must free the string returned.
  */
-static UNICHAR* GetResourcePath(const UNICHAR* pathnameUNI)
+static UNICHAR* GetResourcePath(NuArchive* pArchive,
+    const UNICHAR* pathnameUNI)
 {
     Assert(pathnameUNI != NULL);
 
@@ -288,8 +292,9 @@ static UNICHAR* GetResourcePath(const UNICHAR* pathnameUNI)
         strlen(pathnameUNI) * sizeof(UNICHAR) + sizeof(kMacRsrcPath);
     char* buf;
 
-    buf = (char*) malloc(bufLen);
-    snprintf(buf, bufLen, "%s%s", pathnameUNI, kMacRsrcPath);
+    buf = (char*) Nu_Malloc(pArchive, bufLen);
+    if (buf != NULL)
+        snprintf(buf, bufLen, "%s%s", pathnameUNI, kMacRsrcPath);
     return buf;
 }
 # endif /*HAS_RESOURCE_FORKS*/
@@ -379,6 +384,28 @@ static NuError Nu_SetFinderInfo(NuArchive* pArchive, const NuRecord* pRecord,
 #endif /*MAC_LIKE*/
 
 
+#if defined(UNIX_LIKE) || defined(WINDOWS_LIKE)
+/*
+ * Fill out a NuFileInfo struct from the results of stat().
+ */
+static void Nu_StatToFileInfo(const struct stat* pSbuf, NuFileInfo* pFileInfo)
+{
+    pFileInfo->isRegularFile = false;
+    if (S_ISREG(pSbuf->st_mode))
+        pFileInfo->isRegularFile = true;
+    pFileInfo->isDirectory = false;
+    if (S_ISDIR(pSbuf->st_mode))
+        pFileInfo->isDirectory = true;
+
+    /* BUG: should check for 32-bit overflow from 64-bit off_t */
+    pFileInfo->dataEof = pSbuf->st_size;
+    pFileInfo->isForked = false;
+    Nu_GMTSecondsToDateTime(&pSbuf->st_mtime, &pFileInfo->modWhen);
+    pFileInfo->unixMode = pSbuf->st_mode;
+    pFileInfo->isValid = true;
+}
+#endif
+
 /*
  * Get the file info into a NuFileInfo struct.  Fields which are
  * inappropriate for the current system are set to default values.
@@ -407,16 +434,7 @@ static NuError Nu_GetFileInfo(NuArchive* pArchive, const UNICHAR* pathnameUNI,
             goto bail;
         }
 
-        pFileInfo->isRegularFile = false;
-        if (S_ISREG(sbuf.st_mode))
-            pFileInfo->isRegularFile = true;
-        pFileInfo->isDirectory = false;
-        if (S_ISDIR(sbuf.st_mode))
-            pFileInfo->isDirectory = true;
-
-        /* BUG: should check for 32-bit overflow from 64-bit off_t */
-        pFileInfo->dataEof = sbuf.st_size;
-        pFileInfo->isForked = false;
+        Nu_StatToFileInfo(&sbuf, pFileInfo);
 # if defined(MAC_LIKE) && defined(HAS_RESOURCE_FORKS)
         if (!pFileInfo->isDirectory) {
             /*
@@ -429,7 +447,7 @@ static NuError Nu_GetFileInfo(NuArchive* pArchive, const UNICHAR* pathnameUNI,
              * don't know if xattr has always worked with resource forks,
              * so we'll stick with stat for now.
              */
-            UNICHAR* rsrcPath = GetResourcePath(pathnameUNI);
+            UNICHAR* rsrcPath = GetResourcePath(pArchive, pathnameUNI);
 
             struct stat res_sbuf;
 
@@ -437,12 +455,9 @@ static NuError Nu_GetFileInfo(NuArchive* pArchive, const UNICHAR* pathnameUNI,
                 pFileInfo->isForked = (res_sbuf.st_size != 0);
             }
 
-            free(rsrcPath);
+            Nu_Free(pArchive, rsrcPath);
         }
 # endif
-        Nu_GMTSecondsToDateTime(&sbuf.st_mtime, &pFileInfo->modWhen);
-        pFileInfo->unixMode = sbuf.st_mode;
-        pFileInfo->isValid = true;
     }
 #else
     #error "Port this"
@@ -452,6 +467,33 @@ bail:
     return err;
 }
 
+#ifdef NU_DIR_FDS
+/*
+ * Like Nu_GetFileInfo, but for a file in an open directory.
+ */
+static NuError Nu_GetFileInfoAt(NuArchive* pArchive, int dirFd,
+    const UNICHAR* leafUNI, NuFileInfo* pFileInfo)
+{
+    struct stat sbuf;
+
+    Assert(pArchive != NULL);
+    Assert(leafUNI != NULL);
+    Assert(pFileInfo != NULL);
+
+    pFileInfo->isValid = false;
+
+    if (fstatat(dirFd, leafUNI, &sbuf, 0) != 0) {
+        if (errno == ENOENT)
+            return kNuErrFileNotFound;
+        else
+            return kNuErrFileStat;
+    }
+
+    Nu_StatToFileInfo(&sbuf, pFileInfo);
+    return kNuErrNone;
+}
+#endif
+
 
 /*
  * Determine whether a specific fork in the file exists.
@@ -528,9 +570,12 @@ static NuError Nu_FileForkExists(NuArchive* pArchive,
 
 /*
  * Set the dates on a file according to what's in the record.
+ *
+ * If "fd" is an open file descriptor for the file, and the system lets
+ * us, it's used instead of the pathname.  Pass -1 to use the pathname.
  */
 static NuError Nu_SetFileDates(NuArchive* pArchive, const NuRecord* pRecord,
-    const UNICHAR* pathnameUNI)
+    int fd, const UNICHAR* pathnameUNI)
 {
     NuError err = kNuErrNone;
 
@@ -547,6 +592,20 @@ static NuError Nu_SetFileDates(NuArchive* pArchive, const NuRecord* pRecord,
         utbuf.actime = utbuf.modtime;
 
         /* only do it if the NuDateTime was valid */
+# ifdef NU_DIR_FDS
+        if (utbuf.modtime && fd >= 0) {
+            struct timespec times[2];
+
+            times[0].tv_sec = times[1].tv_sec = utbuf.modtime;
+            times[0].tv_nsec = times[1].tv_nsec = 0;
+            if (futimens(fd, times) < 0) {
+                Nu_ReportError(NU_BLOB, errno,
+                    "Unable to set time stamp on '%s'", pathnameUNI);
+                err = kNuErrFileSetDate;
+                goto bail;
+            }
+        } else
+# endif
         if (utbuf.modtime) {
             if (utime(pathnameUNI, &utbuf) < 0) {
                 Nu_ReportError(NU_BLOB, errno,
@@ -594,10 +653,11 @@ static Boolean Nu_IsRecordLocked(const NuRecord* pRecord)
  * Set the file access permissions based on what's in the record.
  *
  * This assumes that the file is currently writable, so we only need
- * to do something if the original file was "locked".
+ * to do something if the original file was "locked".  "fd" works the
+ * same way as for Nu_SetFileDates.
  */
 static NuError Nu_SetFileAccess(NuArchive* pArchive, const NuRecord* pRecord,
-    const UNICHAR* pathnameUNI)
+    int fd, const UNICHAR* pathnameUNI)
 {
     NuError err = kNuErrNone;
 
@@ -609,13 +669,20 @@ static NuError Nu_SetFileAccess(NuArchive* pArchive, const NuRecord* pRecord,
     /* only need to do something if the file was "locked" */
     if (Nu_IsRecordLocked(pRecord)) {
         mode_t mask;
+        int cc;
 
         /* set it to 444, modified by umask */
         mask = umask(0);
         umask(mask);
         //DBUG(("+++ chmod '%s' %03o (mask=%03o)\n", pathname,
         //    (S_IRUSR | S_IRGRP | S_IROTH) & ~mask, mask));
-        if (chmod(pathnameUNI, (S_IRUSR | S_IRGRP | S_IROTH) & ~mask) < 0) {
+# ifdef NU_DIR_FDS
+        if (fd >= 0)
+            cc = fchmod(fd, (S_IRUSR | S_IRGRP | S_IROTH) & ~mask);
+        else
+# endif
+            cc = chmod(pathnameUNI, (S_IRUSR | S_IRGRP | S_IROTH) & ~mask);
+        if (cc < 0) {
             Nu_ReportError(NU_BLOB, errno,
                 "unable to set access for '%s' to %03o", pathnameUNI,
                 (int) mask);
@@ -696,15 +763,22 @@ static NuError Nu_Mkdir(NuArchive* pArchive, const char* dir)
     Assert(pArchive != NULL);
     Assert(dir != NULL);
 
+    /*
+     * Our caller only gets here if the directory wasn't there, so EEXIST
+     * means someone else extracting into the same tree just made it.  If
+     * it's a file instead, opening the output file will fail.
+     */
 #if defined(UNIX_LIKE)
-    if (mkdir(dir, S_IRWXU | S_IRGRP|S_IXGRP | S_IROTH|S_IXOTH) < 0) {
+    if (mkdir(dir, S_IRWXU | S_IRGRP|S_IXGRP | S_IROTH|S_IXOTH) < 0 &&
+        errno != EEXIST)
+    {
         err = errno ? errno : kNuErrDirCreate;
         Nu_ReportError(NU_BLOB, err, "Unable to create dir '%s'", dir);
         goto bail;
     }
 
 #elif defined(WINDOWS_LIKE)
-    if (mkdir(dir) < 0) {
+    if (mkdir(dir) < 0 && errno != EEXIST) {
         err = errno ? errno : kNuErrDirCreate;
         Nu_ReportError(NU_BLOB, err, "Unable to create dir '%s'", dir);
         goto bail;
@@ -737,7 +811,7 @@ static NuError Nu_CreateSubdirIFN(NuArchive* pArchive,
     Assert(fssep != '\0');
 
     /* pathStart might have whole path, but we only want up to "pathEnd" */
-    tmpBuf = strdup(pathStartUNI);
+    tmpBuf = Nu_Strdup(pArchive, pathStartUNI);
     tmpBuf[pathEnd - pathStartUNI +1] = '\0';
 
     err = Nu_GetFileInfo(pArchive, tmpBuf, &fileInfo);
@@ -843,9 +917,9 @@ static NuError Nu_OpenFileForWrite(NuArchive* pArchive,
 {
 #if defined(MAC_LIKE) && defined(HAS_RESOURCE_FORKS)
     if (openRsrc) {
-        UNICHAR* rsrcPath = GetResourcePath(pathnameUNI);
+        UNICHAR* rsrcPath = GetResourcePath(pArchive, pathnameUNI);
         *pFp = fopen(rsrcPath, kNuFileOpenWriteTrunc);
-        free(rsrcPath);
+        Nu_Free(pArchive, rsrcPath);
     } else {
         *pFp = fopen(pathnameUNI, kNuFileOpenWriteTrunc);
     }
@@ -857,6 +931,29 @@ static NuError Nu_OpenFileForWrite(NuArchive* pArchive,
     return kNuErrNone;
 }
 
+#ifdef NU_DIR_FDS
+/*
+ * Open a file in an open directory for writing, truncating it.
+ */
+static NuError Nu_OpenFileForWriteAt(NuArchive* pArchive, int dirFd,
+    const UNICHAR* leafUNI, FILE** pFp)
+{
+    NuError err;
+    int fd;
+
+    fd = openat(dirFd, leafUNI, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return errno ? errno : -1;
+    *pFp = fdopen(fd, kNuFileOpenWriteTrunc);
+    if (*pFp == NULL) {
+        err = errno ? errno : -1;
+        close(fd);
+        return err;
+    }
+    return kNuErrNone;
+}
+#endif
+
 
 /*
  * Open an output file and prepare it for writing.
@@ -876,6 +973,11 @@ NuError Nu_OpenOutputFile(NuArchive* pArchive, const NuRecord* pRecord,
     NuFileInfo fileInfo;
     NuErrorStatus errorStatus;
     NuResult result;
+#ifdef NU_DIR_FDS
+    Boolean haveDir = false, dirMissing = false;
+    const UNICHAR* leafUNI = NULL;
+    int dirFd = -1;
+#endif
 
     Assert(pArchive != NULL);
     Assert(pRecord != NULL);
@@ -916,8 +1018,40 @@ NuError Nu_OpenOutputFile(NuArchive* pArchive, const NuRecord* pRecord,
      * empty, this will *not* set "exists".
      */
     fileInfo.isValid = false;
-    err = Nu_FileForkExists(pArchive, newPathnameUNI, isForkedFile,
-            extractingRsrc, &exists, &fileInfo);
+
+    /* if an earlier copy of this file is still being written, let it finish */
+    Nu_OutQueueWaitForPath(pArchive, newPathnameUNI);
+
+#ifdef NU_DIR_FDS
+    /*
+     * Look the file up in its directory, which we may already have open.
+     * If the directory doesn't exist, neither does the file.  If we can't
+     * open the directory for some other reason, use the pathname.
+     */
+    if (newFssep == '/') {
+        err = Nu_DirCacheGet(pArchive, newPathnameUNI, false, &dirFd,
+                &leafUNI);
+        if (err == kNuErrNone)
+            haveDir = true;
+        else if (err == kNuErrFileNotFound)
+            dirMissing = true;
+        err = kNuErrNone;
+    }
+    if (haveDir) {
+        exists = true;
+        err = Nu_GetFileInfoAt(pArchive, dirFd, leafUNI, &fileInfo);
+        if (err == kNuErrFileNotFound) {
+            err = kNuErrNone;
+            exists = false;
+        }
+    } else if (dirMissing) {
+        exists = false;
+    } else
+#endif
+    {
+        err = Nu_FileForkExists(pArchive, newPathnameUNI, isForkedFile,
+                extractingRsrc, &exists, &fileInfo);
+    }
     BailError(err);
 
     if (exists) {
@@ -1069,14 +1203,30 @@ NuError Nu_OpenOutputFile(NuArchive* pArchive, const NuRecord* pRecord,
                 &fileInfo);
         BailError(err);
     } else if (!fileInfo.isValid) {
-        err = Nu_CreatePathIFN(pArchive, newPathnameUNI, newFssep);
-        BailError(err);
+#ifdef NU_DIR_FDS
+        if (dirMissing) {
+            err = Nu_DirCacheGet(pArchive, newPathnameUNI, true, &dirFd,
+                    &leafUNI);
+            haveDir = (err == kNuErrNone);
+        }
+        if (!haveDir)
+#endif
+        {
+            err = Nu_CreatePathIFN(pArchive, newPathnameUNI, newFssep);
+            BailError(err);
+        }
     }
 
     /*
      * Open sesame.
      */
-    err = Nu_OpenFileForWrite(pArchive, newPathnameUNI, extractingRsrc, pFp);
+#ifdef NU_DIR_FDS
+    if (haveDir)
+        err = Nu_OpenFileForWriteAt(pArchive, dirFd, leafUNI, pFp);
+    else
+#endif
+        err = Nu_OpenFileForWrite(pArchive, newPathnameUNI, extractingRsrc,
+                pFp);
     BailError(err);
 
 
@@ -1118,14 +1268,25 @@ NuError Nu_CloseOutputFile(NuArchive* pArchive, const NuRecord* pRecord,
     FILE* fp, const UNICHAR* pathnameUNI)
 {
     NuError err;
+    int fd = -1;
 
     Assert(pArchive != NULL);
     Assert(pRecord != NULL);
     Assert(fp != NULL);
 
-    fclose(fp);
+#ifdef NU_DIR_FDS
+    /*
+     * Set the dates and access on the open file, so the pathname doesn't
+     * have to be looked up again.  The buffered data has to go out first,
+     * or writing it would change the mod date.
+     */
+    if (fflush(fp) == 0)
+        fd = fileno(fp);
+#endif
+    if (fd < 0)
+        fclose(fp);
 
-    err = Nu_SetFileDates(pArchive, pRecord, pathnameUNI);
+    err = Nu_SetFileDates(pArchive, pRecord, fd, pathnameUNI);
     BailError(err);
 
 #if defined(MAC_LIKE)
@@ -1135,10 +1296,12 @@ NuError Nu_CloseOutputFile(NuArchive* pArchive, const NuRecord* pRecord,
     BailError(err);
 #endif
 
-    err = Nu_SetFileAccess(pArchive, pRecord, pathnameUNI);
+    err = Nu_SetFileAccess(pArchive, pRecord, fd, pathnameUNI);
     BailError(err);
 
 bail:
+    if (fd >= 0)
+        fclose(fp);
     return kNuErrNone;
 }
 
@@ -1182,7 +1345,7 @@ NuError Nu_OpenInputFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
 #if defined(MAC_LIKE) && defined(HAS_RESOURCE_FORKS)
     UNICHAR* rsrcPath = NULL;
     if (openRsrc) {
-        rsrcPath = GetResourcePath(pathnameUNI);
+        rsrcPath = GetResourcePath(pArchive, pathnameUNI);
         pathnameUNI = rsrcPath;
     }
 #endif
@@ -1252,7 +1415,7 @@ bail:
         }
     }
 #if defined(MAC_LIKE) && defined(HAS_RESOURCE_FORKS)
-    free(rsrcPath);
+    Nu_Free(pArchive, rsrcPath);
 #endif
     return err;
 }
@@ -1313,12 +1476,18 @@ NuError Nu_RenameFile(const UNICHAR* fromPathUNI, const UNICHAR* toPathUNI)
 
 /*
  * Wrapper for ftell().
+ *
+ * These four count the calls, and the bytes read and written, in
+ * pArchive's stats.  pArchive may be NULL, in which case nothing is
+ * counted.
  */
-NuError Nu_FTell(FILE* fp, long* pOffset)
+NuError Nu_FTell(NuArchive* pArchive, FILE* fp, long* pOffset)
 {
     Assert(fp != NULL);
     Assert(pOffset != NULL);
 
+    if (pArchive != NULL)
+        pArchive->stats.ftellCalls++;
     errno = 0;
     *pOffset = ftell(fp);
     if (*pOffset < 0) {
@@ -1331,11 +1500,13 @@ NuError Nu_FTell(FILE* fp, long* pOffset)
 /*
  * Wrapper for fseek().
  */
-NuError Nu_FSeek(FILE* fp, long offset, int ptrname)
+NuError Nu_FSeek(NuArchive* pArchive, FILE* fp, long offset, int ptrname)
 {
     Assert(fp != NULL);
     Assert(ptrname == SEEK_SET || ptrname == SEEK_CUR || ptrname == SEEK_END);
 
+    if (pArchive != NULL)
+        pArchive->stats.fseekCalls++;
     errno = 0;
     if (fseek(fp, offset, ptrname) < 0) {
         Nu_ReportError(NU_NILBLOB, errno,
@@ -1349,12 +1520,17 @@ NuError Nu_FSeek(FILE* fp, long offset, int ptrname)
  * Wrapper for fread().  Note the arguments resemble read(2) rather than the
  * slightly silly ones used by fread(3S).
  */
-NuError Nu_FRead(FILE* fp, void* buf, size_t nbyte)
+NuError Nu_FRead(NuArchive* pArchive, FILE* fp, void* buf, size_t nbyte)
 {
     size_t result;
 
     errno = 0;
     result = fread(buf, nbyte, 1, fp);
+    if (pArchive != NULL) {
+        pArchive->stats.freadCalls++;
+        if (result == 1)
+            Nu_StatsAddRead(pArchive, nbyte);
+    }
     if (result != 1)
         return errno ? errno : kNuErrFileRead;
     return kNuErrNone;
@@ -1364,12 +1540,18 @@ NuError Nu_FRead(FILE* fp, void* buf, size_t nbyte)
  * Wrapper for fwrite().  Note the arguments resemble write(2) rather than the
  * slightly silly ones used by fwrite(3S).
  */
-NuError Nu_FWrite(FILE* fp, const void* buf, size_t nbyte)
+NuError Nu_FWrite(NuArchive* pArchive, FILE* fp, const void* buf,
+    size_t nbyte)
 {
     size_t result;
 
     errno = 0;
     result = fwrite(buf, nbyte, 1, fp);
+    if (pArchive != NULL) {
+        pArchive->stats.fwriteCalls++;
+        if (result == 1)
+            Nu_StatsAddWrite(pArchive, fp, nbyte);
+    }
     if (result != 1)
         return errno ? errno : kNuErrFileWrite;
     return kNuErrNone;
@@ -1404,7 +1586,7 @@ NuError Nu_CopyFileSection(NuArchive* pArchive, FILE* dstFp, FILE* srcFp,
     while (length) {
         readLen = length > kNuGenCompBufSize ?  kNuGenCompBufSize : length;
 
-        err = Nu_FRead(srcFp, pArchive->compBuf, readLen);
+        err = Nu_FRead(pArchive, srcFp, pArchive->compBuf, readLen);
         if (err != kNuErrNone) {
             Nu_ReportError(NU_BLOB, err,
                     "Nu_FRead failed while copying file section "
@@ -1412,9 +1594,10 @@ NuError Nu_CopyFileSection(NuArchive* pArchive, FILE* dstFp, FILE* srcFp,
                 (long) srcFp, readLen, length, err);
             goto bail;
         }
-        err = Nu_FWrite(dstFp, pArchive->compBuf, readLen);
+        err = Nu_FWrite(pArchive, dstFp, pArchive->compBuf, readLen);
         BailError(err);
 
+        pArchive->stats.bytesCopied += readLen;
         length -= readLen;
     }
 
@@ -1441,16 +1624,16 @@ NuError Nu_GetFileLength(NuArchive* pArchive, FILE* fp, long* pLength)
     Assert(fp != NULL);
     Assert(pLength != NULL);
 
-    err = Nu_FTell(fp, &oldpos);
+    err = Nu_FTell(pArchive, fp, &oldpos);
     BailError(err);
 
-    err = Nu_FSeek(fp, 0, SEEK_END);
+    err = Nu_FSeek(pArchive, fp, 0, SEEK_END);
     BailError(err);
 
-    err = Nu_FTell(fp, pLength);
+    err = Nu_FTell(pArchive, fp, pLength);
     BailError(err);
 
-    err = Nu_FSeek(fp, oldpos, SEEK_SET);
+    err = Nu_FSeek(pArchive, fp, oldpos, SEEK_SET);
     BailError(err);
 
 bail:
@@ -1478,3 +1661,71 @@ NuError Nu_TruncateOpenFile(FILE* fp, long length)
     #endif
 }
 
+/*
+ * Push anything buffered for "fp" out to the disk, so that it survives a
+ * crash or power failure.  Used when the ordering of writes to different
+ * files matters, e.g. the in-place compaction journal.
+ */
+NuError Nu_SyncOpenFile(FILE* fp)
+{
+    if (fflush(fp) != 0)
+        return errno ? errno : -1;
+
+    #if defined(HAVE_FSYNC)
+    if (fsync(fileno(fp)) < 0)
+        return errno ? errno : -1;
+    return kNuErrNone;
+    #elif defined(HAVE__COMMIT)
+    if (_commit(fileno(fp)) < 0)
+        return errno ? errno : -1;
+    return kNuErrNone;
+    #else
+    /* not fatal; the data is flushed, but may not be on the disk yet */
+    return kNuErrInternal;
+    #endif
+}
+
+/*
+ * Push the directory entry for a newly created file out to the disk.  On
+ * most Unix filesystems, syncing the file doesn't do that, so a crash
+ * could leave the file's data on the disk with nothing pointing to it.
+ *
+ * Returns kNuErrInternal if there's no way to do it here.
+ */
+NuError Nu_SyncParentDir(NuArchive* pArchive, const UNICHAR* pathnameUNI)
+{
+    #if defined(HAVE_FSYNC) && defined(UNIX_LIKE)
+    NuError err = kNuErrNone;
+    UNICHAR* dirPathUNI;
+    char* cp;
+    int fd;
+
+    dirPathUNI = Nu_Strdup(pArchive, pathnameUNI);
+    if (dirPathUNI == NULL)
+        return kNuErrMalloc;
+    cp = strrchr(dirPathUNI, '/');
+    if (cp == NULL)
+        strcpy(dirPathUNI, ".");
+    else if (cp == dirPathUNI)
+        *(cp+1) = '\0';
+    else
+        *cp = '\0';
+
+    fd = open(dirPathUNI, O_RDONLY);
+    if (fd < 0) {
+        err = errno ? errno : -1;
+    } else {
+        if (fsync(fd) < 0)
+            err = errno ? errno : -1;
+        close(fd);
+    }
+
+    Nu_Free(pArchive, dirPathUNI);
+    return err;
+    #else
+    (void) pArchive;
+    (void) pathnameUNI;
+    return kNuErrInternal;
+    #endif
+}
+
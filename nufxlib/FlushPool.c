@@ -0,0 +1,655 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Parallel compression of new records during NuFlush.
+ *
+ * The new records are written to the archive one thread at a time, and
+ * most of that time is spent in the compressor.  When more than one worker
+ * thread is allowed, a pool of workers runs ahead of the flush, reading
+ * each new file or buffer into memory and compressing it exactly the way
+ * Nu_CompressToArchive would, CRC and all.  When the flush gets to the
+ * thread, it just writes out the result.  The records are still assembled
+ * on the main thread, in order, so the archive is byte-for-byte the same
+ * as a serial flush would produce.
+ *
+ * Anything the workers can't handle exactly -- pre-sized threads, "fp"
+ * sources, resource forks, large files, or a result that no longer matches
+ * what the flush decided to do -- is compressed on the main thread as
+ * usual.  If the flush catches up with a job the workers haven't started
+ * yet, it takes the job back and does it itself, so it never waits on an
+ * idle pool.  Nothing the workers do is visible to the application, which
+ * still sees every progress update, error callback, and skip/abort choice
+ * on the main thread.
+ *
+ * The pool lives only as long as Nu_CreateNewRecords.
+ */
+#include "NufxLibPriv.h"
+
+/* inputs larger than this are compressed on the main thread */
+#define kNuFlushPoolMaxJobLen   (8 * 1024 * 1024)
+
+/* workers pause when finished results are holding this much memory */
+#define kNuFlushPoolMaxHeld     (64 * 1024 * 1024)
+
+typedef enum NuFlushJobState {
+    kNuFlushJobWaiting = 0,     /* not started */
+    kNuFlushJobRunning,         /* a worker has it */
+    kNuFlushJobDone,            /* results are ready */
+    kNuFlushJobRetired          /* results used or discarded */
+} NuFlushJobState;
+
+typedef struct NuFlushJob {
+    /* set by Nu_FlushPoolBegin, read-only after that */
+    const NuRecord*     pRecord;
+    const NuThreadMod*  pThreadMod;
+    NuThreadID          threadID;
+    NuThreadFormat      dfltFormat;
+    uint32_t            fileType;
+    uint32_t            extraType;
+    const UNICHAR*      pathnameUNI;    /* input file, or NULL for buffer */
+    const uint8_t*      buffer;         /* input buffer */
+    uint32_t            bufLen;
+
+    NuFlushJobState     state;          /* guarded by the pool's lock */
+
+    /* results, owned by whoever set the state to Running or Done */
+    Boolean             usable;         /* false if the flush should redo it */
+    NuThreadFormat      format;         /* format that was tried */
+    uint32_t            srcLen;
+    uint16_t            crc;
+    uint8_t*            srcBuf;         /* file contents; NULL for buffers */
+    uint8_t*            dstBuf;         /* NULL if it didn't get smaller */
+    uint32_t            dstLen;
+    uint32_t            memUsed;        /* bytes in srcBuf and dstBuf */
+} NuFlushJob;
+
+typedef struct NuFlushWorker {
+    struct NuFlushPool* pPool;
+    NuArchive*          pScratch;       /* codec state for this worker */
+    NuWorker            worker;
+    Boolean             running;        /* started and not yet joined */
+} NuFlushWorker;
+
+struct NuFlushPool {
+    NuFlushJob*     jobs;
+    int             numJobs;
+    int             firstLive;          /* first job of the current record */
+
+    NuFlushWorker*  workers;
+    int             numWorkers;
+
+    /* guarded by "lock" */
+    NuMutex         lock;
+    NuCond          cond;               /* broadcast after any change */
+    int             nextJob;            /* next job for the workers */
+    uint32_t        bytesHeld;          /* memUsed for Done jobs */
+    Boolean         stop;               /* workers should quit */
+};
+
+
+/*
+ * Returns "true" if the workers can compress this threadMod exactly the
+ * way the flush would.
+ */
+static Boolean Nu_FlushPoolIsEligible(const NuArchive* pArchive,
+    const NuThreadMod* pThreadMod)
+{
+    const NuDataSource* pDataSource = pThreadMod->entry.add.pDataSource;
+    NuThreadFormat dfltFormat = pThreadMod->entry.add.threadFormat;
+    const UNICHAR* pathnameUNI;
+    const uint8_t* buffer;
+    uint32_t bufLen;
+
+    if (pThreadMod->entry.kind != kNuThreadModAdd ||
+        pThreadMod->entry.add.isPresized ||
+        pThreadMod->entry.add.threadID == kNuThreadIDFilename)
+    {
+        return false;
+    }
+    if (Nu_DataSourceGetThreadFormat(pDataSource) !=
+                                                kNuThreadFormatUncompressed)
+    {
+        return false;
+    }
+    if (!Nu_DataSourceGetDirectInput(pDataSource, &pathnameUNI, &buffer,
+            &bufLen))
+    {
+        return false;
+    }
+    if (pathnameUNI == NULL && bufLen > kNuFlushPoolMaxJobLen)
+        return false;
+
+    /* without a policy, we know up front if there's any work to do */
+    if ((!pArchive->valCompressPolicy ||
+         !Nu_IsCompressibleThreadID(pThreadMod->entry.add.threadID)) &&
+        (dfltFormat == kNuThreadFormatUncompressed ||
+         dfltFormat == kNuThreadFormatBestOf))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Read a job's input file into memory.  Files that have grown too large,
+ * or that can't be read, are left for the flush to deal with.
+ */
+static NuError Nu_FlushJobReadFile(NuArchive* pScratch, NuFlushJob* pJob)
+{
+    NuError err = kNuErrNone;
+    FILE* fp = NULL;
+    long length;
+
+    fp = fopen(pJob->pathnameUNI, kNuFileOpenReadOnly);
+    if (fp == NULL) {
+        err = kNuErrFileOpen;
+        goto bail;
+    }
+    pScratch->stats.fseekCalls += 2;
+    pScratch->stats.ftellCalls++;
+    if (fseek(fp, 0, SEEK_END) < 0 || (length = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) < 0)
+    {
+        err = kNuErrFileSeek;
+        goto bail;
+    }
+    if (length > kNuFlushPoolMaxJobLen) {
+        err = kNuErrBufferOverrun;
+        goto bail;
+    }
+
+    pJob->srcLen = (uint32_t) length;
+    if (length == 0)
+        goto bail;
+    pJob->srcBuf = Nu_Malloc(pScratch, pJob->srcLen);
+    BailAlloc(pJob->srcBuf);
+    pJob->memUsed += pJob->srcLen;
+    pScratch->stats.freadCalls++;
+    if (fread(pJob->srcBuf, pJob->srcLen, 1, fp) != 1)
+        err = kNuErrFileRead;
+    else
+        Nu_StatsAddRead(pScratch, pJob->srcLen);
+
+bail:
+    if (fp != NULL)
+        fclose(fp);
+    return err;
+}
+
+/*
+ * Compress one job's input.  Runs on a worker thread, so it only touches
+ * the job and the worker's scratch archive.
+ *
+ * This follows the same steps as Nu_CompressToArchive, so the result
+ * is only marked usable if it's what the flush would have produced.
+ */
+static void Nu_FlushJobRun(NuFlushJob* pJob, NuArchive* pScratch)
+{
+    NuError err;
+    NuDataSource* pDataSource = NULL;
+    NuStraw* pStraw = NULL;
+    NuCompStream stream;
+    const uint8_t* srcBuf;
+    NuValue compression;
+    uint32_t ruleIdx;
+    uint16_t crc;
+
+    if (pJob->pathnameUNI != NULL) {
+        err = Nu_FlushJobReadFile(pScratch, pJob);
+        BailError(err);
+        srcBuf = pJob->srcBuf;
+    } else {
+        pJob->srcLen = pJob->bufLen;
+        srcBuf = pJob->buffer;
+    }
+
+    /* empty and tiny inputs are cheap, and have their own rules */
+    if (pJob->srcLen == 0 ||
+        (pScratch->valMimicSHK && pJob->srcLen < kNuSHKLZWThreshold))
+    {
+        goto bail;
+    }
+
+    pJob->format = pJob->dfltFormat;
+    if (pScratch->valCompressPolicy &&
+        Nu_IsCompressibleThreadID(pJob->threadID) &&
+        Nu_PolicyFindRule(pScratch, pJob->fileType, pJob->extraType,
+            pJob->threadID, pJob->srcLen, &ruleIdx, &compression))
+    {
+        pJob->format = Nu_ConvertCompressValToFormat(pScratch, compression);
+    }
+    if (pJob->format == kNuThreadFormatUncompressed ||
+        pJob->format == kNuThreadFormatBestOf)
+    {
+        goto bail;
+    }
+
+    pJob->crc = Nu_CalcCRC16(kNuInitialThreadCRC, srcBuf, pJob->srcLen);
+
+    /* no point in keeping anything that doesn't get smaller */
+    if (pJob->srcLen > 1) {
+        pJob->dstBuf = Nu_Malloc(pScratch, pJob->srcLen - 1);
+        BailAlloc(pJob->dstBuf);
+        pJob->memUsed += pJob->srcLen - 1;
+
+        err = Nu_DataSourceBuffer_New(kNuThreadFormatUncompressed, 0,
+                srcBuf, 0, pJob->srcLen, NULL, &pDataSource);
+        BailError(err);
+        err = Nu_StrawNew(pScratch, pDataSource, NULL, &pStraw);
+        BailError(err);
+        Nu_CompStreamInitBuffer(&stream, pJob->dstBuf, pJob->srcLen - 1);
+
+        crc = kNuInitialThreadCRC;
+        err = Nu_CompressToStream(pScratch, pStraw, &stream, pJob->format,
+                pJob->srcLen, &pJob->dstLen, &crc);
+        if (err == kNuErrNone)
+            err = Nu_CompStreamGetError(&stream);
+    } else {
+        err = kNuErrBufferOverrun;
+    }
+
+    if (err == kNuErrBufferOverrun) {
+        /* got bigger, so it gets stored */
+        pJob->memUsed -= pJob->srcLen > 1 ? pJob->srcLen - 1 : 0;
+        Nu_Free(pScratch, pJob->dstBuf);
+        pJob->dstBuf = NULL;
+        pJob->dstLen = pJob->srcLen;
+        err = kNuErrNone;
+    }
+    BailError(err);
+    Assert(pJob->dstBuf == NULL || crc == pJob->crc);
+
+    pJob->usable = true;
+
+bail:
+    if (!pJob->usable) {
+        /* let the flush report whatever went wrong */
+        Nu_Free(pScratch, pJob->srcBuf);
+        Nu_Free(pScratch, pJob->dstBuf);
+        pJob->srcBuf = pJob->dstBuf = NULL;
+        pJob->memUsed = 0;
+    }
+    (void) Nu_StrawFree(pScratch, pStraw);
+    (void) Nu_DataSourceFree(pDataSource);
+}
+
+/*
+ * Worker thread.  Takes jobs in order until there aren't any left, or
+ * the pool is shut down.  Stops taking jobs while the finished ones are
+ * holding too much memory; the flush frees them as it goes.
+ */
+static void Nu_FlushPoolWorker(void* arg)
+{
+    NuFlushWorker* pWorker = arg;
+    NuFlushPool* pPool = pWorker->pPool;
+    NuFlushJob* pJob;
+
+    Nu_MutexLock(&pPool->lock);
+    while (true) {
+        while (!pPool->stop && pPool->nextJob < pPool->numJobs &&
+               pPool->bytesHeld >= kNuFlushPoolMaxHeld)
+        {
+            Nu_CondWait(&pPool->cond, &pPool->lock);
+        }
+        if (pPool->stop || pPool->nextJob == pPool->numJobs)
+            break;
+
+        pJob = &pPool->jobs[pPool->nextJob++];
+        if (pJob->state != kNuFlushJobWaiting)
+            continue;       /* the flush took it back */
+        pJob->state = kNuFlushJobRunning;
+        Nu_MutexUnlock(&pPool->lock);
+
+        Nu_FlushJobRun(pJob, pWorker->pScratch);
+
+        Nu_MutexLock(&pPool->lock);
+        pJob->state = kNuFlushJobDone;
+        pPool->bytesHeld += pJob->memUsed;
+        Nu_CondBroadcast(&pPool->cond);
+    }
+    Nu_MutexUnlock(&pPool->lock);
+}
+
+
+/*
+ * Get exclusive use of a job.  Waits if a worker is busy with it.  If no
+ * worker has started it, it's taken back, and NULL is returned.
+ */
+static NuFlushJob* Nu_FlushPoolClaim(NuFlushPool* pPool, NuFlushJob* pJob)
+{
+    Nu_MutexLock(&pPool->lock);
+    while (pJob->state == kNuFlushJobRunning)
+        Nu_CondWait(&pPool->cond, &pPool->lock);
+    if (pJob->state == kNuFlushJobWaiting) {
+        pJob->state = kNuFlushJobRetired;
+        pJob = NULL;
+    } else if (pJob->state != kNuFlushJobDone) {
+        pJob = NULL;
+    }
+    Nu_MutexUnlock(&pPool->lock);
+
+    return pJob;
+}
+
+/*
+ * Throw away a claimed job's results.
+ */
+static void Nu_FlushPoolRelease(NuFlushPool* pPool, NuFlushJob* pJob)
+{
+    Nu_Free(NULL, pJob->srcBuf);
+    Nu_Free(NULL, pJob->dstBuf);
+    pJob->srcBuf = pJob->dstBuf = NULL;
+
+    Nu_MutexLock(&pPool->lock);
+    Assert(pJob->state == kNuFlushJobDone);
+    Assert(pPool->bytesHeld >= pJob->memUsed);
+    pPool->bytesHeld -= pJob->memUsed;
+    pJob->memUsed = 0;
+    pJob->state = kNuFlushJobRetired;
+    Nu_CondBroadcast(&pPool->cond);
+    Nu_MutexUnlock(&pPool->lock);
+}
+
+/*
+ * Stop the workers and throw the whole thing away.
+ */
+static void Nu_FlushPoolDelete(NuArchive* pArchive, NuFlushPool* pPool)
+{
+    int i;
+
+    if (pPool == NULL)
+        return;
+
+    Nu_MutexLock(&pPool->lock);
+    pPool->stop = true;
+    Nu_CondBroadcast(&pPool->cond);
+    Nu_MutexUnlock(&pPool->lock);
+
+    for (i = 0; i < pPool->numWorkers; i++) {
+        if (pPool->workers[i].running)
+            Nu_WorkerJoin(&pPool->workers[i].worker);
+        if (pPool->workers[i].pScratch != NULL)
+            Nu_StatsMerge(pArchive, pPool->workers[i].pScratch);
+        (void) Nu_NuArchiveFree(pPool->workers[i].pScratch);
+    }
+    for (i = 0; i < pPool->numJobs; i++) {
+        Nu_Free(NULL, pPool->jobs[i].srcBuf);
+        Nu_Free(NULL, pPool->jobs[i].dstBuf);
+    }
+
+    Nu_CondDestroy(&pPool->cond);
+    Nu_MutexDestroy(&pPool->lock);
+    Nu_Free(pArchive, pPool->workers);
+    Nu_Free(pArchive, pPool->jobs);
+    Nu_Free(pArchive, pPool);
+}
+
+
+/*
+ * Start compressing the threads in the "new" record set, if more than
+ * one worker thread is allowed and there's something for them to do.
+ * Failing to start a thread isn't an error; the flush just does all the
+ * work itself.
+ *
+ * Follow with Nu_FlushPoolEnd.
+ */
+NuError Nu_FlushPoolBegin(NuArchive* pArchive)
+{
+    NuError err = kNuErrNone;
+    NuFlushPool* pPool = NULL;
+    const NuRecord* pRecord;
+    const NuThreadMod* pThreadMod;
+    int numWorkers, numJobs, numBusy, numCodecWorkers, i;
+
+    Assert(pArchive != NULL);
+    Assert(pArchive->pFlushPool == NULL);
+
+    numWorkers = Nu_GetWorkerCount(pArchive);
+    if (numWorkers <= 1)
+        goto bail;
+
+    numJobs = 0;
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        pThreadMod = pRecord->pThreadMods;
+        for ( ; pThreadMod != NULL; pThreadMod = pThreadMod->pNext) {
+            if (Nu_FlushPoolIsEligible(pArchive, pThreadMod))
+                numJobs++;
+        }
+    }
+    if (numJobs == 0)
+        goto bail;
+
+    pPool = Nu_Calloc(pArchive, sizeof(*pPool));
+    BailAlloc(pPool);
+    Nu_MutexInit(&pPool->lock);
+    Nu_CondInit(&pPool->cond);
+    pPool->jobs = Nu_Calloc(pArchive, numJobs * sizeof(*pPool->jobs));
+    BailAlloc(pPool->jobs);
+    pPool->workers = Nu_Calloc(pArchive,
+                        numWorkers * sizeof(*pPool->workers));
+    BailAlloc(pPool->workers);
+
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        pThreadMod = pRecord->pThreadMods;
+        for ( ; pThreadMod != NULL; pThreadMod = pThreadMod->pNext) {
+            NuFlushJob* pJob = &pPool->jobs[pPool->numJobs];
+
+            if (!Nu_FlushPoolIsEligible(pArchive, pThreadMod))
+                continue;
+            pJob->pRecord = pRecord;
+            pJob->pThreadMod = pThreadMod;
+            pJob->threadID = pThreadMod->entry.add.threadID;
+            pJob->dfltFormat = pThreadMod->entry.add.threadFormat;
+            pJob->fileType = pRecord->recFileType;
+            pJob->extraType = pRecord->recExtraType;
+            (void) Nu_DataSourceGetDirectInput(
+                    pThreadMod->entry.add.pDataSource, &pJob->pathnameUNI,
+                    &pJob->buffer, &pJob->bufLen);
+            pPool->numJobs++;
+        }
+    }
+    Assert(pPool->numJobs == numJobs);
+
+    /*
+     * Each worker gets its own codec state, set up the way the archive's
+     * is.  The worker count matters too, since the bzip2 and deflate
+     * compressors split large inputs differently when they can run in
+     * parallel.  The split doesn't depend on how many threads they get,
+     * only on whether they get more than one, so the archive's count is
+     * shared out among the workers that can be busy at once, with each
+     * getting at least two.  That keeps the output the same while
+     * holding the threads running at once to twice the archive's count,
+     * rather than its square.
+     */
+    numBusy = (numJobs < numWorkers) ? numJobs : numWorkers;
+    numCodecWorkers = numWorkers / numBusy;
+    if (numCodecWorkers < 2)
+        numCodecWorkers = 2;
+
+    for (i = 0; i < numWorkers; i++) {
+        NuFlushWorker* pWorker = &pPool->workers[i];
+        NuArchive* pScratch;
+
+        err = Nu_ScratchArchiveNew(&pWorker->pScratch);
+        BailError(err);
+        pPool->numWorkers++;
+        pWorker->pPool = pPool;
+
+        pScratch = pWorker->pScratch;
+        Nu_ScratchArchiveSync(pArchive, pScratch);
+        pScratch->valMimicSHK = pArchive->valMimicSHK;
+        pScratch->valWorkerThreads = numCodecWorkers;
+        pScratch->valCompressPolicy = pArchive->valCompressPolicy;
+        err = Nu_SetCompressPolicy(pScratch, pArchive->policyRules,
+                pArchive->numPolicyRules);
+        BailError(err);
+    }
+
+    for (i = 0; i < pPool->numWorkers; i++) {
+        NuFlushWorker* pWorker = &pPool->workers[i];
+
+        pWorker->running = Nu_WorkerTryStart(&pWorker->worker,
+                                Nu_FlushPoolWorker, pWorker);
+        if (!pWorker->running)
+            break;
+    }
+    if (i == 0) {
+        DBUG(("--- unable to start flush worker threads\n"));
+        goto bail;
+    }
+
+    pArchive->pFlushPool = pPool;
+    pPool = NULL;
+
+bail:
+    Nu_FlushPoolDelete(pArchive, pPool);
+    return err;
+}
+
+/*
+ * Shut down the pool, if there is one.  Anything the flush didn't get
+ * to is discarded.
+ */
+void Nu_FlushPoolEnd(NuArchive* pArchive)
+{
+    Nu_FlushPoolDelete(pArchive, pArchive->pFlushPool);
+    pArchive->pFlushPool = NULL;
+}
+
+
+/*
+ * Write a thread that the workers compressed to "dstFp", filling in
+ * "pThread" just like Nu_CompressToArchive does.  The threadMod's data
+ * source must be prepared, and "targetFormat" is what the flush decided
+ * to compress it with.
+ *
+ * Sets "*pWritten" if the thread was written.  If it wasn't, because the
+ * workers didn't get to it or came up with something different, the
+ * caller should compress it the usual way.
+ */
+NuError Nu_FlushPoolWriteThread(NuArchive* pArchive,
+    const NuThreadMod* pThreadMod, NuThreadFormat targetFormat,
+    NuProgressData* pProgressData, FILE* dstFp, NuThread* pThread,
+    Boolean* pWritten)
+{
+    NuError err = kNuErrNone, err2;
+    NuFlushPool* pPool = pArchive->pFlushPool;
+    NuFlushJob* pJob = NULL;
+    NuDataSource* pDataSource = pThreadMod->entry.add.pDataSource;
+    NuStraw* pStraw = NULL;
+    NuCompStream dstStream;
+    NuThreadFormat format;
+    const uint8_t* outBuf;
+    int i;
+
+    Assert(pThread != NULL);
+    Assert(pWritten != NULL);
+
+    *pWritten = false;
+    if (pPool == NULL)
+        return kNuErrNone;
+
+    /* the current record's jobs start at "firstLive" */
+    for (i = pPool->firstLive; i < pPool->numJobs; i++) {
+        if (pPool->jobs[i].pRecord != pPool->jobs[pPool->firstLive].pRecord)
+            break;
+        if (pPool->jobs[i].pThreadMod == pThreadMod) {
+            pJob = Nu_FlushPoolClaim(pPool, &pPool->jobs[i]);
+            break;
+        }
+    }
+    if (pJob == NULL)
+        return kNuErrNone;
+
+    if (!pJob->usable || pJob->format != targetFormat ||
+        pJob->srcLen != Nu_DataSourceGetDataLen(pDataSource))
+    {
+        DBUG(("--- flush pool result for '%s' not used\n",
+            pJob->pathnameUNI != NULL ? pJob->pathnameUNI : "(buffer)"));
+        goto bail;
+    }
+
+    if (pJob->dstBuf != NULL) {
+        format = pJob->format;
+        outBuf = pJob->dstBuf;
+    } else {
+        format = kNuThreadFormatUncompressed;
+        outBuf = pJob->srcBuf != NULL ? pJob->srcBuf : pJob->buffer;
+    }
+
+    pThread->thThreadClass = NuThreadIDGetClass(pJob->threadID);
+    pThread->thThreadKind = NuThreadIDGetKind(pJob->threadID);
+    pThread->thThreadFormat = format;
+    pThread->thThreadCRC = pJob->crc;
+    pThread->thThreadEOF = pJob->srcLen;
+    pThread->thCompThreadEOF = pJob->dstLen;
+    pThread->actualThreadEOF = pJob->srcLen;
+
+    /*
+     * The application gets the same progress messages it would have, so
+     * it still has a chance to skip or abort before anything is written.
+     */
+    err = Nu_StrawNew(pArchive, pDataSource, pProgressData, &pStraw);
+    BailError(err);
+    if (pProgressData != NULL) {
+        if (format != kNuThreadFormatUncompressed)
+            Nu_StrawSetProgressState(pStraw, kNuProgressCompressing);
+        else
+            Nu_StrawSetProgressState(pStraw, kNuProgressStoring);
+    }
+    err = Nu_ProgressDataCompressPrep(pArchive, pStraw, format, pJob->srcLen);
+    BailError(err);
+    if (pProgressData != NULL) {
+        pProgressData->uncompressedProgress = 0;
+        err = Nu_StrawSendProgressUpdate(pArchive, pStraw);
+        BailError(err);
+    }
+
+    Nu_WriteBehindOpenThread(pArchive, dstFp, &dstStream);
+    err = Nu_CompStreamWrite(&dstStream, outBuf, pJob->dstLen);
+    err2 = Nu_WriteBehindCloseThread(&dstStream);
+    if (err == kNuErrNone)
+        err = err2;
+    BailError(err);
+    *pWritten = true;
+
+    if (pProgressData != NULL) {
+        pProgressData->uncompressedProgress = pJob->srcLen;
+        (void) Nu_StrawSetProgressState(pStraw, kNuProgressDone);
+        err = Nu_StrawSendProgressUpdate(pArchive, pStraw);
+        BailError(err);
+    }
+
+bail:
+    Nu_FlushPoolRelease(pPool, pJob);
+    (void) Nu_StrawFree(pArchive, pStraw);
+    return err;
+}
+
+/*
+ * Called when the flush is done with a record, whether it was written or
+ * skipped.  Discards whatever the workers did for it that wasn't used.
+ */
+void Nu_FlushPoolRecordDone(NuArchive* pArchive, const NuRecord* pRecord)
+{
+    NuFlushPool* pPool = pArchive->pFlushPool;
+    NuFlushJob* pJob;
+
+    if (pPool == NULL)
+        return;
+
+    while (pPool->firstLive < pPool->numJobs &&
+           pPool->jobs[pPool->firstLive].pRecord == pRecord)
+    {
+        pJob = Nu_FlushPoolClaim(pPool, &pPool->jobs[pPool->firstLive]);
+        if (pJob != NULL)
+            Nu_FlushPoolRelease(pPool, pJob);
+        pPool->firstLive++;
+    }
+}
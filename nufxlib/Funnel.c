@@ -242,8 +242,24 @@ NuError Nu_FunnelNew(NuArchive* pArchive, NuDataSink* pDataSink,
 
     pFunnel = Nu_Calloc(pArchive, sizeof(*pFunnel));
     BailAlloc(pFunnel);
-    pFunnel->buffer = Nu_Malloc(pArchive, kNuFunnelBufSize);
-    BailAlloc(pFunnel->buffer);
+
+    /*
+     * When we're testing, the data goes nowhere, so there's no point in
+     * buffering it or figuring out what EOL conversion it would get.
+     * The expanders have already checked the CRC by the time it gets
+     * here, so all we do is count it for the progress meter.
+     */
+    if (pArchive->testMode &&
+        Nu_DataSinkGetType(pDataSink) == kNuDataSinkToVoid)
+    {
+        pFunnel->verifyOnly = true;
+        convertEOL = kNuConvertOff;
+        if (pProgress != NULL)
+            pProgress->expand.convertEOL = kNuConvertOff;
+    } else {
+        pFunnel->buffer = Nu_Malloc(pArchive, kNuFunnelBufSize);
+        BailAlloc(pFunnel->buffer);
+    }
 
     pFunnel->pDataSink = pDataSink;
     pFunnel->convertEOL = convertEOL;
@@ -318,23 +334,45 @@ void Nu_FunnelSetMaxOutput(NuFunnel* pFunnel, uint32_t maxBytes)
 static Boolean Nu_CheckHighASCII(const NuFunnel* pFunnel, const uint8_t* buffer,
     uint32_t count)
 {
-    Boolean isHighASCII;
+    const uint8_t* endPtr = buffer + count;
+#ifdef HAVE_SSE2
+    const __m128i space = _mm_set1_epi8(0x20);
+#else
+    const uint64_t highBits = Nu_ByteSplat(0x80);
+    uint64_t val;
+#endif
 
     Assert(buffer != NULL);
     Assert(count != 0);
     Assert(pFunnel->checkStripHighASCII);
 
-    isHighASCII = true;
-    while (count--) {
-        if ((*buffer & 0x80) == 0 && *buffer != 0x20) {
-            isHighASCII = false;
-            break;
+#ifdef HAVE_SSE2
+    while (endPtr - buffer >= 16) {
+        __m128i val = _mm_loadu_si128((const __m128i*) buffer);
+        if ((_mm_movemask_epi8(val) |
+             _mm_movemask_epi8(_mm_cmpeq_epi8(val, space))) != 0xffff)
+        {
+            return false;
         }
-        
+        buffer += 16;
+    }
+#else
+    /* anything without the high bit set, spaces included, gets a closer look */
+    while (endPtr - buffer >= 8) {
+        memcpy(&val, buffer, sizeof(val));
+        if ((val & highBits) != highBits)
+            break;
+        buffer += 8;
+    }
+#endif
+
+    while (buffer < endPtr) {
+        if ((*buffer & 0x80) == 0 && *buffer != 0x20)
+            return false;
         buffer++;
     }
 
-    return isHighASCII;
+    return true;
 }
 
 /*
@@ -374,6 +412,101 @@ static const char gNuIsBinary[256] = {
 
 #define kNuMaxUpperASCII    1       /* max #of binary chars per 100 bytes */
 #define kNuMinConvThreshold 40      /* min of 40 chars for auto-detect */
+
+#ifdef HAVE_SSE2
+/*
+ * Add up the 16 byte counters in "acc".
+ */
+static inline uint32_t Nu_SumByteCounters(__m128i acc)
+{
+    __m128i sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+
+    return _mm_cvtsi128_si32(sums) +
+           _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+}
+#endif
+
+/*
+ * Count up the binary characters, LFs, and CRs in the buffer, as seen
+ * through gNuIsBinary.  If "isHighASCII" is set, the high bit is
+ * stripped from each character first.
+ *
+ * With SSE2 the table is replaced by range checks: a character is binary
+ * if it's a control character other than BS, TAB, LF, FF, or CR, if it's
+ * DEL, or if it's in 0x80-0x9f.
+ */
+static void Nu_CountTextChars(const uint8_t* buffer, uint32_t count,
+    Boolean isHighASCII, uint32_t* pNumBinary, uint32_t* pNumLF,
+    uint32_t* pNumCR)
+{
+    const uint8_t* endPtr = buffer + count;
+    uint32_t numBinary = 0, numLF = 0, numCR = 0;
+    uint8_t val;
+
+#ifdef HAVE_SSE2
+    const __m128i mask = _mm_set1_epi8(isHighASCII ? 0x7f : (char) 0xff);
+    const __m128i topBits = _mm_set1_epi8((char) 0xe0);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i upperCtrl = _mm_set1_epi8((char) 0x80);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i bs = _mm_set1_epi8(0x08);
+    const __m128i tab = _mm_set1_epi8(0x09);
+    const __m128i ff = _mm_set1_epi8(0x0c);
+    const __m128i lf = _mm_set1_epi8(kNuCharLF);
+    const __m128i cr = _mm_set1_epi8(kNuCharCR);
+
+    while (endPtr - buffer >= 16) {
+        __m128i binAcc = zero, lfAcc = zero, crAcc = zero;
+        int rounds;
+
+        /* the per-byte counters are good for 255 rounds */
+        for (rounds = 0; rounds < 255 && endPtr - buffer >= 16; rounds++) {
+            __m128i chars, top, isLF, isCR, textCtrl, isBinary;
+
+            chars = _mm_and_si128(_mm_loadu_si128((const __m128i*) buffer),
+                        mask);
+            top = _mm_and_si128(chars, topBits);
+            isLF = _mm_cmpeq_epi8(chars, lf);
+            isCR = _mm_cmpeq_epi8(chars, cr);
+            textCtrl = _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(chars, bs),
+                                     _mm_cmpeq_epi8(chars, tab)),
+                        _mm_or_si128(_mm_or_si128(isLF, isCR),
+                                     _mm_cmpeq_epi8(chars, ff)));
+            isBinary = _mm_or_si128(
+                        _mm_andnot_si128(textCtrl, _mm_cmpeq_epi8(top, zero)),
+                        _mm_or_si128(_mm_cmpeq_epi8(top, upperCtrl),
+                                     _mm_cmpeq_epi8(chars, del)));
+
+            /* matches are 0xff, i.e. -1 */
+            binAcc = _mm_sub_epi8(binAcc, isBinary);
+            lfAcc = _mm_sub_epi8(lfAcc, isLF);
+            crAcc = _mm_sub_epi8(crAcc, isCR);
+            buffer += 16;
+        }
+
+        numBinary += Nu_SumByteCounters(binAcc);
+        numLF += Nu_SumByteCounters(lfAcc);
+        numCR += Nu_SumByteCounters(crAcc);
+    }
+#endif
+
+    while (buffer < endPtr) {
+        val = *buffer++;
+        if (isHighASCII)
+            val &= 0x7f;
+        if (gNuIsBinary[val])
+            numBinary++;
+        if (val == kNuCharLF)
+            numLF++;
+        if (val == kNuCharCR)
+            numCR++;
+    }
+
+    *pNumBinary = numBinary;
+    *pNumLF = numLF;
+    *pNumCR = numCR;
+}
 /*
  * Decide, based on the contents of the buffer, whether we should do an
  * EOL conversion on the data.
@@ -398,9 +531,8 @@ static const char gNuIsBinary[256] = {
 static NuValue Nu_DetermineConversion(NuFunnel* pFunnel, const uint8_t* buffer,
     uint32_t count)
 {
-    uint32_t bufCount, numBinary, numLF, numCR;
+    uint32_t numBinary, numLF, numCR;
     Boolean isHighASCII;
-    uint8_t val;
 
     if (count < kNuMinConvThreshold)
         return kNuConvertOff;
@@ -417,19 +549,7 @@ static NuValue Nu_DetermineConversion(NuFunnel* pFunnel, const uint8_t* buffer,
         DBUG(("+++ not even checking isHighASCII\n"));
     }
 
-    bufCount = count;
-    numBinary = numLF = numCR = 0;
-    while (bufCount--) {
-        val = *buffer++;
-        if (isHighASCII)
-            val &= 0x7f;
-        if (gNuIsBinary[val])
-            numBinary++;
-        if (val == kNuCharLF)
-            numLF++;
-        if (val == kNuCharCR)
-            numCR++;
-    }
+    Nu_CountTextChars(buffer, count, isHighASCII, &numBinary, &numLF, &numCR);
 
     /* if #found is > #allowed, it's a binary file */
     if (count < 100) {
@@ -474,8 +594,8 @@ static NuValue Nu_DetermineConversion(NuFunnel* pFunnel, const uint8_t* buffer,
  * This is either a Funnel function or a DataSink function, depending on
  * your perspective.
  */
-static inline void Nu_FunnelPutBlock(NuFunnel* pFunnel, const uint8_t* buf,
-    uint32_t len)
+static inline void Nu_FunnelPutBlock(NuArchive* pArchive, NuFunnel* pFunnel,
+    const uint8_t* buf, uint32_t len)
 {
     Assert(pFunnel != NULL);
     Assert(pFunnel->pDataSink != NULL);
@@ -494,31 +614,122 @@ static inline void Nu_FunnelPutBlock(NuFunnel* pFunnel, const uint8_t* buf,
     pFunnel->outCount += len;
 #endif
 
-    Nu_DataSinkPutBlock(pFunnel->pDataSink, buf, len);
+    Nu_DataSinkPutBlock(pArchive, pFunnel->pDataSink, buf, len);
 }
 
 
+/* converted text is gathered up in this much stack space */
+#define kNuFunnelConvBufSize    4096
+
 /*
- * Output the EOL marker requested for this system.
+ * Store the EOL marker requested for this system in "buf", which must
+ * have room for two bytes.  Returns the number of bytes stored.
  */
-static inline void Nu_PutEOL(NuFunnel* pFunnel)
+static inline uint32_t Nu_StoreEOL(const NuFunnel* pFunnel, uint8_t* buf)
 {
-    uint8_t ch;
-
     if (pFunnel->convertEOLTo == kNuEOLCR) {
-        ch = kNuCharCR;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
+        buf[0] = kNuCharCR;
+        return 1;
     } else if (pFunnel->convertEOLTo == kNuEOLLF) {
-        ch = kNuCharLF;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
+        buf[0] = kNuCharLF;
+        return 1;
     } else if (pFunnel->convertEOLTo == kNuEOLCRLF) {
-        ch = kNuCharCR;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
-        ch = kNuCharLF;
-        Nu_FunnelPutBlock(pFunnel, &ch, 1);
+        buf[0] = kNuCharCR;
+        buf[1] = kNuCharLF;
+        return 2;
     } else {
         Assert(0);
+        return 0;
+    }
+}
+
+/*
+ * Return the number of bytes at the start of "buffer" that aren't CR or
+ * LF once they've been ANDed with "mask".
+ */
+static inline uint32_t Nu_FindEOLChar(const uint8_t* buffer, uint32_t count,
+    uint8_t mask)
+{
+    const uint8_t* ptr = buffer;
+    const uint8_t* endPtr = buffer + count;
+    uint8_t uch;
+
+#ifdef HAVE_SSE2
+    const __m128i charMask = _mm_set1_epi8((char) mask);
+    const __m128i lf = _mm_set1_epi8(kNuCharLF);
+    const __m128i cr = _mm_set1_epi8(kNuCharCR);
+
+    while (endPtr - ptr >= 16) {
+        __m128i chars = _mm_and_si128(_mm_loadu_si128((const __m128i*) ptr),
+                            charMask);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chars, lf),
+                                    _mm_cmpeq_epi8(chars, cr));
+        if (_mm_movemask_epi8(hits) != 0)
+            break;
+        ptr += 16;
+    }
+#else
+    const uint64_t charMask = Nu_ByteSplat(mask);
+    const uint64_t lf = Nu_ByteSplat(kNuCharLF);
+    const uint64_t cr = Nu_ByteSplat(kNuCharCR);
+    uint64_t chars;
+
+    while (endPtr - ptr >= 8) {
+        memcpy(&chars, ptr, sizeof(chars));
+        chars &= charMask;
+        if (Nu_HasZeroByte(chars ^ lf) || Nu_HasZeroByte(chars ^ cr))
+            break;
+        ptr += 8;
+    }
+#endif
+
+    while (ptr < endPtr) {
+        uch = *ptr & mask;
+        if (uch == kNuCharLF || uch == kNuCharCR)
+            break;
+        ptr++;
+    }
+    return (uint32_t) (ptr - buffer);
+}
+
+/*
+ * Copy "count" bytes from "src" to "dst", ANDing them with "mask".
+ */
+static inline void Nu_CopyMasked(uint8_t* dst, const uint8_t* src,
+    uint32_t count, uint8_t mask)
+{
+    const uint8_t* endPtr = src + count;
+#ifdef HAVE_SSE2
+    const __m128i charMask = _mm_set1_epi8((char) mask);
+#else
+    const uint64_t charMask = Nu_ByteSplat(mask);
+    uint64_t chars;
+#endif
+
+    if (mask == 0xff) {
+        memcpy(dst, src, count);
+        return;
+    }
+
+#ifdef HAVE_SSE2
+    while (endPtr - src >= 16) {
+        _mm_storeu_si128((__m128i*) dst, _mm_and_si128(
+                _mm_loadu_si128((const __m128i*) src), charMask));
+        src += 16;
+        dst += 16;
     }
+#else
+    while (endPtr - src >= 8) {
+        memcpy(&chars, src, sizeof(chars));
+        chars &= charMask;
+        memcpy(dst, &chars, sizeof(chars));
+        src += 8;
+        dst += 8;
+    }
+#endif
+
+    while (src < endPtr)
+        *dst++ = *src++ & mask;
 }
 
 /*
@@ -529,8 +740,8 @@ static inline void Nu_PutEOL(NuFunnel* pFunnel)
  * that looks like an EOL mark and convert it.  Doesn't matter if it's
  * CR, LF, or CRLF; all three get converted to whatever the system uses.
  */
-static NuError Nu_FunnelWriteConvert(NuFunnel* pFunnel, const uint8_t* buffer,
-    uint32_t count)
+static NuError Nu_FunnelWriteConvert(NuArchive* pArchive, NuFunnel* pFunnel,
+    const uint8_t* buffer, uint32_t count)
 {
     NuError err = kNuErrNone;
     uint32_t progressCount = count;
@@ -574,12 +785,14 @@ static NuError Nu_FunnelWriteConvert(NuFunnel* pFunnel, const uint8_t* buffer,
 
     if (pFunnel->convertEOL == kNuConvertOff) {
         /* write it straight */
-        Nu_FunnelPutBlock(pFunnel, buffer, count);
+        Nu_FunnelPutBlock(pArchive, pFunnel, buffer, count);
     } else {
         /* do the EOL conversion and optional high-bit stripping */
         Boolean lastCR = pFunnel->lastCR;   /* make local copy */
-        uint8_t uch;
-        int mask;
+        uint8_t convBuf[kNuFunnelConvBufSize];
+        uint32_t convCount = 0;
+        uint32_t span, chunk;
+        uint8_t uch, mask;
 
         if (pFunnel->doStripHighASCII)
             mask = 0x7f;
@@ -587,25 +800,45 @@ static NuError Nu_FunnelWriteConvert(NuFunnel* pFunnel, const uint8_t* buffer,
             mask = 0xff;
 
         /*
-         * We could get a significant speed improvement here by writing
-         * non-EOL chars as a larger block instead of single bytes.
+         * Copy everything between EOL markers through in bulk, and only
+         * look at the CRs and LFs individually.  The output is gathered
+         * into convBuf so we're not writing a line at a time.
          */
-        while (count--) {
-            uch = (*buffer) & mask;
-
-            if (uch == kNuCharCR) {
-                Nu_PutEOL(pFunnel);
-                lastCR = true;
-            } else if (uch == kNuCharLF) {
-                if (!lastCR)
-                    Nu_PutEOL(pFunnel);
-                lastCR = false;
-            } else {
-                Nu_FunnelPutBlock(pFunnel, &uch, 1);
+        while (count) {
+            span = Nu_FindEOLChar(buffer, count, mask);
+            if (span != 0)
                 lastCR = false;
+            count -= span;
+            while (span) {
+                if (convCount == kNuFunnelConvBufSize) {
+                    Nu_FunnelPutBlock(pArchive, pFunnel, convBuf, convCount);
+                    convCount = 0;
+                }
+                chunk = kNuFunnelConvBufSize - convCount;
+                if (chunk > span)
+                    chunk = span;
+                Nu_CopyMasked(convBuf + convCount, buffer, chunk, mask);
+                convCount += chunk;
+                buffer += chunk;
+                span -= chunk;
+            }
+            if (!count)
+                break;
+
+            /* CR always ends a line; LF does unless it follows a CR */
+            uch = *buffer++ & mask;
+            count--;
+            if (uch == kNuCharCR || !lastCR) {
+                if (convCount > kNuFunnelConvBufSize - 2) {
+                    Nu_FunnelPutBlock(pArchive, pFunnel, convBuf, convCount);
+                    convCount = 0;
+                }
+                convCount += Nu_StoreEOL(pFunnel, convBuf + convCount);
             }
-            buffer++;
+            lastCR = (uch == kNuCharCR);
         }
+        if (convCount)
+            Nu_FunnelPutBlock(pArchive, pFunnel, convBuf, convCount);
         pFunnel->lastCR = lastCR;   /* save copy */
 
     }
@@ -633,8 +866,14 @@ NuError Nu_FunnelFlush(NuArchive* pArchive, NuFunnel* pFunnel)
     if (!pFunnel->bufCount)
         goto bail;
 
-    err = Nu_FunnelWriteConvert(pFunnel, pFunnel->buffer, pFunnel->bufCount);
-    BailError(err);
+    if (pFunnel->verifyOnly) {
+        if (pFunnel->pProgress != NULL)
+            pFunnel->pProgress->uncompressedProgress += pFunnel->bufCount;
+    } else {
+        err = Nu_FunnelWriteConvert(pArchive, pFunnel, pFunnel->buffer,
+                pFunnel->bufCount);
+        BailError(err);
+    }
 
     pFunnel->bufCount = 0;
     err = Nu_FunnelSendProgressUpdate(pArchive, pFunnel);
@@ -656,6 +895,17 @@ NuError Nu_FunnelWrite(NuArchive* pArchive, NuFunnel* pFunnel,
 
     /*pFunnel->inCount += count;*/
 
+    /*
+     * If we're just testing, "bufCount" is the number of bytes we've
+     * seen since the last progress update.
+     */
+    if (pFunnel->verifyOnly) {
+        pFunnel->bufCount += count;
+        if (pFunnel->bufCount >= kNuVerifyProgressSize)
+            err = Nu_FunnelFlush(pArchive, pFunnel);
+        goto bail;
+    }
+
     /*
      * If it will fit into the buffer, just copy it in.
      */
@@ -684,7 +934,7 @@ NuError Nu_FunnelWrite(NuArchive* pArchive, NuFunnel* pFunnel,
 
         if (count >= kNuFunnelBufSize / 4) {
             /* it's more than 25% of the buffer, just write it now */
-            err = Nu_FunnelWriteConvert(pFunnel, buffer, count);
+            err = Nu_FunnelWriteConvert(pArchive, pFunnel, buffer, count);
             BailError(err);
         } else {
             memcpy(pFunnel->buffer, buffer, count);
@@ -803,7 +1053,9 @@ NuError Nu_StrawFree(NuArchive* pArchive, NuStraw* pStraw)
 NuError Nu_StrawSetProgressState(NuStraw* pStraw, NuProgressState state)
 {
     Assert(pStraw != NULL);
-    Assert(pStraw->pProgress != NULL);
+
+    if (pStraw->pProgress == NULL)
+        return kNuErrNone;
 
     pStraw->pProgress->state = state;
 
@@ -846,11 +1098,14 @@ NuError Nu_StrawRead(NuArchive* pArchive, NuStraw* pStraw, uint8_t* buffer,
     Assert(buffer != NULL);
     Assert(len > 0);
 
+    if (pStraw->abortFunc != NULL && (*pStraw->abortFunc)(pStraw->abortArg))
+        return kNuErrAborted;
+
     /*
      * No buffering going on, so this is straightforward.
      */
 
-    err = Nu_DataSourceGetBlock(pStraw->pDataSource, buffer, len);
+    err = Nu_DataSourceGetBlock(pArchive, pStraw->pDataSource, buffer, len);
     BailError(err);
 
     /*
@@ -899,6 +1154,6 @@ NuError Nu_StrawRewind(NuArchive* pArchive, NuStraw* pStraw)
     pStraw->lastProgress = 0;
     pStraw->lastDisplayed = 0;
 
-    return Nu_DataSourceRewind(pStraw->pDataSource);
+    return Nu_DataSourceRewind(pArchive, pStraw->pDataSource);
 }
 
@@ -157,14 +157,17 @@ typedef struct LZCState {
 
     /* compression */
     NuStraw* pStraw;
-    FILE* outfp;
+    NuCompStream* pOutStream;
     long uncompRemaining;
 
     /* expansion */
-    FILE* infp;
+    NuCompStream* pInStream;
     NuFunnel* pFunnel;
     uint16_t* pCrc;
     long compRemaining;
+    int readFailed;
+    char* token;                /* string buffer to build token */
+    int maxtoklen;
 
 
     /*
@@ -221,6 +224,33 @@ typedef struct LZCState {
     UCHAR inbuf[MAXBITS];       /* nextcode */
 } LZCState;
 
+/*
+ * Tables that are kept in the archive between calls, so we don't have to
+ * allocate (up to) a few hundred KB for every thread.  Nu_LZC_alloc_tables
+ * grows them as needed; they never shrink.
+ */
+typedef struct LZCTables {
+    char FAR *sfx;
+
+    #if (SPLIT_PFX)
+        CODE FAR *pfx[2];
+    #else
+        CODE FAR *pfx;
+    #endif
+
+    #if (SPLIT_HT)
+        CODE FAR *ht[2];
+    #else
+        CODE FAR *ht;
+    #endif
+
+    INTCODE oldmaxcode;
+    HASH oldhashsize;
+
+    char* token;
+    int maxtoklen;
+} LZCTables;
+
 
 /*
  * The following two parameter tables are the hash table sizes and
@@ -415,6 +445,102 @@ static int Nu_LZC_alloc_tables(LZCState* pLzcState, INTCODE newmaxcode,
 # endif
 
 
+/*
+ * Pick up the tables left behind by a previous call, allocating the
+ * holder if this is the first time through.
+ */
+static NuError Nu_LZCLoadTables(LZCState* pLzcState)
+{
+    NuArchive* pArchive = pLzcState->pArchive;
+    LZCTables* pTables;
+
+    if (pArchive->lzcState == NULL) {
+        pArchive->lzcState = Nu_Calloc(pArchive, sizeof(LZCTables));
+        if (pArchive->lzcState == NULL)
+            return kNuErrMalloc;
+    }
+    pTables = pArchive->lzcState;
+
+    pLzcState->sfx = pTables->sfx;
+#if (SPLIT_PFX)
+    pLzcState->pfx[0] = pTables->pfx[0];
+    pLzcState->pfx[1] = pTables->pfx[1];
+#else
+    pLzcState->pfx = pTables->pfx;
+#endif
+#if (SPLIT_HT)
+    pLzcState->ht[0] = pTables->ht[0];
+    pLzcState->ht[1] = pTables->ht[1];
+#else
+    pLzcState->ht = pTables->ht;
+#endif
+    pLzcState->oldmaxcode = pTables->oldmaxcode;
+    pLzcState->oldhashsize = pTables->oldhashsize;
+    pLzcState->token = pTables->token;
+    pLzcState->maxtoklen = pTables->maxtoklen;
+
+    return kNuErrNone;
+}
+
+/*
+ * Stash the tables in the archive for next time.
+ */
+static void Nu_LZCSaveTables(LZCState* pLzcState)
+{
+    LZCTables* pTables = pLzcState->pArchive->lzcState;
+
+    Assert(pTables != NULL);
+
+    pTables->sfx = pLzcState->sfx;
+#if (SPLIT_PFX)
+    pTables->pfx[0] = pLzcState->pfx[0];
+    pTables->pfx[1] = pLzcState->pfx[1];
+#else
+    pTables->pfx = pLzcState->pfx;
+#endif
+#if (SPLIT_HT)
+    pTables->ht[0] = pLzcState->ht[0];
+    pTables->ht[1] = pLzcState->ht[1];
+#else
+    pTables->ht = pLzcState->ht;
+#endif
+    pTables->oldmaxcode = pLzcState->oldmaxcode;
+    pTables->oldhashsize = pLzcState->oldhashsize;
+    pTables->token = pLzcState->token;
+    pTables->maxtoklen = pLzcState->maxtoklen;
+}
+
+/*
+ * Free the tables held by an archive.
+ */
+void Nu_FreeLZCState(void* lzcState)
+{
+    NuArchive* pArchive = NULL;     /* for free_array */
+    LZCTables* pTables = lzcState;
+
+    if (pTables == NULL)
+        return;
+
+#if (SPLIT_HT)
+    free_array(CODE,pTables->ht[1], 0);
+    free_array(CODE,pTables->ht[0], 0);
+#else
+    free_array(CODE,pTables->ht, 0);
+#endif
+
+#if (SPLIT_PFX)
+    free_array(CODE,pTables->pfx[1], 128);
+    free_array(CODE,pTables->pfx[0], 128);
+#else
+    free_array(CODE,pTables->pfx, 256);
+#endif
+    free_array(char,pTables->sfx, 256);
+
+    Nu_Free(NULL, pTables->token);
+    Nu_Free(NULL, pTables);
+}
+
+
 /*
  * ===========================================================================
  *      Compression
@@ -495,12 +621,12 @@ static void Nu_LZC_putcode(LZCState* pLzcState, INTCODE code, register int bits)
         if (bits == 0) {
             /* bits == 0 means EOF, write the rest of the buffer. */
             if (pLzcState->offset > 0) {
-                fwrite(pLzcState->outbuf,1,(pLzcState->offset +7) >> 3, pLzcState->outfp);
+                Nu_CompStreamWrite(pLzcState->pOutStream, pLzcState->outbuf,
+                    (pLzcState->offset +7) >> 3);
                 pLzcState->bytes_out += ((pLzcState->offset +7) >> 3);
             }
             pLzcState->offset = 0;
             pLzcState->oldbits = 0;
-            fflush(pLzcState->outfp);
             return;
         }
         else {
@@ -509,7 +635,8 @@ static void Nu_LZC_putcode(LZCState* pLzcState, INTCODE code, register int bits)
              * until after it has read a buffer full.
              */
             if (pLzcState->offset > 0) {
-                fwrite(pLzcState->outbuf, 1, pLzcState->oldbits, pLzcState->outfp);
+                Nu_CompStreamWrite(pLzcState->pOutStream, pLzcState->outbuf,
+                    pLzcState->oldbits);
                 pLzcState->bytes_out += pLzcState->oldbits;
                 pLzcState->offset = 0;
             }
@@ -536,7 +663,7 @@ static void Nu_LZC_putcode(LZCState* pLzcState, INTCODE code, register int bits)
     }
     if ((pLzcState->offset += bits) == (bits << 3)) {
         pLzcState->bytes_out += bits;
-        fwrite(pLzcState->outbuf,1,bits,pLzcState->outfp);
+        Nu_CompStreamWrite(pLzcState->pOutStream, pLzcState->outbuf, bits);
         pLzcState->offset = 0;
     }
     return;
@@ -582,7 +709,7 @@ static void Nu_LZC_compress(LZCState* pLzcState, uint32_t* pDstLen)
     register INTCODE code;
     HASH hashf[256];
 
-    Assert(pLzcState->outfp != NULL);
+    Assert(pLzcState->pOutStream != NULL);
 
     pLzcState->maxcode = Maxcode(pLzcState->maxbits);
     pLzcState->hashsize = Hashsize(pLzcState->maxbits);
@@ -629,10 +756,11 @@ static void Nu_LZC_compress(LZCState* pLzcState, uint32_t* pDstLen)
     * string, or we find an unused entry (which indicates a new string).
     */
     if (1 /*!nomagic*/) {
-        putc(gNu_magic_header[0], pLzcState->outfp);
-        putc(gNu_magic_header[1], pLzcState->outfp);
-        putc((char)(pLzcState->maxbits | pLzcState->block_compress), pLzcState->outfp);
-        if(ferror(pLzcState->outfp)){  /* check it on entry */
+        Nu_CompStreamPutc(pLzcState->pOutStream, gNu_magic_header[0]);
+        Nu_CompStreamPutc(pLzcState->pOutStream, gNu_magic_header[1]);
+        Nu_CompStreamPutc(pLzcState->pOutStream,
+            (char)(pLzcState->maxbits | pLzcState->block_compress));
+        if (Nu_CompStreamGetError(pLzcState->pOutStream)) { /* check on entry */
             pLzcState->exit_stat = WRITEERR;
             return;
         }
@@ -753,8 +881,9 @@ static void Nu_LZC_compress(LZCState* pLzcState, uint32_t* pDstLen)
 /*
  * NufxLib interface to LZC compression.
  */
-static NuError Nu_CompressLZC(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc, int maxbits)
+static NuError Nu_CompressLZC(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc,
+    int maxbits)
 {
     NuError err = kNuErrNone;
     LZCState lzcState;
@@ -762,7 +891,7 @@ static NuError Nu_CompressLZC(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
     memset(&lzcState, 0, sizeof(lzcState));
     lzcState.pArchive = pArchive;
     lzcState.pStraw = pStraw;
-    lzcState.outfp = fp;
+    lzcState.pOutStream = pStream;
     lzcState.uncompRemaining = srcLen;
 
     if (pCrc == NULL) {
@@ -775,24 +904,17 @@ static NuError Nu_CompressLZC(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
     lzcState.maxbits = maxbits;
     lzcState.block_compress = BLOCK_MASK;     /* enabled */
 
+    err = Nu_LZCLoadTables(&lzcState);
+    if (err != kNuErrNone)
+        return err;
+
     Nu_LZC_compress(&lzcState, pDstLen);
     err = lzcState.exit_stat;
+    if (err == kNuErrNone)
+        err = Nu_CompStreamGetError(pStream);   /* catch failed writes */
     DBUG(("+++ LZC_compress returned with %d\n", err));
 
-#if (SPLIT_HT)
-    free_array(CODE,lzcState.ht[1], 0);
-    free_array(CODE,lzcState.ht[0], 0);
-#else
-    free_array(CODE,lzcState.ht, 0);
-#endif
-
-#if (SPLIT_PFX)
-    free_array(CODE,lzcState.pfx[1], 128);
-    free_array(CODE,lzcState.pfx[0], 128);
-#else
-    free_array(CODE,lzcState.pfx, 256);
-#endif
-    free_array(char,lzcState.sfx, 256);
+    Nu_LZCSaveTables(&lzcState);
 
     if (pCrc != NULL)
         *pCrc = lzcState.crc;
@@ -800,16 +922,18 @@ static NuError Nu_CompressLZC(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
     return err;
 }
 
-NuError Nu_CompressLZC12(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+NuError Nu_CompressLZC12(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
-    return Nu_CompressLZC(pArchive, pStraw, fp, srcLen, pDstLen, pCrc, 12);
+    return Nu_CompressLZC(pArchive, pStraw, pStream, srcLen, pDstLen, pCrc,
+            12);
 }
 
-NuError Nu_CompressLZC16(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+NuError Nu_CompressLZC16(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
-    return Nu_CompressLZC(pArchive, pStraw, fp, srcLen, pDstLen, pCrc, 16);
+    return Nu_CompressLZC(pArchive, pStraw, pStream, srcLen, pDstLen, pCrc,
+            (int) pArchive->valLZCBits);
 }
 
 
@@ -870,9 +994,13 @@ static int Nu_LZC_nextcode(LZCState* pLzcState, INTCODE* codeptr)
             getSize = pLzcState->compRemaining;
         if (!getSize)       /* act like EOF */
             return FALSE;
-        pLzcState->size = fread(pLzcState->inbuf, 1, getSize, pLzcState->infp) << 3;
-        if (pLzcState->size <= 0 || ferror(pLzcState->infp))
+        if (Nu_CompStreamRead(pLzcState->pInStream, pLzcState->inbuf,
+                getSize) != kNuErrNone)
+        {
+            pLzcState->readFailed = TRUE;
             return(FALSE);
+        }
+        pLzcState->size = getSize << 3;
         pLzcState->compRemaining -= getSize;
         pLzcState->offset = shift = 0;
     }
@@ -896,11 +1024,11 @@ static void Nu_LZC_decompress(LZCState* pLzcState, uint32_t compressedLen)
     char sufxchar = 0;
     INTCODE savecode;
     FLAG fulltable = FALSE, cleartable;
-    /*static*/ char *token= NULL;         /* String buffer to build token */
-    /*static*/ int maxtoklen = MAXTOKLEN;
+    char *token;                /* String buffer to build token */
+    int maxtoklen;
     int flags;
 
-    Assert(pLzcState->infp != NULL);
+    Assert(pLzcState->pInStream != NULL);
 
     pLzcState->exit_stat = OK;
 
@@ -915,14 +1043,14 @@ static void Nu_LZC_decompress(LZCState* pLzcState, uint32_t compressedLen)
     /*
      * This comes out of "compress.c" rather than "compapi.c".
      */
-    if ((getc(pLzcState->infp)!=(gNu_magic_header[0] & 0xFF))
-        || (getc(pLzcState->infp)!=(gNu_magic_header[1] & 0xFF)))
+    if ((Nu_CompStreamGetc(pLzcState->pInStream)!=(gNu_magic_header[0] & 0xFF))
+        || (Nu_CompStreamGetc(pLzcState->pInStream)!=(gNu_magic_header[1] & 0xFF)))
     {
         DBUG(("not in compressed format\n"));
         pLzcState->exit_stat = kNuErrBadData;
         return;
     }
-    flags = getc(pLzcState->infp);    /* set -b from file */
+    flags = Nu_CompStreamGetc(pLzcState->pInStream);  /* set -b from file */
     pLzcState->block_compress = flags & BLOCK_MASK;
     pLzcState->maxbits = flags & BIT_MASK;
     if(pLzcState->maxbits > MAXBITS) {
@@ -934,12 +1062,17 @@ static void Nu_LZC_decompress(LZCState* pLzcState, uint32_t compressedLen)
 
     pLzcState->compRemaining -= 3;
 
-    /* Initialze the token buffer. */
-    token = (char*)Nu_Malloc(pArchive, maxtoklen);
-    if (token == NULL) {
-        pLzcState->exit_stat = NOMEM;
-        return;
+    /* Initialze the token buffer, unless we have one from last time. */
+    if (pLzcState->token == NULL) {
+        pLzcState->maxtoklen = MAXTOKLEN;
+        pLzcState->token = (char*)Nu_Malloc(pArchive, pLzcState->maxtoklen);
+        if (pLzcState->token == NULL) {
+            pLzcState->exit_stat = NOMEM;
+            return;
+        }
     }
+    token = pLzcState->token;
+    maxtoklen = pLzcState->maxtoklen;
 
     if (Nu_LZC_alloc_tables(pLzcState, pLzcState->maxcode = ~(~(INTCODE)0 << pLzcState->maxbits),0)) /* exit_stat already set */
         return;
@@ -1000,11 +1133,15 @@ static void Nu_LZC_decompress(LZCState* pLzcState, uint32_t compressedLen)
             }
             #endif
             if (i >= maxtoklen) {
+                char* newToken;
+
                 maxtoklen *= 2;   /* double the size of the token buffer */
-                if ((token = Nu_Realloc(pArchive, token, maxtoklen)) == NULL) {
+                if ((newToken = Nu_Realloc(pArchive, token, maxtoklen)) == NULL) {
                     pLzcState->exit_stat = TOKTOOBIG;
                     return;
                 }
+                pLzcState->token = token = newToken;
+                pLzcState->maxtoklen = maxtoklen;
             }
             token[i++] = suffix(code);
             code = (INTCODE)prefix(code);
@@ -1039,9 +1176,7 @@ static void Nu_LZC_decompress(LZCState* pLzcState, uint32_t compressedLen)
             pLzcState->nextfree = code;
         }
     } while (Nu_LZC_nextcode(pLzcState, &savecode));
-    pLzcState->exit_stat = (ferror(pLzcState->infp))? READERR : OK;
-
-    Nu_Free(pArchive, token);
+    pLzcState->exit_stat = (pLzcState->readFailed)? READERR : OK;
     return ;
 }
 
@@ -1050,14 +1185,15 @@ static void Nu_LZC_decompress(LZCState* pLzcState, uint32_t compressedLen)
  * NufxLib interface to LZC expansion.
  */
 NuError Nu_ExpandLZC(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc)
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
     LZCState lzcState;
 
     memset(&lzcState, 0, sizeof(lzcState));
     lzcState.pArchive = pArchive;
-    lzcState.infp = infp;
+    lzcState.pInStream = pStream;
     lzcState.pFunnel = pFunnel;
 
     if (pCrc == NULL) {
@@ -1067,24 +1203,15 @@ NuError Nu_ExpandLZC(NuArchive* pArchive, const NuRecord* pRecord,
         lzcState.crc = *pCrc;
     }
 
+    err = Nu_LZCLoadTables(&lzcState);
+    if (err != kNuErrNone)
+        return err;
+
     Nu_LZC_decompress(&lzcState, pThread->thCompThreadEOF);
     err = lzcState.exit_stat;
     DBUG(("+++ LZC_decompress returned with %d\n", err));
 
-#if (SPLIT_HT)
-    free_array(CODE,lzcState.ht[1], 0);
-    free_array(CODE,lzcState.ht[0], 0);
-#else
-    free_array(CODE,lzcState.ht, 0);
-#endif
-
-#if (SPLIT_PFX)
-    free_array(CODE,lzcState.pfx[1], 128);
-    free_array(CODE,lzcState.pfx[0], 128);
-#else
-    free_array(CODE,lzcState.pfx, 256);
-#endif
-    free_array(char,lzcState.sfx, 256);
+    Nu_LZCSaveTables(&lzcState);
 
     if (pCrc != NULL)
         *pCrc = lzcState.crc;
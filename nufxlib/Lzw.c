@@ -175,6 +175,83 @@ static NuError Nu_AllocLZWCompressState(NuArchive* pArchive)
 }
 
 
+/*
+ * Find the first byte at or after "inPtr" that the RLE compressor needs to
+ * look at: the start of a run (it matches the byte after it) or an escape
+ * character.  Everything before it is emitted unchanged.  Never returns
+ * more than endPtr-1, so the caller always has a byte to work on.
+ */
+static inline const uint8_t* Nu_FindRLEBreak(const uint8_t* inPtr,
+    const uint8_t* endPtr)
+{
+#ifdef HAVE_SSE2
+    const __m128i escape = _mm_set1_epi8((char) kNuRLEDefaultEscape);
+
+    while (endPtr - inPtr > 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i*) inPtr);
+        __m128i next = _mm_loadu_si128((const __m128i*) (inPtr + 1));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(cur, next),
+                                    _mm_cmpeq_epi8(cur, escape));
+        if (_mm_movemask_epi8(hits) != 0)
+            break;
+        inPtr += 16;
+    }
+#else
+    const uint64_t escape = Nu_ByteSplat(kNuRLEDefaultEscape);
+    uint64_t cur, next;
+
+    while (endPtr - inPtr > 8) {
+        memcpy(&cur, inPtr, sizeof(cur));
+        memcpy(&next, inPtr + 1, sizeof(next));
+        if (Nu_HasZeroByte(cur ^ next) || Nu_HasZeroByte(cur ^ escape))
+            break;
+        inPtr += 8;
+    }
+#endif
+
+    /* pin down the exact position a byte at a time */
+    while (endPtr - inPtr > 1 && inPtr[0] != inPtr[1] &&
+           inPtr[0] != kNuRLEDefaultEscape)
+    {
+        inPtr++;
+    }
+    return inPtr;
+}
+
+/*
+ * Return the length of the run of identical bytes starting at "inPtr".
+ */
+static inline int Nu_RLERunLength(const uint8_t* inPtr, const uint8_t* endPtr)
+{
+    const uint8_t* startPtr = inPtr;
+    uint8_t matchChar = *inPtr;
+
+#ifdef HAVE_SSE2
+    const __m128i match = _mm_set1_epi8((char) matchChar);
+
+    while (endPtr - inPtr >= 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i*) inPtr);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(cur, match)) != 0xffff)
+            break;
+        inPtr += 16;
+    }
+#else
+    const uint64_t match = Nu_ByteSplat(matchChar);
+    uint64_t cur;
+
+    while (endPtr - inPtr >= 8) {
+        memcpy(&cur, inPtr, sizeof(cur));
+        if (cur != match)
+            break;
+        inPtr += 8;
+    }
+#endif
+
+    while (inPtr < endPtr && *inPtr == matchChar)
+        inPtr++;
+    return (int) (inPtr - startPtr);
+}
+
 /*
  * Compress a block of input from lzwState->inputBuf to lzwState->rleBuf.
  * The size of the output is returned in "*pRLESize" (will be zero if the
@@ -194,17 +271,25 @@ static NuError Nu_CompressBlockRLE(LZWCompressState* lzwState, int* pRLESize)
 {
     const uint8_t* inPtr = lzwState->inputBuf;
     const uint8_t* endPtr = inPtr + kNuLZWBlockSize;
+    const uint8_t* litEnd;
     uint8_t* outPtr = lzwState->rleBuf;
     uint8_t matchChar;
     int matchCount;
 
     while (inPtr < endPtr) {
+        /* copy the stretch that can't be RLE-encoded straight through */
+        litEnd = Nu_FindRLEBreak(inPtr, endPtr);
+        if (litEnd != inPtr) {
+            memcpy(outPtr, inPtr, litEnd - inPtr);
+            outPtr += litEnd - inPtr;
+            inPtr = litEnd;
+        }
+
         matchChar = *inPtr;
-        matchCount = 1;
 
         /* count up the matching chars */
-        while (*++inPtr == matchChar && inPtr < endPtr)
-            matchCount++;
+        matchCount = Nu_RLERunLength(inPtr, endPtr);
+        inPtr += matchCount;
 
         if (matchCount > 3) {
             if (matchCount > 256) {
@@ -551,8 +636,8 @@ static NuError Nu_CompressLZWBlock(LZWCompressState* lzwState,
  *
  * On exit, the output file will be positioned past the last byte written.
  */
-static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pThreadCrc, Boolean isType2)
+static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pThreadCrc, Boolean isType2)
 {
     NuError err = kNuErrNone;
     LZWCompressState* lzwState;
@@ -564,7 +649,7 @@ static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
 
     Assert(pArchive != NULL);
     Assert(pStraw != NULL);
-    Assert(fp != NULL);
+    Assert(pStream != NULL);
     Assert(srcLen > 0);
     Assert(pDstLen != NULL);
     Assert(pThreadCrc != NULL);
@@ -606,16 +691,16 @@ static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
      * have to compress the whole thing, then seek back afterward and
      * write the value.  This annoyance went away in LZW/2.
      */
-    err = Nu_FTell(fp, &initialOffset);
+    err = Nu_CompStreamTell(pStream, &initialOffset);
     BailError(err);
 
     if (!isType2) {
-        putc(0, fp);        /* leave space for CRC */
-        putc(0, fp);
+        Nu_CompStreamPutc(pStream, 0);        /* leave space for CRC */
+        Nu_CompStreamPutc(pStream, 0);
         compressedLen += 2;
     }
-    putc(kNuLZWDefaultVol, fp);
-    putc(kNuRLEDefaultEscape, fp);
+    Nu_CompStreamPutc(pStream, kNuLZWDefaultVol);
+    Nu_CompStreamPutc(pStream, kNuRLEDefaultEscape);
     compressedLen += 2;
 
     if (isType2)
@@ -648,10 +733,11 @@ static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
          * Compute the CRC.  For LZW/1 this is on the entire 4K block, for
          * the "version 3" thread header CRC this is on just the "real" data.
          */
-        *pThreadCrc = Nu_CalcCRC16(*pThreadCrc, lzwState->inputBuf, blockSize);
+        *pThreadCrc = Nu_StatsCalcCRC16(pArchive, *pThreadCrc,
+                        lzwState->inputBuf, blockSize);
         if (!isType2) {
-            lzwState->chunkCrc = Nu_CalcCRC16(lzwState->chunkCrc,
-                lzwState->inputBuf, kNuLZWBlockSize);
+            lzwState->chunkCrc = Nu_StatsCalcCRC16(pArchive,
+                lzwState->chunkCrc, lzwState->inputBuf, kNuLZWBlockSize);
         }
 
         /*
@@ -697,31 +783,31 @@ static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
             if (isType2)
                 rleSize |= 0x8000;      /* for LZW/2, set "LZW used" flag */
 
-            putc(rleSize & 0xff, fp);   /* size after RLE */
-            putc(rleSize >> 8, fp);
+            Nu_CompStreamPutc(pStream, rleSize & 0xff);   /* size after RLE */
+            Nu_CompStreamPutc(pStream, rleSize >> 8);
             compressedLen += 2;
 
             if (isType2) {
                 /* write compressed LZW len (+4 for header bytes) */
-                putc((lzwSize+4) & 0xff, fp);
-                putc((lzwSize+4) >> 8, fp);
+                Nu_CompStreamPutc(pStream, (lzwSize+4) & 0xff);
+                Nu_CompStreamPutc(pStream, (lzwSize+4) >> 8);
                 compressedLen += 2;
             } else {
                 /* set LZW/1 "LZW used" flag */
-                putc(1, fp);
+                Nu_CompStreamPutc(pStream, 1);
                 compressedLen++;
             }
         
             /* write data from LZW buffer */
-            err = Nu_FWrite(fp, lzwState->lzwBuf, lzwSize);
+            err = Nu_CompStreamWrite(pStream, lzwState->lzwBuf, lzwSize);
             BailError(err);
             compressedLen += lzwSize;
         } else {
             /*
              * LZW failed.
              */
-            putc(rleSize & 0xff, fp);   /* size after RLE */
-            putc(rleSize >> 8, fp);
+            Nu_CompStreamPutc(pStream, rleSize & 0xff);   /* size after RLE */
+            Nu_CompStreamPutc(pStream, rleSize >> 8);
             compressedLen += 2;
 
             if (isType2) {
@@ -729,12 +815,12 @@ static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
                 Nu_ClearLZWTable(lzwState);
             } else {
                 /* set LZW/1 "LZW not used" flag */
-                putc(0, fp);
+                Nu_CompStreamPutc(pStream, 0);
                 compressedLen++;
             }
 
             /* write data from RLE or plain-input buffer */
-            err = Nu_FWrite(fp, lzwInputBuf, rleSize);
+            err = Nu_CompStreamWrite(pStream, lzwInputBuf, rleSize);
             BailError(err);
             compressedLen += rleSize;
         }
@@ -752,22 +838,26 @@ static NuError Nu_CompressLZW(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
     if (!isType2) {
         long curOffset;
 
-        err = Nu_FTell(fp, &curOffset);
+        err = Nu_CompStreamTell(pStream, &curOffset);
         BailError(err);
-        err = Nu_FSeek(fp, initialOffset, SEEK_SET);
+        err = Nu_CompStreamSeek(pStream, initialOffset, SEEK_SET);
         BailError(err);
-        putc(lzwState->chunkCrc & 0xff, fp);
-        putc(lzwState->chunkCrc >> 8, fp);
-        err = Nu_FSeek(fp, curOffset, SEEK_SET);
+        Nu_CompStreamPutc(pStream, lzwState->chunkCrc & 0xff);
+        Nu_CompStreamPutc(pStream, lzwState->chunkCrc >> 8);
+        err = Nu_CompStreamSeek(pStream, curOffset, SEEK_SET);
         BailError(err);
     }
 
     /* P8SHK and GSHK add an extra byte to LZW-compressed threads */
     if (pArchive->valMimicSHK) {
-        putc(0, fp);
+        Nu_CompStreamPutc(pStream, 0);
         compressedLen++;
     }
 
+    /* catch any failures from the single-byte writes */
+    err = Nu_CompStreamGetError(pStream);
+    BailError(err);
+
     *pDstLen = compressedLen;
 
 bail:
@@ -777,19 +867,19 @@ bail:
 /*
  * Compress ShrinkIt-style "LZW/1".
  */
-NuError Nu_CompressLZW1(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+NuError Nu_CompressLZW1(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
-    return Nu_CompressLZW(pArchive, pStraw, fp, srcLen, pDstLen, pCrc, false);
+    return Nu_CompressLZW(pArchive, pStraw, pStream, srcLen, pDstLen, pCrc, false);
 }
 
 /*
  * Compress ShrinkIt-style "LZW/2".
  */
-NuError Nu_CompressLZW2(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+NuError Nu_CompressLZW2(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
-    return Nu_CompressLZW(pArchive, pStraw, fp, srcLen, pDstLen, pCrc, true);
+    return Nu_CompressLZW(pArchive, pStraw, pStream, srcLen, pDstLen, pCrc, true);
 }
 
 
@@ -1226,7 +1316,9 @@ static NuError Nu_ExpandRLE(LZWExpandState* lzwState, const uint8_t* inbuf,
     uint8_t *outbuf;
     uint8_t *outbufend;
     const uint8_t *inbufend;
+    const uint8_t *escPtr;
     uint8_t uch, rleEscape;
+    size_t litLen;
     int count;
 
     outbuf = lzwState->rleOutBuf;
@@ -1234,21 +1326,30 @@ static NuError Nu_ExpandRLE(LZWExpandState* lzwState, const uint8_t* inbuf,
     inbufend = inbuf + expectedInputUsed;
     rleEscape = lzwState->rleEscape;
 
-    while (outbuf < outbufend) {
+    while (outbuf < outbufend && inbuf < inbufend) {
+        /* copy everything up to the next escape */
+        litLen = outbufend - outbuf;
+        if (litLen > (size_t) (inbufend - inbuf))
+            litLen = inbufend - inbuf;
+        escPtr = memchr(inbuf, rleEscape, litLen);
+        if (escPtr != NULL)
+            litLen = escPtr - inbuf;
+        memcpy(outbuf, inbuf, litLen);
+        outbuf += litLen;
+        inbuf += litLen;
+        if (escPtr == NULL)
+            continue;
+
+        inbuf++;
         uch = *inbuf++;
-        if (uch == rleEscape) {
-            uch = *inbuf++;
-            count = *inbuf++;
-            if (outbuf + count >= outbufend) {
-                /* don't overrun buffer */
-                Assert(outbuf != outbufend);
-                break;
-            }
-            while (count-- >= 0)
-                *outbuf++ = uch;
-        } else {
-            *outbuf++ = uch;
+        count = *inbuf++;
+        if (outbuf + count >= outbufend) {
+            /* don't overrun buffer */
+            Assert(outbuf != outbufend);
+            break;
         }
+        memset(outbuf, uch, count + 1);
+        outbuf += count + 1;
     }
 
     if (outbuf != outbufend) {
@@ -1290,17 +1391,19 @@ static inline uint8_t Nu_GetHeaderByte(LZWExpandState* lzwState)
  * will contain the CRC of the uncompressed data.
  */
 NuError Nu_ExpandLZW(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel,
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
     uint16_t* pThreadCrc)
 {
     NuError err = kNuErrNone;
     Boolean isType2;
     LZWExpandState* lzwState;
     uint32_t compRemaining, uncompRemaining, minSize;
+    uint16_t padCrc = 0;
+    uint32_t padLen = 0;
 
     Assert(pArchive != NULL);
     Assert(pThread != NULL);
-    Assert(infp != NULL);
+    Assert(pStream != NULL);
     Assert(pFunnel != NULL);
 
     /*
@@ -1346,12 +1449,12 @@ NuError Nu_ExpandLZW(NuArchive* pArchive, const NuRecord* pRecord,
      * Read the LZW header out of the data stream.
      */
     if (!isType2) {
-        lzwState->fileCrc = getc(infp);
-        lzwState->fileCrc |= getc(infp) << 8;
+        lzwState->fileCrc = Nu_CompStreamGetc(pStream);
+        lzwState->fileCrc |= Nu_CompStreamGetc(pStream) << 8;
         compRemaining -= 2;
     }
-    lzwState->diskVol = getc(infp);     /* disk volume #; not really used */
-    lzwState->rleEscape = getc(infp);   /* RLE escape char for this thread */
+    lzwState->diskVol = Nu_CompStreamGetc(pStream);     /* disk vol; unused */
+    lzwState->rleEscape = Nu_CompStreamGetc(pStream);   /* RLE escape char */
     compRemaining -= 2;
 
     lzwState->dataInBuffer = 0;
@@ -1412,8 +1515,8 @@ NuError Nu_ExpandLZW(NuArchive* pArchive, const NuRecord* pRecord,
                 getSize = compRemaining;
 
             /*printf("+++ READING %ld\n", getSize);*/
-            err = Nu_FRead(infp, lzwState->dataPtr + lzwState->dataInBuffer,
-                    getSize);
+            err = Nu_CompStreamRead(pStream,
+                    lzwState->dataPtr + lzwState->dataInBuffer, getSize);
             if (err != kNuErrNone) {
                 Nu_ReportError(NU_BLOB, err,
                     "failed reading compressed data (%u bytes)", getSize);
@@ -1532,14 +1635,24 @@ NuError Nu_ExpandLZW(NuArchive* pArchive, const NuRecord* pRecord,
          * it out to 4096 bytes.
          *
          * See commentary in the compression code for why we have to
-         * compute two CRCs for LZW/1.
+         * compute two CRCs for LZW/1.  They cover the same bytes, apart
+         * from the padding, so we only run through the data once: the
+         * chunk CRC starts at zero, which lets us fold it into the
+         * thread CRC at the end.  The padding is CRCed separately and
+         * appended to the chunk CRC afterward.
          */
-        if (pThreadCrc != NULL) {
-            *pThreadCrc = Nu_CalcCRC16(*pThreadCrc, writeBuf, writeLen);
-        }
-        if (!isType2) {
-            lzwState->chunkCrc = Nu_CalcCRC16(lzwState->chunkCrc,
-                writeBuf, kNuLZWBlockSize);
+        if (isType2) {
+            if (pThreadCrc != NULL)
+                *pThreadCrc = Nu_StatsCalcCRC16(pArchive, *pThreadCrc,
+                                writeBuf, writeLen);
+        } else {
+            lzwState->chunkCrc = Nu_StatsCalcCRC16(pArchive,
+                lzwState->chunkCrc, writeBuf, writeLen);
+            if (writeLen < kNuLZWBlockSize) {
+                Assert(uncompRemaining == writeLen);
+                padLen = kNuLZWBlockSize - writeLen;
+                padCrc = Nu_CalcCRC16(0, writeBuf + writeLen, padLen);
+            }
         }
 
         /* write the data, possibly doing an EOL conversion */
@@ -1554,6 +1667,15 @@ NuError Nu_ExpandLZW(NuArchive* pArchive, const NuRecord* pRecord,
         Assert(uncompRemaining < 32767*65536);
     }
 
+    if (!isType2) {
+        if (pThreadCrc != NULL) {
+            *pThreadCrc = Nu_CRC16Combine(*pThreadCrc, lzwState->chunkCrc,
+                            pThread->actualThreadEOF);
+        }
+        lzwState->chunkCrc = Nu_CRC16Combine(lzwState->chunkCrc, padCrc,
+                                padLen);
+    }
+
     /*
      * It appears that ShrinkIt appends an extra byte after the last
      * LZW block.  The byte is included in the compThreadEOF, but isn't
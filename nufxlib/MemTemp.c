@@ -0,0 +1,208 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Memory-backed temp file for NuFlush.
+ *
+ * When a flush has to rebuild the archive, it's written to the temp file
+ * and then renamed over the original.  For small archives, most of the
+ * time goes into the disk traffic for the temp file: lots of small writes,
+ * plus the seeks back to fill in record headers.  When kNuValueMemTempLimit
+ * is set, and the new archive can't be bigger than that, the flush builds
+ * it in an anonymous memory file instead.  At the end, the whole thing is
+ * copied into the (empty) on-disk temp file in one pass, and renamed over
+ * the original as usual.
+ *
+ * The memory file is a real FILE*, so everything that writes to the temp
+ * file works unchanged.  While it's in use, pArchive->tmpFp points at it,
+ * and the on-disk temp file is parked in pArchive->diskTmpFp.
+ *
+ * The size is estimated up front, from the size of the current archive
+ * and the sizes of everything being added.  If any of them can't be
+ * determined, or the system doesn't have memfd_create(), the on-disk temp
+ * file is used.
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE    /* for memfd_create */
+#endif
+#include "NufxLibPriv.h"
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_FDOPEN)
+# include <sys/mman.h>
+# define NU_MEM_TEMP
+#endif
+
+/* allowance for the record header of each record that's added */
+#define kNuMemTempRecordSlop    1024
+
+
+/*
+ * Add the largest amount of data the thread mods in "pRecord" can write.
+ * Returns "false" if we can't tell.
+ */
+static Boolean Nu_MemTempAddRecord(const NuRecord* pRecord, uint32_t* pTotal)
+{
+    const NuThreadMod* pThreadMod;
+    const NuDataSource* pDataSource;
+    uint32_t len;
+
+    for (pThreadMod = pRecord->pThreadMods; pThreadMod != NULL;
+        pThreadMod = pThreadMod->pNext)
+    {
+        if (pThreadMod->entry.kind == kNuThreadModAdd)
+            pDataSource = pThreadMod->entry.add.pDataSource;
+        else if (pThreadMod->entry.kind == kNuThreadModUpdate)
+            pDataSource = pThreadMod->entry.update.pDataSource;
+        else
+            continue;
+
+        if (!Nu_DataSourceGetMaxLen(pDataSource, &len))
+            return false;
+        len += kNuThreadHeaderSize;
+        if (*pTotal + len < *pTotal)
+            return false;       /* overflow */
+        *pTotal += len;
+    }
+
+    return true;
+}
+
+/*
+ * Decide if the archive we're about to build will fit in the memory
+ * temp file.
+ */
+static Boolean Nu_MemTempFits(NuArchive* pArchive)
+{
+    const NuRecord* pRecord;
+    long archiveLen;
+    uint32_t total;
+
+    if (pArchive->valMemTempLimit == 0)
+        return false;
+
+    if (Nu_GetFileLength(pArchive, pArchive->archiveFp, &archiveLen) !=
+        kNuErrNone)
+    {
+        return false;
+    }
+    total = (uint32_t) archiveLen;
+
+    /*
+     * Records in the "copy" set can only shrink, except for threads
+     * being added or replaced.
+     */
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->copyRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        if (!Nu_MemTempAddRecord(pRecord, &total))
+            return false;
+    }
+
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        total += kNuMemTempRecordSlop;
+        if (!Nu_MemTempAddRecord(pRecord, &total))
+            return false;
+    }
+
+    DBUG(("--- Memory temp: estimate %u, limit %u\n", total,
+        pArchive->valMemTempLimit));
+    return total <= pArchive->valMemTempLimit;
+}
+
+
+/*
+ * If the new archive is small enough, switch pArchive->tmpFp over to a
+ * memory file.  Call at the start of a flush that writes to the temp file.
+ *
+ * Failing to create the memory file isn't an error; we just use the disk.
+ */
+void Nu_MemTempBegin(NuArchive* pArchive)
+{
+#ifdef NU_MEM_TEMP
+    int fd;
+    FILE* memFp;
+
+    Assert(pArchive->diskTmpFp == NULL);
+    Assert(pArchive->tmpFp != NULL);
+
+    if (!Nu_MemTempFits(pArchive))
+        return;
+
+    fd = memfd_create("nufxlib-temp", 0);
+    if (fd < 0) {
+        DBUG(("--- memfd_create failed (errno=%d)\n", errno));
+        return;
+    }
+    memFp = fdopen(fd, kNuFileOpenReadWriteCreat);
+    if (memFp == NULL) {
+        close(fd);
+        return;
+    }
+
+    DBUG(("--- Building archive in memory\n"));
+    pArchive->diskTmpFp = pArchive->tmpFp;
+    pArchive->tmpFp = memFp;
+#else
+    (void) pArchive;
+#endif
+}
+
+/*
+ * Copy the archive from the memory file into the on-disk temp file, and
+ * switch back to it.  Does nothing if we weren't using the memory file.
+ *
+ * On exit, pArchive->tmpFp is positioned at the end of the archive.
+ */
+NuError Nu_MemTempCommit(NuArchive* pArchive)
+{
+    NuError err = kNuErrNone;
+    FILE* memFp;
+    long length;
+
+    if (pArchive->diskTmpFp == NULL)
+        return kNuErrNone;
+
+    memFp = pArchive->tmpFp;
+    err = Nu_GetFileLength(pArchive, memFp, &length);
+    BailError(err);
+
+    DBUG(("--- Writing %ld bytes from memory to temp file\n", length));
+    err = Nu_FSeek(pArchive, memFp, 0, SEEK_SET);
+    BailError(err);
+    err = Nu_FSeek(pArchive, pArchive->diskTmpFp, 0, SEEK_SET);
+    BailError(err);
+    err = Nu_CopyFileSection(pArchive, pArchive->diskTmpFp, memFp, length);
+    BailError(err);
+    if (fflush(pArchive->diskTmpFp) != 0 || ferror(pArchive->diskTmpFp)) {
+        err = kNuErrFileWrite;
+        goto bail;
+    }
+
+    pArchive->tmpFp = pArchive->diskTmpFp;
+    pArchive->diskTmpFp = NULL;
+    fclose(memFp);
+
+bail:
+    if (err != kNuErrNone)
+        Nu_ReportError(NU_BLOB, err, "Unable to write temp file '%s'",
+            pArchive->tmpPathnameUNI);
+    return err;
+}
+
+/*
+ * Throw away the memory file, if any, and go back to the disk file.
+ * The on-disk temp file is left however it was.
+ */
+void Nu_MemTempDiscard(NuArchive* pArchive)
+{
+    if (pArchive->diskTmpFp == NULL)
+        return;
+
+    DBUG(("--- Discarding memory temp file\n"));
+    if (pArchive->tmpFp != NULL)
+        fclose(pArchive->tmpFp);
+    pArchive->tmpFp = pArchive->diskTmpFp;
+    pArchive->diskTmpFp = NULL;
+}
@@ -313,42 +313,182 @@ bail:
 /*
  * Memory allocation wrappers.
  *
- * Under gcc these would be macros, but not all compilers can handle that.
+ * Everything goes through an NuAllocator: the archive's, if there is one,
+ * or the global allocator for things that don't belong to an archive.
+ * The application can replace either one, and can do so while blocks
+ * from the old one are still around, so each block starts with a header
+ * that says where it came from.  Frees and reallocs go back to that
+ * allocator no matter which archive they're made for.
  *
- * [ It should be possible to use mmalloc instead of malloc.  Just tuck the
- *   mmalloc descriptor into the NuArchive struct. ]
+ * The header also holds the size, so allocators without a realloc
+ * function (e.g. arenas) can be handled with a copy.
  */
 
 #ifndef USE_DMALLOC
+typedef union NuAllocHeader {
+    struct {
+        const NuAllocator*  pAllocator;
+        size_t              size;
+    } info;
+    double          align[2];       /* keep the block aligned like malloc */
+} NuAllocHeader;
+
+static void* Nu_StdMalloc(void* context, size_t size)
+{
+    return malloc(size);
+}
+static void* Nu_StdRealloc(void* context, void* ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+static void Nu_StdFree(void* context, void* ptr)
+{
+    free(ptr);
+}
+
+static const NuAllocator gNuStdAllocator = {
+    Nu_StdMalloc, Nu_StdRealloc, Nu_StdFree, NULL
+};
+
+/* used for anything that doesn't belong to an archive */
+static const NuAllocator* gNuGlobalAllocator = &gNuStdAllocator;
+
+
+/*
+ * Get the allocator for an archive, or the global allocator if "pArchive"
+ * is NULL.
+ */
+const NuAllocator* Nu_GetAllocator(const NuArchive* pArchive)
+{
+    if (pArchive == NULL)
+        return gNuGlobalAllocator;
+    return pArchive->pAllocator;
+}
+
+/*
+ * Returns "true" if the archive has only ever used the global allocator.
+ * Memory from anything else mustn't outlive the archive.
+ */
+Boolean Nu_UsesGlobalAllocator(const NuArchive* pArchive)
+{
+    return !pArchive->ownAllocator &&
+            pArchive->pAllocator == gNuGlobalAllocator;
+}
+
+/*
+ * Set the global allocator.  NULL means malloc().
+ */
+NuError Nu_SetGlobalAllocator(const NuAllocator* pAllocator)
+{
+    if (pAllocator == NULL)
+        pAllocator = &gNuStdAllocator;
+    else if (pAllocator->mallocFunc == NULL)
+        return kNuErrInvalidArg;
+
+    gNuGlobalAllocator = pAllocator;
+    return kNuErrNone;
+}
+
+/*
+ * Set the allocator for an archive.  NULL means the global allocator.
+ */
+NuError Nu_SetAllocator(NuArchive* pArchive, const NuAllocator* pAllocator)
+{
+    if (pAllocator == NULL)
+        pAllocator = gNuGlobalAllocator;
+    else if (pAllocator->mallocFunc == NULL)
+        return kNuErrInvalidArg;
+
+    if (pAllocator != gNuGlobalAllocator)
+        pArchive->ownAllocator = true;
+    pArchive->pAllocator = pAllocator;
+    return kNuErrNone;
+}
+
+/*
+ * Allocate a block from a specific allocator.  Returns NULL, without
+ * reporting anything, on failure.
+ */
+static void* Nu_AllocBlock(const NuAllocator* pAllocator, size_t size)
+{
+    NuAllocHeader* pHdr;
+
+    Assert(size > 0);
+    pHdr = (*pAllocator->mallocFunc)(pAllocator->context,
+            sizeof(NuAllocHeader) + size);
+    if (pHdr == NULL)
+        return NULL;
+
+    pHdr->info.pAllocator = pAllocator;
+    pHdr->info.size = size;
+    DebugFill(pHdr +1, size);
+    return pHdr +1;
+}
+
+void* Nu_AllocatorMalloc(const NuAllocator* pAllocator, size_t size)
+{
+    NuArchive* pArchive = NULL;     /* no archive to report to */
+    void* _result;
+
+    _result = Nu_AllocBlock(pAllocator, size);
+    if (_result == NULL) {
+        Nu_ReportError(NU_BLOB, kNuErrMalloc,
+            "malloc(%u) failed", (unsigned int) size);
+        DebugAbort();   /* leave a core dump if we're built for it */
+    }
+    return _result;
+}
+
 void* Nu_Malloc(NuArchive* pArchive, size_t size)
 {
     void* _result;
 
-    Assert(size > 0);
-    _result = malloc(size);
+    _result = Nu_AllocBlock(Nu_GetAllocator(pArchive), size);
     if (_result == NULL) {
         Nu_ReportError(NU_BLOB, kNuErrMalloc,
             "malloc(%u) failed", (unsigned int) size);
         DebugAbort();   /* leave a core dump if we're built for it */
     }
-    DebugFill(_result, size);
     return _result;
 }
 
 void* Nu_Calloc(NuArchive* pArchive, size_t size)
 {
     void* _cresult = Nu_Malloc(pArchive, size);
-    memset(_cresult, 0, size);
+    if (_cresult != NULL)
+        memset(_cresult, 0, size);
     return _cresult;
 }
 
 void* Nu_Realloc(NuArchive* pArchive, void* ptr, size_t size)
 {
+    NuAllocHeader* pHdr;
+    const NuAllocator* pAllocator;
     void* _result;
 
     Assert(ptr != NULL);     /* disallow this usage */
     Assert(size > 0);       /* disallow this usage */
-    _result = realloc(ptr, size);
+
+    pHdr = (NuAllocHeader*) ptr - 1;
+    pAllocator = pHdr->info.pAllocator;
+    if (pAllocator->reallocFunc != NULL) {
+        pHdr = (*pAllocator->reallocFunc)(pAllocator->context, pHdr,
+                sizeof(NuAllocHeader) + size);
+        if (pHdr != NULL) {
+            pHdr->info.size = size;
+            _result = pHdr +1;
+        } else {
+            _result = NULL;
+        }
+    } else {
+        _result = Nu_AllocBlock(pAllocator, size);
+        if (_result != NULL) {
+            memcpy(_result, ptr,
+                size < pHdr->info.size ? size : pHdr->info.size);
+            Nu_Free(pArchive, ptr);
+        }
+    }
+
     if (_result == NULL) {
         Nu_ReportError(NU_BLOB, kNuErrMalloc,
             "realloc(%u) failed", (unsigned int) size);
@@ -359,8 +499,37 @@ void* Nu_Realloc(NuArchive* pArchive, void* ptr, size_t size)
 
 void Nu_Free(NuArchive* pArchive, void* ptr)
 {
-    if (ptr != NULL)
-        free(ptr);
+    NuAllocHeader* pHdr;
+    const NuAllocator* pAllocator;
+
+    if (ptr == NULL)
+        return;
+
+    pHdr = (NuAllocHeader*) ptr - 1;
+    pAllocator = pHdr->info.pAllocator;
+    if (pAllocator->freeFunc != NULL)
+        (*pAllocator->freeFunc)(pAllocator->context, pHdr);
+}
+
+char* Nu_Strdup(NuArchive* pArchive, const char* str)
+{
+    size_t len = strlen(str) +1;
+    char* _result;
+
+    _result = Nu_Malloc(pArchive, len);
+    if (_result != NULL)
+        memcpy(_result, str, len);
+    return _result;
+}
+#else /*USE_DMALLOC*/
+NuError Nu_SetGlobalAllocator(const NuAllocator* pAllocator)
+{
+    return kNuErrUnsupFeature;
+}
+
+NuError Nu_SetAllocator(NuArchive* pArchive, const NuAllocator* pAllocator)
+{
+    return kNuErrUnsupFeature;
 }
 #endif
 
@@ -375,3 +544,276 @@ NuResult Nu_InternalFreeCallback(NuArchive* pArchive, void* args)
     return kNuOK;
 }
 
+
+/*
+ * Set up and tear down a NuMutex that isn't statically initialized.
+ */
+void Nu_MutexInit(NuMutex* pMutex)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_mutex_init(pMutex, NULL);
+#elif defined(_WIN32)
+    InitializeSRWLock(pMutex);
+#else
+    *pMutex = 0;
+#endif
+}
+
+void Nu_MutexDestroy(NuMutex* pMutex)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_mutex_destroy(pMutex);
+#else
+    (void) pMutex;      /* SRW locks don't need cleanup */
+#endif
+}
+
+/*
+ * Lock and unlock a NuMutex.  These do nothing if the library was built
+ * without thread support.
+ */
+void Nu_MutexLock(NuMutex* pMutex)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_mutex_lock(pMutex);
+#elif defined(_WIN32)
+    AcquireSRWLockExclusive(pMutex);
+#else
+    (void) pMutex;
+#endif
+}
+
+void Nu_MutexUnlock(NuMutex* pMutex)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_mutex_unlock(pMutex);
+#elif defined(_WIN32)
+    ReleaseSRWLockExclusive(pMutex);
+#else
+    (void) pMutex;
+#endif
+}
+
+
+/*
+ * Condition variable operations.  Without thread support there's nobody
+ * to wait for, so Nu_CondWait must not be called.
+ */
+void Nu_CondInit(NuCond* pCond)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_cond_init(pCond, NULL);
+#elif defined(_WIN32)
+    InitializeConditionVariable(pCond);
+#else
+    *pCond = 0;
+#endif
+}
+
+void Nu_CondDestroy(NuCond* pCond)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_cond_destroy(pCond);
+#else
+    (void) pCond;
+#endif
+}
+
+void Nu_CondWait(NuCond* pCond, NuMutex* pMutex)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_cond_wait(pCond, pMutex);
+#elif defined(_WIN32)
+    (void) SleepConditionVariableSRW(pCond, pMutex, INFINITE, 0);
+#else
+    (void) pCond;
+    (void) pMutex;
+    Assert(0);
+#endif
+}
+
+void Nu_CondBroadcast(NuCond* pCond)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_cond_broadcast(pCond);
+#elif defined(_WIN32)
+    WakeAllConditionVariable(pCond);
+#else
+    (void) pCond;
+#endif
+}
+
+
+/*
+ * Get a millisecond counter, for timing things.  The value wraps around,
+ * so compare two of them by subtracting.
+ */
+uint32_t Nu_GetTickCount(void)
+{
+#if defined(_WIN32)
+    return GetTickCount();
+#elif defined(HAVE_SYS_TIME_H)
+    struct timeval tv;
+
+    (void) gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+    return (uint32_t) time(NULL) * 1000;
+#endif
+}
+
+/*
+ * Get a nanosecond counter, for the stats.  It only goes forward, and
+ * only differences between two values mean anything.
+ */
+uint64_t Nu_GetNanoTime(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (uint64_t) (count.QuadPart / freq.QuadPart) * 1000000000 +
+        (uint64_t) (count.QuadPart % freq.QuadPart) * 1000000000 /
+            freq.QuadPart;
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#elif defined(HAVE_SYS_TIME_H)
+    struct timeval tv;
+
+    (void) gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000000 + (uint64_t) tv.tv_usec * 1000;
+#else
+    return (uint64_t) time(NULL) * 1000000000;
+#endif
+}
+
+/*
+ * Get the CPU time used by the calling thread, in nanoseconds.  Where
+ * there's no per-thread clock, this is the time used by the process.
+ */
+uint64_t Nu_GetThreadCPUTime(void)
+{
+#if defined(_WIN32)
+    FILETIME createTime, exitTime, kernelTime, userTime;
+    ULARGE_INTEGER kernel, user;
+
+    if (!GetThreadTimes(GetCurrentThread(), &createTime, &exitTime,
+            &kernelTime, &userTime))
+    {
+        return 0;
+    }
+    kernel.LowPart = kernelTime.dwLowDateTime;
+    kernel.HighPart = kernelTime.dwHighDateTime;
+    user.LowPart = userTime.dwLowDateTime;
+    user.HighPart = userTime.dwHighDateTime;
+    return (kernel.QuadPart + user.QuadPart) * 100;     /* 100ns units */
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return (uint64_t) clock() * 1000000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Get the number of worker threads a codec may use for this archive.
+ * Always 1 if the library was built without thread support.
+ */
+int Nu_GetWorkerCount(const NuArchive* pArchive)
+{
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+    return (int) pArchive->valWorkerThreads;
+#else
+    (void) pArchive;
+    return 1;
+#endif
+}
+
+#if defined(HAVE_PTHREAD)
+static void* Nu_WorkerMain(void* arg)
+{
+    NuWorker* pWorker = arg;
+    uint64_t startTime = Nu_GetThreadCPUTime();
+
+    (*pWorker->func)(pWorker->arg);
+    pWorker->cpuTime = Nu_GetThreadCPUTime() - startTime;
+    return NULL;
+}
+#elif defined(_WIN32)
+static unsigned __stdcall Nu_WorkerMain(void* arg)
+{
+    NuWorker* pWorker = arg;
+    uint64_t startTime = Nu_GetThreadCPUTime();
+
+    (*pWorker->func)(pWorker->arg);
+    pWorker->cpuTime = Nu_GetThreadCPUTime() - startTime;
+    return 0;
+}
+#endif
+
+/*
+ * Run "func(arg)" on a new thread.  Returns "false", without calling the
+ * function, if the thread can't be created or the library was built
+ * without thread support.  On success, follow with Nu_WorkerJoin.
+ */
+Boolean Nu_WorkerTryStart(NuWorker* pWorker, NuWorkerFunc func, void* arg)
+{
+    Assert(pWorker != NULL);
+    Assert(func != NULL);
+
+    pWorker->func = func;
+    pWorker->arg = arg;
+    pWorker->running = false;
+    pWorker->cpuTime = 0;
+
+#if defined(HAVE_PTHREAD)
+    if (pthread_create(&pWorker->thread, NULL, Nu_WorkerMain, pWorker) == 0)
+        pWorker->running = true;
+#elif defined(_WIN32)
+    pWorker->thread = (HANDLE) _beginthreadex(NULL, 0, Nu_WorkerMain,
+                        pWorker, 0, NULL);
+    if (pWorker->thread != NULL)
+        pWorker->running = true;
+#endif
+
+    return pWorker->running;
+}
+
+/*
+ * Run "func(arg)" on a new thread.  If the thread can't be created, or
+ * the library was built without thread support, the function is called
+ * directly, so this always "succeeds".  Follow with Nu_WorkerJoin.
+ */
+void Nu_WorkerStart(NuWorker* pWorker, NuWorkerFunc func, void* arg)
+{
+    if (Nu_WorkerTryStart(pWorker, func, arg))
+        return;
+
+    DBUG(("--- running worker function on caller's thread\n"));
+    (*func)(arg);
+}
+
+/*
+ * Wait for a worker to finish.
+ */
+void Nu_WorkerJoin(NuWorker* pWorker)
+{
+    Assert(pWorker != NULL);
+
+    if (!pWorker->running)
+        return;
+
+#if defined(HAVE_PTHREAD)
+    (void) pthread_join(pWorker->thread, NULL);
+#elif defined(_WIN32)
+    (void) WaitForSingleObject(pWorker->thread, INFINITE);
+    CloseHandle(pWorker->thread);
+#endif
+    pWorker->running = false;
+}
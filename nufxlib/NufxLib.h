@@ -279,11 +279,40 @@ enum {
  */
 typedef struct NuArchive NuArchive;
 
+/*
+ * Codec contexts hold the state used by NuCompressBuffer and
+ * NuExpandBuffer.  Like NuArchive, the structure is opaque.
+ */
+typedef struct NuCodecContext NuCodecContext;
+
 /*
  * Generic callback prototype.
  */
 typedef NuResult (*NuCallback)(NuArchive* pArchive, void* args);
 
+/*
+ * Memory allocation hooks, for NuSetGlobalAllocator and NuSetAllocator.
+ * "reallocFunc" and "freeFunc" may be NULL; without a realloc function
+ * the library allocates and copies, and without a free function blocks
+ * are left for the allocator to reclaim (e.g. an arena that's dropped
+ * all at once).  "context" is passed to each call.
+ *
+ * The structure isn't copied.  It must stay valid until everything
+ * allocated through it has been freed: for an archive, until NuClose
+ * returns; for the global allocator, until the archives, data sources,
+ * data sinks, and codec contexts created while it was set are gone, and
+ * the codec pool has been emptied.  Blocks are always returned to the
+ * allocator they came from, so either one can be changed at any time.
+ *
+ * The functions may be called from the library's worker threads.
+ */
+typedef struct NuAllocator {
+    void*   (*mallocFunc)(void* context, size_t size);
+    void*   (*reallocFunc)(void* context, void* ptr, size_t size);
+    void    (*freeFunc)(void* context, void* ptr);
+    void*   context;
+} NuAllocator;
+
 /*
  * Parameters that affect archive operations.
  */
@@ -303,7 +332,22 @@ typedef enum NuValueID {
     kNuValueStripHighASCII      = 12,
     kNuValueJunkSkipMax         = 13,
     kNuValueIgnoreLZW2Len       = 14,
-    kNuValueHandleBadMac        = 15
+    kNuValueHandleBadMac        = 15,
+    kNuValueWorkerThreads       = 16,
+    kNuValueDeflateLevel        = 17,
+    kNuValueDeflateStrategy     = 18,
+    kNuValueBzip2BlockSize      = 19,
+    kNuValueLZCBits             = 20,
+    kNuValueBestOfFormats       = 21,
+    kNuValueBestOfTimeLimit     = 22,
+    kNuValueCompressPolicy      = 23,
+    kNuValueReadAhead           = 24,
+    kNuValueWriteBehind         = 25,
+    kNuValueCompactInPlace      = 26,
+    kNuValueMemTempLimit        = 27,
+    kNuValueOutputQueueLimit    = 28,
+    kNuValueInputPrefetch       = 29,
+    kNuValueStatsTiming         = 30
 } NuValueID;
 typedef uint32_t NuValue;
 
@@ -325,6 +369,7 @@ enum NuValueValue {
     kNuCompressDeflate          = 16,
     kNuCompressBzip2            = 17,
     kNuCompressZX0              = 18,
+    kNuCompressBest             = 19,   /* smallest of kNuValueBestOfFormats */
 
     /* for kNuValueEOL */
     kNuEOLUnknown               = 50,
@@ -341,9 +386,19 @@ enum NuValueValue {
     kNuMaybeOverwrite           = 90,
     kNuNeverOverwrite           = 91,
     kNuAlwaysOverwrite          = 93,
-    kNuMustOverwrite            = 94
+    kNuMustOverwrite            = 94,
+
+    /* for kNuValueDeflateStrategy */
+    kNuDeflateStrategyDefault   = 100,
+    kNuDeflateStrategyFiltered  = 101,
+    kNuDeflateStrategyHuffman   = 102,
+    kNuDeflateStrategyRLE       = 103,
+    kNuDeflateStrategyFixed     = 104
 };
 
+/* for kNuValueBestOfFormats, which is a set of NuThreadFormats */
+#define NuMakeFormatMask(format) ((NuValue) 1 << (format))
+
 
 /*
  * Pull out archive attributes.
@@ -587,6 +642,97 @@ typedef struct NuFileDetails {
     NuDateTime      archiveWhen;
 } NuFileDetails;
 
+/*
+ * One file for NuAddFiles.  The fields are the arguments to NuAddFile.
+ */
+typedef struct NuAddFileEntry {
+    const UNICHAR*  pathnameUNI;    /* where to read the data from */
+    NuFileDetails   fileDetails;
+    short           isFromRsrcFork;
+} NuAddFileEntry;
+
+
+/*
+ * One rule in a compression policy.  When kNuValueCompressPolicy is set,
+ * each data thread that's about to be compressed is checked against the
+ * rules in order, and the first one that matches decides how it gets
+ * compressed.  If none match, the kNuValueDataCompression setting that
+ * was in effect when the thread was added is used.
+ *
+ * Ranges are inclusive.  Use kNuPolicyAny to match anything.
+ */
+#define kNuPolicyAny    0xffffffff
+
+typedef struct NuPolicyRule {
+    uint32_t        fileType;       /* ProDOS file type, or kNuPolicyAny */
+    uint32_t        extraTypeMin;   /* ProDOS aux type range */
+    uint32_t        extraTypeMax;
+    uint32_t        threadKind;     /* kNuThreadKindDataFork, etc. */
+    uint32_t        lenMin;         /* uncompressed thread length range */
+    uint32_t        lenMax;
+    NuValue         compression;    /* kNuCompressNone, kNuCompressLZW2, ... */
+} NuPolicyRule;
+
+/*
+ * What happened to the threads a policy rule was applied to.
+ */
+typedef struct NuPolicyStats {
+    uint32_t        numThreads;     /* threads that matched the rule */
+    uint32_t        numStored;      /* ...that ended up uncompressed */
+    uint64_t        uncompressedBytes;
+    uint64_t        compressedBytes;
+} NuPolicyStats;
+
+
+/*
+ * Counters kept by each archive, returned by NuGetStats and cleared by
+ * NuResetStats.  The counts are always kept.  The times, in nanoseconds,
+ * are only collected while kNuValueStatsTiming is set, because reading
+ * the clocks costs more than everything else here put together.
+ *
+ * A codec's time runs from when it's handed the data to when it's done,
+ * so it includes reading its input and writing its output.  The CPU time
+ * includes the worker threads the codec ran on.  CRC time is the time
+ * spent on the CRCs of whole buffers; the CRCs that some codecs compute
+ * as they go, or on worker threads, are part of the codec's time.
+ * Attempts that fail or are abandoned, like best-of candidates that
+ * didn't come out smaller, are counted with no output bytes.
+ */
+#define kNuStatsNumFormats  (kNuThreadFormatZX0 + 1)
+
+typedef struct NuCodecStats {
+    uint64_t        bytesIn;        /* uncompressed bytes when compressing */
+    uint64_t        bytesOut;
+    uint64_t        numCalls;       /* #of threads */
+    uint64_t        wallTime;
+    uint64_t        cpuTime;
+} NuCodecStats;
+
+typedef struct NuStats {
+    /* file I/O, on the archive, the temp file, and the files we add and
+       extract */
+    uint64_t        bytesRead;
+    uint64_t        bytesWritten;
+    uint64_t        bytesCopied;    /* copied from one file to another */
+    uint64_t        tempFileBytes;  /* written to the temp file */
+    uint64_t        freadCalls;
+    uint64_t        fwriteCalls;
+    uint64_t        fseekCalls;
+    uint64_t        ftellCalls;
+
+    /* record headers read from the archive */
+    uint64_t        recordsScanned;
+    uint64_t        headerParseTime;
+
+    /* CRCs of thread data */
+    uint64_t        crcBytes;
+    uint64_t        crcTime;
+
+    /* indexed by NuThreadFormat */
+    NuCodecStats    compress[kNuStatsNumFormats];
+    NuCodecStats    expand[kNuStatsNumFormats];
+} NuStats;
+
 
 /*
  * Passed into the SelectionFilter callback.
@@ -797,6 +943,9 @@ NUFXLIB_API NuError NuAddThread(NuArchive* pArchive, NuRecordIdx recordIdx,
 NUFXLIB_API NuError NuAddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
             const NuFileDetails* pFileDetails, short fromRsrcFork,
             NuRecordIdx* pRecordIdx);
+NUFXLIB_API NuError NuAddFiles(NuArchive* pArchive,
+            const NuAddFileEntry* pEntries, uint32_t numEntries,
+            NuRecordIdx* pRecordIdxs, NuError* pResults);
 NUFXLIB_API NuError NuRename(NuArchive* pArchive, NuRecordIdx recordIdx,
             const char* pathnameMOR, char fssep);
 NUFXLIB_API NuError NuSetRecordAttr(NuArchive* pArchive, NuRecordIdx recordIdx,
@@ -820,6 +969,12 @@ NUFXLIB_API NuError NuSetValue(NuArchive* pArchive, NuValueID ident,
             NuValue value);
 NUFXLIB_API NuError NuGetAttr(NuArchive* pArchive, NuAttrID ident,
             NuAttr* pAttr);
+NUFXLIB_API NuError NuSetCompressPolicy(NuArchive* pArchive,
+            const NuPolicyRule* pRules, uint32_t numRules);
+NUFXLIB_API NuError NuGetCompressPolicyStats(NuArchive* pArchive,
+            uint32_t idx, NuPolicyRule* pRule, NuPolicyStats* pStats);
+NUFXLIB_API NuError NuGetStats(NuArchive* pArchive, NuStats* pStats);
+NUFXLIB_API NuError NuResetStats(NuArchive* pArchive);
 NUFXLIB_API NuError NuDebugDumpArchive(NuArchive* pArchive);
 
 /* sources and sinks */
@@ -846,12 +1001,27 @@ NUFXLIB_API NuError NuFreeDataSink(NuDataSink* pDataSink);
 NUFXLIB_API NuError NuDataSinkGetOutCount(NuDataSink* pDataSink,
             uint32_t* pOutCount);
 
+/* buffer-to-buffer compression and expansion */
+NUFXLIB_API NuError NuCreateCodecContext(NuCodecContext** ppContext);
+NUFXLIB_API NuError NuFreeCodecContext(NuCodecContext* pContext);
+NUFXLIB_API NuError NuSetCodecValue(NuCodecContext* pContext,
+            NuValueID ident, NuValue value);
+NUFXLIB_API NuError NuCompressBuffer(NuCodecContext* pContext,
+            NuThreadFormat threadFormat, const uint8_t* srcBuf,
+            uint32_t srcLen, uint8_t* dstBuf, uint32_t dstBufLen,
+            uint32_t* pDstLen, uint16_t* pCrc);
+NUFXLIB_API NuError NuExpandBuffer(NuCodecContext* pContext,
+            NuThreadFormat threadFormat, const uint8_t* srcBuf,
+            uint32_t srcLen, uint8_t* dstBuf, uint32_t dstLen,
+            uint16_t* pCrc);
+
 /* miscellaneous non-archive operations */
 NUFXLIB_API NuError NuGetVersion(int32_t* pMajorVersion, int32_t* pMinorVersion,
             int32_t* pBugVersion, const char** ppBuildDate,
             const char** ppBuildFlags);
 NUFXLIB_API const char* NuStrError(NuError err);
 NUFXLIB_API NuError NuTestFeature(NuFeature feature);
+NUFXLIB_API NuError NuSetCodecPoolLimit(long maxEntries);
 NUFXLIB_API void NuRecordCopyAttr(NuRecordAttr* pRecordAttr,
             const NuRecord* pRecord);
 NUFXLIB_API NuError NuRecordCopyThreads(const NuRecord* pRecord,
@@ -885,6 +1055,11 @@ NUFXLIB_API NuCallback NuSetErrorMessageHandler(NuArchive* pArchive,
             NuCallback messageHandlerFunc);
 NUFXLIB_API NuCallback NuSetGlobalErrorMessageHandler(NuCallback messageHandlerFunc);
 
+/* memory allocation */
+NUFXLIB_API NuError NuSetAllocator(NuArchive* pArchive,
+            const NuAllocator* pAllocator);
+NUFXLIB_API NuError NuSetGlobalAllocator(const NuAllocator* pAllocator);
+
 
 #ifdef __cplusplus
 }
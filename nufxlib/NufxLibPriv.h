@@ -70,6 +70,15 @@ typedef enum NuOpenMode {
 /* size of general-purpose compression buffer */
 #define kNuGenCompBufSize       32768
 
+/* for ShrinkIt-mimic mode, don't compress files under 512 bytes */
+#define kNuSHKLZWThreshold      512
+
+/*
+ * Target format for kNuCompressBest.  This never appears in an archive;
+ * Nu_CompressToArchive replaces it with whichever format won.
+ */
+#define kNuThreadFormatBestOf   ((NuThreadFormat) 0xffff)
+
 #define kNuCharLF   0x0a
 #define kNuCharCR   0x0d
 
@@ -91,6 +100,38 @@ typedef struct NuRecordSet {
     NuRecord*       nuRecordTail;
 } NuRecordSet;
 
+/* background archive reader, defined in ReadAhead.c */
+typedef struct NuReadAhead NuReadAhead;
+
+/* background output writer, defined in WriteBehind.c */
+typedef struct NuWriteBehind NuWriteBehind;
+
+/* compressors for new records, defined in FlushPool.c */
+typedef struct NuFlushPool NuFlushPool;
+
+/* expanders for existing records, defined in TestPool.c */
+typedef struct NuTestPool NuTestPool;
+
+/*
+ * Open directories for extraction, defined in DirCache.c.  This needs the
+ * POSIX.1-2008 "at" calls; without them, extraction uses pathnames.
+ */
+#if defined(UNIX_LIKE) && !defined(MAC_LIKE) && defined(HAVE_OPENAT) && \
+    defined(HAVE_MKDIRAT) && defined(HAVE_FSTATAT) && \
+    defined(HAVE_FUTIMENS) && defined(HAVE_FCHMOD)
+# define NU_DIR_FDS
+#endif
+typedef struct NuDirCache NuDirCache;
+
+/* batch of extracted files being written; see OutQueue.c */
+typedef struct NuOutQueue NuOutQueue;
+
+/* input files being read ahead of the flush; see Prefetch.c */
+typedef struct NuPrefetch NuPrefetch;
+
+/* storage for records and thread mods; see Arena.c */
+typedef struct NuArena NuArena;
+
 /*
  * Archive state.
  */
@@ -110,6 +151,7 @@ struct NuArchive {
 
     UNICHAR*        tmpPathnameUNI;         /* temp file, for writes */
     FILE*           tmpFp;
+    FILE*           diskTmpFp;              /* parked while tmpFp is in RAM */
 
     /* used during initial processing; helps avoid ftell() calls */
     long            currentOffset;
@@ -138,6 +180,51 @@ struct NuArchive {
     uint8_t*        compBuf;                /* large general-purpose buffer */
     void*           lzwCompressState;       /* state for LZW/1 and LZW/2 */
     void*           lzwExpandState;         /* state for LZW/1 and LZW/2 */
+    void*           lzcState;               /* tables for LZC */
+    void*           deflateState;           /* zlib stream for deflate */
+    void*           inflateState;           /* zlib stream for inflate */
+    void*           bzip2State;             /* buffers for libbz2 */
+
+    /* private archives that hold codec state for best-of compression */
+    NuArchive*      bestOfScratch[kNuThreadFormatBzip2 + 1];
+
+    /* compression policy; rules are NULL when the default table is used */
+    NuPolicyRule*   policyRules;
+    uint32_t        numPolicyRules;
+    NuPolicyStats*  policyStats;            /* numPolicyRules+1 entries */
+
+    /* background reader for read-only archives; see ReadAhead.c */
+    NuReadAhead*    pReadAhead;
+
+    /* background writer, only present during a flush; see WriteBehind.c */
+    NuWriteBehind*  pWriteBehind;
+
+    /* compressors for new records, only present during a flush */
+    NuFlushPool*    pFlushPool;
+
+    /* expanders for existing records, only present during a test */
+    NuTestPool*     pTestPool;
+
+    /* directories we're extracting into; see DirCache.c */
+    NuDirCache*     pDirCache;
+
+    /* extracted files waiting to be written; see OutQueue.c */
+    NuOutQueue*     pOutQueue;
+
+    /* input files for new records, only present during a flush */
+    NuPrefetch*     pPrefetch;
+
+    /* records, their contents, and their thread mods; see Arena.c */
+    NuArena*        pArena;
+    long            numThreadMods;          /* how many haven't been freed */
+
+    /* where our memory comes from; see NuSetAllocator */
+    const NuAllocator* pAllocator;
+    Boolean         ownAllocator;           /* ever set to non-global? */
+
+    /* counters for NuGetStats; see Stats.c */
+    NuStats         stats;
+    uint64_t        workerCPUTime;          /* CPU used by joined workers */
 
     /* options and attributes that the user can set */
     /* (these can be changed by a callback, so don't cache them internally) */
@@ -158,6 +245,21 @@ struct NuArchive {
     NuValue         valJunkSkipMax;         /* scan this far for header */
     NuValue         valIgnoreLZW2Len;       /* don't verify LZW/II len field */
     NuValue         valHandleBadMac;        /* handle "bad Mac" archives */
+    NuValue         valWorkerThreads;       /* max codec worker threads */
+    NuValue         valDeflateLevel;        /* zlib compression level */
+    NuValue         valDeflateStrategy;     /* zlib strategy */
+    NuValue         valBzip2BlockSize;      /* libbz2 block size, in 100K */
+    NuValue         valLZCBits;             /* max code size for LZC16 */
+    NuValue         valBestOfFormats;       /* formats to try for "best" */
+    NuValue         valBestOfTimeLimit;     /* msec, 0 means no limit */
+    NuValue         valCompressPolicy;      /* pick compression by type? */
+    NuValue         valReadAhead;           /* read archive on a thread? */
+    NuValue         valWriteBehind;         /* write output on a thread? */
+    NuValue         valCompactInPlace;      /* delete w/o temp file? */
+    NuValue         valMemTempLimit;        /* build small archives in RAM */
+    NuValue         valOutputQueueLimit;    /* bytes of queued extract writes */
+    NuValue         valInputPrefetch;       /* bytes of input to read ahead */
+    NuValue         valStatsTiming;         /* time things for the stats? */
 
     /* callback functions */
     NuCallback      selectionFilterFunc;
@@ -169,6 +271,18 @@ struct NuArchive {
 
 #define kNuArchiveStructMagic   0xc0edbabe
 
+
+/*
+ * Codec context, for buffer-to-buffer compression and expansion.  The
+ * codec state lives in a NuArchive that is never opened.
+ */
+struct NuCodecContext {
+    uint32_t        structMagic;
+    NuArchive*      pArchive;
+};
+
+#define kNuCodecContextStructMagic  0xc0dec0de
+
 #define kNuDefaultRecordName    "UNKNOWN"   /* use ASCII charset */
 
 
@@ -237,6 +351,7 @@ struct NuThreadMod {
  */
 
 #define kNuFunnelBufSize    16384
+#define kNuVerifyProgressSize   (256 * 1024)    /* bytes between updates */
 
 /*
  * File funnel definition.  This is used for writing output to files
@@ -269,6 +384,9 @@ typedef struct NuFunnel {
 
     Boolean         isFirstWrite;   /* cleared on first write */
 
+    /* testing only; data is counted for the progress meter and discarded */
+    Boolean         verifyOnly;
+
 #if 0
     uint32_t        inCount;        /* total #of bytes in the top */
     uint32_t        outCount;       /* total #of bytes out the bottom */
@@ -304,11 +422,54 @@ typedef struct NuStraw {
     /* progress update fields */
     uint32_t        lastProgress;
     uint32_t        lastDisplayed;
+
+    /* if set, called before each read; returning true aborts the read */
+    Boolean         (*abortFunc)(void* arg);
+    void*           abortArg;
 } NuStraw;
 
 /*NuError Nu_CopyStreamToStream(FILE* outfp, FILE* infp, uint32_t count);*/
 
 
+/*
+ * Compressed data stream.  Compressors write to one of these, expanders
+ * read from one.  It's either a stdio FILE* (the archive or temp file) or
+ * a block of memory, so the codecs can be used without doing file I/O.
+ * Expanders may also be handed a read-ahead stream, which gets the file
+ * data from a background reader, and compressors a write-behind stream,
+ * which hands the output to a background writer.
+ */
+typedef enum NuCompStreamType {
+    kNuCompStreamUnknown = 0,
+    kNuCompStreamFile,
+    kNuCompStreamBuffer,
+    kNuCompStreamReadAhead,
+    kNuCompStreamWriteBehind
+} NuCompStreamType;
+
+typedef struct NuCompStream {
+    NuCompStreamType    type;
+
+    /* kNuCompStreamFile */
+    FILE*           fp;
+    NuArchive*      pArchive;       /* counts the I/O */
+
+    /* kNuCompStreamReadAhead */
+    NuReadAhead*    pReadAhead;
+    Boolean         ownReadAhead;   /* free it when the thread is done? */
+
+    /* kNuCompStreamWriteBehind */
+    NuWriteBehind*  pWriteBehind;
+
+    /* kNuCompStreamBuffer */
+    uint8_t*        buffer;
+    uint32_t        bufLen;         /* max amount of data "buffer" holds */
+    uint32_t        dataLen;        /* #of bytes of valid data in buffer */
+    uint32_t        offset;         /* current read/write position */
+    NuError         stickyErr;
+} NuCompStream;
+
+
 /*
  * ===========================================================================
  *      Data source and sink abstractions
@@ -375,6 +536,16 @@ union NuDataSource {
  * DataSink is used when extracting data from an archive.
  */
 
+/*
+ * Zero blocks of this size are left as holes when extracting to a file.
+ * Disk images go by ProDOS/DOS blocks; anything smaller than a filesystem
+ * block doesn't save space for ordinary files.
+ */
+#define kNuSparseDiskBlockSize  512
+#define kNuSparseFileBlockSize  4096
+#define kNuSparseMaxBlockSize   4096
+#define kNuMaxHoleSeek          0x40000000  /* fits in a 32-bit long */
+
 typedef enum NuDataSinkType {
     kNuDataSinkUnknown = 0,
     kNuDataSinkToFile,
@@ -402,6 +573,16 @@ union NuDataSink {
 
         /* temp storage; must be NULL except when processing in library */
         FILE*               fp;
+
+        /* zero blocks are seeked over to leave holes; see SourceSink.c */
+        uint32_t            sparseBlockSize;    /* 0 if not doing holes */
+        uint32_t            fileOffset;     /* current offset in "fp" */
+        uint32_t            holeLen;        /* bytes seeked over but unwritten */
+
+        /* data collected for the output queue; see OutQueue.c */
+        uint8_t*            queueBuf;       /* NULL if writing to "fp" */
+        uint32_t            queueLen;
+        uint32_t            queueSize;
     } toFile;
 
     struct {
@@ -481,12 +662,72 @@ union NuDataSink {
             }                                                       \
         }
 
+/*
+ * Scanners that can't use SSE2 look at 8 bytes at a time with these.
+ * Nu_ByteSplat copies "ch" into all 8 bytes of a uint64_t, and
+ * Nu_HasZeroByte is nonzero if any byte of "x" is zero.  The latter can
+ * also flag bytes above the first zero, so it says whether a block has a
+ * zero in it, not where.
+ */
+#define Nu_ByteSplat(ch)    (0x0101010101010101ULL * (uint8_t) (ch))
+#define Nu_HasZeroByte(x)   \
+            (((x) - 0x0101010101010101ULL) & ~(x) & 0x8080808080808080ULL)
+
+
+/*
+ * Mutex, for the few things that are shared between archives.  Without
+ * thread support this does nothing, and the shared state is only safe
+ * to use from one thread at a time.
+ */
+#if defined(HAVE_PTHREAD)
+typedef pthread_mutex_t NuMutex;
+# define kNuMutexInitializer    PTHREAD_MUTEX_INITIALIZER
+#elif defined(_WIN32)
+typedef SRWLOCK NuMutex;
+# define kNuMutexInitializer    SRWLOCK_INIT
+#else
+typedef int NuMutex;
+# define kNuMutexInitializer    0
+#endif
+
+/*
+ * Condition variable, used with a NuMutex.  These are only useful with
+ * thread support, so there's no fallback.
+ */
+#if defined(HAVE_PTHREAD)
+typedef pthread_cond_t NuCond;
+#elif defined(_WIN32)
+typedef CONDITION_VARIABLE NuCond;
+#else
+typedef int NuCond;
+#endif
+
+/*
+ * Worker thread, for codecs that split their work into independent
+ * pieces.  Without thread support the work is done by Nu_WorkerStart,
+ * so the callers don't need to care.
+ */
+typedef void (*NuWorkerFunc)(void* arg);
+typedef struct NuWorker {
+    NuWorkerFunc    func;
+    void*           arg;
+    Boolean         running;                /* set if we need to join */
+    uint64_t        cpuTime;                /* CPU used, once joined */
+#if defined(HAVE_PTHREAD)
+    pthread_t       thread;
+#elif defined(_WIN32)
+    HANDLE          thread;
+#endif
+} NuWorker;
+
 
 /*
  * Internal function prototypes and inline functions.
  */
 
 /* Archive.c */
+NuError Nu_NuArchiveNew(NuArchive** ppArchive);
+NuError Nu_NuArchiveFree(NuArchive* pArchive);
 void Nu_MasterHeaderCopy(NuArchive* pArchive, NuMasterHeader* pDstHeader,
     const NuMasterHeader* pSrcHeader);
 NuError Nu_GetMasterHeader(NuArchive* pArchive,
@@ -538,11 +779,28 @@ NuError Nu_SeekArchive(NuArchive* pArchive, FILE* fp, long offset,
     int ptrname);
 NuError Nu_RewindArchive(NuArchive* pArchive);
 
+/* Arena.c */
+#ifdef USE_DMALLOC
+# define Nu_ArenaAlloc(archive, size) Nu_Malloc(archive, size)
+# define Nu_ArenaCalloc(archive, size) Nu_Calloc(archive, size)
+# define Nu_ArenaRealloc(archive, ptr, size) Nu_Realloc(archive, ptr, size)
+# define Nu_ArenaFree(archive, ptr) Nu_Free(archive, ptr)
+#else
+void* Nu_ArenaAlloc(NuArchive* pArchive, size_t size);
+void* Nu_ArenaCalloc(NuArchive* pArchive, size_t size);
+void* Nu_ArenaRealloc(NuArchive* pArchive, void* ptr, size_t size);
+void Nu_ArenaFree(NuArchive* pArchive, void* ptr);
+#endif
+char* Nu_ArenaStrdup(NuArchive* pArchive, const char* str);
+void Nu_ArenaDestroy(NuArchive* pArchive);
+
 /* Bzip2.c */
-NuError Nu_CompressBzip2(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressBzip2(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
 NuError Nu_ExpandBzip2(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc);
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc);
+void Nu_FreeBzip2State(void* bzip2State);
 
 /* Charset.c */
 size_t Nu_ConvertMORToUNI(const char* stringMOR, UNICHAR* bufUNI,
@@ -551,7 +809,46 @@ UNICHAR* Nu_CopyMORToUNI(const char* stringMOR);
 size_t Nu_ConvertUNIToMOR(const UNICHAR* stringUNI, char* bufMOR,
     size_t bufSize);
 
+/* Codec.c */
+NuError Nu_CreateCodecContext(NuCodecContext** ppContext);
+NuError Nu_FreeCodecContext(NuCodecContext* pContext);
+NuError Nu_CompressBuffer(NuCodecContext* pContext,
+    NuThreadFormat threadFormat, const uint8_t* srcBuf, uint32_t srcLen,
+    uint8_t* dstBuf, uint32_t dstBufLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_ExpandBuffer(NuCodecContext* pContext, NuThreadFormat threadFormat,
+    const uint8_t* srcBuf, uint32_t srcLen, uint8_t* dstBuf, uint32_t dstLen,
+    uint16_t* pCrc);
+
+/* CodecPool.c */
+void Nu_CodecPoolAttach(NuArchive* pArchive);
+void Nu_CodecPoolRelease(NuArchive* pArchive);
+NuError Nu_SetCodecPoolLimit(long limit);
+
+/* Compact.c */
+Boolean Nu_CanCompactInPlace(NuArchive* pArchive);
+NuError Nu_CompactInPlace(NuArchive* pArchive);
+NuError Nu_CompactRecover(NuArchive* pArchive);
+
+/* CompStream.c */
+void Nu_CompStreamInitFile(NuArchive* pArchive, NuCompStream* pStream,
+    FILE* fp);
+void Nu_CompStreamInitBuffer(NuCompStream* pStream, uint8_t* buffer,
+    uint32_t bufLen);
+void Nu_CompStreamInitReadBuffer(NuCompStream* pStream, const uint8_t* buffer,
+    uint32_t dataLen);
+NuError Nu_CompStreamRead(NuCompStream* pStream, void* buf, uint32_t len);
+NuError Nu_CompStreamWrite(NuCompStream* pStream, const void* buf,
+    uint32_t len);
+int Nu_CompStreamGetc(NuCompStream* pStream);
+void Nu_CompStreamPutc(NuCompStream* pStream, int val);
+NuError Nu_CompStreamTell(NuCompStream* pStream, long* pOffset);
+NuError Nu_CompStreamSeek(NuCompStream* pStream, long offset, int ptrname);
+NuError Nu_CompStreamGetError(NuCompStream* pStream);
+
 /* Compress.c */
+NuError Nu_CompressToStream(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, NuThreadFormat targetFormat, uint32_t srcLen,
+    uint32_t* pDstLen, uint16_t* pCrc);
 NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
     NuThreadID threadID, NuThreadFormat sourceFormat,
     NuThreadFormat targetFormat, NuProgressData* progressData, FILE* dstFp,
@@ -559,10 +856,13 @@ NuError Nu_CompressToArchive(NuArchive* pArchive, NuDataSource* pDataSource,
 NuError Nu_CopyPresizedToArchive(NuArchive* pArchive,
     NuDataSource* pDataSource, NuThreadID threadID, FILE* dstFp,
     NuThread* pThread, char** ppSavedCopy);
+NuError Nu_ScratchArchiveNew(NuArchive** ppScratch);
+void Nu_ScratchArchiveSync(const NuArchive* pArchive, NuArchive* pScratch);
 
 /* Crc16.c */
 extern const uint16_t gNuCrc16Table[256];
 uint16_t Nu_CalcCRC16(uint16_t seed, const uint8_t* ptr, int count);
+uint16_t Nu_CRC16Combine(uint16_t crc1, uint16_t crc2, uint32_t len2);
 /*
  * Update the CRC-16.
  *
@@ -593,15 +893,29 @@ NuError Nu_ThreadModAdd_FindByThreadID(const NuRecord* pRecord,
 void Nu_FreeThreadMods(NuArchive* pArchive, NuRecord* pRecord);
 NuThreadMod* Nu_ThreadMod_FindByThreadIdx(const NuRecord* pRecord,
     NuThreadIdx threadIdx);
+Boolean Nu_RecordNeedsRebuild(const NuRecord* pRecord);
 NuError Nu_Flush(NuArchive* pArchive, uint32_t* pStatusFlags);
 
 /* Deflate.c */
-NuError Nu_CompressDeflate(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressDeflate(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
 NuError Nu_ExpandDeflate(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc);
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc);
+void Nu_FreeDeflateState(void* deflateState);
+void Nu_FreeInflateState(void* inflateState);
+
+/* DirCache.c */
+#ifdef NU_DIR_FDS
+NuError Nu_DirCacheGet(NuArchive* pArchive, const UNICHAR* pathnameUNI,
+    Boolean create, int* pDirFd, const UNICHAR** pLeafUNI);
+#endif
+void Nu_DirCacheFlush(NuArchive* pArchive);
 
 /* Expand.c */
+NuError Nu_ExpandFromStream(NuArchive* pArchive, const NuRecord* pRecord,
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc);
 NuError Nu_ExpandStream(NuArchive* pArchive, const NuRecord* pRecord,
     const NuThread* pThread, FILE* infp, NuFunnel* pFunnel);
 
@@ -617,14 +931,26 @@ NuError Nu_OpenInputFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
     Boolean openRsrc, FILE** pFp);
 NuError Nu_DeleteFile(const UNICHAR* pathnameUNI);
 NuError Nu_RenameFile(const UNICHAR* fromPathUNI, const UNICHAR* toPathUNI);
-NuError Nu_FTell(FILE* fp, long* pOffset);
-NuError Nu_FSeek(FILE* fp, long offset, int ptrname);
-NuError Nu_FRead(FILE* fp, void* buf, size_t nbyte);
-NuError Nu_FWrite(FILE* fp, const void* buf, size_t nbyte);
+NuError Nu_FTell(NuArchive* pArchive, FILE* fp, long* pOffset);
+NuError Nu_FSeek(NuArchive* pArchive, FILE* fp, long offset, int ptrname);
+NuError Nu_FRead(NuArchive* pArchive, FILE* fp, void* buf, size_t nbyte);
+NuError Nu_FWrite(NuArchive* pArchive, FILE* fp, const void* buf,
+    size_t nbyte);
 NuError Nu_CopyFileSection(NuArchive* pArchive, FILE* dstFp, FILE* srcFp,
     long length);
 NuError Nu_GetFileLength(NuArchive* pArchive, FILE* fp, long* pLength);
 NuError Nu_TruncateOpenFile(FILE* fp, long length);
+NuError Nu_SyncOpenFile(FILE* fp);
+NuError Nu_SyncParentDir(NuArchive* pArchive, const UNICHAR* pathnameUNI);
+
+/* FlushPool.c */
+NuError Nu_FlushPoolBegin(NuArchive* pArchive);
+void Nu_FlushPoolEnd(NuArchive* pArchive);
+NuError Nu_FlushPoolWriteThread(NuArchive* pArchive,
+    const NuThreadMod* pThreadMod, NuThreadFormat targetFormat,
+    NuProgressData* pProgressData, FILE* dstFp, NuThread* pThread,
+    Boolean* pWritten);
+void Nu_FlushPoolRecordDone(NuArchive* pArchive, const NuRecord* pRecord);
 
 /* Funnel.c */
 NuError Nu_ProgressDataInit_Compress(NuArchive* pArchive,
@@ -662,22 +988,29 @@ NuError Nu_StrawRead(NuArchive* pArchive, NuStraw* pStraw, uint8_t* buffer,
 NuError Nu_StrawRewind(NuArchive* pArchive, NuStraw* pStraw);
 
 /* Lzc.c */
-NuError Nu_CompressLZC12(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
-NuError Nu_CompressLZC16(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressLZC12(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressLZC16(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
 NuError Nu_ExpandLZC(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc);
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc);
+void Nu_FreeLZCState(void* lzcState);
 
 /* Lzw.c */
-NuError Nu_CompressLZW1(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
-NuError Nu_CompressLZW2(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressLZW1(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressLZW2(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
 NuError Nu_ExpandLZW(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel,
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
     uint16_t* pThreadCrc);
 
+/* MemTemp.c */
+void Nu_MemTempBegin(NuArchive* pArchive);
+NuError Nu_MemTempCommit(NuArchive* pArchive);
+void Nu_MemTempDiscard(NuArchive* pArchive);
+
 /* MiscUtils.c */
 /*extern const char* kNufxLibName;*/
 extern NuCallback gNuGlobalErrorMessageHandler;
@@ -694,13 +1027,77 @@ void Nu_ReportError(NuArchive* pArchive, const char* file, int line,
 # define Nu_Calloc(archive, size) calloc(1, size)
 # define Nu_Realloc(archive, ptr, size) realloc(ptr, size)
 # define Nu_Free(archive, ptr) (ptr != NULL ? free(ptr) : (void)0)
+# define Nu_Strdup(archive, str) strdup(str)
+# define Nu_AllocatorMalloc(allocator, size) malloc(size)
+# define Nu_GetAllocator(archive) ((const NuAllocator*) NULL)
+# define Nu_UsesGlobalAllocator(archive) true
 #else
 void* Nu_Malloc(NuArchive* pArchive, size_t size);
 void* Nu_Calloc(NuArchive* pArchive, size_t size);
 void* Nu_Realloc(NuArchive* pArchive, void* ptr, size_t size);
 void Nu_Free(NuArchive* pArchive, void* ptr);
+char* Nu_Strdup(NuArchive* pArchive, const char* str);
+void* Nu_AllocatorMalloc(const NuAllocator* pAllocator, size_t size);
+const NuAllocator* Nu_GetAllocator(const NuArchive* pArchive);
+Boolean Nu_UsesGlobalAllocator(const NuArchive* pArchive);
 #endif
+NuError Nu_SetGlobalAllocator(const NuAllocator* pAllocator);
+NuError Nu_SetAllocator(NuArchive* pArchive, const NuAllocator* pAllocator);
 NuResult Nu_InternalFreeCallback(NuArchive* pArchive, void* args);
+void Nu_MutexInit(NuMutex* pMutex);
+void Nu_MutexDestroy(NuMutex* pMutex);
+void Nu_MutexLock(NuMutex* pMutex);
+void Nu_MutexUnlock(NuMutex* pMutex);
+void Nu_CondInit(NuCond* pCond);
+void Nu_CondDestroy(NuCond* pCond);
+void Nu_CondWait(NuCond* pCond, NuMutex* pMutex);
+void Nu_CondBroadcast(NuCond* pCond);
+uint32_t Nu_GetTickCount(void);
+uint64_t Nu_GetNanoTime(void);
+uint64_t Nu_GetThreadCPUTime(void);
+int Nu_GetWorkerCount(const NuArchive* pArchive);
+Boolean Nu_WorkerTryStart(NuWorker* pWorker, NuWorkerFunc func, void* arg);
+void Nu_WorkerStart(NuWorker* pWorker, NuWorkerFunc func, void* arg);
+void Nu_WorkerJoin(NuWorker* pWorker);
+
+/* OutQueue.c */
+uint8_t* Nu_OutQueueGetBuffer(NuArchive* pArchive, uint32_t len);
+NuError Nu_OutQueueAdd(NuArchive* pArchive, const NuRecord* pRecord, FILE* fp,
+    const UNICHAR* pathnameUNI, uint8_t* buf, uint32_t len);
+void Nu_OutQueueWaitForPath(NuArchive* pArchive, const UNICHAR* pathnameUNI);
+NuError Nu_OutQueueDrain(NuArchive* pArchive);
+void Nu_OutQueueFree(NuArchive* pArchive);
+
+/* Prefetch.c */
+void Nu_PrefetchBegin(NuArchive* pArchive);
+void Nu_PrefetchAdvance(NuArchive* pArchive, const NuRecord* pRecord);
+void Nu_PrefetchRecordDone(NuArchive* pArchive);
+void Nu_PrefetchEnd(NuArchive* pArchive);
+
+/* Policy.c */
+NuError Nu_SetCompressPolicy(NuArchive* pArchive, const NuPolicyRule* pRules,
+    uint32_t numRules);
+NuError Nu_GetCompressPolicyStats(NuArchive* pArchive, uint32_t idx,
+    NuPolicyRule* pRule, NuPolicyStats* pStats);
+void Nu_FreeCompressPolicy(NuArchive* pArchive);
+NuThreadFormat Nu_PolicyChooseFormat(NuArchive* pArchive,
+    const NuRecord* pRecord, NuThreadID threadID,
+    const NuDataSource* pDataSource, NuThreadFormat dfltFormat,
+    int* pRuleIdx);
+Boolean Nu_PolicyFindRule(const NuArchive* pArchive, uint32_t fileType,
+    uint32_t extraType, NuThreadID threadID, uint32_t srcLen,
+    uint32_t* pRuleIdx, NuValue* pCompression);
+void Nu_PolicyAddStats(NuArchive* pArchive, int ruleIdx,
+    const NuThread* pThread);
+
+/* ReadAhead.c */
+NuError Nu_ReadAheadOpenThread(NuArchive* pArchive, const NuThread* pThread,
+    FILE* infp, NuCompStream* pStream);
+void Nu_ReadAheadCloseThread(NuArchive* pArchive, NuCompStream* pStream);
+void Nu_ReadAheadFree(NuArchive* pArchive);
+NuError Nu_ReadAheadRead(NuReadAhead* pReadAhead, void* buf, uint32_t len);
+int Nu_ReadAheadGetc(NuReadAhead* pReadAhead);
+long Nu_ReadAheadTell(const NuReadAhead* pReadAhead);
 
 /* Record.c */
 void Nu_RecordAddThreadMod(NuRecord* pRecord, NuThreadMod* pThreadMod);
@@ -715,10 +1112,14 @@ NuRecord* Nu_RecordSet_GetListTail(const NuRecordSet* pRecordSet);
 Boolean Nu_RecordSet_IsEmpty(const NuRecordSet* pRecordSet);
 NuError Nu_RecordSet_FreeAllRecords(NuArchive* pArchive,
     NuRecordSet* pRecordSet);
+void Nu_RecordSet_DiscardAllRecords(NuArchive* pArchive,
+    NuRecordSet* pRecordSet);
 NuError Nu_RecordSet_DeleteRecordPtr(NuArchive* pArchive,
     NuRecordSet* pRecordSet, NuRecord** ppRecord);
 NuError Nu_RecordSet_DeleteRecord(NuArchive* pArchive, NuRecordSet* pRecordSet,
     NuRecord* pRecord);
+NuError Nu_RecordSet_MoveRecordToTail(NuRecordSet* pRecordSet,
+    NuRecord* pRecord);
 NuError Nu_RecordSet_Clone(NuArchive* pArchive, NuRecordSet* pDstSet,
     const NuRecordSet* pSrcSet);
 NuError Nu_RecordSet_MoveAllRecords(NuArchive* pArchive, NuRecordSet* pDstSet,
@@ -754,6 +1155,8 @@ NuError Nu_AddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
     NuRecordIdx* pRecordIdx);
 NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
     NuRecordIdx* pRecordIdx, NuRecord** ppRecord);
+NuError Nu_AddFiles(NuArchive* pArchive, const NuAddFileEntry* pEntries,
+    uint32_t numEntries, NuRecordIdx* pRecordIdxs, NuError* pResults);
 NuError Nu_Rename(NuArchive* pArchive, NuRecordIdx recIdx,
     const char* pathnameMOR, char fssepMOR);
 NuError Nu_SetRecordAttr(NuArchive* pArchive, NuRecordIdx recordIdx,
@@ -785,9 +1188,14 @@ NuError Nu_DataSourcePrepareInput(NuArchive* pArchive,
 void Nu_DataSourceUnPrepareInput(NuArchive* pArchive,
     NuDataSource* pDataSource);
 const char* Nu_DataSourceFile_GetPathname(NuDataSource* pDataSource);
-NuError Nu_DataSourceGetBlock(NuDataSource* pDataSource, uint8_t* buf,
-    uint32_t len);
-NuError Nu_DataSourceRewind(NuDataSource* pDataSource);
+Boolean Nu_DataSourceGetDirectInput(const NuDataSource* pDataSource,
+    const UNICHAR** ppPathnameUNI, const uint8_t** ppBuffer,
+    uint32_t* pLength);
+Boolean Nu_DataSourceGetMaxLen(const NuDataSource* pDataSource,
+    uint32_t* pLength);
+NuError Nu_DataSourceGetBlock(NuArchive* pArchive, NuDataSource* pDataSource,
+    uint8_t* buf, uint32_t len);
+NuError Nu_DataSourceRewind(NuArchive* pArchive, NuDataSource* pDataSource);
 NuError Nu_DataSinkFile_New(Boolean doExpand, NuValue convertEOL,
     const UNICHAR* pathnameUNI, UNICHAR fssep, NuDataSink** ppDataSink);
 NuError Nu_DataSinkFP_New(Boolean doExpand, NuValue convertEOL, FILE* fp,
@@ -805,16 +1213,54 @@ const char* Nu_DataSinkFile_GetPathname(const NuDataSink* pDataSink);
 UNICHAR Nu_DataSinkFile_GetFssep(const NuDataSink* pDataSink);
 FILE* Nu_DataSinkFile_GetFP(const NuDataSink* pDataSink);
 void Nu_DataSinkFile_SetFP(NuDataSink* pDataSink, FILE* fp);
+void Nu_DataSinkFile_SetSparse(NuDataSink* pDataSink, uint32_t blockSize);
+void Nu_DataSinkFile_SetQueueBuf(NuDataSink* pDataSink, uint8_t* buf,
+    uint32_t size);
+uint8_t* Nu_DataSinkFile_TakeQueueBuf(NuDataSink* pDataSink,
+    uint32_t* pLen);
+NuError Nu_DataSinkFile_EndHole(NuArchive* pArchive, NuDataSink* pDataSink);
 void Nu_DataSinkFile_Close(NuDataSink* pDataSink);
-NuError Nu_DataSinkPutBlock(NuDataSink* pDataSink, const uint8_t* buf,
-    uint32_t len);
+NuError Nu_DataSinkPutBlock(NuArchive* pArchive, NuDataSink* pDataSink,
+    const uint8_t* buf, uint32_t len);
 NuError Nu_DataSinkGetError(NuDataSink* pDataSink);
 
 /* Squeeze.c */
-NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
+NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc);
 NuError Nu_ExpandHuffmanSQ(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc);
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc);
+
+/* Stats.c */
+typedef struct NuStatsTimer {
+    uint64_t        wallStart;
+    uint64_t        cpuStart;
+    uint64_t        workerStart;
+} NuStatsTimer;
+#define Nu_StatsAddRead(pArchive, len) \
+    ((pArchive)->stats.bytesRead += (len))
+#define Nu_StatsAddWrite(pArchive, fp, len) \
+    ((pArchive)->stats.bytesWritten += (len), \
+     (fp) == (pArchive)->tmpFp ? \
+        (void) ((pArchive)->stats.tempFileBytes += (len)) : (void) 0)
+uint64_t Nu_StatsStartClock(const NuArchive* pArchive);
+void Nu_StatsStopClock(const NuArchive* pArchive, uint64_t start,
+    uint64_t* pTotal);
+void Nu_StatsCodecStart(const NuArchive* pArchive, NuStatsTimer* pTimer);
+void Nu_StatsCodecStop(const NuArchive* pArchive, const NuStatsTimer* pTimer,
+    NuCodecStats* pCodecStats, uint32_t bytesIn, uint32_t bytesOut);
+void Nu_StatsAddWorker(NuArchive* pArchive, const NuWorker* pWorker);
+uint16_t Nu_StatsCalcCRC16(NuArchive* pArchive, uint16_t seed,
+    const uint8_t* ptr, int count);
+void Nu_StatsMerge(NuArchive* pArchive, NuArchive* pScratch);
+NuError Nu_GetStats(NuArchive* pArchive, NuStats* pStats);
+NuError Nu_ResetStats(NuArchive* pArchive);
+
+/* TestPool.c */
+NuError Nu_TestPoolBegin(NuArchive* pArchive);
+void Nu_TestPoolEnd(NuArchive* pArchive);
+NuError Nu_TestPoolCheckThread(NuArchive* pArchive, const NuThread* pThread,
+    NuFunnel* pFunnel, Boolean* pVerified);
 
 /* Thread.c */
 NuThread* Nu_GetThread(const NuRecord* pRecord, int idx);
@@ -833,6 +1279,7 @@ NuError Nu_WriteThreadHeaders(NuArchive* pArchive, NuRecord* pRecord, FILE* fp,
     uint16_t* pCrc);
 NuError Nu_ComputeThreadData(NuArchive* pArchive, NuRecord* pRecord);
 NuError Nu_ScanThreads(NuArchive* pArchive, NuRecord* pRecord,long numThreads);
+NuError Nu_ExtractFinish(NuArchive* pArchive, NuError err);
 NuError Nu_ExtractThreadBulk(NuArchive* pArchive, const NuRecord* pRecord,
     const NuThread* pThread);
 NuError Nu_SkipThread(NuArchive* pArchive, const NuRecord* pRecord,
@@ -858,4 +1305,18 @@ NuThreadFormat Nu_ConvertCompressValToFormat(NuArchive* pArchive,
 NuError Nu_GetVersion(int32_t* pMajorVersion, int32_t* pMinorVersion,
     int32_t* pBugVersion, const char** ppBuildDate, const char** ppBuildFlags);
 
+/* WriteBehind.c */
+NuError Nu_WriteBehindBegin(NuArchive* pArchive, FILE* fp);
+NuError Nu_WriteBehindEnd(NuArchive* pArchive);
+void Nu_WriteBehindOpenThread(NuArchive* pArchive, FILE* dstFp,
+    NuCompStream* pStream);
+NuError Nu_WriteBehindCloseThread(NuCompStream* pStream);
+NuError Nu_WriteBehindWrite(NuWriteBehind* pWriteBehind, const void* buf,
+    uint32_t len);
+void Nu_WriteBehindPutc(NuWriteBehind* pWriteBehind, int val);
+long Nu_WriteBehindTell(const NuWriteBehind* pWriteBehind);
+NuError Nu_WriteBehindSeek(NuArchive* pArchive, NuWriteBehind* pWriteBehind,
+    long offset, int ptrname);
+NuError Nu_WriteBehindGetError(NuWriteBehind* pWriteBehind);
+
 #endif /*NUFXLIB_NUFXLIBPRIV_H*/
@@ -0,0 +1,703 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Asynchronous output for extracted files.
+ *
+ * When an archive holds thousands of tiny files, extraction spends most
+ * of its time waiting for each file to be written and closed, one at a
+ * time.  When kNuValueOutputQueueLimit is set, small threads are expanded
+ * into a memory buffer instead of straight into the file.  The buffer is
+ * handed to an io_uring along with the (already open) file, and we move
+ * on to the next thread.  Writes are submitted in batches, and when one
+ * finishes we set the dates and access and close the file, as
+ * Nu_CloseOutputFile would have done.
+ *
+ * Files are still created synchronously, by Nu_OpenOutputFile, so the
+ * "file exists" checks and the prompts that go with them work as before.
+ * If we're asked to overwrite a file that's still in the queue, the queue
+ * is drained first.
+ *
+ * The total size of the buffers in the queue is limited by the value of
+ * kNuValueOutputQueueLimit, and a thread can't use more than a quarter of
+ * that.  If the expanded data turns out to be bigger than the buffer
+ * (e.g. from EOL conversion), the data sink writes what it has to the
+ * file and carries on normally.
+ *
+ * Write errors are noticed when the write completes, which may be a few
+ * files later.  They're reported then, and returned at the end of the
+ * extract call.
+ *
+ * Without io_uring (non-Linux systems, old kernels, or if the ring can't
+ * be set up), no buffers are handed out and files are written directly,
+ * as they always were.  Setting NUFXLIB_NO_IO_URING in the environment
+ * does the same thing, so the fallback can be tested.
+ *
+ * If the ring fails after it's been set up, we wait for the kernel to
+ * finish the writes it already has, and write the rest of the queue
+ * directly.  Setting NUFXLIB_IO_URING_FAIL to N makes submissions fail
+ * once N writes have gone in, to test that.
+ */
+#include "NufxLibPriv.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    defined(__GNUC__)
+#  define NU_IO_URING
+# endif
+#endif
+
+/*
+ * Write a file and close it, without the queue.  Takes ownership of "fp"
+ * and "buf".
+ */
+static NuError Nu_OutQueueWriteNow(NuArchive* pArchive,
+    const NuRecord* pRecord, FILE* fp, const UNICHAR* pathnameUNI,
+    uint8_t* buf, uint32_t len)
+{
+    NuError err;
+
+    err = Nu_FWrite(pArchive, fp, buf, len);
+    if (err == kNuErrNone) {
+        err = Nu_CloseOutputFile(pArchive, pRecord, fp, pathnameUNI);
+    } else {
+        Nu_ReportError(NU_BLOB, err, "Unable to write '%s'", pathnameUNI);
+        fclose(fp);
+    }
+    Nu_Free(pArchive, buf);
+    return err;
+}
+
+#ifdef NU_IO_URING
+
+/* how many files can be in the queue */
+#define kNuOutQueueDepth    64
+
+/* how many writes we collect before submitting them */
+#define kNuOutQueueBatch    16
+
+/*
+ * A file waiting to be written.  "record" is a shallow copy of the
+ * record, which is only used for its dates and access flags; the
+ * pointers in it aren't valid.
+ */
+typedef struct NuOutQueueEntry {
+    FILE*           fp;                 /* NULL if the entry is free */
+    uint8_t*        buf;
+    uint32_t        len;
+    uint32_t        written;
+    Boolean         inFlight;           /* write handed to the ring */
+    UNICHAR*        pathnameUNI;
+    NuRecord        record;
+} NuOutQueueEntry;
+
+struct NuOutQueue {
+    int             ringFd;
+    Boolean         broken;             /* ring failed; stop using it */
+
+    /* submission queue */
+    void*           sqRing;
+    size_t          sqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t          sqesSize;
+    unsigned*       sqHead;
+    unsigned*       sqTail;
+    unsigned        sqMask;
+    unsigned*       sqArray;
+    unsigned        sqLocalTail;        /* includes unsubmitted entries */
+    unsigned        numUnsubmitted;
+    unsigned        numInFlight;
+    unsigned        numSubmitted;       /* total, for failAfter */
+    unsigned        failAfter;          /* NUFXLIB_IO_URING_FAIL */
+
+    /* completion queue; may share the mapping with the SQ */
+    void*           cqRing;
+    size_t          cqRingSize;
+    struct io_uring_cqe* cqes;
+    unsigned*       cqHead;
+    unsigned*       cqTail;
+    unsigned        cqMask;
+
+    NuOutQueueEntry entries[kNuOutQueueDepth];
+    uint32_t        numQueued;
+    uint32_t        bytesQueued;
+    NuError         stickyErr;          /* first write failure */
+};
+
+
+/*
+ * Thin wrappers for the system calls.  There's no libc wrapper for these.
+ */
+static int Nu_IoUringSetup(unsigned entries, struct io_uring_params* pParams)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, pParams);
+}
+static int Nu_IoUringEnter(int ringFd, unsigned toSubmit, unsigned minComplete,
+    unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete,
+                flags, NULL, 0);
+}
+
+
+/*
+ * Tear down the ring.  Anything still in the queue has to be dealt with
+ * first.
+ */
+static void Nu_OutQueueFreeRing(NuArchive* pArchive, NuOutQueue* pQueue)
+{
+    if (pQueue->sqes != NULL)
+        munmap(pQueue->sqes, pQueue->sqesSize);
+    if (pQueue->cqRing != NULL && pQueue->cqRing != pQueue->sqRing)
+        munmap(pQueue->cqRing, pQueue->cqRingSize);
+    if (pQueue->sqRing != NULL)
+        munmap(pQueue->sqRing, pQueue->sqRingSize);
+    if (pQueue->ringFd >= 0)
+        close(pQueue->ringFd);
+    Nu_Free(pArchive, pQueue);
+}
+
+/*
+ * Create the queue and its ring.  Returns NULL if io_uring isn't
+ * available.
+ */
+static NuOutQueue* Nu_OutQueueNew(NuArchive* pArchive)
+{
+    NuOutQueue* pQueue;
+    struct io_uring_params params;
+    const char* noRing;
+    const char* failAfter;
+    uint8_t* sqPtr;
+    uint8_t* cqPtr;
+
+    noRing = getenv("NUFXLIB_NO_IO_URING");
+    if (noRing != NULL && *noRing != '\0') {
+        DBUG(("--- io_uring disabled by NUFXLIB_NO_IO_URING\n"));
+        return NULL;
+    }
+
+    pQueue = Nu_Calloc(pArchive, sizeof(*pQueue));
+    if (pQueue == NULL)
+        return NULL;
+
+    failAfter = getenv("NUFXLIB_IO_URING_FAIL");
+    if (failAfter != NULL)
+        pQueue->failAfter = (unsigned) atoi(failAfter);
+
+    memset(&params, 0, sizeof(params));
+    pQueue->ringFd = Nu_IoUringSetup(kNuOutQueueDepth, &params);
+    if (pQueue->ringFd < 0) {
+        DBUG(("--- io_uring_setup failed (errno=%d)\n", errno));
+        goto fail;
+    }
+
+    pQueue->sqRingSize = params.sq_off.array +
+                            params.sq_entries * sizeof(unsigned);
+    pQueue->cqRingSize = params.cq_off.cqes +
+                            params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (pQueue->cqRingSize > pQueue->sqRingSize)
+            pQueue->sqRingSize = pQueue->cqRingSize;
+        pQueue->cqRingSize = pQueue->sqRingSize;
+    }
+
+    pQueue->sqRing = mmap(NULL, pQueue->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, pQueue->ringFd,
+                        IORING_OFF_SQ_RING);
+    if (pQueue->sqRing == MAP_FAILED) {
+        pQueue->sqRing = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        pQueue->cqRing = pQueue->sqRing;
+    } else {
+        pQueue->cqRing = mmap(NULL, pQueue->cqRingSize,
+                            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            pQueue->ringFd, IORING_OFF_CQ_RING);
+        if (pQueue->cqRing == MAP_FAILED) {
+            pQueue->cqRing = NULL;
+            goto fail;
+        }
+    }
+    pQueue->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    pQueue->sqes = mmap(NULL, pQueue->sqesSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, pQueue->ringFd,
+                        IORING_OFF_SQES);
+    if (pQueue->sqes == MAP_FAILED) {
+        pQueue->sqes = NULL;
+        goto fail;
+    }
+
+    sqPtr = pQueue->sqRing;
+    pQueue->sqHead = (unsigned*) (sqPtr + params.sq_off.head);
+    pQueue->sqTail = (unsigned*) (sqPtr + params.sq_off.tail);
+    pQueue->sqMask = *(unsigned*) (sqPtr + params.sq_off.ring_mask);
+    pQueue->sqArray = (unsigned*) (sqPtr + params.sq_off.array);
+    pQueue->sqLocalTail = *pQueue->sqTail;
+
+    cqPtr = pQueue->cqRing;
+    pQueue->cqHead = (unsigned*) (cqPtr + params.cq_off.head);
+    pQueue->cqTail = (unsigned*) (cqPtr + params.cq_off.tail);
+    pQueue->cqMask = *(unsigned*) (cqPtr + params.cq_off.ring_mask);
+    pQueue->cqes = (struct io_uring_cqe*) (cqPtr + params.cq_off.cqes);
+
+    DBUG(("--- output queue ready (sq=%u cq=%u)\n", params.sq_entries,
+        params.cq_entries));
+    return pQueue;
+
+fail:
+    Nu_OutQueueFreeRing(pArchive, pQueue);
+    return NULL;
+}
+
+/*
+ * Put a write for the unwritten part of an entry on the submission queue.
+ * It isn't submitted until Nu_OutQueueSubmit is called.
+ */
+static void Nu_OutQueuePrepWrite(NuOutQueue* pQueue, int idx)
+{
+    NuOutQueueEntry* pEntry = &pQueue->entries[idx];
+    struct io_uring_sqe* pSqe;
+    unsigned slot;
+
+    slot = pQueue->sqLocalTail & pQueue->sqMask;
+    pSqe = &pQueue->sqes[slot];
+    memset(pSqe, 0, sizeof(*pSqe));
+    pSqe->opcode = IORING_OP_WRITE;
+    pSqe->fd = fileno(pEntry->fp);
+    pSqe->addr = (uint64_t) (uintptr_t) (pEntry->buf + pEntry->written);
+    pSqe->len = pEntry->len - pEntry->written;
+    pSqe->off = pEntry->written;
+    pSqe->user_data = idx;
+    pQueue->sqArray[slot] = slot;
+
+    Assert(!pEntry->inFlight);
+    pEntry->inFlight = true;
+    pQueue->numInFlight++;
+    pQueue->sqLocalTail++;
+    pQueue->numUnsubmitted++;
+}
+
+/*
+ * Hand everything on the submission queue to the kernel.  If "wait" is
+ * set, also wait for at least one write to complete.
+ *
+ * If the kernel is short on resources, we wait for something to finish
+ * and try again.  Any other failure breaks the ring.
+ */
+static NuError Nu_OutQueueSubmit(NuArchive* pArchive, NuOutQueue* pQueue,
+    Boolean wait)
+{
+    unsigned toSubmit;
+    int cc;
+
+    __atomic_store_n(pQueue->sqTail, pQueue->sqLocalTail, __ATOMIC_RELEASE);
+
+    while (pQueue->numUnsubmitted || wait) {
+        toSubmit = pQueue->numUnsubmitted;
+        if (pQueue->failAfter != 0 &&
+            pQueue->numSubmitted + toSubmit > pQueue->failAfter)
+        {
+            toSubmit = pQueue->failAfter - pQueue->numSubmitted;
+        }
+        if (toSubmit == 0 && pQueue->numUnsubmitted != 0) {
+            /* testing; pretend the kernel won't take any more */
+            cc = -1;
+            errno = EIO;
+        } else {
+            cc = Nu_IoUringEnter(pQueue->ringFd, toSubmit, wait ? 1 : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0);
+        }
+        if (cc < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EBUSY) && !wait) {
+                wait = true;
+                continue;
+            }
+            Nu_ReportError(NU_BLOB, errno, "io_uring_enter failed");
+            pQueue->broken = true;
+            return kNuErrFileWrite;
+        }
+        Assert((unsigned) cc <= toSubmit);
+        pQueue->numUnsubmitted -= cc;
+        pQueue->numSubmitted += cc;
+        wait = false;
+    }
+
+    return kNuErrNone;
+}
+
+/*
+ * Finish off a queue entry: set the file's dates and access, close it,
+ * and throw away the buffer.
+ */
+static void Nu_OutQueueRetire(NuArchive* pArchive, NuOutQueue* pQueue,
+    NuOutQueueEntry* pEntry, Boolean ok)
+{
+    if (ok) {
+        (void) Nu_CloseOutputFile(pArchive, &pEntry->record, pEntry->fp,
+                pEntry->pathnameUNI);
+    } else {
+        fclose(pEntry->fp);
+    }
+
+    Assert(pQueue->bytesQueued >= pEntry->len);
+    pQueue->bytesQueued -= pEntry->len;
+    pQueue->numQueued--;
+
+    Nu_Free(pArchive, pEntry->buf);
+    Nu_Free(pArchive, pEntry->pathnameUNI);
+    memset(pEntry, 0, sizeof(*pEntry));
+}
+
+/*
+ * Write an entry without the ring.
+ */
+static void Nu_OutQueueWriteDirect(NuArchive* pArchive, NuOutQueue* pQueue,
+    NuOutQueueEntry* pEntry)
+{
+    NuError err;
+
+    Assert(!pEntry->inFlight);
+
+    /* the ring writes at an offset, so the file position is still zero */
+    err = Nu_FSeek(pArchive, pEntry->fp, (long) pEntry->written, SEEK_SET);
+    if (err == kNuErrNone)
+        err = Nu_FWrite(pArchive, pEntry->fp, pEntry->buf + pEntry->written,
+                pEntry->len - pEntry->written);
+    if (err != kNuErrNone) {
+        Nu_ReportError(NU_BLOB, err, "Unable to write '%s'",
+            pEntry->pathnameUNI);
+        if (pQueue->stickyErr == kNuErrNone)
+            pQueue->stickyErr = err;
+    }
+    Nu_OutQueueRetire(pArchive, pQueue, pEntry, err == kNuErrNone);
+}
+
+/*
+ * Process whatever is on the completion queue.
+ */
+static void Nu_OutQueueReap(NuArchive* pArchive, NuOutQueue* pQueue)
+{
+    NuOutQueueEntry* pEntry;
+    struct io_uring_cqe* pCqe;
+    unsigned head, tail;
+    int res;
+
+    head = *pQueue->cqHead;
+    tail = __atomic_load_n(pQueue->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        pCqe = &pQueue->cqes[head & pQueue->cqMask];
+        Assert(pCqe->user_data < kNuOutQueueDepth);
+        pEntry = &pQueue->entries[pCqe->user_data];
+        res = pCqe->res;
+        head++;
+
+        if (pEntry->fp == NULL || !pEntry->inFlight) {
+            /* we gave up waiting for this one; see Nu_OutQueueQuiesce */
+            continue;
+        }
+        pEntry->inFlight = false;
+        pQueue->numInFlight--;
+
+        if (res == -EINVAL && pEntry->written == 0) {
+            /* kernel doesn't know IORING_OP_WRITE (pre-5.6); give up */
+            DBUG(("--- io_uring can't write, falling back\n"));
+            pQueue->broken = true;
+            Nu_OutQueueWriteDirect(pArchive, pQueue, pEntry);
+        } else if (res < 0) {
+            Nu_ReportError(NU_BLOB, -res, "Unable to write '%s'",
+                pEntry->pathnameUNI);
+            if (pQueue->stickyErr == kNuErrNone)
+                pQueue->stickyErr = kNuErrFileWrite;
+            Nu_OutQueueRetire(pArchive, pQueue, pEntry, false);
+        } else if (res == 0) {
+            /* no progress; shouldn't happen with a regular file */
+            Nu_OutQueueWriteDirect(pArchive, pQueue, pEntry);
+        } else {
+            /* count it like an fwrite() */
+            pArchive->stats.fwriteCalls++;
+            pArchive->stats.bytesWritten += res;
+            pEntry->written += res;
+            if (pEntry->written < pEntry->len) {
+                /* short write, send the rest, unless the ring is gone */
+                if (pQueue->broken)
+                    Nu_OutQueueWriteDirect(pArchive, pQueue, pEntry);
+                else
+                    Nu_OutQueuePrepWrite(pQueue, pEntry - pQueue->entries);
+            } else {
+                Nu_OutQueueRetire(pArchive, pQueue, pEntry, true);
+            }
+        }
+    }
+    __atomic_store_n(pQueue->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * The ring is broken.  Wait for the kernel to finish every write it has
+ * picked up, so that nothing it might still be using is freed or closed.
+ * Writes it hasn't picked up are forgotten; we won't submit them now.
+ *
+ * If we can't even wait, the entries that are still in flight are
+ * abandoned, leaving their buffers and files open.
+ */
+static void Nu_OutQueueQuiesce(NuArchive* pArchive, NuOutQueue* pQueue)
+{
+    NuOutQueueEntry* pEntry;
+    unsigned head;
+    uint64_t idx;
+    int i, cc;
+
+    Assert(pQueue->broken);
+
+    head = __atomic_load_n(pQueue->sqHead, __ATOMIC_ACQUIRE);
+    while (head != pQueue->sqLocalTail) {
+        idx = pQueue->sqes[head & pQueue->sqMask].user_data;
+        pEntry = &pQueue->entries[idx];
+        if (pEntry->inFlight) {
+            pEntry->inFlight = false;
+            pQueue->numInFlight--;
+        }
+        head++;
+    }
+    pQueue->numUnsubmitted = 0;
+
+    Nu_OutQueueReap(pArchive, pQueue);
+    while (pQueue->numInFlight != 0) {
+        cc = Nu_IoUringEnter(pQueue->ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (cc < 0 && errno != EINTR) {
+            Nu_ReportError(NU_BLOB, errno, "io_uring_enter failed");
+            break;
+        }
+        Nu_OutQueueReap(pArchive, pQueue);
+    }
+
+    for (i = 0; pQueue->numInFlight != 0 && i < kNuOutQueueDepth; i++) {
+        pEntry = &pQueue->entries[i];
+        if (pEntry->fp == NULL || !pEntry->inFlight)
+            continue;
+        Nu_ReportError(NU_BLOB, kNuErrFileWrite, "Unable to write '%s'",
+            pEntry->pathnameUNI);
+        if (pQueue->stickyErr == kNuErrNone)
+            pQueue->stickyErr = kNuErrFileWrite;
+        Assert(pQueue->bytesQueued >= pEntry->len);
+        pQueue->bytesQueued -= pEntry->len;
+        pQueue->numQueued--;
+        pQueue->numInFlight--;
+        Nu_Free(pArchive, pEntry->pathnameUNI);
+        memset(pEntry, 0, sizeof(*pEntry));
+    }
+}
+
+/*
+ * Wait until the number of entries and bytes in the queue drop to the
+ * given levels.
+ */
+static void Nu_OutQueueWait(NuArchive* pArchive, NuOutQueue* pQueue,
+    uint32_t maxEntries, uint32_t maxBytes)
+{
+    NuOutQueueEntry* pEntry;
+    int i;
+
+    Nu_OutQueueReap(pArchive, pQueue);
+    while (pQueue->numQueued > maxEntries || pQueue->bytesQueued > maxBytes) {
+        if (pQueue->broken)
+            break;
+        (void) Nu_OutQueueSubmit(pArchive, pQueue, true);
+        Nu_OutQueueReap(pArchive, pQueue);
+    }
+
+    /*
+     * If the ring broke, let the kernel finish what it has, then write
+     * whatever is left ourselves, picking up where the ring stopped.
+     */
+    if (pQueue->broken && pQueue->numQueued != 0) {
+        Nu_OutQueueQuiesce(pArchive, pQueue);
+        for (i = 0; i < kNuOutQueueDepth; i++) {
+            pEntry = &pQueue->entries[i];
+            if (pEntry->fp != NULL)
+                Nu_OutQueueWriteDirect(pArchive, pQueue, pEntry);
+        }
+    }
+}
+
+#endif /*NU_IO_URING*/
+
+
+/*
+ * Get a buffer to expand a thread of "len" bytes into, for use with
+ * Nu_OutQueueAdd.  Returns NULL if the thread should be written to the
+ * file directly.  This may wait for earlier files to be written.
+ *
+ * The buffer is allocated with Nu_Malloc.
+ */
+uint8_t* Nu_OutQueueGetBuffer(NuArchive* pArchive, uint32_t len)
+{
+#ifdef NU_IO_URING
+    NuOutQueue* pQueue;
+    uint32_t limit = pArchive->valOutputQueueLimit;
+
+    if (len == 0 || limit == 0 || len > limit / 4)
+        return NULL;
+
+    pQueue = pArchive->pOutQueue;
+    if (pQueue == NULL) {
+        pQueue = Nu_OutQueueNew(pArchive);
+        if (pQueue == NULL) {
+            /* don't try again */
+            pArchive->valOutputQueueLimit = 0;
+            return NULL;
+        }
+        pArchive->pOutQueue = pQueue;
+    }
+    if (pQueue->broken)
+        return NULL;
+
+    /* make room */
+    Nu_OutQueueWait(pArchive, pQueue, kNuOutQueueDepth - 1, limit - len);
+    if (pQueue->broken)
+        return NULL;
+
+    return Nu_Malloc(pArchive, len);
+#else
+    (void) pArchive;
+    (void) len;
+    return NULL;
+#endif
+}
+
+/*
+ * Queue up "len" bytes in "buf" to be written to "fp".  When the write
+ * is done, the file will be closed with Nu_CloseOutputFile.  This takes
+ * ownership of "fp" and "buf", whatever happens.
+ *
+ * "buf" must have come from Nu_OutQueueGetBuffer, and nothing else can
+ * have been queued since.
+ */
+NuError Nu_OutQueueAdd(NuArchive* pArchive, const NuRecord* pRecord, FILE* fp,
+    const UNICHAR* pathnameUNI, uint8_t* buf, uint32_t len)
+{
+#ifdef NU_IO_URING
+    NuOutQueue* pQueue = pArchive->pOutQueue;
+    NuOutQueueEntry* pEntry = NULL;
+    UNICHAR* pathCopyUNI;
+    int idx;
+
+    Assert(pQueue != NULL);
+    Assert(pQueue->numQueued < kNuOutQueueDepth);
+
+    /* nothing to write (e.g. the thread turned out to be empty) */
+    if (len == 0)
+        return Nu_OutQueueWriteNow(pArchive, pRecord, fp, pathnameUNI, buf,
+                len);
+
+    pathCopyUNI = Nu_Strdup(pArchive, pathnameUNI);
+    if (pathCopyUNI == NULL || pQueue->broken) {
+        Nu_Free(pArchive, pathCopyUNI);
+        return Nu_OutQueueWriteNow(pArchive, pRecord, fp, pathnameUNI, buf,
+                len);
+    }
+
+    for (idx = 0; idx < kNuOutQueueDepth; idx++) {
+        if (pQueue->entries[idx].fp == NULL) {
+            pEntry = &pQueue->entries[idx];
+            break;
+        }
+    }
+    Assert(pEntry != NULL);
+
+    pEntry->fp = fp;
+    pEntry->buf = buf;
+    pEntry->len = len;
+    pEntry->written = 0;
+    pEntry->pathnameUNI = pathCopyUNI;
+    pEntry->record = *pRecord;
+    pQueue->numQueued++;
+    pQueue->bytesQueued += len;
+
+    Nu_OutQueuePrepWrite(pQueue, idx);
+    if (pQueue->numUnsubmitted >= kNuOutQueueBatch)
+        (void) Nu_OutQueueSubmit(pArchive, pQueue, false);
+    Nu_OutQueueReap(pArchive, pQueue);
+    return kNuErrNone;
+#else
+    /* shouldn't get here, but it's easy enough to handle */
+    return Nu_OutQueueWriteNow(pArchive, pRecord, fp, pathnameUNI, buf, len);
+#endif
+}
+
+/*
+ * If "pathnameUNI" is waiting to be written, wait for the queue to empty.
+ * Call this before opening a file that already exists.
+ */
+void Nu_OutQueueWaitForPath(NuArchive* pArchive, const UNICHAR* pathnameUNI)
+{
+#ifdef NU_IO_URING
+    NuOutQueue* pQueue = pArchive->pOutQueue;
+    int i;
+
+    if (pQueue == NULL || pQueue->numQueued == 0)
+        return;
+
+    for (i = 0; i < kNuOutQueueDepth; i++) {
+        if (pQueue->entries[i].fp != NULL &&
+            strcmp(pQueue->entries[i].pathnameUNI, pathnameUNI) == 0)
+        {
+            DBUG(("--- waiting for '%s' to be written\n", pathnameUNI));
+            Nu_OutQueueWait(pArchive, pQueue, 0, 0);
+            break;
+        }
+    }
+#else
+    (void) pArchive;
+    (void) pathnameUNI;
+#endif
+}
+
+/*
+ * Wait for everything in the queue to be written and closed.  Returns
+ * the first write error since the last call, if any.
+ */
+NuError Nu_OutQueueDrain(NuArchive* pArchive)
+{
+#ifdef NU_IO_URING
+    NuOutQueue* pQueue = pArchive->pOutQueue;
+    NuError err;
+
+    if (pQueue == NULL)
+        return kNuErrNone;
+
+    Nu_OutQueueWait(pArchive, pQueue, 0, 0);
+    Assert(pQueue->numQueued == 0);
+
+    err = pQueue->stickyErr;
+    pQueue->stickyErr = kNuErrNone;
+    return err;
+#else
+    (void) pArchive;
+    return kNuErrNone;
+#endif
+}
+
+/*
+ * Drain the queue and free it.
+ */
+void Nu_OutQueueFree(NuArchive* pArchive)
+{
+#ifdef NU_IO_URING
+    if (pArchive->pOutQueue == NULL)
+        return;
+
+    (void) Nu_OutQueueDrain(pArchive);
+    Nu_OutQueueFreeRing(pArchive, pArchive->pOutQueue);
+    pArchive->pOutQueue = NULL;
+#else
+    (void) pArchive;
+#endif
+}
@@ -0,0 +1,293 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Compression policy.
+ *
+ * Normally every data thread is compressed with kNuValueDataCompression.
+ * That's a waste of time for files that are already compressed, like
+ * ShrinkIt archives and packed pictures, which almost never get smaller.
+ * When kNuValueCompressPolicy is enabled, the thread's file type, aux
+ * type, kind, and length are checked against a table of rules, and the
+ * first match picks the compression (or says to store it).
+ *
+ * A count is kept of what happened to the threads each rule was applied
+ * to, so the application can see whether the rules are pulling their
+ * weight.
+ */
+#include "NufxLibPriv.h"
+
+/* most rules we'll accept in NuSetCompressPolicy */
+#define kNuMaxPolicyRules   256
+
+/*
+ * The default policy.  These types are compressed already, so LZW just
+ * burns time before giving up and storing them.
+ */
+static const NuPolicyRule gNuDefaultPolicy[] = {
+    /* ShrinkIt archives (LBR/$8002); other LBR types may be uncompressed */
+    { 0xe0, 0x8002, 0x8002, kNuPolicyAny, 0, kNuPolicyAny,
+        kNuCompressNone },
+    /* packed super hi-res pictures (PNT) */
+    { 0xc0, 0x0000, kNuPolicyAny, kNuPolicyAny, 0, kNuPolicyAny,
+        kNuCompressNone },
+    /* packed hi-res and double hi-res pictures (FOT) */
+    { 0x08, 0x4000, 0x4001, kNuPolicyAny, 0, kNuPolicyAny,
+        kNuCompressNone },
+    /* digitized sound samples (SND) */
+    { 0xd8, 0x0000, kNuPolicyAny, kNuPolicyAny, 0, kNuPolicyAny,
+        kNuCompressNone },
+    /* too small to be worth the trouble */
+    { kNuPolicyAny, 0x0000, kNuPolicyAny, kNuPolicyAny, 0, 31,
+        kNuCompressNone },
+};
+
+
+/*
+ * Get the rules in effect for this archive.
+ */
+static const NuPolicyRule* Nu_GetPolicyRules(const NuArchive* pArchive,
+    uint32_t* pNumRules)
+{
+    if (pArchive->policyRules == NULL) {
+        *pNumRules = NELEM(gNuDefaultPolicy);
+        return gNuDefaultPolicy;
+    } else {
+        *pNumRules = pArchive->numPolicyRules;
+        return pArchive->policyRules;
+    }
+}
+
+/*
+ * Returns "true" if "compression" is something kNuValueDataCompression
+ * would accept.
+ */
+static Boolean Nu_IsValidPolicyCompression(NuValue compression)
+{
+    return ((compression >= kNuCompressNone &&
+             compression <= kNuCompressBzip2) ||
+            compression == kNuCompressBest);
+}
+
+/*
+ * Replace the archive's policy table.  Passing NULL restores the default
+ * table.  The statistics are reset either way.
+ */
+NuError Nu_SetCompressPolicy(NuArchive* pArchive, const NuPolicyRule* pRules,
+    uint32_t numRules)
+{
+    NuError err = kNuErrNone;
+    NuPolicyRule* newRules = NULL;
+    uint32_t i;
+
+    if (pRules != NULL) {
+        if (numRules == 0 || numRules > kNuMaxPolicyRules) {
+            err = kNuErrInvalidArg;
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid number of policy rules (%u)", numRules);
+            goto bail;
+        }
+        for (i = 0; i < numRules; i++) {
+            const NuPolicyRule* pRule = &pRules[i];
+
+            if (pRule->extraTypeMin > pRule->extraTypeMax ||
+                pRule->lenMin > pRule->lenMax)
+            {
+                err = kNuErrInvalidArg;
+                Nu_ReportError(NU_BLOB, err,
+                    "Policy rule %u has an empty range", i);
+                goto bail;
+            }
+            if (!Nu_IsValidPolicyCompression(pRule->compression)) {
+                err = kNuErrInvalidArg;
+                Nu_ReportError(NU_BLOB, err,
+                    "Policy rule %u has invalid compression %u", i,
+                    pRule->compression);
+                goto bail;
+            }
+        }
+
+        newRules = Nu_Malloc(pArchive, numRules * sizeof(*newRules));
+        BailAlloc(newRules);
+        memcpy(newRules, pRules, numRules * sizeof(*newRules));
+    } else {
+        numRules = 0;
+    }
+
+    Nu_FreeCompressPolicy(pArchive);
+    pArchive->policyRules = newRules;
+    pArchive->numPolicyRules = numRules;
+
+bail:
+    return err;
+}
+
+/*
+ * Get a rule and its statistics.  "idx" may be one past the last rule,
+ * in which case the results are for the threads that didn't match any
+ * rule, and "*pRule" matches everything.
+ *
+ * Either of "pRule" and "pStats" may be NULL.
+ */
+NuError Nu_GetCompressPolicyStats(NuArchive* pArchive, uint32_t idx,
+    NuPolicyRule* pRule, NuPolicyStats* pStats)
+{
+    const NuPolicyRule* rules;
+    uint32_t numRules;
+
+    rules = Nu_GetPolicyRules(pArchive, &numRules);
+    if (idx > numRules)
+        return kNuErrNotFound;
+
+    if (pRule != NULL) {
+        if (idx < numRules) {
+            *pRule = rules[idx];
+        } else {
+            pRule->fileType = kNuPolicyAny;
+            pRule->extraTypeMin = 0;
+            pRule->extraTypeMax = kNuPolicyAny;
+            pRule->threadKind = kNuPolicyAny;
+            pRule->lenMin = 0;
+            pRule->lenMax = kNuPolicyAny;
+            pRule->compression = pArchive->valDataCompression;
+        }
+    }
+    if (pStats != NULL) {
+        if (pArchive->policyStats != NULL)
+            *pStats = pArchive->policyStats[idx];
+        else
+            memset(pStats, 0, sizeof(*pStats));
+    }
+
+    return kNuErrNone;
+}
+
+/*
+ * Discard the policy table and statistics.
+ */
+void Nu_FreeCompressPolicy(NuArchive* pArchive)
+{
+    Nu_Free(pArchive, pArchive->policyRules);
+    Nu_Free(pArchive, pArchive->policyStats);
+    pArchive->policyRules = NULL;
+    pArchive->policyStats = NULL;
+    pArchive->numPolicyRules = 0;
+}
+
+
+/*
+ * Returns "true" if the rule matches.
+ */
+static Boolean Nu_PolicyRuleMatches(const NuPolicyRule* pRule,
+    uint32_t fileType, uint32_t extraType, uint32_t threadKind, uint32_t len)
+{
+    if (pRule->fileType != kNuPolicyAny && pRule->fileType != fileType)
+        return false;
+    if (extraType < pRule->extraTypeMin || extraType > pRule->extraTypeMax)
+        return false;
+    if (pRule->threadKind != kNuPolicyAny && pRule->threadKind != threadKind)
+        return false;
+    if (len < pRule->lenMin || len > pRule->lenMax)
+        return false;
+    return true;
+}
+
+/*
+ * Find the first rule that matches a thread of "srcLen" bytes in a record
+ * with the specified file and aux type.  The rule's index is stored in
+ * "*pRuleIdx" (one past the last rule if none matched), and its
+ * compression value in "*pCompression".
+ *
+ * Returns "true" if a rule matched.  This doesn't change anything or
+ * report anything, so it's safe to call from a worker thread.
+ */
+Boolean Nu_PolicyFindRule(const NuArchive* pArchive, uint32_t fileType,
+    uint32_t extraType, NuThreadID threadID, uint32_t srcLen,
+    uint32_t* pRuleIdx, NuValue* pCompression)
+{
+    const NuPolicyRule* rules;
+    uint32_t numRules, i;
+
+    rules = Nu_GetPolicyRules(pArchive, &numRules);
+    for (i = 0; i < numRules; i++) {
+        if (Nu_PolicyRuleMatches(&rules[i], fileType, extraType,
+                NuThreadIDGetKind(threadID), srcLen))
+        {
+            *pRuleIdx = i;
+            *pCompression = rules[i].compression;
+            return true;
+        }
+    }
+
+    *pRuleIdx = numRules;
+    return false;
+}
+
+/*
+ * Decide how to compress a thread.  "dfltFormat" is what the thread was
+ * going to be compressed with.  The data source must be prepared, so
+ * that its length is known.
+ *
+ * "*pRuleIdx" gets the index of the rule that was used, which is one past
+ * the last rule if none matched, or -1 if the policy doesn't apply.
+ */
+NuThreadFormat Nu_PolicyChooseFormat(NuArchive* pArchive,
+    const NuRecord* pRecord, NuThreadID threadID,
+    const NuDataSource* pDataSource, NuThreadFormat dfltFormat,
+    int* pRuleIdx)
+{
+    uint32_t ruleIdx;
+    NuValue compression;
+    Boolean found;
+
+    Assert(pRecord != NULL);
+    Assert(pRuleIdx != NULL);
+
+    *pRuleIdx = -1;
+    if (!pArchive->valCompressPolicy || !Nu_IsCompressibleThreadID(threadID) ||
+        Nu_DataSourceGetThreadFormat(pDataSource) !=
+                                            kNuThreadFormatUncompressed)
+    {
+        return dfltFormat;
+    }
+
+    found = Nu_PolicyFindRule(pArchive, pRecord->recFileType,
+                pRecord->recExtraType, threadID,
+                Nu_DataSourceGetDataLen(pDataSource), &ruleIdx, &compression);
+    *pRuleIdx = (int) ruleIdx;
+    if (!found)
+        return dfltFormat;
+
+    DBUG(("--- policy rule %u matched '%s'\n", ruleIdx, pRecord->filenameMOR));
+    return Nu_ConvertCompressValToFormat(pArchive, compression);
+}
+
+/*
+ * Add a newly-written thread to the statistics for "ruleIdx".
+ */
+void Nu_PolicyAddStats(NuArchive* pArchive, int ruleIdx,
+    const NuThread* pThread)
+{
+    NuPolicyStats* pStats;
+    uint32_t numRules;
+
+    if (ruleIdx < 0)
+        return;
+
+    if (pArchive->policyStats == NULL) {
+        (void) Nu_GetPolicyRules(pArchive, &numRules);
+        pArchive->policyStats = Nu_Calloc(pArchive,
+                                    (numRules + 1) * sizeof(NuPolicyStats));
+        if (pArchive->policyStats == NULL)
+            return;     /* not worth failing over */
+    }
+
+    pStats = &pArchive->policyStats[ruleIdx];
+    pStats->numThreads++;
+    if (pThread->thThreadFormat == kNuThreadFormatUncompressed)
+        pStats->numStored++;
+    pStats->uncompressedBytes += pThread->thThreadEOF;
+    pStats->compressedBytes += pThread->thCompThreadEOF;
+}
@@ -0,0 +1,244 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Input prefetch for NuFlush.
+ *
+ * Each input file is opened and read just before it's compressed, so the
+ * disk sits idle while we compress, and the CPU sits idle while we wait
+ * for the next file.  With a cold cache or a network filesystem, that's
+ * a lot of waiting.  When kNuValueInputPrefetch is set, the flush tells
+ * the system about the files coming up with posix_fadvise(WILLNEED), so
+ * they're being read into the page cache while the current one is
+ * compressed.
+ *
+ * The value is the most file data we'll have asked for ahead of the
+ * flush.  A file that doesn't fit in what's left only has its start
+ * prefetched.  The data belongs to the page cache, not us, but the limit
+ * keeps us from pushing out the file we're compressing with ones we won't
+ * get to for a while.  We also stop after kNuPrefetchMaxFiles files, so
+ * archives full of tiny files don't open everything at once.
+ *
+ * Only plain files are prefetched; resource forks, buffers, and FILE*
+ * sources are read as usual.  Without posix_fadvise() this does nothing.
+ */
+#include "NufxLibPriv.h"
+
+#ifdef HAVE_POSIX_FADVISE
+# include <fcntl.h>
+# define NU_PREFETCH
+#endif
+
+#ifdef NU_PREFETCH
+
+/* most files we'll prefetch ahead of the flush */
+#define kNuPrefetchMaxFiles     16
+
+typedef struct NuPrefetchFile {
+    long            recordNum;      /* which new record it's for */
+    uint32_t        len;            /* how much we asked for */
+} NuPrefetchFile;
+
+struct NuPrefetch {
+    /* the next record to look at, and its position in the "new" set */
+    const NuRecord* pNextRecord;
+    long            nextRecordNum;
+
+    /* position of the record being compressed */
+    long            curRecordNum;
+
+    /* files we've prefetched that the flush hasn't finished with */
+    NuPrefetchFile  files[kNuPrefetchMaxFiles];
+    int             head;
+    int             count;
+    uint32_t        outstanding;    /* sum of files[].len */
+};
+
+
+/*
+ * Ask for the first "len" bytes of a file.  Returns the amount asked for,
+ * which is less than "len" if the file is smaller, or zero if we couldn't
+ * open it.  (Missing files are reported when the flush gets to them.)
+ */
+static uint32_t Nu_PrefetchFile(const UNICHAR* pathnameUNI, uint32_t len)
+{
+    struct stat sb;
+    int fd;
+
+    fd = open(pathnameUNI, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        len = 0;
+    } else {
+        if ((off_t) len > sb.st_size)
+            len = (uint32_t) sb.st_size;
+        if (len != 0)
+            (void) posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    }
+
+    close(fd);
+    return len;
+}
+
+/*
+ * Prefetch the plain files in "pRecord".  Returns "false", having done
+ * nothing, if they won't all fit in the file list.
+ */
+static Boolean Nu_PrefetchRecord(NuArchive* pArchive, NuPrefetch* pPrefetch,
+    const NuRecord* pRecord)
+{
+    const NuThreadMod* pThreadMod;
+    const UNICHAR* pathnameUNI;
+    const uint8_t* buffer;
+    uint32_t bufLen, len, limit;
+    NuPrefetchFile* pFile;
+    int numFiles = 0;
+
+    pThreadMod = pRecord->pThreadMods;
+    for ( ; pThreadMod != NULL; pThreadMod = pThreadMod->pNext) {
+        if (pThreadMod->entry.kind == kNuThreadModAdd &&
+            Nu_DataSourceGetDirectInput(pThreadMod->entry.add.pDataSource,
+                &pathnameUNI, &buffer, &bufLen) &&
+            pathnameUNI != NULL)
+        {
+            numFiles++;
+        }
+    }
+    if (pPrefetch->count + numFiles > kNuPrefetchMaxFiles)
+        return false;
+
+    limit = pArchive->valInputPrefetch;
+    pThreadMod = pRecord->pThreadMods;
+    for ( ; pThreadMod != NULL; pThreadMod = pThreadMod->pNext) {
+        if (pPrefetch->outstanding >= limit)
+            break;
+        if (pThreadMod->entry.kind != kNuThreadModAdd ||
+            !Nu_DataSourceGetDirectInput(pThreadMod->entry.add.pDataSource,
+                &pathnameUNI, &buffer, &bufLen) ||
+            pathnameUNI == NULL)
+        {
+            continue;
+        }
+
+        len = Nu_PrefetchFile(pathnameUNI, limit - pPrefetch->outstanding);
+        if (len == 0)
+            continue;
+
+        DBUG(("--- Prefetching %u bytes of '%s'\n", len, pathnameUNI));
+        pFile = &pPrefetch->files[(pPrefetch->head + pPrefetch->count) %
+                                    kNuPrefetchMaxFiles];
+        pFile->recordNum = pPrefetch->nextRecordNum;
+        pFile->len = len;
+        pPrefetch->count++;
+        pPrefetch->outstanding += len;
+    }
+
+    return true;
+}
+
+#endif /*NU_PREFETCH*/
+
+
+/*
+ * Get ready to prefetch the inputs for the "new" record set.  Call at
+ * the start of Nu_CreateNewRecords.
+ *
+ * Failing to allocate the state isn't an error; we just don't prefetch.
+ */
+void Nu_PrefetchBegin(NuArchive* pArchive)
+{
+#ifdef NU_PREFETCH
+    NuPrefetch* pPrefetch;
+
+    Assert(pArchive->pPrefetch == NULL);
+
+    if (pArchive->valInputPrefetch == 0)
+        return;
+
+    pPrefetch = Nu_Calloc(pArchive, sizeof(*pPrefetch));
+    if (pPrefetch == NULL)
+        return;
+    pPrefetch->pNextRecord =
+                        Nu_RecordSet_GetListHead(&pArchive->newRecordSet);
+    pArchive->pPrefetch = pPrefetch;
+#else
+    (void) pArchive;
+#endif
+}
+
+/*
+ * We're about to construct "pRecord".  Prefetch the inputs of the records
+ * after it, as far as the limits allow.
+ */
+void Nu_PrefetchAdvance(NuArchive* pArchive, const NuRecord* pRecord)
+{
+#ifdef NU_PREFETCH
+    NuPrefetch* pPrefetch = pArchive->pPrefetch;
+
+    if (pPrefetch == NULL)
+        return;
+
+    /* if we've fallen behind, skip ahead; this one's being read now */
+    if (pPrefetch->nextRecordNum <= pPrefetch->curRecordNum) {
+        pPrefetch->pNextRecord = pRecord->pNext;
+        pPrefetch->nextRecordNum = pPrefetch->curRecordNum +1;
+    }
+
+    while (pPrefetch->pNextRecord != NULL &&
+        pPrefetch->outstanding < pArchive->valInputPrefetch)
+    {
+        if (!Nu_PrefetchRecord(pArchive, pPrefetch, pPrefetch->pNextRecord))
+            break;
+        pPrefetch->pNextRecord = pPrefetch->pNextRecord->pNext;
+        pPrefetch->nextRecordNum++;
+    }
+#else
+    (void) pArchive;
+    (void) pRecord;
+#endif
+}
+
+/*
+ * The flush is done with the current record, so whatever we prefetched
+ * for it no longer counts against the limit.
+ *
+ * The record may be about to be removed from the "new" set, so we don't
+ * hold on to it.
+ */
+void Nu_PrefetchRecordDone(NuArchive* pArchive)
+{
+#ifdef NU_PREFETCH
+    NuPrefetch* pPrefetch = pArchive->pPrefetch;
+    NuPrefetchFile* pFile;
+
+    if (pPrefetch == NULL)
+        return;
+
+    while (pPrefetch->count != 0) {
+        pFile = &pPrefetch->files[pPrefetch->head];
+        if (pFile->recordNum > pPrefetch->curRecordNum)
+            break;
+        Assert(pPrefetch->outstanding >= pFile->len);
+        pPrefetch->outstanding -= pFile->len;
+        pPrefetch->head = (pPrefetch->head +1) % kNuPrefetchMaxFiles;
+        pPrefetch->count--;
+    }
+    pPrefetch->curRecordNum++;
+#else
+    (void) pArchive;
+#endif
+}
+
+/*
+ * Throw away the prefetch state.  Anything we asked for stays in the
+ * page cache until the system wants the memory back.
+ */
+void Nu_PrefetchEnd(NuArchive* pArchive)
+{
+    Nu_Free(pArchive, pArchive->pPrefetch);
+    pArchive->pPrefetch = NULL;
+}
@@ -0,0 +1,448 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Read-ahead for extraction.
+ *
+ * The expanders alternate between reading a chunk of compressed data and
+ * decoding it, so on a slow device (a network filesystem, or a pipe
+ * feeding a streaming archive) the CPU sits idle during every read.  When
+ * kNuValueReadAhead is set, a background thread reads the archive into a
+ * ring of large buffers while the expander works on the previous ones.
+ *
+ * There are two ways this gets used:
+ *
+ * Read-only archives get a reader with its own FILE* on the archive,
+ * which runs through the file sequentially.  Extraction visits threads in
+ * TOC order, which is file order, so the next thread's data is usually
+ * buffered by the time it's wanted; the record headers in between are
+ * just skipped.  A request for something the reader has already passed,
+ * or that's a long way ahead, restarts the reader at the new offset.
+ *
+ * Streaming archives can't be read ahead of the record headers, because
+ * those are read straight from the archive FILE*.  Instead, each large
+ * thread gets a reader that reads exactly the thread's compressed data
+ * and is shut down when the thread is done.  Writable archives get the
+ * same treatment, since the archive file can be replaced by a flush.
+ *
+ * If the library doesn't have thread support, or a thread can't be
+ * started, the expander just reads the archive FILE* as usual.
+ */
+#include "NufxLibPriv.h"
+
+/* size of each buffer in the ring, and how many there are */
+#define kNuReadAheadBufSize     (64 * 1024)
+#define kNuReadAheadBufCount    4
+
+/* threads smaller than this aren't worth starting a reader for */
+#define kNuReadAheadMinThread   (2 * kNuReadAheadBufSize)
+
+/* requests at most this far ahead are read up to, rather than seeked to */
+#define kNuReadAheadMaxSkip     (kNuReadAheadBufSize * kNuReadAheadBufCount)
+
+typedef struct NuReadAheadBuf {
+    uint8_t*        data;           /* kNuReadAheadBufSize bytes */
+    uint32_t        len;            /* #of bytes of valid data */
+} NuReadAheadBuf;
+
+struct NuReadAhead {
+    FILE*           fp;
+    Boolean         ownFp;          /* close "fp" when we're done? */
+
+    NuWorker        worker;
+    Boolean         running;        /* worker started and not yet joined */
+
+    /* everything from here to the reader state is guarded by "lock" */
+    NuMutex         lock;
+    NuCond          cond;           /* broadcast after any change */
+    int             head;           /* next buffer for the expander */
+    int             numFull;        /* #of buffers holding unread data */
+    Boolean         stop;           /* reader should quit */
+    Boolean         readerDone;     /* reader hit its limit, EOF, or error */
+    uint32_t        freadCalls;     /* not yet added to the archive stats */
+    uint64_t        bytesRead;
+
+    NuReadAheadBuf  bufs[kNuReadAheadBufCount];
+
+    /* reader state; only touched by the worker while it's running */
+    int             tail;           /* next buffer to fill */
+    Boolean         bounded;        /* stop after "remaining" bytes? */
+    uint32_t        remaining;
+
+    /* expander state */
+    uint32_t        headPos;        /* read position in bufs[head] */
+    long            offset;         /* offset of the next byte; from the
+                                       start of the data if "bounded" */
+};
+
+
+/*
+ * The reader thread.  Fills empty buffers until it's told to stop, or
+ * runs out of things to read.
+ */
+static void Nu_ReadAheadReader(void* arg)
+{
+    NuReadAhead* pReadAhead = arg;
+    NuReadAheadBuf* pBuf;
+    uint32_t want;
+    size_t got;
+
+    Nu_MutexLock(&pReadAhead->lock);
+    while (true) {
+        while (pReadAhead->numFull == kNuReadAheadBufCount &&
+               !pReadAhead->stop)
+        {
+            Nu_CondWait(&pReadAhead->cond, &pReadAhead->lock);
+        }
+        if (pReadAhead->stop)
+            break;
+        Nu_MutexUnlock(&pReadAhead->lock);
+
+        /* the buffer at "tail" is ours until we count it as full */
+        pBuf = &pReadAhead->bufs[pReadAhead->tail];
+        want = kNuReadAheadBufSize;
+        if (pReadAhead->bounded && want > pReadAhead->remaining)
+            want = pReadAhead->remaining;
+        got = 0;
+        if (want != 0)
+            got = fread(pBuf->data, 1, want, pReadAhead->fp);
+        pBuf->len = (uint32_t) got;
+        if (pReadAhead->bounded)
+            pReadAhead->remaining -= (uint32_t) got;
+
+        Nu_MutexLock(&pReadAhead->lock);
+        if (want != 0) {
+            pReadAhead->freadCalls++;
+            pReadAhead->bytesRead += got;
+        }
+        if (got != 0) {
+            pReadAhead->tail = (pReadAhead->tail + 1) % kNuReadAheadBufCount;
+            pReadAhead->numFull++;
+        }
+        if (got < want || want == 0 ||
+            (pReadAhead->bounded && pReadAhead->remaining == 0))
+        {
+            pReadAhead->readerDone = true;
+        }
+        Nu_CondBroadcast(&pReadAhead->cond);
+        if (pReadAhead->readerDone)
+            break;
+    }
+    Nu_MutexUnlock(&pReadAhead->lock);
+}
+
+/*
+ * Start the reader at the current position of the FILE*, which is at file
+ * offset "offset".  If "bounded" is set, it reads "limit" bytes and stops,
+ * and "offset" should be zero.
+ *
+ * Returns "false" if a thread couldn't be started.
+ */
+static Boolean Nu_ReadAheadStart(NuReadAhead* pReadAhead, long offset,
+    Boolean bounded, uint32_t limit)
+{
+    Assert(!pReadAhead->running);
+
+    pReadAhead->head = pReadAhead->tail = 0;
+    pReadAhead->numFull = 0;
+    pReadAhead->stop = pReadAhead->readerDone = false;
+    pReadAhead->bounded = bounded;
+    pReadAhead->remaining = limit;
+    pReadAhead->headPos = 0;
+    pReadAhead->offset = offset;
+
+    pReadAhead->running = Nu_WorkerTryStart(&pReadAhead->worker,
+                            Nu_ReadAheadReader, pReadAhead);
+    return pReadAhead->running;
+}
+
+/*
+ * Stop the reader and wait for it to exit.  The file position is left
+ * wherever the reader got to.
+ */
+static void Nu_ReadAheadStop(NuReadAhead* pReadAhead)
+{
+    if (!pReadAhead->running)
+        return;
+
+    Nu_MutexLock(&pReadAhead->lock);
+    pReadAhead->stop = true;
+    Nu_CondBroadcast(&pReadAhead->cond);
+    Nu_MutexUnlock(&pReadAhead->lock);
+
+    Nu_WorkerJoin(&pReadAhead->worker);
+    pReadAhead->running = false;
+}
+
+/*
+ * Add what the reader has read so far to the archive's stats.  The reader
+ * may still be running.
+ */
+static void Nu_ReadAheadCollectStats(NuArchive* pArchive,
+    NuReadAhead* pReadAhead)
+{
+    Nu_MutexLock(&pReadAhead->lock);
+    pArchive->stats.freadCalls += pReadAhead->freadCalls;
+    Nu_StatsAddRead(pArchive, pReadAhead->bytesRead);
+    pReadAhead->freadCalls = 0;
+    pReadAhead->bytesRead = 0;
+    Nu_MutexUnlock(&pReadAhead->lock);
+}
+
+/*
+ * Dispose of a reader, stopping it first if necessary.
+ */
+static void Nu_ReadAheadDelete(NuArchive* pArchive, NuReadAhead* pReadAhead)
+{
+    int i;
+
+    if (pReadAhead == NULL)
+        return;
+
+    Nu_ReadAheadStop(pReadAhead);
+    Nu_ReadAheadCollectStats(pArchive, pReadAhead);
+    if (pReadAhead->ownFp && pReadAhead->fp != NULL)
+        fclose(pReadAhead->fp);
+    for (i = 0; i < kNuReadAheadBufCount; i++)
+        Nu_Free(pArchive, pReadAhead->bufs[i].data);
+    Nu_CondDestroy(&pReadAhead->cond);
+    Nu_MutexDestroy(&pReadAhead->lock);
+    Nu_Free(pArchive, pReadAhead);
+}
+
+/*
+ * Allocate a reader for "fp".  The reader isn't started.  If "ownFp" is
+ * set, the file will be closed when the reader is deleted.
+ */
+static NuError Nu_ReadAheadNew(NuArchive* pArchive, FILE* fp, Boolean ownFp,
+    NuReadAhead** ppReadAhead)
+{
+    NuError err = kNuErrNone;
+    NuReadAhead* pReadAhead;
+    int i;
+
+    pReadAhead = Nu_Calloc(pArchive, sizeof(*pReadAhead));
+    BailAlloc(pReadAhead);
+    Nu_MutexInit(&pReadAhead->lock);
+    Nu_CondInit(&pReadAhead->cond);
+    pReadAhead->fp = fp;
+    pReadAhead->ownFp = ownFp;
+
+    for (i = 0; i < kNuReadAheadBufCount; i++) {
+        pReadAhead->bufs[i].data = Nu_Malloc(pArchive, kNuReadAheadBufSize);
+        if (pReadAhead->bufs[i].data == NULL) {
+            pReadAhead->ownFp = false;      /* caller still owns it */
+            Nu_ReadAheadDelete(pArchive, pReadAhead);
+            pReadAhead = NULL;
+            err = kNuErrMalloc;
+            goto bail;
+        }
+    }
+
+bail:
+    *ppReadAhead = pReadAhead;
+    return err;
+}
+
+
+/*
+ * Pull "len" bytes out of the ring, copying them to "buf" unless it's
+ * NULL.  Running out of data is treated like a short read on a file.
+ */
+static NuError Nu_ReadAheadConsume(NuReadAhead* pReadAhead, uint8_t* buf,
+    uint32_t len)
+{
+    const NuReadAheadBuf* pBuf;
+    Boolean haveData;
+    uint32_t avail;
+
+    Assert(pReadAhead->running);
+
+    while (len) {
+        Nu_MutexLock(&pReadAhead->lock);
+        while (pReadAhead->numFull == 0 && !pReadAhead->readerDone)
+            Nu_CondWait(&pReadAhead->cond, &pReadAhead->lock);
+        haveData = (pReadAhead->numFull != 0);
+        Nu_MutexUnlock(&pReadAhead->lock);
+
+        if (!haveData)
+            return kNuErrFileRead;
+
+        /* the reader won't touch a full buffer, so no lock needed */
+        pBuf = &pReadAhead->bufs[pReadAhead->head];
+        avail = pBuf->len - pReadAhead->headPos;
+        if (avail > len)
+            avail = len;
+        if (buf != NULL) {
+            memcpy(buf, pBuf->data + pReadAhead->headPos, avail);
+            buf += avail;
+        }
+        len -= avail;
+        pReadAhead->headPos += avail;
+        pReadAhead->offset += avail;
+
+        if (pReadAhead->headPos == pBuf->len) {
+            /* hand it back to the reader */
+            Nu_MutexLock(&pReadAhead->lock);
+            pReadAhead->head = (pReadAhead->head + 1) % kNuReadAheadBufCount;
+            pReadAhead->numFull--;
+            pReadAhead->headPos = 0;
+            Nu_CondBroadcast(&pReadAhead->cond);
+            Nu_MutexUnlock(&pReadAhead->lock);
+        }
+    }
+
+    return kNuErrNone;
+}
+
+/*
+ * Read "len" bytes.  Used by the read-ahead flavor of NuCompStream.
+ */
+NuError Nu_ReadAheadRead(NuReadAhead* pReadAhead, void* buf, uint32_t len)
+{
+    Assert(buf != NULL);
+
+    return Nu_ReadAheadConsume(pReadAhead, buf, len);
+}
+
+/*
+ * Read a single byte.  Returns EOF when there's nothing left, like getc().
+ */
+int Nu_ReadAheadGetc(NuReadAhead* pReadAhead)
+{
+    uint8_t val;
+
+    if (Nu_ReadAheadConsume(pReadAhead, &val, 1) != kNuErrNone)
+        return EOF;
+    return val;
+}
+
+/*
+ * Get the file offset of the next byte we'll return.
+ */
+long Nu_ReadAheadTell(const NuReadAhead* pReadAhead)
+{
+    return pReadAhead->offset;
+}
+
+
+/*
+ * Get the archive's shared reader ready to return data from file offset
+ * "offset", creating it if this is the first time through.
+ *
+ * Returns "false" if the reader isn't available, in which case the caller
+ * should read the archive directly.
+ */
+static Boolean Nu_ReadAheadSeekShared(NuArchive* pArchive, long offset)
+{
+    NuReadAhead* pReadAhead = pArchive->pReadAhead;
+    FILE* fp;
+
+    if (pReadAhead == NULL) {
+        fp = fopen(pArchive->archivePathnameUNI, kNuFileOpenReadOnly);
+        if (fp == NULL) {
+            DBUG(("--- unable to reopen archive for read-ahead\n"));
+            return false;
+        }
+        if (Nu_ReadAheadNew(pArchive, fp, true, &pReadAhead) != kNuErrNone) {
+            fclose(fp);
+            return false;
+        }
+        pArchive->pReadAhead = pReadAhead;
+    }
+
+    /* if it's just past where we are, read up to it */
+    if (pReadAhead->running && offset >= pReadAhead->offset &&
+        offset - pReadAhead->offset <= kNuReadAheadMaxSkip &&
+        Nu_ReadAheadConsume(pReadAhead, NULL,
+            (uint32_t) (offset - pReadAhead->offset)) == kNuErrNone)
+    {
+        return true;
+    }
+
+    /* otherwise, start over from there */
+    Nu_ReadAheadStop(pReadAhead);
+    pArchive->stats.fseekCalls++;
+    if (fseek(pReadAhead->fp, offset, SEEK_SET) < 0)
+        return false;
+    return Nu_ReadAheadStart(pReadAhead, offset, false, 0);
+}
+
+/*
+ * Set up "pStream" to read the compressed data for "pThread", with
+ * read-ahead if it's enabled and looks worthwhile.  Otherwise the stream
+ * reads "infp" directly.  "infp" must be positioned at the start of the
+ * thread data.
+ *
+ * Follow with Nu_ReadAheadCloseThread.
+ */
+NuError Nu_ReadAheadOpenThread(NuArchive* pArchive, const NuThread* pThread,
+    FILE* infp, NuCompStream* pStream)
+{
+    NuError err = kNuErrNone;
+    NuReadAhead* pReadAhead = NULL;
+    long offset;
+
+    Assert(pThread != NULL);
+    Assert(infp != NULL);
+
+    Nu_CompStreamInitFile(pArchive, pStream, infp);
+    if (!pArchive->valReadAhead || !pThread->thCompThreadEOF)
+        goto bail;
+
+    if (pArchive->openMode == kNuOpenRO && infp == pArchive->archiveFp) {
+        err = Nu_FTell(pArchive, infp, &offset);
+        BailError(err);
+        if (!Nu_ReadAheadSeekShared(pArchive, offset))
+            goto bail;
+        pReadAhead = pArchive->pReadAhead;
+        pStream->ownReadAhead = false;
+    } else {
+        if (pThread->thCompThreadEOF < kNuReadAheadMinThread)
+            goto bail;
+        err = Nu_ReadAheadNew(pArchive, infp, false, &pReadAhead);
+        BailError(err);
+        if (!Nu_ReadAheadStart(pReadAhead, 0, true,
+                pThread->thCompThreadEOF))
+        {
+            Nu_ReadAheadDelete(pArchive, pReadAhead);
+            goto bail;
+        }
+        pStream->ownReadAhead = true;
+    }
+
+    pStream->type = kNuCompStreamReadAhead;
+    pStream->pReadAhead = pReadAhead;
+
+bail:
+    return err;
+}
+
+/*
+ * Done reading a thread.  If it had a reader of its own, shut it down.
+ */
+void Nu_ReadAheadCloseThread(NuArchive* pArchive, NuCompStream* pStream)
+{
+    Assert(pStream != NULL);
+
+    if (pStream->type != kNuCompStreamReadAhead)
+        return;
+
+    if (pStream->ownReadAhead) {
+        Nu_ReadAheadDelete(pArchive, pStream->pReadAhead);
+        pStream->pReadAhead = NULL;
+    } else {
+        Nu_ReadAheadCollectStats(pArchive, pStream->pReadAhead);
+    }
+}
+
+/*
+ * Discard the archive's shared reader.
+ */
+void Nu_ReadAheadFree(NuArchive* pArchive)
+{
+    Nu_ReadAheadDelete(pArchive, pArchive->pReadAhead);
+    pArchive->pReadAhead = NULL;
+}
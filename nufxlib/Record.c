@@ -7,6 +7,7 @@
  * Record-level operations.
  */
 #include "NufxLibPriv.h"
+#include <ctype.h>
 
 
 /*
@@ -54,7 +55,7 @@ static NuError Nu_RecordNew(NuArchive* pArchive, NuRecord** ppRecord)
 {
     Assert(ppRecord != NULL);
 
-    *ppRecord = Nu_Malloc(pArchive, sizeof(**ppRecord));
+    *ppRecord = Nu_ArenaAlloc(pArchive, sizeof(**ppRecord));
     if (*ppRecord == NULL)
         return kNuErrMalloc;
 
@@ -69,12 +70,12 @@ static NuError Nu_FreeRecordContents(NuArchive* pArchive, NuRecord* pRecord)
 {
     Assert(pRecord != NULL);
 
-    Nu_Free(pArchive, pRecord->recOptionList);
-    Nu_Free(pArchive, pRecord->extraBytes);
-    Nu_Free(pArchive, pRecord->recFilenameMOR);
-    Nu_Free(pArchive, pRecord->threadFilenameMOR);
-    Nu_Free(pArchive, pRecord->newFilenameMOR);
-    Nu_Free(pArchive, pRecord->pThreads);
+    Nu_ArenaFree(pArchive, pRecord->recOptionList);
+    Nu_ArenaFree(pArchive, pRecord->extraBytes);
+    Nu_ArenaFree(pArchive, pRecord->recFilenameMOR);
+    Nu_ArenaFree(pArchive, pRecord->threadFilenameMOR);
+    Nu_ArenaFree(pArchive, pRecord->newFilenameMOR);
+    Nu_ArenaFree(pArchive, pRecord->pThreads);
     /* don't Free(pRecord->pNext)! */
     Nu_FreeThreadMods(pArchive, pRecord);
 
@@ -92,7 +93,7 @@ static NuError Nu_RecordFree(NuArchive* pArchive, NuRecord* pRecord)
         return kNuErrNone;
 
     (void) Nu_FreeRecordContents(pArchive, pRecord);
-    Nu_Free(pArchive, pRecord);
+    Nu_ArenaFree(pArchive, pRecord);
 
     return kNuErrNone;
 }
@@ -112,7 +113,7 @@ static NuError CopySizedField(NuArchive* pArchive, void* vppDst,
 
     if (len) {
         Assert(pSrc != NULL);
-        *ppDst = Nu_Malloc(pArchive, len);
+        *ppDst = Nu_ArenaAlloc(pArchive, len);
         BailAlloc(*ppDst);
         memcpy(*ppDst, pSrc, len);
     } else {
@@ -359,6 +360,33 @@ bail:
     return err;
 }
 
+/*
+ * Reset the record set to initial state without freeing the records.  Use
+ * this when the archive is being thrown away; the records live in its
+ * arena, which takes them all at once.  Thread mods are still released,
+ * because they hold references to the application's data sources.
+ */
+void Nu_RecordSet_DiscardAllRecords(NuArchive* pArchive,
+    NuRecordSet* pRecordSet)
+{
+#ifdef USE_DMALLOC
+    (void) Nu_RecordSet_FreeAllRecords(pArchive, pRecordSet);
+#else
+    NuRecord* pRecord;
+
+    /* usually there aren't any, and we don't have to visit the records */
+    pRecord = pRecordSet->nuRecordHead;
+    while (pRecord != NULL && pArchive->numThreadMods != 0) {
+        Nu_FreeThreadMods(pArchive, pRecord);
+        pRecord = pRecord->pNext;
+    }
+
+    pRecordSet->nuRecordHead = pRecordSet->nuRecordTail = NULL;
+    pRecordSet->numRecords = 0;
+    pRecordSet->loaded = false;
+#endif
+}
+
 
 /*
  * Add a new record to the end of the list.
@@ -469,6 +497,39 @@ bail:
     return err;
 }
 
+/*
+ * Move a record to the end of the record set.  Used when a record is
+ * rewritten past the end of the archive, so that the list stays in the
+ * same order as the file.
+ */
+NuError Nu_RecordSet_MoveRecordToTail(NuRecordSet* pRecordSet,
+    NuRecord* pRecord)
+{
+    NuRecord** ppRecord;
+
+    Assert(pRecordSet != NULL);
+    Assert(pRecord != NULL);
+
+    if (pRecordSet->nuRecordTail == pRecord)
+        return kNuErrNone;
+
+    ppRecord = Nu_RecordSet_GetListHeadPtr(pRecordSet);
+    while (*ppRecord != NULL && *ppRecord != pRecord)
+        ppRecord = &((*ppRecord)->pNext);
+    if (*ppRecord == NULL) {
+        DBUG(("--- Nu_RecordSet_MoveRecordToTail failed\n"));
+        return kNuErrNotFound;
+    }
+
+    /* unhook it; since it isn't the tail, the tail doesn't change */
+    *ppRecord = pRecord->pNext;
+    pRecord->pNext = NULL;
+    pRecordSet->nuRecordTail->pNext = pRecord;
+    pRecordSet->nuRecordTail = pRecord;
+
+    return kNuErrNone;
+}
+
 /*
  * Make a clone of a record set.  This is used to create the "copy" record
  * set out of the "orig" set.
@@ -700,6 +761,180 @@ static NuError Nu_RecordSet_ReverseFindByName(const NuRecordSet* pRecordSet,
 }
 
 
+/*
+ * Hash table of record names, used by NuAddFiles.
+ *
+ * Adding a file searches the "new" set for a record to attach the file
+ * to, and the "copy" or "orig" set for a record it would replace.  Both
+ * are linear scans, so adding N files to an archive with M records is
+ * O(N*(N+M)).  A batch add indexes the names once, and keeps the index
+ * up to date as it adds and replaces records.
+ *
+ * Names are hashed the same way Nu_CompareRecordNames compares them.
+ * Records with the same name share a chain.  Depending on "lastWins",
+ * Find returns either the first one added to the index (which matches
+ * Nu_RecordSet_FindByName when built in list order) or the last one
+ * (matching Nu_RecordSet_ReverseFindByName).
+ */
+#define kNuNameIndexNone    (-1L)
+
+typedef struct NuNameIndexEntry {
+    NuRecord*       pRecord;            /* NULL if removed */
+    uint32_t        hash;
+    long            next;               /* next in chain, or None */
+} NuNameIndexEntry;
+
+typedef struct NuNameIndex {
+    long*           buckets;
+    uint32_t        numBuckets;         /* power of 2 */
+    NuNameIndexEntry* entries;
+    long            numEntries;
+    long            maxEntries;
+    Boolean         lastWins;
+} NuNameIndex;
+
+static uint32_t Nu_HashRecordName(const char* nameMOR)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*nameMOR != '\0') {
+#ifdef NU_CASE_SENSITIVE
+        hash ^= (uint8_t) *nameMOR++;
+#else
+        hash ^= (uint8_t) toupper((uint8_t) *nameMOR++);
+#endif
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Add a record to the index.  The index must have room for it.
+ */
+static void Nu_NameIndexAdd(NuNameIndex* pIndex, NuRecord* pRecord)
+{
+    NuNameIndexEntry* pEntry;
+    long* pLink;
+    long idx;
+
+    Assert(pIndex->numEntries < pIndex->maxEntries);
+    idx = pIndex->numEntries++;
+    pEntry = &pIndex->entries[idx];
+    pEntry->pRecord = pRecord;
+    pEntry->hash = Nu_HashRecordName(pRecord->filenameMOR);
+
+    pLink = &pIndex->buckets[pEntry->hash & (pIndex->numBuckets-1)];
+    if (!pIndex->lastWins) {
+        while (*pLink != kNuNameIndexNone)
+            pLink = &pIndex->entries[*pLink].next;
+    }
+    pEntry->next = *pLink;
+    *pLink = idx;
+}
+
+/*
+ * Remove entry "idx" from the index.  The record it points to may already
+ * have been freed, so we don't look at it.
+ */
+static void Nu_NameIndexRemove(NuNameIndex* pIndex, long idx)
+{
+    long* pLink;
+
+    Assert(idx >= 0 && idx < pIndex->numEntries);
+    pLink = &pIndex->buckets[pIndex->entries[idx].hash &
+                                                (pIndex->numBuckets-1)];
+    while (*pLink != kNuNameIndexNone) {
+        if (*pLink == idx) {
+            *pLink = pIndex->entries[idx].next;
+            pIndex->entries[idx].pRecord = NULL;
+            return;
+        }
+        pLink = &pIndex->entries[*pLink].next;
+    }
+    Assert(0);
+}
+
+/*
+ * Find a record by name.  "*pIdx" gets the index entry, for
+ * Nu_NameIndexRemove.
+ */
+static NuError Nu_NameIndexFind(const NuNameIndex* pIndex, const char* nameMOR,
+    NuRecord** ppRecord, long* pIdx)
+{
+    const NuNameIndexEntry* pEntry;
+    uint32_t hash;
+    long idx;
+
+    Assert(nameMOR != NULL);
+    Assert(ppRecord != NULL);
+    Assert(pIdx != NULL);
+
+    hash = Nu_HashRecordName(nameMOR);
+    idx = pIndex->buckets[hash & (pIndex->numBuckets-1)];
+    while (idx != kNuNameIndexNone) {
+        pEntry = &pIndex->entries[idx];
+        if (pEntry->hash == hash &&
+            Nu_CompareRecordNames(pEntry->pRecord->filenameMOR, nameMOR) == 0)
+        {
+            *ppRecord = pEntry->pRecord;
+            *pIdx = idx;
+            return kNuErrNone;
+        }
+        idx = pEntry->next;
+    }
+
+    return kNuErrRecNameNotFound;
+}
+
+static void Nu_NameIndexFree(NuArchive* pArchive, NuNameIndex* pIndex)
+{
+    Nu_Free(pArchive, pIndex->buckets);
+    Nu_Free(pArchive, pIndex->entries);
+    memset(pIndex, 0, sizeof(*pIndex));
+}
+
+/*
+ * Index the records in "pRecordSet", leaving room for "extra" more.
+ * Anything already in the index is discarded.
+ */
+static NuError Nu_NameIndexBuild(NuArchive* pArchive, NuNameIndex* pIndex,
+    const NuRecordSet* pRecordSet, uint32_t extra, Boolean lastWins)
+{
+    NuRecord* pRecord;
+    long numRecords = 0;
+    uint32_t i;
+
+    Nu_NameIndexFree(pArchive, pIndex);
+    pIndex->lastWins = lastWins;
+
+    pRecord = Nu_RecordSet_GetListHead(pRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext)
+        numRecords++;
+
+    pIndex->maxEntries = numRecords + extra;
+    pIndex->numBuckets = 16;
+    while ((long) pIndex->numBuckets < pIndex->maxEntries)
+        pIndex->numBuckets *= 2;
+
+    pIndex->buckets = Nu_Malloc(pArchive,
+                        pIndex->numBuckets * sizeof(*pIndex->buckets));
+    pIndex->entries = Nu_Malloc(pArchive,
+                        (pIndex->maxEntries +1) * sizeof(*pIndex->entries));
+    if (pIndex->buckets == NULL || pIndex->entries == NULL) {
+        Nu_NameIndexFree(pArchive, pIndex);
+        return kNuErrMalloc;
+    }
+    for (i = 0; i < pIndex->numBuckets; i++)
+        pIndex->buckets[i] = kNuNameIndexNone;
+
+    pRecord = Nu_RecordSet_GetListHead(pRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext)
+        Nu_NameIndexAdd(pIndex, pRecord);
+
+    return kNuErrNone;
+}
+
+
 /*
  * We have a copy of the record in the "copy" set, but we've decided
  * (perhaps because the user elected to Skip a failed add) that we'd
@@ -853,6 +1088,7 @@ bail:
 static NuError Nu_ReadRecordHeader(NuArchive* pArchive, NuRecord* pRecord)
 {
     NuError err = kNuErrNone;
+    uint64_t startTime;
     uint16_t crc;
     FILE* fp;
     int bytesRead;
@@ -863,6 +1099,7 @@ static NuError Nu_ReadRecordHeader(NuArchive* pArchive, NuRecord* pRecord)
     Assert(pRecord->pNext == NULL);
 
     fp = pArchive->archiveFp;
+    startTime = Nu_StatsStartClock(pArchive);
 
     pRecord->recordIdx = Nu_GetNextRecordIdx(pArchive);
 
@@ -957,7 +1194,8 @@ static NuError Nu_ReadRecordHeader(NuArchive* pArchive, NuRecord* pRecord)
         }
 
         if (pRecord->recOptionSize) {
-            pRecord->recOptionList = Nu_Malloc(pArchive,pRecord->recOptionSize);
+            pRecord->recOptionList =
+                        Nu_ArenaAlloc(pArchive, pRecord->recOptionSize);
             BailAlloc(pRecord->recOptionList);
             (void) Nu_ReadBytesC(pArchive, fp, pRecord->recOptionList,
                     pRecord->recOptionSize, &crc);
@@ -978,7 +1216,7 @@ static NuError Nu_ReadRecordHeader(NuArchive* pArchive, NuRecord* pRecord)
      * allocate space for it and read it if it exists.
      */
     if (pRecord->extraCount) {
-        pRecord->extraBytes = Nu_Malloc(pArchive, pRecord->extraCount);
+        pRecord->extraBytes = Nu_ArenaAlloc(pArchive, pRecord->extraCount);
         BailAlloc(pRecord->extraBytes);
         (void) Nu_ReadBytesC(pArchive, fp, pRecord->extraBytes,
                 pRecord->extraCount, &crc);
@@ -998,7 +1236,7 @@ static NuError Nu_ReadRecordHeader(NuArchive* pArchive, NuRecord* pRecord)
     }
     if (pRecord->recFilenameLength) {
         pRecord->recFilenameMOR =
-                Nu_Malloc(pArchive, pRecord->recFilenameLength +1);
+                Nu_ArenaAlloc(pArchive, pRecord->recFilenameLength +1);
         BailAlloc(pRecord->recFilenameMOR);
         (void) Nu_ReadBytesC(pArchive, fp, pRecord->recFilenameMOR,
                 pRecord->recFilenameLength, &crc);
@@ -1065,9 +1303,12 @@ static NuError Nu_ReadRecordHeader(NuArchive* pArchive, NuRecord* pRecord)
         }
     }
 
+    pArchive->stats.recordsScanned++;
+
 bail:
     if (err != kNuErrNone)
         (void)Nu_FreeRecordContents(pArchive, pRecord);
+    Nu_StatsStopClock(pArchive, startTime, &pArchive->stats.headerParseTime);
     return err;
 }
 
@@ -1164,7 +1405,7 @@ NuError Nu_WriteRecordHeader(NuArchive* pArchive, NuRecord* pRecord, FILE* fp)
     DBUG(("--- Writing record header (v=%d)\n", pRecord->recVersionNumber));
     
     (void) Nu_WriteBytes(pArchive, fp, pRecord->recNufxID, kNufxIDLen);
-    err = Nu_FTell(fp, &crcOffset);
+    err = Nu_FTell(pArchive, fp, &crcOffset);
     BailError(err);
 
     /*
@@ -1251,12 +1492,12 @@ NuError Nu_WriteRecordHeader(NuArchive* pArchive, NuRecord* pRecord, FILE* fp)
     BailError(err);
 
     /* get the current file offset, for some computations later */
-    err = Nu_FTell(fp, &pArchive->currentOffset);
+    err = Nu_FTell(pArchive, fp, &pArchive->currentOffset);
     BailError(err);
 
     /* go back and fill in the CRC */
     pRecord->recHeaderCRC = crc;
-    err = Nu_FSeek(fp, crcOffset, SEEK_SET);
+    err = Nu_FSeek(pArchive, fp, crcOffset, SEEK_SET);
     BailError(err);
     Nu_WriteTwo(pArchive, fp, pRecord->recHeaderCRC);
 
@@ -1634,6 +1875,7 @@ NuError Nu_StreamExtract(NuArchive* pArchive)
 
 bail:
     (void) Nu_FreeRecordContents(pArchive, &tmpRecord);
+    err = Nu_ExtractFinish(pArchive, err);
     return err;
 }
 
@@ -1807,7 +2049,7 @@ NuError Nu_Extract(NuArchive* pArchive)
 
         if (!pArchive->haveToc) {
             /* remember where the end of the record is */
-            err = Nu_FTell(pArchive->archiveFp, &offset);
+            err = Nu_FTell(pArchive, pArchive->archiveFp, &offset);
             BailError(err);
         }
 
@@ -1817,13 +2059,14 @@ NuError Nu_Extract(NuArchive* pArchive)
 
         if (!pArchive->haveToc) {
             /* line us back up so RecordWalkGetNext can read the record hdr */
-            err = Nu_FSeek(pArchive->archiveFp, offset, SEEK_SET);
+            err = Nu_FSeek(pArchive, pArchive->archiveFp, offset, SEEK_SET);
             BailError(err);
         }
     }
 
 bail:
     (void) Nu_RecordWalkFinish(pArchive, err);
+    err = Nu_ExtractFinish(pArchive, err);
     return err;
 }
 
@@ -1851,21 +2094,29 @@ NuError Nu_ExtractRecord(NuArchive* pArchive, NuRecordIdx recIdx)
     BailError(err);
 
 bail:
+    err = Nu_ExtractFinish(pArchive, err);
     return err;
 }
 
 
 /*
  * Test the contents of an archive.  Works just like extraction, but we
- * don't store anything.
+ * don't store anything.  If we're allowed more than one worker thread,
+ * the threads are expanded in parallel; see TestPool.c.
  */
 NuError Nu_Test(NuArchive* pArchive)
 {
     NuError err;
 
+    err = Nu_TestPoolBegin(pArchive);
+    BailError(err);
+
     pArchive->testMode = true;
     err = Nu_Extract(pArchive);
     pArchive->testMode = false;
+
+bail:
+    Nu_TestPoolEnd(pArchive);
     return err;
 }
 
@@ -2188,6 +2439,70 @@ bail:
     return err;
 }
 
+/*
+ * State for a batch of adds (NuAddFiles).  The "existing" index covers
+ * the set Nu_AddRecord looks for duplicates in, which starts out as "orig"
+ * and becomes "copy" when the first record is replaced.  It's built the
+ * first time we need it.
+ */
+typedef struct NuAddBatch {
+    NuNameIndex         existing;
+    const NuRecordSet*  pExistingSet;   /* what "existing" covers */
+    NuNameIndex         added;          /* the "new" set */
+} NuAddBatch;
+
+/*
+ * Look for a record with the given name in the "copy" set, or the "orig"
+ * set if we don't have a copy yet.  "*ppRecordSet" gets the set searched.
+ *
+ * "*pIdx" gets the index entry if "pBatch" was used, so the caller can
+ * remove the record from the index if it gets replaced.
+ */
+static NuError Nu_FindExistingByName(NuArchive* pArchive, NuAddBatch* pBatch,
+    const char* nameMOR, NuRecordSet** ppRecordSet, NuRecord** ppRecord,
+    long* pIdx)
+{
+    NuError err;
+    NuRecordSet* pRecordSet;
+
+    pRecordSet = &pArchive->copyRecordSet;
+    if (!Nu_RecordSet_GetLoaded(pRecordSet))
+        pRecordSet = &pArchive->origRecordSet;
+    Assert(Nu_RecordSet_GetLoaded(pRecordSet));
+    *ppRecordSet = pRecordSet;
+    *pIdx = kNuNameIndexNone;
+
+    if (pBatch == NULL)
+        return Nu_RecordSet_FindByName(pRecordSet, nameMOR, ppRecord);
+
+    if (pBatch->pExistingSet != pRecordSet) {
+        err = Nu_NameIndexBuild(pArchive, &pBatch->existing, pRecordSet, 0,
+                false);
+        if (err != kNuErrNone) {
+            pBatch->pExistingSet = NULL;
+            return err;
+        }
+        pBatch->pExistingSet = pRecordSet;
+    }
+    return Nu_NameIndexFind(&pBatch->existing, nameMOR, ppRecord, pIdx);
+}
+
+/*
+ * Look for a record with the given name in the "new" set.  If there's
+ * more than one, we get the last one added.
+ */
+static NuError Nu_FindNewByName(NuArchive* pArchive, NuAddBatch* pBatch,
+    const char* nameMOR, NuRecord** ppRecord)
+{
+    long idx;
+
+    if (pBatch == NULL) {
+        return Nu_RecordSet_ReverseFindByName(&pArchive->newRecordSet,
+                nameMOR, ppRecord);
+    }
+    return Nu_NameIndexFind(&pBatch->added, nameMOR, ppRecord, &idx);
+}
+
 /*
  * Create a new record, filling in most of the blanks from "pFileDetails".
  *
@@ -2202,9 +2517,13 @@ bail:
  * in "*pRecordIdx", and the NuThreadIdx of the filename thread will be
  * placed in "*pThreadIdx".  If "*ppNewRecord" is non-NULL, it gets a pointer
  * to the newly-created record (this isn't part of the external interface).
+ *
+ * If "pBatch" is non-NULL, names are looked up in its indexes instead of
+ * the record sets.
  */
-NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
-    NuRecordIdx* pRecordIdx, NuRecord** ppNewRecord)
+static NuError Nu_AddRecordCommon(NuArchive* pArchive, NuAddBatch* pBatch,
+    const NuFileDetails* pFileDetails, NuRecordIdx* pRecordIdx,
+    NuRecord** ppNewRecord)
 {
     NuError err;
     NuRecord* pNewRecord = NULL;
@@ -2244,13 +2563,11 @@ NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
     if (!pArchive->valAllowDuplicates) {
         NuRecordSet* pRecordSet;
         NuRecord* pFoundRecord;
+        long foundIdx;
 
-        pRecordSet = &pArchive->copyRecordSet;
-        if (!Nu_RecordSet_GetLoaded(pRecordSet))
-            pRecordSet = &pArchive->origRecordSet;
-        Assert(Nu_RecordSet_GetLoaded(pRecordSet));
-        err = Nu_RecordSet_FindByName(pRecordSet, pFileDetails->storageNameMOR,
-                &pFoundRecord);
+        err = Nu_FindExistingByName(pArchive, pBatch,
+                pFileDetails->storageNameMOR, &pRecordSet, &pFoundRecord,
+                &foundIdx);
         if (err == kNuErrNone) {
             /* handle the existing record */
             DBUG(("--- Duplicate record found (%06ld) '%s'\n",
@@ -2262,7 +2579,11 @@ NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
                 DBUG(("--- Returning err=%d\n", err));
                 goto bail;
             }
-        } else {
+
+            /* if it was deleted from the set we indexed, forget it */
+            if (pBatch != NULL && pRecordSet == &pArchive->copyRecordSet)
+                Nu_NameIndexRemove(&pBatch->existing, foundIdx);
+        } else if (err == kNuErrRecNameNotFound) {
             /* if we *must* replace an existing file, we fail now */
             if (pArchive->valHandleExisting == kNuMustOverwrite) {
                 DBUG(("+++ can't freshen nonexistent '%s'\n",
@@ -2270,10 +2591,12 @@ NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
                 err = kNuErrDuplicateNotFound;
                 goto bail;
             }
+        } else {
+            goto bail;
         }
 
         if (Nu_RecordSet_GetLoaded(&pArchive->newRecordSet)) {
-            err = Nu_RecordSet_FindByName(&pArchive->newRecordSet,
+            err = Nu_FindNewByName(pArchive, pBatch,
                     pFileDetails->storageNameMOR, &pFoundRecord);
             if (err == kNuErrNone) {
                 /* we can't delete from the "new" list, so return an error */
@@ -2312,7 +2635,8 @@ NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
 
     pNewRecord->recordIdx = Nu_GetNextRecordIdx(pArchive);
     pNewRecord->threadFilenameMOR = NULL;
-    pNewRecord->newFilenameMOR = strdup(pFileDetails->storageNameMOR);
+    pNewRecord->newFilenameMOR =
+                Nu_ArenaStrdup(pArchive, pFileDetails->storageNameMOR);
     pNewRecord->filenameMOR = pNewRecord->newFilenameMOR;
     pNewRecord->recHeaderLength = -1;
     pNewRecord->totalCompLength = 0;
@@ -2324,6 +2648,8 @@ NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
      */
     err = Nu_RecordSet_AddRecord(&pArchive->newRecordSet, pNewRecord);
     BailError(err);
+    if (pBatch != NULL)
+        Nu_NameIndexAdd(&pBatch->added, pNewRecord);
 
     /* return values */
     if (pRecordIdx != NULL)
@@ -2335,6 +2661,13 @@ bail:
     return err;
 }
 
+NuError Nu_AddRecord(NuArchive* pArchive, const NuFileDetails* pFileDetails,
+    NuRecordIdx* pRecordIdx, NuRecord** ppNewRecord)
+{
+    return Nu_AddRecordCommon(pArchive, NULL, pFileDetails, pRecordIdx,
+            ppNewRecord);
+}
+
 
 /*
  * Add a new "add file" thread mod to the specified record.
@@ -2401,10 +2734,13 @@ bail:
  * of thread the file should be stored as.
  *
  * If "pRecordIdx" is non-NULL, it will receive the newly assigned recordID.
+ *
+ * If "pBatch" is non-NULL, names are looked up in its indexes instead of
+ * the record sets.
  */
-NuError Nu_AddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
-    const NuFileDetails* pFileDetails, Boolean fromRsrcFork,
-    NuRecordIdx* pRecordIdx)
+static NuError Nu_AddFileCommon(NuArchive* pArchive, NuAddBatch* pBatch,
+    const UNICHAR* pathnameUNI, const NuFileDetails* pFileDetails,
+    Boolean fromRsrcFork, NuRecordIdx* pRecordIdx)
 {
     NuError err = kNuErrNone;
     NuRecordIdx recordIdx = 0;
@@ -2452,7 +2788,7 @@ NuError Nu_AddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
     if (Nu_RecordSet_GetLoaded(&pArchive->newRecordSet)) {
         NuRecord* pNewRecord;
 
-        err = Nu_RecordSet_ReverseFindByName(&pArchive->newRecordSet,
+        err = Nu_FindNewByName(pArchive, pBatch,
                 pFileDetails->storageNameMOR, &pNewRecord);
         if (err == kNuErrNone) {
             /* is it okay to add it here? */
@@ -2500,7 +2836,8 @@ NuError Nu_AddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
      * any matches it finds.  On success, we should have a brand-new record
      * to play with.
      */
-    err = Nu_AddRecord(pArchive, pFileDetails, &recordIdx, &pRecord);
+    err = Nu_AddRecordCommon(pArchive, pBatch, pFileDetails, &recordIdx,
+            &pRecord);
     BailError(err);
     DBUG(("--- Added new record %06ld\n", recordIdx));
 
@@ -2518,6 +2855,85 @@ bail:
     return err;
 }
 
+NuError Nu_AddFile(NuArchive* pArchive, const UNICHAR* pathnameUNI,
+    const NuFileDetails* pFileDetails, Boolean fromRsrcFork,
+    NuRecordIdx* pRecordIdx)
+{
+    return Nu_AddFileCommon(pArchive, NULL, pathnameUNI, pFileDetails,
+            fromRsrcFork, pRecordIdx);
+}
+
+/*
+ * Add a batch of files.  Each one is handled exactly the way Nu_AddFile
+ * would, in order, but the archive is checked once up front, and names
+ * are looked up in hash tables rather than by walking the record sets.
+ *
+ * "pRecordIdxs" and "pResults", if non-NULL, receive the record index
+ * (0 on failure) and result of each entry.  Without "pResults", we stop
+ * at the first entry that fails, and return its error.  With it, we keep
+ * going, and only stop if the application aborts or we run out of memory.
+ * The entries we didn't get to get a record index of 0 and a result of
+ * kNuErrAborted.
+ */
+NuError Nu_AddFiles(NuArchive* pArchive, const NuAddFileEntry* pEntries,
+    uint32_t numEntries, NuRecordIdx* pRecordIdxs, NuError* pResults)
+{
+    NuError err;
+    NuAddBatch batch;
+    const NuAddFileEntry* pEntry;
+    NuRecordIdx recordIdx;
+    uint32_t i;
+
+    memset(&batch, 0, sizeof(batch));
+
+    if (pEntries == NULL && numEntries != 0)
+        return kNuErrInvalidArg;
+
+    if (Nu_IsReadOnly(pArchive))
+        return kNuErrArchiveRO;
+    err = Nu_GetTOCIfNeeded(pArchive);
+    BailError(err);
+
+    /* each entry adds at most one record to the "new" set */
+    err = Nu_NameIndexBuild(pArchive, &batch.added, &pArchive->newRecordSet,
+            numEntries, true);
+    BailError(err);
+
+    for (i = 0; i < numEntries; i++) {
+        pEntry = &pEntries[i];
+        recordIdx = 0;
+        err = Nu_AddFileCommon(pArchive, &batch, pEntry->pathnameUNI,
+                &pEntry->fileDetails, (Boolean)(pEntry->isFromRsrcFork != 0),
+                &recordIdx);
+        if (pRecordIdxs != NULL)
+            pRecordIdxs[i] = recordIdx;
+        if (pResults != NULL)
+            pResults[i] = err;
+
+        if (err != kNuErrNone) {
+            if (pResults == NULL || err == kNuErrAborted ||
+                err == kNuErrMalloc)
+            {
+                break;
+            }
+            err = kNuErrNone;
+        }
+    }
+
+    /* mark anything we didn't get to */
+    for (i++; i < numEntries; i++) {
+        if (pRecordIdxs != NULL)
+            pRecordIdxs[i] = 0;
+        if (pResults != NULL)
+            pResults[i] = kNuErrAborted;
+    }
+
+bail:
+    Nu_NameIndexFree(pArchive, &batch.existing);
+    Nu_NameIndexFree(pArchive, &batch.added);
+    return err;
+}
+
 
 /*
  * Rename a record.  There are three situations:
@@ -2628,7 +3044,8 @@ NuError Nu_Rename(NuArchive* pArchive, NuRecordIdx recIdx,
     if (doAdd || doUpdate) {
         Assert(newCapacity);
         err = Nu_DataSourceBuffer_New(kNuThreadFormatUncompressed,
-                newCapacity, (const uint8_t*)strdup(pathnameMOR), 0,
+                newCapacity,
+                (const uint8_t*) Nu_Strdup(pArchive, pathnameMOR), 0,
                 requiredCapacity /*(strlen)*/, Nu_InternalFreeCallback,
                 &pDataSource);
         BailError(err);
@@ -159,7 +159,7 @@ NuError Nu_DataSourceFile_New(NuThreadFormat threadFormat, uint32_t otherLen,
     (*ppDataSource)->common.otherLen = otherLen;
     (*ppDataSource)->common.refCount = 1;
 
-    (*ppDataSource)->fromFile.pathnameUNI = strdup(pathnameUNI);
+    (*ppDataSource)->fromFile.pathnameUNI = Nu_Strdup(NULL, pathnameUNI);
     (*ppDataSource)->fromFile.fromRsrcFork = isFromRsrcFork;
     (*ppDataSource)->fromFile.fp = NULL;     /* to be filled in later */
 
@@ -351,8 +351,8 @@ NuError Nu_DataSourcePrepareInput(NuArchive* pArchive,
      * to the correct offset before we begin.
      */
     if (Nu_DataSourceGetType(pDataSource) == kNuDataSourceFromFP) {
-        err = Nu_FSeek(pDataSource->fromFP.fp, pDataSource->fromFP.offset,
-                SEEK_SET);
+        err = Nu_FSeek(pArchive, pDataSource->fromFP.fp,
+                pDataSource->fromFP.offset, SEEK_SET);
         goto bail;      /* return this err */
     }
 
@@ -417,11 +417,94 @@ const char* Nu_DataSourceFile_GetPathname(NuDataSource* pDataSource)
 }
 
 
+/*
+ * Find out where an unprepared data source gets its input, so that it can
+ * be read by something other than the usual straw (e.g. a worker thread).
+ *
+ * For a "buffer" source, "*ppBuffer" and "*pLength" are set to the data
+ * that hasn't been read yet.  For a "file" source, "*ppPathnameUNI" is
+ * set.  Returns "false" for anything else, including resource forks,
+ * which can't be opened by pathname everywhere.
+ */
+Boolean Nu_DataSourceGetDirectInput(const NuDataSource* pDataSource,
+    const UNICHAR** ppPathnameUNI, const uint8_t** ppBuffer,
+    uint32_t* pLength)
+{
+    Assert(pDataSource != NULL);
+
+    *ppPathnameUNI = NULL;
+    *ppBuffer = NULL;
+    *pLength = 0;
+
+    switch (pDataSource->sourceType) {
+    case kNuDataSourceFromFile:
+        if (pDataSource->fromFile.fromRsrcFork)
+            return false;
+        *ppPathnameUNI = pDataSource->fromFile.pathnameUNI;
+        return true;
+    case kNuDataSourceFromBuffer:
+        *ppBuffer = pDataSource->fromBuffer.buffer +
+                    pDataSource->fromBuffer.curOffset;
+        *pLength = (uint32_t) pDataSource->fromBuffer.curDataLen;
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/*
+ * Find out how much data an unprepared data source will supply, or the
+ * size it's pre-sized to, whichever is larger.  Returns "false" if that
+ * can't be determined without opening it.
+ */
+Boolean Nu_DataSourceGetMaxLen(const NuDataSource* pDataSource,
+    uint32_t* pLength)
+{
+    uint32_t len;
+
+    Assert(pDataSource != NULL);
+
+    switch (pDataSource->sourceType) {
+    case kNuDataSourceFromFile:
+#if defined(UNIX_LIKE) || defined(WINDOWS_LIKE)
+        {
+            struct stat sbuf;
+
+            if (pDataSource->fromFile.fromRsrcFork)
+                return false;
+            if (stat(pDataSource->fromFile.pathnameUNI, &sbuf) != 0 ||
+                sbuf.st_size < 0 || sbuf.st_size > 0xffffffffL)
+            {
+                return false;
+            }
+            len = (uint32_t) sbuf.st_size;
+        }
+        break;
+#else
+        return false;
+#endif
+    case kNuDataSourceFromFP:
+    case kNuDataSourceFromBuffer:
+        len = pDataSource->common.dataLen;
+        break;
+    default:
+        Assert(0);
+        return false;
+    }
+
+    if (len < pDataSource->common.otherLen)
+        len = pDataSource->common.otherLen;
+    *pLength = len;
+    return true;
+}
+
+
 /*
  * Read a block of data from a dataSource.
  */
-NuError Nu_DataSourceGetBlock(NuDataSource* pDataSource, uint8_t* buf,
-    uint32_t len)
+NuError Nu_DataSourceGetBlock(NuArchive* pArchive, NuDataSource* pDataSource,
+    uint8_t* buf, uint32_t len)
 {
     NuError err;
 
@@ -432,13 +515,13 @@ NuError Nu_DataSourceGetBlock(NuDataSource* pDataSource, uint8_t* buf,
     switch (pDataSource->sourceType) {
     case kNuDataSourceFromFile:
         Assert(pDataSource->fromFile.fp != NULL);
-        err = Nu_FRead(pDataSource->fromFile.fp, buf, len);
+        err = Nu_FRead(pArchive, pDataSource->fromFile.fp, buf, len);
         if (feof(pDataSource->fromFile.fp))
             Nu_ReportError(NU_NILBLOB, err, "EOF hit unexpectedly");
         return err;
 
     case kNuDataSourceFromFP:
-        err = Nu_FRead(pDataSource->fromFP.fp, buf, len);
+        err = Nu_FRead(pArchive, pDataSource->fromFP.fp, buf, len);
         if (feof(pDataSource->fromFP.fp))
             Nu_ReportError(NU_NILBLOB, err, "EOF hit unexpectedly");
         return err;
@@ -465,7 +548,7 @@ NuError Nu_DataSourceGetBlock(NuDataSource* pDataSource, uint8_t* buf,
 /*
  * Rewind a data source to the start of its input.
  */
-NuError Nu_DataSourceRewind(NuDataSource* pDataSource)
+NuError Nu_DataSourceRewind(NuArchive* pArchive, NuDataSource* pDataSource)
 {
     NuError err;
 
@@ -474,11 +557,11 @@ NuError Nu_DataSourceRewind(NuDataSource* pDataSource)
     switch (pDataSource->sourceType) {
     case kNuDataSourceFromFile:
         Assert(pDataSource->fromFile.fp != NULL);
-        err = Nu_FSeek(pDataSource->fromFile.fp, 0, SEEK_SET);
+        err = Nu_FSeek(pArchive, pDataSource->fromFile.fp, 0, SEEK_SET);
         break; /* fall through with error */
     case kNuDataSourceFromFP:
-        err = Nu_FSeek(pDataSource->fromFP.fp, pDataSource->fromFP.offset,
-                SEEK_SET);
+        err = Nu_FSeek(pArchive, pDataSource->fromFP.fp,
+                pDataSource->fromFP.offset, SEEK_SET);
         break; /* fall through with error */
     case kNuDataSourceFromBuffer:
         pDataSource->fromBuffer.curOffset = pDataSource->fromBuffer.offset;
@@ -576,10 +659,14 @@ NuError Nu_DataSinkFile_New(Boolean doExpand, NuValue convertEOL,
     else
         (*ppDataSink)->common.convertEOL = kNuConvertOff;
     (*ppDataSink)->common.outCount = 0;
-    (*ppDataSink)->toFile.pathnameUNI = strdup(pathnameUNI);
+    (*ppDataSink)->toFile.pathnameUNI = Nu_Strdup(NULL, pathnameUNI);
     (*ppDataSink)->toFile.fssep = fssep;
 
     (*ppDataSink)->toFile.fp = NULL;
+    (*ppDataSink)->toFile.sparseBlockSize = 0;
+    (*ppDataSink)->toFile.fileOffset = 0;
+    (*ppDataSink)->toFile.holeLen = 0;
+    (*ppDataSink)->toFile.queueBuf = NULL;
 
 bail:
     return err;
@@ -759,6 +846,208 @@ void Nu_DataSinkFile_SetFP(NuDataSink* pDataSink, FILE* fp)
     Assert(pDataSink->sinkType == kNuDataSinkToFile);
 
     pDataSink->toFile.fp = fp;
+    pDataSink->toFile.sparseBlockSize = 0;
+    pDataSink->toFile.fileOffset = 0;
+    pDataSink->toFile.holeLen = 0;
+    Nu_Free(NULL, pDataSink->toFile.queueBuf);
+    pDataSink->toFile.queueBuf = NULL;
+}
+
+/*
+ * Enable holes for the file currently set in a file sink.  Blocks of
+ * "blockSize" bytes that are entirely zero, aligned with the start of
+ * the file, are seeked over rather than written, so the filesystem
+ * doesn't have to store them.  Pass 0 to write everything.
+ *
+ * This only makes sense for a regular file that was just created or
+ * truncated, which is what Nu_OpenOutputFile gives us.
+ */
+void Nu_DataSinkFile_SetSparse(NuDataSink* pDataSink, uint32_t blockSize)
+{
+    Assert(pDataSink != NULL);
+    Assert(pDataSink->sinkType == kNuDataSinkToFile);
+    Assert(pDataSink->toFile.fileOffset == 0);
+    Assert(blockSize <= kNuSparseMaxBlockSize);
+
+    pDataSink->toFile.sparseBlockSize = blockSize;
+}
+
+/*
+ * Collect the output in "buf" instead of writing it to the file, so it
+ * can be handed to the output queue.  The sink takes ownership of "buf",
+ * which must have come from Nu_Malloc.
+ *
+ * If more than "size" bytes arrive, what we have is written to the file
+ * and the buffer is discarded.
+ */
+void Nu_DataSinkFile_SetQueueBuf(NuDataSink* pDataSink, uint8_t* buf,
+    uint32_t size)
+{
+    Assert(pDataSink != NULL);
+    Assert(pDataSink->sinkType == kNuDataSinkToFile);
+    Assert(pDataSink->toFile.queueBuf == NULL);
+    Assert(pDataSink->toFile.sparseBlockSize == 0);
+
+    pDataSink->toFile.queueBuf = buf;
+    pDataSink->toFile.queueLen = 0;
+    pDataSink->toFile.queueSize = size;
+}
+
+/*
+ * Take back the buffer from Nu_DataSinkFile_SetQueueBuf, with the length
+ * of the data in it.  Returns NULL if the data didn't fit, in which case
+ * it has all been written to the file.
+ */
+uint8_t* Nu_DataSinkFile_TakeQueueBuf(NuDataSink* pDataSink, uint32_t* pLen)
+{
+    uint8_t* buf;
+
+    Assert(pDataSink != NULL);
+    Assert(pDataSink->sinkType == kNuDataSinkToFile);
+
+    buf = pDataSink->toFile.queueBuf;
+    *pLen = pDataSink->toFile.queueLen;
+    pDataSink->toFile.queueBuf = NULL;
+    return buf;
+}
+
+/*
+ * Add data to the queue buffer.  If it doesn't fit, write out what we
+ * have, and go back to writing to the file.
+ */
+static NuError Nu_DataSinkFile_PutQueued(NuArchive* pArchive,
+    NuDataSink* pDataSink, const uint8_t* buf, uint32_t len)
+{
+    NuError err;
+
+    if (len <= pDataSink->toFile.queueSize - pDataSink->toFile.queueLen) {
+        memcpy(pDataSink->toFile.queueBuf + pDataSink->toFile.queueLen,
+            buf, len);
+        pDataSink->toFile.queueLen += len;
+        return kNuErrNone;
+    }
+
+    DBUG(("+++ queue buffer overflowed (%u+%u > %u), writing directly\n",
+        pDataSink->toFile.queueLen, len, pDataSink->toFile.queueSize));
+    err = Nu_FWrite(pArchive, pDataSink->toFile.fp,
+            pDataSink->toFile.queueBuf, pDataSink->toFile.queueLen);
+    Nu_Free(NULL, pDataSink->toFile.queueBuf);
+    pDataSink->toFile.queueBuf = NULL;
+    if (err != kNuErrNone)
+        return err;
+    return Nu_FWrite(pArchive, pDataSink->toFile.fp, buf, len);
+}
+
+/*
+ * Returns "true" if all "len" bytes in "buf" are zero.
+ */
+static Boolean Nu_IsZeroBlock(const uint8_t* buf, uint32_t len)
+{
+    Assert(len > 0);
+    return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/*
+ * Catch up on the zeroes we've skipped.  Anything shorter than a block
+ * can't be a hole, and seeking flushes the FILE* buffer, so short runs
+ * are just written out.
+ *
+ * Nu_FSeek takes a long, which may only be 32 bits, so a hole of 2GB or
+ * more is seeked over in pieces.
+ */
+static NuError Nu_DataSinkFile_SkipHole(NuArchive* pArchive,
+    NuDataSink* pDataSink)
+{
+    static const uint8_t kZeroes[kNuSparseMaxBlockSize] = { 0 };
+    NuError err = kNuErrNone;
+    uint32_t holeLen = pDataSink->toFile.holeLen;
+    uint32_t seekLen;
+
+    pDataSink->toFile.holeLen = 0;
+    if (holeLen < pDataSink->toFile.sparseBlockSize)
+        return Nu_FWrite(pArchive, pDataSink->toFile.fp, kZeroes, holeLen);
+
+    while (holeLen) {
+        seekLen = holeLen;
+        if (seekLen > kNuMaxHoleSeek)
+            seekLen = kNuMaxHoleSeek;
+        err = Nu_FSeek(pArchive, pDataSink->toFile.fp, (long) seekLen,
+                SEEK_CUR);
+        BailError(err);
+        holeLen -= seekLen;
+    }
+
+bail:
+    return err;
+}
+
+/*
+ * Write to a file sink, skipping over zero blocks.  The seek over a hole
+ * is put off until there's something to write after it.
+ *
+ * The data arrives in whatever pieces the expander produces, so a block
+ * can be split across calls.  Zero pieces are added to the hole whether
+ * or not they fill a block, since seeking over zeroes is always safe.
+ */
+static NuError Nu_DataSinkFile_PutSparse(NuArchive* pArchive,
+    NuDataSink* pDataSink, const uint8_t* buf, uint32_t len)
+{
+    NuError err = kNuErrNone;
+    uint32_t blockSize = pDataSink->toFile.sparseBlockSize;
+    uint32_t chunk;
+
+    while (len) {
+        chunk = blockSize - pDataSink->toFile.fileOffset % blockSize;
+        if (chunk > len)
+            chunk = len;
+
+        if (Nu_IsZeroBlock(buf, chunk)) {
+            pDataSink->toFile.holeLen += chunk;
+        } else {
+            if (pDataSink->toFile.holeLen) {
+                err = Nu_DataSinkFile_SkipHole(pArchive, pDataSink);
+                BailError(err);
+            }
+            err = Nu_FWrite(pArchive, pDataSink->toFile.fp, buf, chunk);
+            BailError(err);
+        }
+
+        pDataSink->toFile.fileOffset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+bail:
+    return err;
+}
+
+/*
+ * If the file ended with a hole, extend the file over it.  This must be
+ * called before the file is closed, or the file will come up short.
+ *
+ * Writing the final zero byte is the portable way to set the length;
+ * it costs one filesystem block at most.
+ */
+NuError Nu_DataSinkFile_EndHole(NuArchive* pArchive, NuDataSink* pDataSink)
+{
+    NuError err = kNuErrNone;
+    uint8_t zero = 0;
+
+    Assert(pDataSink != NULL);
+    Assert(pDataSink->sinkType == kNuDataSinkToFile);
+
+    if (pDataSink->toFile.holeLen) {
+        pDataSink->toFile.holeLen--;
+        if (pDataSink->toFile.holeLen) {
+            err = Nu_DataSinkFile_SkipHole(pArchive, pDataSink);
+            BailError(err);
+        }
+        err = Nu_FWrite(pArchive, pDataSink->toFile.fp, &zero, 1);
+        BailError(err);
+    }
+
+bail:
+    return err;
 }
 
 /*
@@ -772,14 +1061,16 @@ void Nu_DataSinkFile_Close(NuDataSink* pDataSink)
         fclose(pDataSink->toFile.fp);
         pDataSink->toFile.fp = NULL;
     }
+    Nu_Free(NULL, pDataSink->toFile.queueBuf);
+    pDataSink->toFile.queueBuf = NULL;
 }
 
 
 /*
  * Write a block of data to a DataSink.
  */
-NuError Nu_DataSinkPutBlock(NuDataSink* pDataSink, const uint8_t* buf,
-    uint32_t len)
+NuError Nu_DataSinkPutBlock(NuArchive* pArchive, NuDataSink* pDataSink,
+    const uint8_t* buf, uint32_t len)
 {
     NuError err;
 
@@ -790,13 +1081,18 @@ NuError Nu_DataSinkPutBlock(NuDataSink* pDataSink, const uint8_t* buf,
     switch (pDataSink->sinkType) {
     case kNuDataSinkToFile:
         Assert(pDataSink->toFile.fp != NULL);
-        err = Nu_FWrite(pDataSink->toFile.fp, buf, len);
+        if (pDataSink->toFile.queueBuf != NULL)
+            err = Nu_DataSinkFile_PutQueued(pArchive, pDataSink, buf, len);
+        else if (pDataSink->toFile.sparseBlockSize != 0)
+            err = Nu_DataSinkFile_PutSparse(pArchive, pDataSink, buf, len);
+        else
+            err = Nu_FWrite(pArchive, pDataSink->toFile.fp, buf, len);
         if (err != kNuErrNone)
             return err;
         break;
     case kNuDataSinkToFP:
         Assert(pDataSink->toFP.fp != NULL);
-        err = Nu_FWrite(pDataSink->toFP.fp, buf, len);
+        err = Nu_FWrite(pArchive, pDataSink->toFP.fp, buf, len);
         if (err != kNuErrNone)
             return err;
         break;
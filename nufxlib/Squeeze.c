@@ -600,7 +600,7 @@ bail:
  * Compress data from input to output, using the values in the "code"
  * and "codeLen" arrays.
  */
-static NuError Nu_SQCompressInput(SQState* pSqState, FILE* fp,
+static NuError Nu_SQCompressInput(SQState* pSqState, NuCompStream* pStream,
     long* pCompressedLen)
 {
     NuError err = kNuErrNone;
@@ -629,7 +629,7 @@ static NuError Nu_SQCompressInput(SQState* pSqState, FILE* fp,
 
         /* if we have more than a byte, output it */
         while (gotbits > 7) {
-            putc(bits & 0xff, fp);
+            Nu_CompStreamPutc(pStream, bits & 0xff);
             compressedLen++;
             bits >>= 8;
             gotbits -= 8;
@@ -638,10 +638,13 @@ static NuError Nu_SQCompressInput(SQState* pSqState, FILE* fp,
 
     if (gotbits) {
         Assert(gotbits < 8);
-        putc(bits & 0xff, fp);
+        Nu_CompStreamPutc(pStream, bits & 0xff);
         compressedLen++;
     }
 
+    /* catch any failures from the single-byte writes */
+    err = Nu_CompStreamGetError(pStream);
+
 bail:
     *pCompressedLen = compressedLen;
     return err;
@@ -651,17 +654,17 @@ bail:
 /*
  * Write a 16-bit value in little-endian order.
  */
-static NuError Nu_SQWriteShort(FILE* outfp, short val)
+static NuError Nu_SQWriteShort(NuCompStream* pStream, short val)
 {
     NuError err;
     uint8_t tmpc;
 
     tmpc = val & 0xff;
-    err = Nu_FWrite(outfp, &tmpc, 1);
+    err = Nu_CompStreamWrite(pStream, &tmpc, 1);
     if (err != kNuErrNone)
         goto bail;
     tmpc = (val >> 8) & 0xff;
-    err = Nu_FWrite(outfp, &tmpc, 1);
+    err = Nu_CompStreamWrite(pStream, &tmpc, 1);
     if (err != kNuErrNone)
         goto bail;
 
@@ -670,7 +673,7 @@ bail:
 }
 
 /*
- * Compress "srcLen" bytes into SQ format, from "pStraw" to "fp".
+ * Compress "srcLen" bytes into SQ format, from "pStraw" to "pStream".
  *
  * This requires two passes through the input.
  *
@@ -678,8 +681,8 @@ bail:
  * it an empty file.  "xsq" works fine, creating an empty tree that
  * "xusq" unpacks.
  */
-NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
-    uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
+NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw,
+    NuCompStream* pStream, uint32_t srcLen, uint32_t* pDstLen, uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
     SQState sqState;
@@ -735,17 +738,17 @@ NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
 
     #ifdef FULL_SQ_HEADER
     /* write file header */
-    err = Nu_SQWriteShort(fp, kNuSQMagic);
+    err = Nu_SQWriteShort(pStream, kNuSQMagic);
     BailError(err);
     compressedLen += 2;
 
-    err = Nu_SQWriteShort(fp, sqState.checksum);
+    err = Nu_SQWriteShort(pStream, sqState.checksum);
     BailError(err);
     compressedLen += 2;
 
     {
         static const char fakename[] = "s.qqq";
-        err = Nu_FWrite(fp, fakename, sizeof(fakename));
+        err = Nu_CompStreamWrite(pStream, fakename, sizeof(fakename));
         BailError(err);
         compressedLen += sizeof(fakename);
     }
@@ -764,7 +767,7 @@ NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
         numNodes = 0;
     else
         numNodes = sqState.treeHead - (kNuSQNumVals - 1);
-    err = Nu_SQWriteShort(fp, (short) numNodes);
+    err = Nu_SQWriteShort(pStream, (short) numNodes);
     BailError(err);
     compressedLen += 2;
 
@@ -775,9 +778,9 @@ NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
         r = sqState.node[i].rchild;
         l = l < kNuSQNumVals ? -(l + 1) : sqState.treeHead - l;
         r = r < kNuSQNumVals ? -(r + 1) : sqState.treeHead - r;
-        err = Nu_SQWriteShort(fp, (short) l);
+        err = Nu_SQWriteShort(pStream, (short) l);
         BailError(err);
-        err = Nu_SQWriteShort(fp, (short) r);
+        err = Nu_SQWriteShort(pStream, (short) r);
         BailError(err);
         compressedLen += 4;
 
@@ -787,7 +790,7 @@ NuError Nu_CompressHuffmanSQ(NuArchive* pArchive, NuStraw* pStraw, FILE* fp,
     /*
      * Convert the input to RLE/Huffman.
      */
-    err = Nu_SQCompressInput(&sqState, fp, &compressedLen);
+    err = Nu_SQCompressInput(&sqState, pStream, &compressedLen);
     BailError(err);
 
     /*
@@ -885,7 +888,8 @@ static inline NuError Nu_USQReadShort(USQState* pUsqState, short* pShort)
  * the file is not essential.
  */
 NuError Nu_ExpandHuffmanSQ(NuArchive* pArchive, const NuRecord* pRecord,
-    const NuThread* pThread, FILE* infp, NuFunnel* pFunnel, uint16_t* pCrc)
+    const NuThread* pThread, NuCompStream* pStream, NuFunnel* pFunnel,
+    uint16_t* pCrc)
 {
     NuError err = kNuErrNone;
     USQState usqState;
@@ -927,7 +931,7 @@ NuError Nu_ExpandHuffmanSQ(NuArchive* pArchive, const NuRecord* pRecord,
      * data left in the file, usqState.dataInBuffer is the amount of
      * compressed data left in the buffer.
      */
-    err = Nu_FRead(infp, usqState.dataPtr, getSize);
+    err = Nu_CompStreamRead(pStream, usqState.dataPtr, getSize);
     if (err != kNuErrNone) {
         Nu_ReportError(NU_BLOB, err,
             "failed reading compressed data (%u bytes)", getSize);
@@ -1027,8 +1031,8 @@ NuError Nu_ExpandHuffmanSQ(NuArchive* pArchive, const NuRecord* pRecord,
             else
                 getSize = compRemaining;
 
-            err = Nu_FRead(infp, usqState.dataPtr + usqState.dataInBuffer,
-                    getSize);
+            err = Nu_CompStreamRead(pStream,
+                    usqState.dataPtr + usqState.dataInBuffer, getSize);
             if (err != kNuErrNone) {
                 Nu_ReportError(NU_BLOB, err,
                     "failed reading compressed data (%u bytes)", getSize);
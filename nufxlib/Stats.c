@@ -0,0 +1,176 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Statistics, for NuGetStats.
+ *
+ * The counters live in the archive, and are bumped where the work is
+ * done: the FileIO.c wrappers count calls and bytes, ArchiveIO.c counts
+ * the header bytes it reads and writes one at a time, and the compress
+ * and expand dispatchers time the codecs.  Counting is just an add, so
+ * it's always on.  Timing needs a clock read at each end, and the CPU
+ * clock is a system call on most platforms, so it's only done when
+ * kNuValueStatsTiming is set.
+ *
+ * Only the archive's own thread touches its counters.  Work done on
+ * other threads is counted somewhere else and added in once the thread
+ * has been joined:
+ *
+ *  - The scratch archives used by best-of compression and the flush
+ *    pool have stats of their own, which Nu_StatsMerge adds to the
+ *    real archive's.
+ *  - The read-ahead and write-behind threads count their I/O under
+ *    their locks, and it's collected when a thread's data is finished.
+ *  - The CPU time of a codec's worker threads is added with
+ *    Nu_StatsAddWorker, and Nu_StatsCodecStop includes it in the codec's
+ *    time.
+ */
+#include "NufxLibPriv.h"
+
+
+/*
+ * Start timing something, if timing is enabled.  Returns zero if not.
+ */
+uint64_t Nu_StatsStartClock(const NuArchive* pArchive)
+{
+    if (!pArchive->valStatsTiming)
+        return 0;
+    return Nu_GetNanoTime();
+}
+
+/*
+ * Add the time since "start" to "*pTotal".  Does nothing if timing
+ * wasn't enabled when the clock was started, or isn't now.
+ */
+void Nu_StatsStopClock(const NuArchive* pArchive, uint64_t start,
+    uint64_t* pTotal)
+{
+    if (start == 0 || !pArchive->valStatsTiming)
+        return;
+    *pTotal += Nu_GetNanoTime() - start;
+}
+
+/*
+ * Get ready to time a codec.
+ */
+void Nu_StatsCodecStart(const NuArchive* pArchive, NuStatsTimer* pTimer)
+{
+    pTimer->wallStart = Nu_StatsStartClock(pArchive);
+    if (pTimer->wallStart != 0) {
+        pTimer->cpuStart = Nu_GetThreadCPUTime();
+        pTimer->workerStart = pArchive->workerCPUTime;
+    }
+}
+
+/*
+ * The codec is done.  Add its time to "pCodecStats", along with the
+ * amount of data that went in and came out.
+ */
+void Nu_StatsCodecStop(const NuArchive* pArchive, const NuStatsTimer* pTimer,
+    NuCodecStats* pCodecStats, uint32_t bytesIn, uint32_t bytesOut)
+{
+    pCodecStats->numCalls++;
+    pCodecStats->bytesIn += bytesIn;
+    pCodecStats->bytesOut += bytesOut;
+
+    if (pTimer->wallStart == 0 || !pArchive->valStatsTiming)
+        return;
+    pCodecStats->wallTime += Nu_GetNanoTime() - pTimer->wallStart;
+    pCodecStats->cpuTime += Nu_GetThreadCPUTime() - pTimer->cpuStart;
+    pCodecStats->cpuTime += pArchive->workerCPUTime - pTimer->workerStart;
+}
+
+/*
+ * Count the CPU time used by a worker thread.  Call after it has been
+ * joined.
+ */
+void Nu_StatsAddWorker(NuArchive* pArchive, const NuWorker* pWorker)
+{
+    pArchive->workerCPUTime += pWorker->cpuTime;
+}
+
+/*
+ * Compute the CRC of a buffer full of thread data, with Nu_CalcCRC16,
+ * and count it.
+ */
+uint16_t Nu_StatsCalcCRC16(NuArchive* pArchive, uint16_t seed,
+    const uint8_t* ptr, int count)
+{
+    uint64_t start = Nu_StatsStartClock(pArchive);
+
+    seed = Nu_CalcCRC16(seed, ptr, count);
+
+    pArchive->stats.crcBytes += count;
+    Nu_StatsStopClock(pArchive, start, &pArchive->stats.crcTime);
+    return seed;
+}
+
+/*
+ * Add the stats from a scratch archive to "pArchive", and clear them.
+ * Any threads that were using the scratch archive must have finished.
+ */
+void Nu_StatsMerge(NuArchive* pArchive, NuArchive* pScratch)
+{
+    NuStats* pDst = &pArchive->stats;
+    const NuStats* pSrc = &pScratch->stats;
+    int i;
+
+    pDst->bytesRead += pSrc->bytesRead;
+    pDst->bytesWritten += pSrc->bytesWritten;
+    pDst->bytesCopied += pSrc->bytesCopied;
+    pDst->tempFileBytes += pSrc->tempFileBytes;
+    pDst->freadCalls += pSrc->freadCalls;
+    pDst->fwriteCalls += pSrc->fwriteCalls;
+    pDst->fseekCalls += pSrc->fseekCalls;
+    pDst->ftellCalls += pSrc->ftellCalls;
+    pDst->recordsScanned += pSrc->recordsScanned;
+    pDst->headerParseTime += pSrc->headerParseTime;
+    pDst->crcBytes += pSrc->crcBytes;
+    pDst->crcTime += pSrc->crcTime;
+
+    for (i = 0; i < kNuStatsNumFormats; i++) {
+        NuCodecStats* pDstCodec = &pDst->compress[i];
+        const NuCodecStats* pSrcCodec = &pSrc->compress[i];
+
+        pDstCodec->bytesIn += pSrcCodec->bytesIn;
+        pDstCodec->bytesOut += pSrcCodec->bytesOut;
+        pDstCodec->numCalls += pSrcCodec->numCalls;
+        pDstCodec->wallTime += pSrcCodec->wallTime;
+        pDstCodec->cpuTime += pSrcCodec->cpuTime;
+
+        pDstCodec = &pDst->expand[i];
+        pSrcCodec = &pSrc->expand[i];
+        pDstCodec->bytesIn += pSrcCodec->bytesIn;
+        pDstCodec->bytesOut += pSrcCodec->bytesOut;
+        pDstCodec->numCalls += pSrcCodec->numCalls;
+        pDstCodec->wallTime += pSrcCodec->wallTime;
+        pDstCodec->cpuTime += pSrcCodec->cpuTime;
+    }
+
+    memset(&pScratch->stats, 0, sizeof(pScratch->stats));
+}
+
+
+/*
+ * Get a copy of the archive's stats.
+ */
+NuError Nu_GetStats(NuArchive* pArchive, NuStats* pStats)
+{
+    if (pStats == NULL)
+        return kNuErrInvalidArg;
+
+    *pStats = pArchive->stats;
+    return kNuErrNone;
+}
+
+/*
+ * Clear the archive's stats, e.g. before starting an operation that
+ * you want the numbers for.
+ */
+NuError Nu_ResetStats(NuArchive* pArchive)
+{
+    memset(&pArchive->stats, 0, sizeof(pArchive->stats));
+    return kNuErrNone;
+}
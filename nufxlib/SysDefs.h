@@ -67,6 +67,7 @@
 # include <direct.h>
 # define FOPEN_WANTS_B
 # define HAVE_CHSIZE
+# define HAVE__COMMIT
 # if _MSC_VER < 1900    /* no snprintf until Visual Studio 2015 */
 #  define snprintf _snprintf
 #  define vsnprintf _vsnprintf
@@ -98,6 +99,19 @@
 #ifdef HAVE_SYS_UTIME_H
 # include <sys/utime.h>
 #endif
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#elif defined(_WIN32)
+# include <windows.h>
+# include <process.h>
+#endif
+
+/* SSE2 is always there on x86-64, and on x86 if the compiler targets it */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define HAVE_SSE2
+# include <emmintrin.h>
+#endif
 
 #if defined(WINDOWS_LIKE)
 # ifndef F_OK
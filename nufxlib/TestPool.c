@@ -0,0 +1,377 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Parallel verification of records during NuTest.
+ *
+ * Testing an archive means expanding every data thread and checking its
+ * CRC, which is all CPU time once the data has been read.  When more than
+ * one worker thread is allowed, a pool of workers runs ahead of the test,
+ * expanding threads into nothing.  Each worker opens the archive file for
+ * itself, so it has its own file position, and gets a scratch archive
+ * for its codec state.  If read-ahead is enabled, the workers get the
+ * same per-thread readers that writable archives use.
+ *
+ * The records are still walked on the main thread, in order.  When the
+ * test gets to a thread a worker has verified, it just sends the progress
+ * updates the expander would have sent.  Anything that went wrong is
+ * left alone, and the thread is expanded again on the main thread, so
+ * the application sees the same error messages and CRC callbacks it
+ * would have without the pool.  If the test catches up with a thread the
+ * workers haven't started yet, it takes it back and does it itself.
+ *
+ * The workers need the thread offsets, so the record headers are all read
+ * before any of the threads are tested.  A damaged header will stop the
+ * test before anything has been verified, rather than partway through.
+ *
+ * The pool lives only as long as Nu_Test.
+ */
+#include "NufxLibPriv.h"
+
+typedef enum NuTestJobState {
+    kNuTestJobWaiting = 0,      /* not started */
+    kNuTestJobRunning,          /* a worker has it */
+    kNuTestJobDone,             /* result is ready */
+    kNuTestJobRetired           /* result used or discarded */
+} NuTestJobState;
+
+typedef struct NuTestJob {
+    /* set by Nu_TestPoolBegin, read-only after that */
+    const NuRecord*     pRecord;
+    const NuThread*     pThread;
+
+    NuTestJobState      state;          /* guarded by the pool's lock */
+
+    /* result, owned by whoever set the state to Running or Done */
+    Boolean             verified;       /* expanded with no complaints */
+} NuTestJob;
+
+typedef struct NuTestWorker {
+    struct NuTestPool*  pPool;
+    NuArchive*          pScratch;       /* codec state for this worker */
+    FILE*               fp;             /* private reader for the archive */
+    NuWorker            worker;
+    Boolean             running;        /* started and not yet joined */
+} NuTestWorker;
+
+struct NuTestPool {
+    NuTestJob*      jobs;
+    int             numJobs;
+    int             nextCheck;          /* first job the test hasn't seen */
+
+    NuTestWorker*   workers;
+    int             numWorkers;
+
+    /* guarded by "lock" */
+    NuMutex         lock;
+    NuCond          cond;               /* broadcast after any change */
+    int             nextJob;            /* next job for the workers */
+    Boolean         stop;               /* workers should quit */
+};
+
+
+/*
+ * Returns "true" if the workers should verify this thread.  Empty threads
+ * aren't worth handing off.
+ */
+static Boolean Nu_TestPoolIsEligible(const NuThread* pThread)
+{
+    return (pThread->thThreadClass == kNuThreadClassData &&
+            pThread->thCompThreadEOF != 0);
+}
+
+/*
+ * Expand one thread and throw the output away.  Runs on a worker thread,
+ * so it only touches the job and the worker.
+ */
+static void Nu_TestJobRun(NuTestJob* pJob, NuTestWorker* pWorker)
+{
+    NuError err;
+    NuArchive* pScratch = pWorker->pScratch;
+    NuDataSink* pDataSink = NULL;
+    NuFunnel* pFunnel = NULL;
+
+    err = Nu_SeekArchive(pScratch, pWorker->fp, pJob->pThread->fileOffset,
+            SEEK_SET);
+    BailError(err);
+
+    err = Nu_DataSinkVoid_New(true, kNuConvertOff, &pDataSink);
+    BailError(err);
+    err = Nu_FunnelNew(pScratch, pDataSink, kNuConvertOff, pScratch->valEOL,
+            NULL, &pFunnel);
+    BailError(err);
+
+    err = Nu_ExpandStream(pScratch, pJob->pRecord, pJob->pThread,
+            pWorker->fp, pFunnel);
+    BailError(err);
+
+    pJob->verified = true;
+
+bail:
+    (void) Nu_FunnelFree(pScratch, pFunnel);
+    if (pDataSink != NULL)
+        (void) Nu_DataSinkFree(pDataSink);
+}
+
+/*
+ * Worker thread.  Takes jobs in order until there aren't any left, or
+ * the pool is shut down.
+ */
+static void Nu_TestPoolWorker(void* arg)
+{
+    NuTestWorker* pWorker = arg;
+    NuTestPool* pPool = pWorker->pPool;
+    NuTestJob* pJob;
+
+    Nu_MutexLock(&pPool->lock);
+    while (!pPool->stop && pPool->nextJob < pPool->numJobs) {
+        pJob = &pPool->jobs[pPool->nextJob++];
+        if (pJob->state != kNuTestJobWaiting)
+            continue;       /* the test took it back */
+        pJob->state = kNuTestJobRunning;
+        Nu_MutexUnlock(&pPool->lock);
+
+        Nu_TestJobRun(pJob, pWorker);
+
+        Nu_MutexLock(&pPool->lock);
+        pJob->state = kNuTestJobDone;
+        Nu_CondBroadcast(&pPool->cond);
+    }
+    Nu_MutexUnlock(&pPool->lock);
+}
+
+
+/*
+ * Get the result of a job, and retire it.  Waits if a worker is busy with
+ * it.  If no worker has started it, it's taken back, and "false" is
+ * returned.
+ */
+static Boolean Nu_TestPoolClaim(NuTestPool* pPool, NuTestJob* pJob)
+{
+    Boolean verified = false;
+
+    Nu_MutexLock(&pPool->lock);
+    while (pJob->state == kNuTestJobRunning)
+        Nu_CondWait(&pPool->cond, &pPool->lock);
+    if (pJob->state == kNuTestJobDone)
+        verified = pJob->verified;
+    pJob->state = kNuTestJobRetired;
+    Nu_MutexUnlock(&pPool->lock);
+
+    return verified;
+}
+
+/*
+ * Stop the workers and throw the whole thing away.
+ */
+static void Nu_TestPoolDelete(NuArchive* pArchive, NuTestPool* pPool)
+{
+    int i;
+
+    if (pPool == NULL)
+        return;
+
+    Nu_MutexLock(&pPool->lock);
+    pPool->stop = true;
+    Nu_CondBroadcast(&pPool->cond);
+    Nu_MutexUnlock(&pPool->lock);
+
+    for (i = 0; i < pPool->numWorkers; i++) {
+        NuTestWorker* pWorker = &pPool->workers[i];
+
+        if (pWorker->running)
+            Nu_WorkerJoin(&pWorker->worker);
+        if (pWorker->fp != NULL)
+            fclose(pWorker->fp);
+        if (pWorker->pScratch != NULL)
+            Nu_StatsMerge(pArchive, pWorker->pScratch);
+        (void) Nu_NuArchiveFree(pWorker->pScratch);
+    }
+
+    Nu_CondDestroy(&pPool->cond);
+    Nu_MutexDestroy(&pPool->lock);
+    Nu_Free(pArchive, pPool->workers);
+    Nu_Free(pArchive, pPool->jobs);
+    Nu_Free(pArchive, pPool);
+}
+
+
+/*
+ * Start verifying the threads in the archive, if more than one worker
+ * thread is allowed and the archive is a file we can open again.  Reads
+ * the whole TOC, if we don't have it yet.  Failing to start a thread isn't
+ * an error; the test just does all the work itself.
+ *
+ * Follow with Nu_TestPoolEnd.
+ */
+NuError Nu_TestPoolBegin(NuArchive* pArchive)
+{
+    NuError err = kNuErrNone;
+    NuTestPool* pPool = NULL;
+    const NuRecord* pRecord;
+    const NuThread* pThread;
+    int numWorkers, numJobs, i;
+    uint32_t idx;
+
+    Assert(pArchive != NULL);
+    Assert(pArchive->pTestPool == NULL);
+
+    numWorkers = Nu_GetWorkerCount(pArchive);
+    if (numWorkers <= 1 || Nu_IsStreaming(pArchive) ||
+        pArchive->archivePathnameUNI == NULL)
+    {
+        goto bail;
+    }
+
+    err = Nu_GetTOCIfNeeded(pArchive);
+    BailError(err);
+
+    numJobs = 0;
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->origRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        for (idx = 0; idx < pRecord->recTotalThreads; idx++) {
+            if (Nu_TestPoolIsEligible(Nu_GetThread(pRecord, idx)))
+                numJobs++;
+        }
+    }
+    if (numJobs == 0)
+        goto bail;
+    if (numWorkers > numJobs)
+        numWorkers = numJobs;
+
+    pPool = Nu_Calloc(pArchive, sizeof(*pPool));
+    BailAlloc(pPool);
+    Nu_MutexInit(&pPool->lock);
+    Nu_CondInit(&pPool->cond);
+    pPool->jobs = Nu_Calloc(pArchive, numJobs * sizeof(*pPool->jobs));
+    BailAlloc(pPool->jobs);
+    pPool->workers = Nu_Calloc(pArchive,
+                        numWorkers * sizeof(*pPool->workers));
+    BailAlloc(pPool->workers);
+
+    pRecord = Nu_RecordSet_GetListHead(&pArchive->origRecordSet);
+    for ( ; pRecord != NULL; pRecord = pRecord->pNext) {
+        for (idx = 0; idx < pRecord->recTotalThreads; idx++) {
+            pThread = Nu_GetThread(pRecord, idx);
+            if (!Nu_TestPoolIsEligible(pThread))
+                continue;
+            pPool->jobs[pPool->numJobs].pRecord = pRecord;
+            pPool->jobs[pPool->numJobs].pThread = pThread;
+            pPool->numJobs++;
+        }
+    }
+    Assert(pPool->numJobs == numJobs);
+
+    /*
+     * Each worker gets its own codec state, with the settings that affect
+     * expansion, and its own FILE* on the archive.
+     */
+    for (i = 0; i < numWorkers; i++) {
+        NuTestWorker* pWorker = &pPool->workers[i];
+        NuArchive* pScratch;
+
+        err = Nu_ScratchArchiveNew(&pWorker->pScratch);
+        BailError(err);
+        pPool->numWorkers++;
+        pWorker->pPool = pPool;
+
+        pScratch = pWorker->pScratch;
+        Nu_ScratchArchiveSync(pArchive, pScratch);
+        pScratch->valIgnoreCRC = pArchive->valIgnoreCRC;
+        pScratch->valIgnoreLZW2Len = pArchive->valIgnoreLZW2Len;
+        pScratch->valMimicSHK = pArchive->valMimicSHK;
+        pScratch->valReadAhead = pArchive->valReadAhead;
+        pScratch->valWorkerThreads = 1;     /* already on a worker */
+
+        pWorker->fp = fopen(pArchive->archivePathnameUNI,
+                        kNuFileOpenReadOnly);
+        if (pWorker->fp == NULL)
+            break;
+    }
+
+    for (i = 0; i < pPool->numWorkers; i++) {
+        NuTestWorker* pWorker = &pPool->workers[i];
+
+        if (pWorker->fp == NULL)
+            break;
+        pWorker->running = Nu_WorkerTryStart(&pWorker->worker,
+                                Nu_TestPoolWorker, pWorker);
+        if (!pWorker->running)
+            break;
+    }
+    if (i == 0) {
+        DBUG(("--- unable to start test worker threads\n"));
+        goto bail;
+    }
+
+    pArchive->pTestPool = pPool;
+    pPool = NULL;
+
+bail:
+    Nu_TestPoolDelete(pArchive, pPool);
+    return err;
+}
+
+/*
+ * Shut down the pool, if there is one.  Anything the test didn't get
+ * to is discarded.
+ */
+void Nu_TestPoolEnd(NuArchive* pArchive)
+{
+    Nu_TestPoolDelete(pArchive, pArchive->pTestPool);
+    pArchive->pTestPool = NULL;
+}
+
+
+/*
+ * Check the pool for a thread the test is about to expand into "pFunnel".
+ *
+ * Sets "*pVerified" if a worker expanded it with no complaints.  The
+ * progress updates the expander would have sent are sent here instead,
+ * so the application can still skip or abort.  If the thread wasn't
+ * verified, the caller should expand it the usual way.
+ */
+NuError Nu_TestPoolCheckThread(NuArchive* pArchive, const NuThread* pThread,
+    NuFunnel* pFunnel, Boolean* pVerified)
+{
+    NuError err;
+    NuTestPool* pPool = pArchive->pTestPool;
+    NuProgressData* pProgressData = pFunnel->pProgress;
+    int i;
+
+    Assert(pVerified != NULL);
+
+    *pVerified = false;
+    if (pPool == NULL || !pArchive->testMode || !Nu_FunnelGetDoExpand(pFunnel))
+        return kNuErrNone;
+
+    /* threads come in TOC order, though the selection filter may skip some */
+    for (i = pPool->nextCheck; i < pPool->numJobs; i++) {
+        if (pPool->jobs[i].pThread == pThread)
+            break;
+    }
+    if (i == pPool->numJobs)
+        return kNuErrNone;
+    pPool->nextCheck = i + 1;
+
+    if (!Nu_TestPoolClaim(pPool, &pPool->jobs[i]))
+        return kNuErrNone;
+    *pVerified = true;
+
+    err = Nu_ProgressDataExpandPrep(pArchive, pFunnel, pThread);
+    BailError(err);
+    if (pProgressData != NULL && pThread->actualThreadEOF != 0) {
+        (void) Nu_FunnelSetProgressState(pFunnel, kNuProgressExpanding);
+        pProgressData->uncompressedProgress = pThread->actualThreadEOF;
+        err = Nu_FunnelSendProgressUpdate(pArchive, pFunnel);
+        BailError(err);
+    }
+    (void) Nu_FunnelSetProgressState(pFunnel, kNuProgressDone);
+    err = Nu_FunnelSendProgressUpdate(pArchive, pFunnel);
+    BailError(err);
+
+bail:
+    return err;
+}
@@ -208,7 +208,7 @@ NuError Nu_ReadThreadHeaders(NuArchive* pArchive, NuRecord* pRecord,
         goto bail;
     }
 
-    pRecord->pThreads = Nu_Malloc(pArchive,
+    pRecord->pThreads = Nu_ArenaAlloc(pArchive,
                             pRecord->recTotalThreads * sizeof(NuThread));
     BailAlloc(pRecord->pThreads);
 
@@ -281,7 +281,7 @@ NuError Nu_ReadThreadHeaders(NuArchive* pArchive, NuRecord* pRecord,
             pRecord->fakeThreads++;
         }
 
-        pRecord->pThreads = Nu_Realloc(pArchive, pRecord->pThreads,
+        pRecord->pThreads = Nu_ArenaRealloc(pArchive, pRecord->pThreads,
                                 pRecord->recTotalThreads * sizeof(NuThread));
         BailAlloc(pRecord->pThreads);
 
@@ -446,7 +446,7 @@ NuError Nu_ScanThreads(NuArchive* pArchive, NuRecord* pRecord, long numThreads)
                     pThread->thCompThreadEOF);
                 goto bail;
             }
-            pRecord->threadFilenameMOR = Nu_Malloc(pArchive,
+            pRecord->threadFilenameMOR = Nu_ArenaAlloc(pArchive,
                                         pThread->thCompThreadEOF +1);
             BailAlloc(pRecord->threadFilenameMOR);
 
@@ -539,6 +539,19 @@ static NuError Nu_ExtractThreadToDataSink(NuArchive* pArchive,
 {
     NuError err;
     NuFunnel* pFunnel = NULL;
+    Boolean verified;
+
+    /*
+     * Set up an output funnel to write to.
+     */
+    err = Nu_FunnelNew(pArchive, pDataSink, Nu_DataSinkGetConvertEOL(pDataSink),
+            pArchive->valEOL, pProgress, &pFunnel);
+    BailError(err);
+
+    /* if we're testing, a worker may have verified it already */
+    err = Nu_TestPoolCheckThread(pArchive, pThread, pFunnel, &verified);
+    if (err != kNuErrNone || verified)
+        goto bail;
 
     /* if it's not a stream, seek to the appropriate spot in the file */
     if (!Nu_IsStreaming(pArchive)) {
@@ -551,13 +564,6 @@ static NuError Nu_ExtractThreadToDataSink(NuArchive* pArchive,
         }
     }
 
-    /*
-     * Set up an output funnel to write to.
-     */
-    err = Nu_FunnelNew(pArchive, pDataSink, Nu_DataSinkGetConvertEOL(pDataSink),
-            pArchive->valEOL, pProgress, &pFunnel);
-    BailError(err);
-
     /*
      * Write it.
      */
@@ -600,8 +606,11 @@ static NuError Nu_ExtractThreadCommon(NuArchive* pArchive,
     UNICHAR* recFilenameStorageUNI = NULL;
     const UNICHAR* newPathnameUNI;
     NuResult result;
+    NuThreadID threadID;
     uint8_t newFssep;
     Boolean doFreeSink = false;
+    uint8_t* queueBuf;
+    uint32_t queueLen;
 
     Assert(pRecord != NULL);
     Assert(pThread != NULL);
@@ -635,8 +644,11 @@ static NuError Nu_ExtractThreadCommon(NuArchive* pArchive,
         selProposal.pThread = pThread;
         result = (*pArchive->selectionFilterFunc)(pArchive, &selProposal);
 
-        if (result == kNuSkip)
-            return Nu_SkipThread(pArchive, pRecord, pThread);
+        if (result == kNuSkip) {
+            /* (goto bail so the test-mode sink gets freed) */
+            err = Nu_SkipThread(pArchive, pRecord, pThread);
+            goto bail;
+        }
         if (result == kNuAbort) {
             err = kNuErrAborted;
             goto bail;
@@ -686,7 +698,8 @@ retry_name:
             /* we don't own this string, so make a copy */
             if (pathProposal.newPathnameUNI != NULL) {
                 Nu_Free(pArchive, newPathStorageUNI);
-                newPathStorageUNI = strdup(pathProposal.newPathnameUNI);
+                newPathStorageUNI =
+                        Nu_Strdup(pArchive, pathProposal.newPathnameUNI);
                 newPathnameUNI = newPathStorageUNI;
             } else {
                 newPathnameUNI = NULL;
@@ -748,6 +761,30 @@ retry_name:
         Assert(fileFp != NULL);
         (void) Nu_DataSinkFile_SetFP(pDataSink, fileFp);
 
+        /*
+         * Small threads can be expanded into memory and handed to the
+         * output queue, so we don't have to wait for the write.
+         */
+        if (Nu_DataSinkGetDoExpand(pDataSink))
+            queueLen = pThread->actualThreadEOF;
+        else
+            queueLen = pThread->thCompThreadEOF;
+        queueBuf = Nu_OutQueueGetBuffer(pArchive, queueLen);
+
+        /*
+         * Disk images are mostly empty blocks more often than not, and
+         * data forks can have long runs of zeroes too.  Leave holes in
+         * the output instead of writing them out.
+         */
+        threadID = NuMakeThreadID(pThread->thThreadClass,
+                    pThread->thThreadKind);
+        if (queueBuf != NULL)
+            Nu_DataSinkFile_SetQueueBuf(pDataSink, queueBuf, queueLen);
+        else if (threadID == kNuThreadIDDiskImage)
+            Nu_DataSinkFile_SetSparse(pDataSink, kNuSparseDiskBlockSize);
+        else if (threadID == kNuThreadIDDataFork)
+            Nu_DataSinkFile_SetSparse(pDataSink, kNuSparseFileBlockSize);
+
         DBUG(("+++ EXTRACTING 0x%08lx from '%s' at offset %0ld to '%s'\n",
             NuMakeThreadID(pThread->thThreadClass, pThread->thThreadKind),
             pRecord->filename, pThread->fileOffset, newPathname));
@@ -765,10 +802,20 @@ retry_name:
     if (Nu_DataSinkGetType(pDataSink) == kNuDataSinkToFile) {
         /*
          * Close the file, adjusting the modification date and access
-         * permissions as appropriate.
+         * permissions as appropriate.  If the data is in memory, the
+         * output queue does that after writing it.
          */
-        err = Nu_CloseOutputFile(pArchive, pRecord,
-                Nu_DataSinkFile_GetFP(pDataSink), newPathnameUNI);
+        queueBuf = Nu_DataSinkFile_TakeQueueBuf(pDataSink, &queueLen);
+        if (queueBuf != NULL) {
+            err = Nu_OutQueueAdd(pArchive, pRecord,
+                    Nu_DataSinkFile_GetFP(pDataSink), newPathnameUNI,
+                    queueBuf, queueLen);
+        } else {
+            err = Nu_DataSinkFile_EndHole(pArchive, pDataSink);
+            BailError(err);
+            err = Nu_CloseOutputFile(pArchive, pRecord,
+                    Nu_DataSinkFile_GetFP(pDataSink), newPathnameUNI);
+        }
         Nu_DataSinkFile_SetFP(pDataSink, NULL);
         BailError(err);
     }
@@ -797,6 +844,25 @@ bail:
     return err;
 }
 
+/*
+ * Clean up at the end of an extract call: wait for the output queue to
+ * finish writing, and close the directories we were extracting into.
+ * We don't want to hold on to those between calls.
+ *
+ * Returns "err", or the first write error from the queue if "err" is
+ * kNuErrNone.
+ */
+NuError Nu_ExtractFinish(NuArchive* pArchive, NuError err)
+{
+    NuError err2;
+
+    err2 = Nu_OutQueueDrain(pArchive);
+    Nu_DirCacheFlush(pArchive);
+    if (err == kNuErrNone)
+        err = err2;
+    return err;
+}
+
 /*
  * Extract a thread from the archive as part of a "bulk" extract operation.
  *
@@ -871,6 +937,7 @@ NuError Nu_ExtractThread(NuArchive* pArchive, NuThreadIdx threadIdx,
     BailError(err);
 
 bail:
+    err = Nu_ExtractFinish(pArchive, err);
     return err;
 }
 
@@ -9,6 +9,18 @@
 #include "NufxLibPriv.h"
 
 #define kMaxJunkSkipMax 8192
+#define kMaxWorkerThreads 64
+#define kMaxBestOfTimeLimit (60 * 60 * 1000)
+
+/* formats that can be named in kNuValueBestOfFormats */
+#define kBestOfFormatsAllowed \
+    (NuMakeFormatMask(kNuThreadFormatHuffmanSQ) | \
+     NuMakeFormatMask(kNuThreadFormatLZW1) | \
+     NuMakeFormatMask(kNuThreadFormatLZW2) | \
+     NuMakeFormatMask(kNuThreadFormatLZC12) | \
+     NuMakeFormatMask(kNuThreadFormatLZC16) | \
+     NuMakeFormatMask(kNuThreadFormatDeflate) | \
+     NuMakeFormatMask(kNuThreadFormatBzip2))
 
 
 /*
@@ -67,6 +79,51 @@ NuError Nu_GetValue(NuArchive* pArchive, NuValueID ident, NuValue* pValue)
     case kNuValueHandleBadMac:
         *pValue = pArchive->valHandleBadMac;
         break;
+    case kNuValueWorkerThreads:
+        *pValue = pArchive->valWorkerThreads;
+        break;
+    case kNuValueDeflateLevel:
+        *pValue = pArchive->valDeflateLevel;
+        break;
+    case kNuValueDeflateStrategy:
+        *pValue = pArchive->valDeflateStrategy;
+        break;
+    case kNuValueBzip2BlockSize:
+        *pValue = pArchive->valBzip2BlockSize;
+        break;
+    case kNuValueLZCBits:
+        *pValue = pArchive->valLZCBits;
+        break;
+    case kNuValueBestOfFormats:
+        *pValue = pArchive->valBestOfFormats;
+        break;
+    case kNuValueBestOfTimeLimit:
+        *pValue = pArchive->valBestOfTimeLimit;
+        break;
+    case kNuValueCompressPolicy:
+        *pValue = pArchive->valCompressPolicy;
+        break;
+    case kNuValueReadAhead:
+        *pValue = pArchive->valReadAhead;
+        break;
+    case kNuValueWriteBehind:
+        *pValue = pArchive->valWriteBehind;
+        break;
+    case kNuValueCompactInPlace:
+        *pValue = pArchive->valCompactInPlace;
+        break;
+    case kNuValueMemTempLimit:
+        *pValue = pArchive->valMemTempLimit;
+        break;
+    case kNuValueOutputQueueLimit:
+        *pValue = pArchive->valOutputQueueLimit;
+        break;
+    case kNuValueInputPrefetch:
+        *pValue = pArchive->valInputPrefetch;
+        break;
+    case kNuValueStatsTiming:
+        *pValue = pArchive->valStatsTiming;
+        break;
     default:
         err = kNuErrInvalidArg;
         Nu_ReportError(NU_BLOB, err, "Unknown ValueID %d requested", ident);
@@ -103,7 +160,9 @@ NuError Nu_SetValue(NuArchive* pArchive, NuValueID ident, NuValue value)
         pArchive->valConvertExtractedEOL = value;
         break;
     case kNuValueDataCompression:
-        if (value < kNuCompressNone || value > kNuCompressBzip2) {
+        if ((value < kNuCompressNone || value > kNuCompressBzip2) &&
+            value != kNuCompressBest)
+        {
             Nu_ReportError(NU_BLOB, err,
                 "Invalid kNuValueDataCompression value %u", value);
             goto bail;
@@ -206,6 +265,116 @@ NuError Nu_SetValue(NuArchive* pArchive, NuValueID ident, NuValue value)
         }
         pArchive->valHandleBadMac = value;
         break;
+    case kNuValueWorkerThreads:
+        if (value < 1 || value > kMaxWorkerThreads) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueWorkerThreads value %u", value);
+            goto bail;
+        }
+        pArchive->valWorkerThreads = value;
+        break;
+    case kNuValueDeflateLevel:
+        if (value < 1 || value > 9) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueDeflateLevel value %u", value);
+            goto bail;
+        }
+        pArchive->valDeflateLevel = value;
+        break;
+    case kNuValueDeflateStrategy:
+        if (value < kNuDeflateStrategyDefault ||
+            value > kNuDeflateStrategyFixed)
+        {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueDeflateStrategy value %u", value);
+            goto bail;
+        }
+        pArchive->valDeflateStrategy = value;
+        break;
+    case kNuValueBzip2BlockSize:
+        if (value < 1 || value > 9) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueBzip2BlockSize value %u", value);
+            goto bail;
+        }
+        pArchive->valBzip2BlockSize = value;
+        break;
+    case kNuValueLZCBits:
+        if (value < 12 || value > 16) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueLZCBits value %u", value);
+            goto bail;
+        }
+        pArchive->valLZCBits = value;
+        break;
+    case kNuValueBestOfFormats:
+        if (value == 0 || (value & ~kBestOfFormatsAllowed) != 0) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueBestOfFormats value 0x%04x", value);
+            goto bail;
+        }
+        pArchive->valBestOfFormats = value;
+        break;
+    case kNuValueBestOfTimeLimit:
+        if (value > kMaxBestOfTimeLimit) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueBestOfTimeLimit value %u", value);
+            goto bail;
+        }
+        pArchive->valBestOfTimeLimit = value;
+        break;
+    case kNuValueCompressPolicy:
+        if (value != true && value != false) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueCompressPolicy value %u", value);
+            goto bail;
+        }
+        pArchive->valCompressPolicy = value;
+        break;
+    case kNuValueReadAhead:
+        if (value != true && value != false) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueReadAhead value %u", value);
+            goto bail;
+        }
+        pArchive->valReadAhead = value;
+        break;
+    case kNuValueWriteBehind:
+        if (value != true && value != false) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueWriteBehind value %u", value);
+            goto bail;
+        }
+        pArchive->valWriteBehind = value;
+        break;
+    case kNuValueCompactInPlace:
+        if (value != true && value != false) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueCompactInPlace value %u", value);
+            goto bail;
+        }
+        pArchive->valCompactInPlace = value;
+        break;
+    case kNuValueMemTempLimit:
+        /* any size is okay; zero disables it */
+        pArchive->valMemTempLimit = value;
+        break;
+    case kNuValueOutputQueueLimit:
+        /* any size is okay; zero disables it */
+        pArchive->valOutputQueueLimit = value;
+        break;
+    case kNuValueInputPrefetch:
+        /* any size is okay; zero disables it */
+        pArchive->valInputPrefetch = value;
+        break;
+    case kNuValueStatsTiming:
+        if (value != true && value != false) {
+            Nu_ReportError(NU_BLOB, err,
+                "Invalid kNuValueStatsTiming value %u", value);
+            goto bail;
+        }
+        pArchive->valStatsTiming = value;
+        break;
     default:
         Nu_ReportError(NU_BLOB, err, "Unknown ValueID %d requested", ident);
         goto bail;
@@ -307,6 +476,8 @@ NuThreadFormat Nu_ConvertCompressValToFormat(NuArchive* pArchive,
                             unsup = true;                               break;
     #endif
 
+    case kNuCompressBest:   threadFormat = kNuThreadFormatBestOf;       break;
+
     default:
         Nu_ReportError(NU_BLOB, kNuErrInvalidArg,
             "Unknown compress value %u", compValue);
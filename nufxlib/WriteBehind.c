@@ -0,0 +1,398 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING-LIB.
+ *
+ * Write-behind for NuFlush.
+ *
+ * When a flush builds the new archive, the compressors write their output
+ * to the temp file (or the original archive) on the same thread that does
+ * the compressing, so every write that blocks stalls the codec.  When
+ * kNuValueWriteBehind is set, the compressed output is collected in a ring
+ * of large buffers instead, and a background thread writes the full ones
+ * out while the compressor keeps going.
+ *
+ * The writer is started at the beginning of the flush and stopped at the
+ * end of it.  Everything other than the compressed thread data (record
+ * headers, copied records, the master header) is still written directly
+ * to the FILE*, and the headers are still patched after the thread sizes
+ * are known, so the queue is drained whenever a thread is finished or a
+ * compressor seeks.  The writer never touches the FILE* while it's idle.
+ *
+ * A failed write is remembered, and reported when the thread is finished,
+ * which fails the flush.  If the library doesn't have thread support, or
+ * a thread can't be started, the compressors write to the file directly.
+ */
+#include "NufxLibPriv.h"
+
+/* size of each buffer in the ring, and how many there are */
+#define kNuWriteBehindBufSize   (64 * 1024)
+#define kNuWriteBehindBufCount  4
+
+typedef struct NuWriteBehindBuf {
+    uint8_t*        data;           /* kNuWriteBehindBufSize bytes */
+    uint32_t        len;            /* #of bytes to write */
+} NuWriteBehindBuf;
+
+struct NuWriteBehind {
+    FILE*           fp;
+
+    NuWorker        worker;
+    Boolean         running;        /* worker started and not yet joined */
+
+    /* everything from here to the compressor state is guarded by "lock" */
+    NuMutex         lock;
+    NuCond          cond;           /* broadcast after any change */
+    int             head;           /* next buffer for the writer */
+    int             numFull;        /* #of buffers waiting to be written */
+    Boolean         stop;           /* writer should quit when idle */
+    NuError         err;            /* first write failure, if any */
+    uint32_t        fwriteCalls;    /* not yet added to the archive stats */
+    uint64_t        bytesWritten;
+
+    NuWriteBehindBuf bufs[kNuWriteBehindBufCount];
+
+    /* compressor state */
+    int             tail;           /* buffer being filled */
+    long            offset;         /* file offset of the next byte */
+};
+
+
+/*
+ * The writer thread.  Writes full buffers until it's told to stop and
+ * there's nothing left to write.
+ *
+ * After a failure the remaining buffers are discarded, so the compressor
+ * doesn't wait forever for space.
+ */
+static void Nu_WriteBehindWriter(void* arg)
+{
+    NuWriteBehind* pWriteBehind = arg;
+    const NuWriteBehindBuf* pBuf;
+    NuError err;
+
+    Nu_MutexLock(&pWriteBehind->lock);
+    while (true) {
+        while (pWriteBehind->numFull == 0 && !pWriteBehind->stop)
+            Nu_CondWait(&pWriteBehind->cond, &pWriteBehind->lock);
+        if (pWriteBehind->numFull == 0)
+            break;
+        err = pWriteBehind->err;
+        Nu_MutexUnlock(&pWriteBehind->lock);
+
+        /* the buffer at "head" is ours until we count it as empty */
+        pBuf = &pWriteBehind->bufs[pWriteBehind->head];
+        if (err == kNuErrNone &&
+            fwrite(pBuf->data, 1, pBuf->len, pWriteBehind->fp) != pBuf->len)
+        {
+            err = kNuErrFileWrite;
+        }
+
+        Nu_MutexLock(&pWriteBehind->lock);
+        if (err == kNuErrNone) {
+            pWriteBehind->fwriteCalls++;
+            pWriteBehind->bytesWritten += pBuf->len;
+        }
+        pWriteBehind->err = err;
+        pWriteBehind->head = (pWriteBehind->head + 1) % kNuWriteBehindBufCount;
+        pWriteBehind->numFull--;
+        Nu_CondBroadcast(&pWriteBehind->cond);
+    }
+    Nu_MutexUnlock(&pWriteBehind->lock);
+}
+
+/*
+ * Hand the buffer we've been filling to the writer, and wait until the
+ * next one is free.
+ *
+ * Returns the writer's error state.
+ */
+static NuError Nu_WriteBehindSubmit(NuWriteBehind* pWriteBehind)
+{
+    NuError err;
+
+    Nu_MutexLock(&pWriteBehind->lock);
+    pWriteBehind->tail = (pWriteBehind->tail + 1) % kNuWriteBehindBufCount;
+    pWriteBehind->numFull++;
+    Nu_CondBroadcast(&pWriteBehind->cond);
+    while (pWriteBehind->numFull == kNuWriteBehindBufCount)
+        Nu_CondWait(&pWriteBehind->cond, &pWriteBehind->lock);
+    pWriteBehind->bufs[pWriteBehind->tail].len = 0;
+    err = pWriteBehind->err;
+    Nu_MutexUnlock(&pWriteBehind->lock);
+
+    return err;
+}
+
+/*
+ * Wait until everything we've been given has been written.  On return the
+ * writer is idle, and the FILE* is positioned after the last byte.
+ */
+static NuError Nu_WriteBehindDrain(NuWriteBehind* pWriteBehind)
+{
+    NuError err;
+
+    if (pWriteBehind->bufs[pWriteBehind->tail].len != 0)
+        (void) Nu_WriteBehindSubmit(pWriteBehind);
+
+    Nu_MutexLock(&pWriteBehind->lock);
+    while (pWriteBehind->numFull != 0)
+        Nu_CondWait(&pWriteBehind->cond, &pWriteBehind->lock);
+    err = pWriteBehind->err;
+    Nu_MutexUnlock(&pWriteBehind->lock);
+
+    return err;
+}
+
+/*
+ * Add what the writer has written so far to the archive's stats.  The
+ * writer may still be running.
+ */
+static void Nu_WriteBehindCollectStats(NuArchive* pArchive,
+    NuWriteBehind* pWriteBehind)
+{
+    Nu_MutexLock(&pWriteBehind->lock);
+    pArchive->stats.fwriteCalls += pWriteBehind->fwriteCalls;
+    Nu_StatsAddWrite(pArchive, pWriteBehind->fp, pWriteBehind->bytesWritten);
+    pWriteBehind->fwriteCalls = 0;
+    pWriteBehind->bytesWritten = 0;
+    Nu_MutexUnlock(&pWriteBehind->lock);
+}
+
+/*
+ * Stop the writer and throw the whole thing away.
+ */
+static void Nu_WriteBehindDelete(NuArchive* pArchive,
+    NuWriteBehind* pWriteBehind)
+{
+    int i;
+
+    if (pWriteBehind == NULL)
+        return;
+
+    if (pWriteBehind->running) {
+        Nu_MutexLock(&pWriteBehind->lock);
+        pWriteBehind->stop = true;
+        Nu_CondBroadcast(&pWriteBehind->cond);
+        Nu_MutexUnlock(&pWriteBehind->lock);
+
+        Nu_WorkerJoin(&pWriteBehind->worker);
+        pWriteBehind->running = false;
+    }
+    Nu_WriteBehindCollectStats(pArchive, pWriteBehind);
+
+    for (i = 0; i < kNuWriteBehindBufCount; i++)
+        Nu_Free(pArchive, pWriteBehind->bufs[i].data);
+    Nu_CondDestroy(&pWriteBehind->cond);
+    Nu_MutexDestroy(&pWriteBehind->lock);
+    Nu_Free(pArchive, pWriteBehind);
+}
+
+
+/*
+ * Start a writer for the flush that's about to write to "fp", if the
+ * application asked for one.  Failing to start a thread isn't an error;
+ * the output just gets written directly.
+ *
+ * Follow with Nu_WriteBehindEnd.
+ */
+NuError Nu_WriteBehindBegin(NuArchive* pArchive, FILE* fp)
+{
+    NuError err = kNuErrNone;
+    NuWriteBehind* pWriteBehind = NULL;
+    int i;
+
+    Assert(pArchive != NULL);
+    Assert(fp != NULL);
+    Assert(pArchive->pWriteBehind == NULL);
+
+    if (!pArchive->valWriteBehind)
+        goto bail;
+
+    pWriteBehind = Nu_Calloc(pArchive, sizeof(*pWriteBehind));
+    BailAlloc(pWriteBehind);
+    Nu_MutexInit(&pWriteBehind->lock);
+    Nu_CondInit(&pWriteBehind->cond);
+    pWriteBehind->fp = fp;
+
+    for (i = 0; i < kNuWriteBehindBufCount; i++) {
+        pWriteBehind->bufs[i].data = Nu_Malloc(pArchive,
+                                        kNuWriteBehindBufSize);
+        if (pWriteBehind->bufs[i].data == NULL) {
+            err = kNuErrMalloc;
+            goto bail;
+        }
+    }
+
+    pWriteBehind->running = Nu_WorkerTryStart(&pWriteBehind->worker,
+                                Nu_WriteBehindWriter, pWriteBehind);
+    if (!pWriteBehind->running) {
+        DBUG(("--- unable to start write-behind thread\n"));
+        goto bail;
+    }
+
+    pArchive->pWriteBehind = pWriteBehind;
+    pWriteBehind = NULL;
+
+bail:
+    Nu_WriteBehindDelete(pArchive, pWriteBehind);
+    return err;
+}
+
+/*
+ * Shut down the flush's writer, if it has one.  Returns an error if any
+ * of the writes failed.
+ */
+NuError Nu_WriteBehindEnd(NuArchive* pArchive)
+{
+    NuWriteBehind* pWriteBehind = pArchive->pWriteBehind;
+    NuError err;
+
+    if (pWriteBehind == NULL)
+        return kNuErrNone;
+
+    err = Nu_WriteBehindDrain(pWriteBehind);
+    Nu_WriteBehindDelete(pArchive, pWriteBehind);
+    pArchive->pWriteBehind = NULL;
+    return err;
+}
+
+
+/*
+ * Set up "pStream" to take the compressed output for a thread, which
+ * will be written to "dstFp" at its current position.  The output goes
+ * through the flush's writer when there is one; otherwise the stream
+ * just writes to "dstFp".
+ *
+ * Follow with Nu_WriteBehindCloseThread.
+ */
+void Nu_WriteBehindOpenThread(NuArchive* pArchive, FILE* dstFp,
+    NuCompStream* pStream)
+{
+    NuWriteBehind* pWriteBehind = pArchive->pWriteBehind;
+    long offset;
+
+    Nu_CompStreamInitFile(pArchive, pStream, dstFp);
+    if (pWriteBehind == NULL || pWriteBehind->fp != dstFp)
+        return;
+
+    /* the writer is idle, so we're free to ask */
+    Assert(pWriteBehind->bufs[pWriteBehind->tail].len == 0);
+    pArchive->stats.ftellCalls++;
+    offset = ftell(dstFp);
+    if (offset < 0)
+        return;
+
+    pWriteBehind->offset = offset;
+    pStream->type = kNuCompStreamWriteBehind;
+    pStream->pWriteBehind = pWriteBehind;
+}
+
+/*
+ * Done writing a thread.  Waits for the output to reach the file, so
+ * the caller can go back and fix up the headers.
+ */
+NuError Nu_WriteBehindCloseThread(NuCompStream* pStream)
+{
+    NuError err;
+
+    Assert(pStream != NULL);
+
+    if (pStream->type != kNuCompStreamWriteBehind)
+        return kNuErrNone;
+    err = Nu_WriteBehindDrain(pStream->pWriteBehind);
+    Nu_WriteBehindCollectStats(pStream->pArchive, pStream->pWriteBehind);
+    return err;
+}
+
+
+/*
+ * Write "len" bytes.  Used by the write-behind flavor of NuCompStream.
+ *
+ * Failures may not show up until a later call.
+ */
+NuError Nu_WriteBehindWrite(NuWriteBehind* pWriteBehind, const void* buf,
+    uint32_t len)
+{
+    const uint8_t* ptr = buf;
+    NuWriteBehindBuf* pBuf;
+    NuError err = kNuErrNone;
+    uint32_t avail;
+
+    Assert(buf != NULL);
+
+    while (len) {
+        pBuf = &pWriteBehind->bufs[pWriteBehind->tail];
+        avail = kNuWriteBehindBufSize - pBuf->len;
+        if (avail > len)
+            avail = len;
+        memcpy(pBuf->data + pBuf->len, ptr, avail);
+        pBuf->len += avail;
+        pWriteBehind->offset += avail;
+        ptr += avail;
+        len -= avail;
+
+        if (pBuf->len == kNuWriteBehindBufSize) {
+            err = Nu_WriteBehindSubmit(pWriteBehind);
+            BailError(err);
+        }
+    }
+
+bail:
+    return err;
+}
+
+/*
+ * Write a single byte.  Errors are sticky; see Nu_WriteBehindGetError.
+ */
+void Nu_WriteBehindPutc(NuWriteBehind* pWriteBehind, int val)
+{
+    NuWriteBehindBuf* pBuf = &pWriteBehind->bufs[pWriteBehind->tail];
+
+    pBuf->data[pBuf->len++] = (uint8_t) val;
+    pWriteBehind->offset++;
+    if (pBuf->len == kNuWriteBehindBufSize)
+        (void) Nu_WriteBehindSubmit(pWriteBehind);
+}
+
+/*
+ * Get the file offset of the next byte we'll write.
+ */
+long Nu_WriteBehindTell(const NuWriteBehind* pWriteBehind)
+{
+    return pWriteBehind->offset;
+}
+
+/*
+ * Seek to a new position.  Everything written so far goes out first.
+ */
+NuError Nu_WriteBehindSeek(NuArchive* pArchive, NuWriteBehind* pWriteBehind,
+    long offset, int ptrname)
+{
+    NuError err;
+
+    err = Nu_WriteBehindDrain(pWriteBehind);
+    BailError(err);
+    err = Nu_FSeek(pArchive, pWriteBehind->fp, offset, ptrname);
+    BailError(err);
+    err = Nu_FTell(pArchive, pWriteBehind->fp, &pWriteBehind->offset);
+    BailError(err);
+
+bail:
+    return err;
+}
+
+/*
+ * Return the writer's error state.  Doesn't wait for pending writes.
+ */
+NuError Nu_WriteBehindGetError(NuWriteBehind* pWriteBehind)
+{
+    NuError err;
+
+    Nu_MutexLock(&pWriteBehind->lock);
+    err = pWriteBehind->err;
+    Nu_MutexUnlock(&pWriteBehind->lock);
+
+    return err;
+}
@@ -13,9 +13,25 @@
 
 #define kTestArchive    "nlbt.shk"
 #define kTestTempFile   "nlbt.tmp"
+#define kTestDataFile   "nlbt.dat"
+#define kTestSparseFile "nlbt.spf"
+#define kTestSparseDisk "nlbt.spd"
+#define kTestSerialArchive  "nlbt1.shk"
+#define kTestPoolArchive    "nlbt4.shk"
+#define kTestJournalArchive "nlbtj.shk"
+#define kTestJournalFile    "nlbtj.shk-journal"
+#define kTestQueueArchive   "nlbtq.shk"
+
+#define kNumFlushFiles  6   /* records in the archives from BuildFlushArchive */
 
 #define kNumEntries     3   /* how many records are we going to add? */
 
+/* DoTests passes */
+#define kPassPlain      0
+#define kPassBestOf     1   /* best-of compression, memory temp file */
+#define kPassPolicy     2   /* policy, write-behind, parallel flush,
+                                   in-place compaction */
+
 /* stick to ASCII characters for these -- not doing conversions just yet */
 #define kTestEntryBytes     "bytes"
 #define kTestEntryBytesUPPER "BYTES"
@@ -918,6 +934,55 @@ failed:
 }
 
 
+/*
+ * Add a comment to the first record, and flush it.  The record has to be
+ * rebuilt, since it doesn't have room for one.
+ */
+int Test_AddComment(NuArchive* pArchive)
+{
+    NuError err;
+    NuRecordIdx recordIdx;
+    NuDataSource* pDataSource = NULL;
+    uint32_t status;
+    static const char* testComment = "Rebuilt in place.";
+
+    printf("... adding comment to first record\n");
+
+    err = NuGetRecordIdxByPosition(pArchive, 0, &recordIdx);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't find #%d (err=%d)\n", 0, err);
+        goto failed;
+    }
+    err = NuCreateDataSourceForBuffer(kNuThreadFormatUncompressed,
+            100, (const uint8_t*)testComment, 0, strlen(testComment), NULL,
+            &pDataSource);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: comment source create failed (err=%d)\n",
+            err);
+        goto failed;
+    }
+    err = NuAddThread(pArchive, recordIdx, kNuThreadIDComment, pDataSource,
+            NULL);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: comment thread add failed (err=%d)\n", err);
+        goto failed;
+    }
+    pDataSource = NULL;  /* now owned by library */
+
+    err = NuFlush(pArchive, &status);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: comment flush failed (err=%d, status=%d)\n",
+            err, status);
+        goto failed;
+    }
+
+    return 0;
+failed:
+    if (pDataSource != NULL)
+        (void) NuFreeDataSource(pDataSource);
+    return -1;
+}
+
 /*
  * Verify that the count in the master header has been updated.
  */
@@ -947,228 +1012,1492 @@ failed:
 
 
 /*
- * Run some tests.
- *
- * Returns 0 on success, -1 on error.
+ * Set up a compression policy that stores the big 'bytes' record.
  */
-int DoTests(void)
+int Test_SetPolicy(NuArchive* pArchive)
 {
     NuError err;
-    NuArchive* pArchive = NULL;
-    uint32_t status;
-    int cc, result = 0;
+    NuPolicyRule rule;
 
-    /*
-     * Make sure we're starting with a clean slate.
-     */
-    if (RemoveTestFile("Test archive", kTestArchive) < 0) {
-        goto failed;
-    }
-    if (RemoveTestFile("Test temp file", kTestTempFile) < 0) {
-        goto failed;
-    }
+    printf("... setting compression policy\n");
+    rule.fileType = kNuPolicyAny;
+    rule.extraTypeMin = 0;
+    rule.extraTypeMax = kNuPolicyAny;
+    rule.threadKind = kNuThreadKindDataFork;
+    rule.lenMin = 100000;
+    rule.lenMax = 99999;
+    rule.compression = kNuCompressNone;
 
-    /*
-     * Test some of the open flags.
-     */
-    if (Test_OpenFlags() != 0)
-        goto failed;
+    FAIL_OK;
+    err = NuSetCompressPolicy(pArchive, &rule, 1);
+    FAIL_BAD;
+    if (err == kNuErrNone) {
+        fprintf(stderr, "ERROR: empty policy range was accepted\n");
+        return -1;
+    }
 
-    /*
-     * Create a new archive to play with.
-     */
-    err = NuOpenRW(kTestArchive, kTestTempFile, kNuOpenCreat|kNuOpenExcl,
-            &pArchive);
+    rule.lenMax = kNuPolicyAny;
+    err = NuSetCompressPolicy(pArchive, &rule, 1);
+    if (err == kNuErrNone)
+        err = NuSetValue(pArchive, kNuValueCompressPolicy, true);
     if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: NuOpenRW failed (err=%d)\n", err);
-        goto failed;
+        fprintf(stderr, "ERROR: unable to set policy (err=%d)\n", err);
+        return -1;
     }
-    if (NuSetErrorMessageHandler(pArchive, ErrorMessageHandler) ==
-        kNuInvalidCallback)
+    return 0;
+}
+
+/*
+ * Make sure the policy did what it was asked to.
+ */
+int Test_PolicyStats(NuArchive* pArchive)
+{
+    NuError err;
+    NuPolicyStats stats;
+
+    printf("... checking compression policy stats\n");
+    err = NuGetCompressPolicyStats(pArchive, 0, NULL, &stats);
+    if (err != kNuErrNone || stats.numThreads != 1 || stats.numStored != 1 ||
+        stats.uncompressedBytes != 131072 || stats.compressedBytes != 131072)
     {
-        fprintf(stderr, "ERROR: couldn't set message handler\n");
-        goto failed;
+        fprintf(stderr, "ERROR: policy rule wasn't applied (err=%d)\n", err);
+        return -1;
     }
 
-    /*
-     * Add some test entries.
-     */
-    if (Test_AddStuff(pArchive) != 0)
-        goto failed;
+    /* the rest went through the default */
+    err = NuGetCompressPolicyStats(pArchive, 1, NULL, &stats);
+    if (err != kNuErrNone || stats.numThreads == 0) {
+        fprintf(stderr, "ERROR: no default policy stats (err=%d)\n", err);
+        return -1;
+    }
+    if (NuGetCompressPolicyStats(pArchive, 2, NULL, &stats) != kNuErrNotFound) {
+        fprintf(stderr, "ERROR: found stats for nonexistent rule\n");
+        return -1;
+    }
+    return 0;
+}
 
-    /*
-     * Check the archive contents.
-     */
-    printf("... checking contents\n");
-    if (Test_Contents(pArchive) != 0)
-        goto failed;
+/*
+ * Make sure the stats counted something.  After adding files we should
+ * have compressed and written data; after reading, we should have read
+ * record headers and expanded data.  Then clear them.
+ */
+int Test_Stats(NuArchive* pArchive, int reading)
+{
+    NuError err;
+    NuStats stats;
+    uint64_t compressed = 0, expanded = 0;
+    int i;
 
-    /*
-     * Reopen it read-only.
-     */
-    printf("... reopening archive read-only\n");
-    err = NuClose(pArchive);
+    printf("... checking stats\n");
+    err = NuGetStats(pArchive, &stats);
     if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: mid NuClose failed (err=%d)\n", err);
-        goto failed;
+        fprintf(stderr, "ERROR: NuGetStats failed (err=%d)\n", err);
+        return -1;
+    }
+    for (i = 0; i < kNuStatsNumFormats; i++) {
+        compressed += stats.compress[i].bytesIn;
+        expanded += stats.expand[i].bytesOut;
     }
-    pArchive = NULL;
 
-    err = NuOpenRO(kTestArchive, &pArchive);
-    if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: NuOpenRO failed (err=%d)\n", err);
-        goto failed;
+    if (!reading && (compressed == 0 || stats.bytesWritten == 0)) {
+        fprintf(stderr, "ERROR: nothing compressed or written\n");
+        return -1;
     }
-    if (NuSetErrorMessageHandler(pArchive, ErrorMessageHandler) ==
-        kNuInvalidCallback)
+    if (reading && (stats.recordsScanned == 0 || stats.bytesRead == 0 ||
+        expanded == 0))
     {
-        fprintf(stderr, "ERROR: couldn't set message handler\n");
-        goto failed;
+        fprintf(stderr, "ERROR: nothing scanned, read, or expanded\n");
+        return -1;
     }
 
-    /*
-     * Make sure the TOC (i.e. list of files) is still what we expect.
-     */
-    printf("... checking contents\n");
-    if (Test_Contents(pArchive) != 0)
-        goto failed;
+    err = NuResetStats(pArchive);
+    if (err == kNuErrNone)
+        err = NuGetStats(pArchive, &stats);
+    if (err != kNuErrNone || stats.bytesRead != 0 ||
+        stats.bytesWritten != 0 || stats.recordsScanned != 0)
+    {
+        fprintf(stderr, "ERROR: stats weren't reset (err=%d)\n", err);
+        return -1;
+    }
+    return 0;
+}
 
-    /*
-     * Verify the archive data.
-     */
-    if (Test_Verify(pArchive) != 0)
-        goto failed;
 
-    /*
-     * Extract the files.
-     */
-    if (Test_Extract(pArchive) != 0)
-        goto failed;
+/*
+ * Add a batch of files with NuAddFiles.  The two forks of "batch" should
+ * end up in one record, the copy of "English" is refused because it's
+ * already in the archive, and the second "other" because it was just
+ * added.  Then flush them.
+ */
+int Test_AddFiles(NuArchive* pArchive, long expected)
+{
+    static const struct {
+        const char* nameMOR;
+        NuThreadID  threadID;
+        NuError     result;
+    } kBatch[] = {
+        { "batch",      kNuThreadIDDataFork,    kNuErrNone },
+        { "batch",      kNuThreadIDRsrcFork,    kNuErrNone },
+        { "ENGLISH",    kNuThreadIDDataFork,    kNuErrSkipped },
+        { "other",      kNuThreadIDDataFork,    kNuErrNone },
+        { "other",      kNuThreadIDDataFork,    kNuErrRecordExists },
+    };
+#define kBatchLen   (int)(sizeof(kBatch) / sizeof(kBatch[0]))
+    NuAddFileEntry entries[kBatchLen];
+    NuRecordIdx recordIdxs[kBatchLen];
+    NuError results[kBatchLen];
+    NuError err;
+    uint32_t status;
+    FILE* fp;
+    int i;
 
-    /*
-     * Reopen it read-write.
-     */
-    printf("... reopening archive read-write\n");
-    err = NuClose(pArchive);
-    if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: late NuClose failed (err=%d)\n", err);
-        goto failed;
-    }
-    pArchive = NULL;
+    printf("... adding a batch of files\n");
 
-    err = NuOpenRW(kTestArchive, kTestTempFile, 0, &pArchive);
-    if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: re-NuOpenRW failed (err=%d)\n", err);
-        goto failed;
-    }
-    if (NuSetErrorMessageHandler(pArchive, ErrorMessageHandler) ==
-        kNuInvalidCallback)
-    {
-        fprintf(stderr, "ERROR: couldn't set message handler\n");
-        goto failed;
+    fp = fopen(kTestDataFile, kNuFileOpenWriteTrunc);
+    if (fp == NULL) {
+        perror("fopen kTestDataFile");
+        return -1;
     }
+    for (i = 0; i < 1000; i++)
+        fprintf(fp, "Line %d of the batch test file.\n", i);
+    fclose(fp);
 
-    /*
-     * Contents shouldn't have changed.
-     */
-    printf("... checking contents\n");
-    if (Test_Contents(pArchive) != 0)
-        goto failed;
-
-    /*
-     * Test deletion.
-     */
-    if (Test_Delete(pArchive) != 0)
-        goto failed;
+    memset(entries, 0, sizeof(entries));
+    for (i = 0; i < kBatchLen; i++) {
+        entries[i].pathnameUNI = kTestDataFile;
+        entries[i].fileDetails.threadID = kBatch[i].threadID;
+        entries[i].fileDetails.storageNameMOR = kBatch[i].nameMOR;
+        entries[i].fileDetails.fileSysInfo = kLocalFssep;
+        entries[i].fileDetails.access = kNuAccessUnlocked;
+    }
 
-    /*
-     * Abort the changes and verify that nothing has changed.
-     */
-    printf("... aborting changes\n");
-    err = NuAbort(pArchive);
+    FAIL_OK;
+    err = NuAddFiles(pArchive, entries, kBatchLen, recordIdxs, results);
+    FAIL_BAD;
     if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: abort failed (err=%d)\n", err);
+        fprintf(stderr, "ERROR: NuAddFiles failed (err=%d)\n", err);
         goto failed;
     }
-
-    printf("... checking contents\n");
-    if (Test_Contents(pArchive) != 0)
+    for (i = 0; i < kBatchLen; i++) {
+        if (results[i] != kBatch[i].result ||
+            (recordIdxs[i] != 0) != (kBatch[i].result == kNuErrNone))
+        {
+            fprintf(stderr, "ERROR: batch entry %d: err=%d idx=%u\n",
+                i, results[i], recordIdxs[i]);
+            goto failed;
+        }
+    }
+    if (recordIdxs[0] != recordIdxs[1] || recordIdxs[0] == recordIdxs[3]) {
+        fprintf(stderr, "ERROR: batch forks weren't paired up\n");
         goto failed;
+    }
 
-    /*
-     * Delete them again.
-     */
-    if (Test_Delete(pArchive) != 0)
+    /* without a results array, we stop at the first failure */
+    FAIL_OK;
+    err = NuAddFiles(pArchive, &entries[3], 2, recordIdxs, NULL);
+    FAIL_BAD;
+    if (err != kNuErrRecordExists || recordIdxs[0] != 0 || recordIdxs[1] != 0) {
+        fprintf(stderr, "ERROR: second batch didn't stop (err=%d)\n", err);
         goto failed;
+    }
 
-    /*
-     * Flush the deletions.  This should remove the first and last records.
-     */
     err = NuFlush(pArchive, &status);
     if (err != kNuErrNone) {
-        fprintf(stderr, "ERROR: flush failed (err=%d, status=%d)\n",
+        fprintf(stderr, "ERROR: batch flush failed (err=%d, status=%d)\n",
             err, status);
         goto failed;
     }
-
-    /*
-     * Check count in master header.
-     */
-    if (Test_MasterCount(pArchive, kNumEntries-2) != 0)
+    if (Test_MasterCount(pArchive, expected) != 0)
         goto failed;
-
-    /*
-     * That's all, folks...
-     */
-    NuClose(pArchive);
-    pArchive = NULL;
-
-    printf("... removing '%s'\n", kTestArchive);
-    cc = unlink(kTestArchive);
-    if (cc < 0) {
-        perror("unlink kTestArchive");
+    err = NuTest(pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: batch verify failed (err=%d)\n", err);
         goto failed;
     }
 
-
-leave:
-    if (pArchive != NULL) {
-        NuAbort(pArchive);
-        NuClose(pArchive);
-    }
-    return result;
-
+    (void) unlink(kTestDataFile);
+    return 0;
 failed:
-    result = -1;
-    goto leave;
+    (void) unlink(kTestDataFile);
+    return -1;
+#undef kBatchLen
 }
 
 
 /*
- * Crank away.
+ * Write "len" bytes from "buf" to a new file.
  */
-int main(void)
+static int WriteTestFile(const char* name, const uint8_t* buf, long len)
 {
-    int32_t major, minor, bug;
-    const char* pBuildDate;
-    const char* pBuildFlags;
-    int cc;
-
-    (void) NuGetVersion(&major, &minor, &bug, &pBuildDate, &pBuildFlags);
-    printf("Using NuFX library v%d.%d.%d, built on or after\n"
-           "  %s with [%s]\n\n",
-        major, minor, bug, pBuildDate, pBuildFlags);
+    FILE* fp;
 
-    if (NuSetGlobalErrorMessageHandler(ErrorMessageHandler) ==
-        kNuInvalidCallback)
-    {
-        fprintf(stderr, "ERROR: can't set the global message handler");
-        exit(1);
+    fp = fopen(name, kNuFileOpenWriteTrunc);
+    if (fp == NULL) {
+        perror("fopen test file");
+        return -1;
+    }
+    if (fwrite(buf, 1, len, fp) != (size_t) len) {
+        perror("fwrite test file");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Make sure the file "name" holds exactly the "len" bytes in "buf".
+ */
+static int CheckTestFile(const char* name, const uint8_t* buf, long len)
+{
+    FILE* fp;
+    uint8_t* fileBuf = NULL;
+    long fileLen;
+    int result = -1;
+
+    fp = fopen(name, kNuFileOpenReadOnly);
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: couldn't open extracted '%s'\n", name);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    fileLen = ftell(fp);
+    rewind(fp);
+    if (fileLen != len) {
+        fprintf(stderr, "ERROR: '%s' is %ld bytes, expected %ld\n",
+            name, fileLen, len);
+        goto bail;
+    }
+
+    fileBuf = malloc(len);
+    if (fileBuf == NULL) {
+        fprintf(stderr, "ERROR: malloc(%ld) failed\n", len);
+        goto bail;
+    }
+    if (fread(fileBuf, 1, len, fp) != (size_t) len ||
+        memcmp(fileBuf, buf, len) != 0)
+    {
+        fprintf(stderr, "ERROR: '%s' doesn't match what was added\n", name);
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    free(fileBuf);
+    fclose(fp);
+    return result;
+}
+
+/*
+ * Add a data fork and a disk image that are mostly zeroes, and extract
+ * them, which leaves holes in the output.  Zero runs are placed at the
+ * start of a block, in the middle, and at the end of the file, where the
+ * hole has to be closed off to get the length right.
+ */
+int Test_ExtractSparse(NuArchive* pArchive)
+{
+    enum { kFileLen = 7 * 4096, kDiskBlocks = 64 };
+    static uint8_t fileBuf[kFileLen];
+    static uint8_t diskBuf[kDiskBlocks * 512];
+    NuFileDetails fileDetails;
+    NuRecordIdx fileIdx, diskIdx;
+    NuError err;
+    uint32_t status;
+    int i;
+
+    printf("... extracting sparse files\n");
+
+    /* one data block, a three-block hole, 100 bytes, and zeroes to EOF */
+    memset(fileBuf, 0, sizeof(fileBuf));
+    for (i = 0; i < 4096; i++)
+        fileBuf[i] = (uint8_t) (i % 251 + 1);
+    for (i = 0; i < 100; i++)
+        fileBuf[4 * 4096 + i] = (uint8_t) (i + 1);
+
+    /* blocks 0 and 10, with holes after each */
+    memset(diskBuf, 0, sizeof(diskBuf));
+    for (i = 0; i < 512; i++) {
+        diskBuf[i] = (uint8_t) (i % 7 + 1);
+        diskBuf[10 * 512 + i] = (uint8_t) (i % 13 + 1);
+    }
+
+    if (RemoveTestFile("Sparse file", kTestSparseFile) < 0 ||
+        RemoveTestFile("Sparse disk", kTestSparseDisk) < 0)
+    {
+        return -1;
+    }
+    if (WriteTestFile(kTestSparseFile, fileBuf, sizeof(fileBuf)) != 0 ||
+        WriteTestFile(kTestSparseDisk, diskBuf, sizeof(diskBuf)) != 0)
+    {
+        goto failed;
+    }
+
+    memset(&fileDetails, 0, sizeof(fileDetails));
+    fileDetails.threadID = kNuThreadIDDataFork;
+    fileDetails.storageNameMOR = kTestSparseFile;
+    fileDetails.fileSysInfo = kLocalFssep;
+    fileDetails.access = kNuAccessUnlocked;
+    err = NuAddFile(pArchive, kTestSparseFile, &fileDetails, false, &fileIdx);
+    if (err == kNuErrNone) {
+        fileDetails.threadID = kNuThreadIDDiskImage;
+        fileDetails.storageNameMOR = kTestSparseDisk;
+        fileDetails.storageType = 512;
+        fileDetails.extraType = kDiskBlocks;
+        err = NuAddFile(pArchive, kTestSparseDisk, &fileDetails, false,
+                &diskIdx);
+    }
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't add sparse files (err=%d)\n", err);
+        goto failed;
+    }
+    err = NuFlush(pArchive, &status);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: sparse flush failed (err=%d, status=%d)\n",
+            err, status);
+        goto failed;
+    }
+
+    /* we made these, so they can go without asking */
+    (void) unlink(kTestSparseFile);
+    (void) unlink(kTestSparseDisk);
+    err = NuExtractRecord(pArchive, fileIdx);
+    if (err == kNuErrNone)
+        err = NuExtractRecord(pArchive, diskIdx);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't extract sparse files (err=%d)\n",
+            err);
+        goto failed;
+    }
+    if (CheckTestFile(kTestSparseFile, fileBuf, sizeof(fileBuf)) != 0 ||
+        CheckTestFile(kTestSparseDisk, diskBuf, sizeof(diskBuf)) != 0)
+    {
+        goto failed;
+    }
+
+    (void) unlink(kTestSparseFile);
+    (void) unlink(kTestSparseDisk);
+    return 0;
+failed:
+    (void) unlink(kTestSparseFile);
+    (void) unlink(kTestSparseDisk);
+    return -1;
+}
+
+
+/*
+ * Read all of "name" into a new buffer.  Returns NULL on failure.
+ */
+static uint8_t* ReadTestFile(const char* name, long* pLen)
+{
+    FILE* fp;
+    uint8_t* buf;
+
+    fp = fopen(name, kNuFileOpenReadOnly);
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: couldn't open '%s'\n", name);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *pLen = ftell(fp);
+    rewind(fp);
+    buf = malloc(*pLen + 1);
+    if (buf != NULL && fread(buf, 1, *pLen, fp) != (size_t) *pLen) {
+        fprintf(stderr, "ERROR: couldn't read '%s'\n", name);
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    return buf;
+}
+
+/*
+ * Write file number "idx" of the BuildFlushArchive set to "pathname".
+ * Each has a different size and mix.
+ */
+static int WriteFlushTestFile(const char* pathname, int idx)
+{
+    FILE* fp;
+    int line;
+
+    fp = fopen(pathname, kNuFileOpenWriteTrunc);
+    if (fp == NULL) {
+        perror("fopen flush test file");
+        return -1;
+    }
+    for (line = 0; line < 500 * (idx + 1); line++) {
+        if (idx % 3 == 2)
+            fprintf(fp, "%08x", (unsigned) (line * 2654435761u));
+        else
+            fprintf(fp, "File %d, line %d of the flush test.\n", idx, line);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Create "archiveName" and add the same set of files to it, with the
+ * flush using "numWorkers" worker threads.  Record "flushN" is modified
+ * at 12:N on 2000-06-15.
+ */
+static int BuildFlushArchive(const char* archiveName, NuValue numWorkers)
+{
+    NuArchive* pArchive = NULL;
+    NuFileDetails fileDetails;
+    NuError err;
+    char pathBuf[16], nameBuf[16];
+    int i;
+
+    err = NuOpenRW(archiveName, kTestTempFile, kNuOpenCreat|kNuOpenExcl,
+            &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: NuOpenRW '%s' failed (err=%d)\n",
+            archiveName, err);
+        goto failed;
+    }
+    err = NuSetValue(pArchive, kNuValueWorkerThreads, numWorkers);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't set worker threads (err=%d)\n", err);
+        goto failed;
+    }
+
+    memset(&fileDetails, 0, sizeof(fileDetails));
+    fileDetails.threadID = kNuThreadIDDataFork;
+    fileDetails.fileSysInfo = kLocalFssep;
+    fileDetails.access = kNuAccessUnlocked;
+    fileDetails.modWhen.year = 100;
+    fileDetails.modWhen.month = 5;
+    fileDetails.modWhen.day = 14;
+    fileDetails.modWhen.hour = 12;
+    fileDetails.createWhen = fileDetails.archiveWhen = fileDetails.modWhen;
+
+    for (i = 0; i < kNumFlushFiles; i++) {
+        /* they're read during the flush, so each needs its own file */
+        sprintf(pathBuf, "nlbt%d.dat", i);
+        if (WriteFlushTestFile(pathBuf, i) != 0)
+            goto failed;
+
+        sprintf(nameBuf, "flush%d", i);
+        fileDetails.modWhen.minute = (uint8_t) i;
+        fileDetails.storageNameMOR = nameBuf;
+        err = NuAddFile(pArchive, pathBuf, &fileDetails, false, NULL);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't add '%s' (err=%d)\n",
+                nameBuf, err);
+            goto failed;
+        }
+    }
+
+    err = NuClose(pArchive);
+    pArchive = NULL;
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: NuClose '%s' failed (err=%d)\n",
+            archiveName, err);
+        goto failed;
+    }
+
+    for (i = 0; i < kNumFlushFiles; i++) {
+        sprintf(pathBuf, "nlbt%d.dat", i);
+        (void) unlink(pathBuf);
+    }
+    return 0;
+failed:
+    if (pArchive != NULL) {
+        NuAbort(pArchive);
+        NuClose(pArchive);
+    }
+    for (i = 0; i < kNumFlushFiles; i++) {
+        sprintf(pathBuf, "nlbt%d.dat", i);
+        (void) unlink(pathBuf);
+    }
+    return -1;
+}
+
+/*
+ * Build the same archive with one worker and with four, and make sure
+ * the parallel flush produced the same bytes as the serial one.  The
+ * master header's dates, and the CRC that covers them, will differ.
+ */
+int Test_FlushWorkers(void)
+{
+    enum { kMasterCRCOffset = 6, kMasterDatesOffset = 12,
+           kMasterDatesLen = 16, kMasterHeaderLen = 48 };
+    uint8_t* serialBuf = NULL;
+    uint8_t* poolBuf = NULL;
+    long serialLen, poolLen;
+    int result = -1;
+
+    printf("... comparing serial and parallel flushes\n");
+
+    if (RemoveTestFile("Test archive", kTestSerialArchive) < 0 ||
+        RemoveTestFile("Test archive", kTestPoolArchive) < 0)
+    {
+        return -1;
+    }
+    if (BuildFlushArchive(kTestSerialArchive, 1) != 0 ||
+        BuildFlushArchive(kTestPoolArchive, 4) != 0)
+    {
+        goto bail;
+    }
+
+    serialBuf = ReadTestFile(kTestSerialArchive, &serialLen);
+    poolBuf = ReadTestFile(kTestPoolArchive, &poolLen);
+    if (serialBuf == NULL || poolBuf == NULL)
+        goto bail;
+    if (serialLen != poolLen || serialLen < kMasterHeaderLen) {
+        fprintf(stderr, "ERROR: flushed archives are %ld and %ld bytes\n",
+            serialLen, poolLen);
+        goto bail;
+    }
+
+    memset(serialBuf + kMasterCRCOffset, 0, 2);
+    memset(poolBuf + kMasterCRCOffset, 0, 2);
+    memset(serialBuf + kMasterDatesOffset, 0, kMasterDatesLen);
+    memset(poolBuf + kMasterDatesOffset, 0, kMasterDatesLen);
+    if (memcmp(serialBuf, poolBuf, serialLen) != 0) {
+        fprintf(stderr, "ERROR: parallel flush didn't match serial flush\n");
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    free(serialBuf);
+    free(poolBuf);
+    (void) unlink(kTestSerialArchive);
+    (void) unlink(kTestPoolArchive);
+    return result;
+}
+
+
+/* how Test_ExtractQueued uses io_uring */
+enum { kRingOn, kRingOff, kRingBreak };
+
+/*
+ * Extract a set of small files with kNuValueOutputQueueLimit set, and
+ * check their contents and modification dates.  With kRingOff, io_uring
+ * is turned off, and the files should be written directly.  With
+ * kRingBreak, the ring fails after taking half of the writes, and the
+ * rest have to be written directly.
+ */
+int Test_ExtractQueued(int ringMode)
+{
+    static char ringOn[] = "NUFXLIB_NO_IO_URING=";
+    static char ringOff[] = "NUFXLIB_NO_IO_URING=1";
+    static char ringOk[] = "NUFXLIB_IO_URING_FAIL=";
+    static char ringBreak[32];
+    NuArchive* pArchive = NULL;
+    NuError err;
+    uint8_t* buf = NULL;
+    char nameBuf[16];
+    struct stat sb;
+    struct tm* pTm;
+    long len;
+    int i, result = -1;
+
+    printf("... extracting through the output queue%s\n",
+        ringMode == kRingOff ? " (without io_uring)" :
+        ringMode == kRingBreak ? " (io_uring fails)" : "");
+
+    for (i = 0; i < kNumFlushFiles; i++) {
+        sprintf(nameBuf, "flush%d", i);
+        if (RemoveTestFile("Output file", nameBuf) < 0)
+            return -1;
+    }
+    if (RemoveTestFile("Test archive", kTestQueueArchive) < 0)
+        return -1;
+    if (BuildFlushArchive(kTestQueueArchive, 1) != 0)
+        goto bail;
+
+    putenv(ringMode == kRingOff ? ringOff : ringOn);
+    if (ringMode == kRingBreak) {
+        sprintf(ringBreak, "NUFXLIB_IO_URING_FAIL=%d", kNumFlushFiles / 2);
+        putenv(ringBreak);
+    }
+    err = NuOpenRO(kTestQueueArchive, &pArchive);
+    if (err == kNuErrNone)
+        err = NuSetValue(pArchive, kNuValueOutputQueueLimit, 1024 * 1024);
+    if (err == kNuErrNone)
+        err = NuExtract(pArchive);
+    if (err == kNuErrNone) {
+        /* waits for the queue */
+        err = NuClose(pArchive);
+        pArchive = NULL;
+    }
+    putenv(ringOn);
+    putenv(ringOk);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: queued extract failed (err=%d)\n", err);
+        goto bail;
+    }
+
+    for (i = 0; i < kNumFlushFiles; i++) {
+        if (WriteFlushTestFile(kTestDataFile, i) != 0)
+            goto bail;
+        buf = ReadTestFile(kTestDataFile, &len);
+        if (buf == NULL)
+            goto bail;
+
+        sprintf(nameBuf, "flush%d", i);
+        if (CheckTestFile(nameBuf, buf, len) != 0)
+            goto bail;
+        free(buf);
+        buf = NULL;
+
+        if (stat(nameBuf, &sb) != 0) {
+            perror("stat extracted file");
+            goto bail;
+        }
+        pTm = localtime(&sb.st_mtime);
+        if (pTm == NULL || pTm->tm_year != 100 || pTm->tm_mon != 5 ||
+            pTm->tm_mday != 15 || pTm->tm_hour != 12 || pTm->tm_min != i)
+        {
+            fprintf(stderr, "ERROR: '%s' has the wrong mod date\n", nameBuf);
+            goto bail;
+        }
+    }
+    result = 0;
+
+bail:
+    if (pArchive != NULL)
+        NuClose(pArchive);
+    free(buf);
+    for (i = 0; i < kNumFlushFiles; i++) {
+        sprintf(nameBuf, "flush%d", i);
+        (void) unlink(nameBuf);
+    }
+    (void) unlink(kTestDataFile);
+    (void) unlink(kTestQueueArchive);
+    return result;
+}
+
+/*
+ * Store "val" little-endian in "len" bytes.
+ */
+static void PutLE(uint8_t* ptr, uint32_t val, int len)
+{
+    while (len--) {
+        *ptr++ = (uint8_t) val;
+        val >>= 8;
+    }
+}
+
+/*
+ * Compute the same CRC-16 the library uses (CCITT, MSB first).
+ */
+static uint16_t TestCRC16(uint16_t crc, const uint8_t* ptr, long len)
+{
+    int bit;
+
+    while (len--) {
+        crc ^= (uint16_t) (*ptr++ << 8);
+        for (bit = 0; bit < 8; bit++) {
+            if (crc & 0x8000)
+                crc = (uint16_t) ((crc << 1) ^ 0x1021);
+            else
+                crc = (uint16_t) (crc << 1);
+        }
+    }
+    return crc;
+}
+
+/*
+ * Write the journal an in-place compaction of "arcBuf" would have left
+ * behind, if it had crashed while moving the first chunk.  The plan
+ * removes the bytes between "dstOffset" and "srcOffset", leaving
+ * "numRecords" records.  This has to match the format in Compact.c.
+ */
+static int WriteTestJournal(const uint8_t* arcBuf, long arcLen,
+    uint32_t srcOffset, uint32_t dstOffset, uint32_t numRecords)
+{
+    enum { kHeaderLen = 28 + 12 + 2, kChunkSize = 256 * 1024,
+           kSlotHeaderLen = 18 };
+    uint8_t header[kHeaderLen];
+    uint8_t slotHeader[kSlotHeaderLen];
+    uint32_t extLen = arcLen - srcOffset;
+    uint16_t crc;
+    FILE* fp;
+    int result = -1;
+
+    if (extLen > kChunkSize) {
+        fprintf(stderr, "ERROR: journal test archive is too big\n");
+        return -1;
+    }
+
+    memcpy(header, "NuCJ", 4);
+    PutLE(header + 4, 2, 2);                        /* version */
+    PutLE(header + 6, numRecords, 4);
+    PutLE(header + 10, dstOffset + extLen, 4);      /* new end */
+    PutLE(header + 14, arcLen, 4);
+    memcpy(header + 18, arcBuf + 6, 2);             /* master CRC */
+    memcpy(header + 20, arcBuf + 38, 4);            /* master EOF */
+    PutLE(header + 24, 1, 4);                       /* one extent */
+    PutLE(header + 28, srcOffset, 4);
+    PutLE(header + 32, dstOffset, 4);
+    PutLE(header + 36, extLen, 4);
+    PutLE(header + 40, TestCRC16(0, header, 40), 2);
+
+    /* sequence 1 goes in the second slot */
+    PutLE(slotHeader, 1, 4);
+    PutLE(slotHeader + 4, 0, 4);                    /* extent index */
+    PutLE(slotHeader + 8, 0, 4);                    /* offset in extent */
+    PutLE(slotHeader + 12, extLen, 4);
+    crc = TestCRC16(0, slotHeader, 16);
+    PutLE(slotHeader + 16, TestCRC16(crc, arcBuf + srcOffset, extLen), 2);
+
+    fp = fopen(kTestJournalFile, kNuFileOpenWriteTrunc);
+    if (fp == NULL) {
+        perror("fopen journal");
+        return -1;
+    }
+    if (fwrite(header, 1, kHeaderLen, fp) != kHeaderLen ||
+        fseek(fp, kHeaderLen + kSlotHeaderLen + kChunkSize, SEEK_SET) != 0 ||
+        fwrite(slotHeader, 1, kSlotHeaderLen, fp) != kSlotHeaderLen ||
+        fwrite(arcBuf + srcOffset, 1, extLen, fp) != extLen)
+    {
+        perror("write journal");
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    fclose(fp);
+    return result;
+}
+
+/*
+ * Find the file offset of record "name".
+ */
+static int GetRecordOffset(NuArchive* pArchive, const char* name,
+    uint32_t* pOffset)
+{
+    NuRecordIdx recordIdx;
+    const NuRecord* pRecord;
+    NuError err;
+
+    err = NuGetRecordIdxByName(pArchive, name, &recordIdx);
+    if (err == kNuErrNone)
+        err = NuGetRecord(pArchive, recordIdx, &pRecord);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't find '%s' (err=%d)\n", name, err);
+        return -1;
+    }
+    *pOffset = (uint32_t) pRecord->fileOffset;
+    return 0;
+}
+
+/*
+ * Leave behind the journal of a compaction that crashed part way through,
+ * after tearing the write it was doing, and make sure NuOpenRW finishes
+ * the job.  Then change the archive, put the journal back, and make sure
+ * it's ignored.
+ */
+int Test_CompactRecover(void)
+{
+    NuArchive* pArchive = NULL;
+    NuRecordIdx recordIdx;
+    NuError err;
+    uint8_t* origBuf = NULL;
+    uint8_t* newBuf = NULL;
+    uint8_t junk[256];
+    uint32_t srcOffset, dstOffset;
+    long origLen, newLen;
+    FILE* fp;
+    int result = -1;
+
+    printf("... finishing an interrupted compaction\n");
+
+    if (RemoveTestFile("Test archive", kTestJournalArchive) < 0 ||
+        RemoveTestFile("Test journal", kTestJournalFile) < 0)
+    {
+        return -1;
+    }
+    if (BuildFlushArchive(kTestJournalArchive, 1) != 0)
+        goto bail;
+
+    /* plan to remove "flush1" */
+    err = NuOpenRO(kTestJournalArchive, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: NuOpenRO journal test failed (err=%d)\n",
+            err);
+        goto bail;
+    }
+    if (GetRecordOffset(pArchive, "flush1", &dstOffset) != 0 ||
+        GetRecordOffset(pArchive, "flush2", &srcOffset) != 0)
+    {
+        goto bail;
+    }
+    NuClose(pArchive);
+    pArchive = NULL;
+
+    origBuf = ReadTestFile(kTestJournalArchive, &origLen);
+    if (origBuf == NULL)
+        goto bail;
+    if (WriteTestJournal(origBuf, origLen, srcOffset, dstOffset, 5) != 0)
+        goto bail;
+
+    /* the first chunk only made it part of the way */
+    memset(junk, 0xa5, sizeof(junk));
+    fp = fopen(kTestJournalArchive, kNuFileOpenReadWrite);
+    if (fp == NULL) {
+        perror("fopen journal test archive");
+        goto bail;
+    }
+    fseek(fp, dstOffset, SEEK_SET);
+    fwrite(junk, 1, sizeof(junk), fp);
+    fclose(fp);
+
+    err = NuOpenRW(kTestJournalArchive, kTestTempFile, 0, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: compaction recovery failed (err=%d)\n", err);
+        goto bail;
+    }
+    if (access(kTestJournalFile, F_OK) == 0) {
+        fprintf(stderr, "ERROR: journal wasn't removed after recovery\n");
+        goto bail;
+    }
+    if (Test_MasterCount(pArchive, 5) != 0)
+        goto bail;
+    err = NuTest(pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: recovered archive failed test (err=%d)\n",
+            err);
+        goto bail;
+    }
+    NuClose(pArchive);
+    pArchive = NULL;
+
+    /* everything after the master header should have moved down */
+    newBuf = ReadTestFile(kTestJournalArchive, &newLen);
+    if (newBuf == NULL)
+        goto bail;
+    if (newLen != (long) dstOffset + origLen - (long) srcOffset ||
+        memcmp(newBuf + 48, origBuf + 48, dstOffset - 48) != 0 ||
+        memcmp(newBuf + dstOffset, origBuf + srcOffset,
+            origLen - srcOffset) != 0)
+    {
+        fprintf(stderr, "ERROR: recovered archive isn't right\n");
+        goto bail;
+    }
+    free(newBuf);
+    newBuf = NULL;
+
+    /*
+     * Now change the archive, and put the journal back as if it couldn't
+     * be removed.  It no longer matches, so it must not be replayed.
+     */
+    err = NuOpenRW(kTestJournalArchive, kTestTempFile, 0, &pArchive);
+    if (err == kNuErrNone)
+        err = NuGetRecordIdxByName(pArchive, "flush5", &recordIdx);
+    if (err == kNuErrNone)
+        err = NuDeleteRecord(pArchive, recordIdx);
+    if (err == kNuErrNone) {
+        err = NuClose(pArchive);
+        pArchive = NULL;
+    }
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't delete 'flush5' (err=%d)\n", err);
+        goto bail;
+    }
+    if (WriteTestJournal(origBuf, origLen, srcOffset, dstOffset, 5) != 0)
+        goto bail;
+    free(origBuf);
+    origBuf = ReadTestFile(kTestJournalArchive, &origLen);
+    if (origBuf == NULL)
+        goto bail;
+
+    err = NuOpenRW(kTestJournalArchive, kTestTempFile, 0, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: open with stale journal failed (err=%d)\n",
+            err);
+        goto bail;
+    }
+    NuClose(pArchive);
+    pArchive = NULL;
+    if (access(kTestJournalFile, F_OK) == 0) {
+        fprintf(stderr, "ERROR: stale journal wasn't removed\n");
+        goto bail;
+    }
+    newBuf = ReadTestFile(kTestJournalArchive, &newLen);
+    if (newBuf == NULL)
+        goto bail;
+    if (newLen != origLen || memcmp(newBuf, origBuf, origLen) != 0) {
+        fprintf(stderr, "ERROR: stale journal was replayed\n");
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    if (pArchive != NULL) {
+        NuAbort(pArchive);
+        NuClose(pArchive);
+    }
+    free(origBuf);
+    free(newBuf);
+    (void) unlink(kTestJournalArchive);
+    (void) unlink(kTestJournalFile);
+    return result;
+}
+
+
+/*
+ * Count the threads that finished, in the archive's extra data.
+ */
+NuResult CountDoneProgress(NuArchive* pArchive, void* vProgress)
+{
+    const NuProgressData* pProgress = vProgress;
+    long count;
+
+    if (pProgress->state == kNuProgressDone &&
+        NuGetExtraData(pArchive, (void**) &count) == kNuErrNone)
+    {
+        (void) NuSetExtraData(pArchive, (void*) (count + 1));
+    }
+    return kNuOK;
+}
+
+/*
+ * Open "archiveName" read-only and test it with "numWorkers" worker
+ * threads.  Returns NuTest's result, and the number of threads that
+ * tested clean in "*pDone".
+ */
+static NuError TestArchiveWithWorkers(const char* archiveName,
+    NuValue numWorkers, long* pDone)
+{
+    NuArchive* pArchive = NULL;
+    NuError err;
+
+    *pDone = 0;
+    err = NuOpenRO(archiveName, &pArchive);
+    if (err != kNuErrNone)
+        return err;
+    (void) NuSetErrorMessageHandler(pArchive, ErrorMessageHandler);
+    (void) NuSetProgressUpdater(pArchive, CountDoneProgress);
+    err = NuSetExtraData(pArchive, (void*) 0);
+    if (err == kNuErrNone)
+        err = NuSetValue(pArchive, kNuValueWorkerThreads, numWorkers);
+    if (err == kNuErrNone)
+        err = NuTest(pArchive);
+    (void) NuGetExtraData(pArchive, (void**) pDone);
+    NuClose(pArchive);
+    return err;
+}
+
+/*
+ * Test an archive with four worker threads.  Then damage one of the
+ * records, and make sure the failure shows up the same way it does
+ * when testing serially, after the same number of good threads.
+ */
+int Test_TestWorkers(void)
+{
+    NuArchive* pArchive = NULL;
+    NuError err, serialErr;
+    uint8_t* buf = NULL;
+    uint32_t offset;
+    long len, done, serialDone;
+    int result = -1;
+
+    printf("... testing with worker threads\n");
+
+    if (RemoveTestFile("Test archive", kTestPoolArchive) < 0)
+        return -1;
+    if (BuildFlushArchive(kTestPoolArchive, 1) != 0)
+        goto bail;
+
+    err = TestArchiveWithWorkers(kTestPoolArchive, 4, &done);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: parallel test failed (err=%d)\n", err);
+        goto bail;
+    }
+    if (done != kNumFlushFiles) {
+        fprintf(stderr, "ERROR: parallel test finished %ld of %d threads\n",
+            done, kNumFlushFiles);
+        goto bail;
+    }
+
+    /* scribble on the end of flush4's data */
+    err = NuOpenRO(kTestPoolArchive, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: NuOpenRO failed (err=%d)\n", err);
+        goto bail;
+    }
+    if (GetRecordOffset(pArchive, "flush5", &offset) != 0)
+        goto bail;
+    NuClose(pArchive);
+    pArchive = NULL;
+
+    buf = ReadTestFile(kTestPoolArchive, &len);
+    if (buf == NULL)
+        goto bail;
+    if (offset < 100 || (long) offset > len) {
+        fprintf(stderr, "ERROR: unexpected offset %u for flush5\n", offset);
+        goto bail;
+    }
+    buf[offset - 100] ^= 0x5a;
+    if (WriteTestFile(kTestPoolArchive, buf, len) != 0)
+        goto bail;
+
+    FAIL_OK;
+    serialErr = TestArchiveWithWorkers(kTestPoolArchive, 1, &serialDone);
+    err = TestArchiveWithWorkers(kTestPoolArchive, 4, &done);
+    FAIL_BAD;
+    if (serialErr == kNuErrNone || err != serialErr) {
+        fprintf(stderr, "ERROR: damaged archive tested %d serially, %d in "
+                        "parallel\n", serialErr, err);
+        goto bail;
+    }
+    if (serialDone != kNumFlushFiles - 2 || done != serialDone) {
+        fprintf(stderr, "ERROR: finished %ld threads serially, %ld in "
+                        "parallel\n", serialDone, done);
+        goto bail;
+    }
+    result = 0;
+
+bail:
+    if (pArchive != NULL)
+        NuClose(pArchive);
+    free(buf);
+    (void) unlink(kTestPoolArchive);
+    return result;
+}
+
+
+/*
+ * Allocator that keeps count, so we can tell whether everything an archive
+ * allocated through it was given back.  There's no realloc function, so
+ * the library has to copy.
+ */
+typedef struct TestAllocStats {
+    long    numAllocs;
+    long    numOutstanding;
+} TestAllocStats;
+
+static void* TestAllocMalloc(void* context, size_t size)
+{
+    TestAllocStats* pStats = context;
+    void* ptr = malloc(size);
+
+    if (ptr != NULL) {
+        pStats->numAllocs++;
+        pStats->numOutstanding++;
+    }
+    return ptr;
+}
+static void TestAllocFree(void* context, void* ptr)
+{
+    TestAllocStats* pStats = context;
+
+    pStats->numOutstanding--;
+    free(ptr);
+}
+
+TestAllocStats gTestAllocStats;
+const NuAllocator gTestAllocator = {
+    TestAllocMalloc, NULL, TestAllocFree, &gTestAllocStats
+};
+
+/*
+ * Give the archive our allocator.
+ */
+int Test_SetAllocator(NuArchive* pArchive)
+{
+    NuError err;
+
+    memset(&gTestAllocStats, 0, sizeof(gTestAllocStats));
+    err = NuSetAllocator(pArchive, &gTestAllocator);
+    if (err == kNuErrUnsupFeature)
+        return 0;
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't set allocator (err=%d)\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Make sure everything that came from our allocator went back.  Call after
+ * the archive is closed.
+ */
+int Test_CheckAllocator(void)
+{
+    printf("... checking allocator (%ld allocations)\n",
+        gTestAllocStats.numAllocs);
+    if (gTestAllocStats.numOutstanding != 0) {
+        fprintf(stderr, "ERROR: %ld blocks weren't freed\n",
+            gTestAllocStats.numOutstanding);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Run some tests.  The archive is built with the default settings, with
+ * best-of compression and a few worker threads, or with a compression
+ * policy, depending on "pass".
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int DoTests(int pass)
+{
+    NuError err;
+    NuArchive* pArchive = NULL;
+    uint32_t status;
+    int cc, result = 0;
+
+    /*
+     * Make sure we're starting with a clean slate.
+     */
+    if (RemoveTestFile("Test archive", kTestArchive) < 0) {
+        goto failed;
+    }
+    if (RemoveTestFile("Test temp file", kTestTempFile) < 0) {
+        goto failed;
+    }
+
+    /*
+     * Test some of the open flags.
+     */
+    if (Test_OpenFlags() != 0)
+        goto failed;
+
+    /*
+     * Parallel flushes have to match serial ones.
+     */
+    if (pass == kPassPlain && Test_FlushWorkers() != 0)
+        goto failed;
+
+    /*
+     * A compaction that was interrupted has to be finished, but only if
+     * the archive hasn't changed since.
+     */
+    if (pass == kPassPlain && Test_CompactRecover() != 0)
+        goto failed;
+
+    /*
+     * Extract through the output queue, with and without io_uring, and
+     * with a ring that breaks partway through.
+     */
+    if (pass == kPassPlain &&
+        (Test_ExtractQueued(kRingOn) != 0 ||
+         Test_ExtractQueued(kRingOff) != 0 ||
+         Test_ExtractQueued(kRingBreak) != 0))
+    {
+        goto failed;
+    }
+
+    /*
+     * Testing with worker threads has to find the same problems.
+     */
+    if (pass == kPassPlain && Test_TestWorkers() != 0)
+        goto failed;
+
+    /*
+     * Create a new archive to play with.
+     */
+    err = NuOpenRW(kTestArchive, kTestTempFile, kNuOpenCreat|kNuOpenExcl,
+            &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: NuOpenRW failed (err=%d)\n", err);
+        goto failed;
+    }
+    if (NuSetErrorMessageHandler(pArchive, ErrorMessageHandler) ==
+        kNuInvalidCallback)
+    {
+        fprintf(stderr, "ERROR: couldn't set message handler\n");
+        goto failed;
+    }
+    if (pass == kPassBestOf) {
+        err = NuSetValue(pArchive, kNuValueDataCompression, kNuCompressBest);
+        if (err == kNuErrNone)
+            err = NuSetValue(pArchive, kNuValueWorkerThreads, 4);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't enable best-of (err=%d)\n", err);
+            goto failed;
+        }
+    }
+
+    if (pass == kPassPolicy) {
+        if (Test_SetPolicy(pArchive) != 0)
+            goto failed;
+        err = NuSetValue(pArchive, kNuValueWriteBehind, true);
+        if (err == kNuErrNone)
+            err = NuSetValue(pArchive, kNuValueWorkerThreads, 4);
+        if (err != kNuErrNone) {
+            fprintf(stderr,
+                "ERROR: couldn't enable write-behind or worker threads "
+                "(err=%d)\n", err);
+            goto failed;
+        }
+    }
+
+    /*
+     * Add some test entries.
+     */
+    if (Test_AddStuff(pArchive) != 0)
+        goto failed;
+    if (pass == kPassPolicy && Test_PolicyStats(pArchive) != 0)
+        goto failed;
+    if (Test_Stats(pArchive, false) != 0)
+        goto failed;
+
+    /*
+     * Check the archive contents.
+     */
+    printf("... checking contents\n");
+    if (Test_Contents(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Reopen it read-only.
+     */
+    printf("... reopening archive read-only\n");
+    err = NuClose(pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: mid NuClose failed (err=%d)\n", err);
+        goto failed;
+    }
+    pArchive = NULL;
+
+    err = NuOpenRO(kTestArchive, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: NuOpenRO failed (err=%d)\n", err);
+        goto failed;
+    }
+    if (NuSetErrorMessageHandler(pArchive, ErrorMessageHandler) ==
+        kNuInvalidCallback)
+    {
+        fprintf(stderr, "ERROR: couldn't set message handler\n");
+        goto failed;
+    }
+    if (pass == kPassPlain) {
+        /* check that the rest of the reading cleans up after itself */
+        if (Test_SetAllocator(pArchive) != 0)
+            goto failed;
+    }
+    if (pass == kPassBestOf) {
+        /* verify and extract through the read-ahead thread */
+        err = NuSetValue(pArchive, kNuValueReadAhead, true);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't enable read-ahead (err=%d)\n",
+                err);
+            goto failed;
+        }
+    }
+    err = NuSetValue(pArchive, kNuValueStatsTiming, true);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: couldn't enable stats timing (err=%d)\n", err);
+        goto failed;
+    }
+
+    /*
+     * Make sure the TOC (i.e. list of files) is still what we expect.
+     */
+    printf("... checking contents\n");
+    if (Test_Contents(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Verify the archive data.
+     */
+    if (Test_Verify(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Extract the files.
+     */
+    if (Test_Extract(pArchive) != 0)
+        goto failed;
+    if (Test_Stats(pArchive, true) != 0)
+        goto failed;
+
+    /*
+     * Reopen it read-write.
+     */
+    printf("... reopening archive read-write\n");
+    err = NuClose(pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: late NuClose failed (err=%d)\n", err);
+        goto failed;
+    }
+    pArchive = NULL;
+    if (pass == kPassPlain && Test_CheckAllocator() != 0)
+        goto failed;
+
+    err = NuOpenRW(kTestArchive, kTestTempFile, 0, &pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: re-NuOpenRW failed (err=%d)\n", err);
+        goto failed;
+    }
+    if (NuSetErrorMessageHandler(pArchive, ErrorMessageHandler) ==
+        kNuInvalidCallback)
+    {
+        fprintf(stderr, "ERROR: couldn't set message handler\n");
+        goto failed;
+    }
+    if (pass == kPassPolicy) {
+        /* squeeze the deleted records out without using the temp file */
+        err = NuSetValue(pArchive, kNuValueModifyOrig, true);
+        if (err == kNuErrNone)
+            err = NuSetValue(pArchive, kNuValueCompactInPlace, true);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't enable compaction (err=%d)\n",
+                err);
+            goto failed;
+        }
+    } else if (pass == kPassBestOf) {
+        /* rebuild the (tiny) archive in memory rather than in the temp file */
+        err = NuSetValue(pArchive, kNuValueMemTempLimit, 1024*1024);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: couldn't set mem temp limit (err=%d)\n",
+                err);
+            goto failed;
+        }
+    }
+
+    /*
+     * Contents shouldn't have changed.
+     */
+    printf("... checking contents\n");
+    if (Test_Contents(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Test deletion.
+     */
+    if (Test_Delete(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Abort the changes and verify that nothing has changed.
+     */
+    printf("... aborting changes\n");
+    err = NuAbort(pArchive);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: abort failed (err=%d)\n", err);
+        goto failed;
+    }
+
+    printf("... checking contents\n");
+    if (Test_Contents(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Delete them again.
+     */
+    if (Test_Delete(pArchive) != 0)
+        goto failed;
+
+    /*
+     * Flush the deletions.  This should remove the first and last records.
+     */
+    err = NuFlush(pArchive, &status);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: flush failed (err=%d, status=%d)\n",
+            err, status);
+        goto failed;
+    }
+
+    /*
+     * Check count in master header.
+     */
+    if (Test_MasterCount(pArchive, kNumEntries-2) != 0)
+        goto failed;
+
+    /*
+     * Make sure the record that was moved down is still intact.
+     */
+    if (pass == kPassPolicy) {
+        printf("... verifying compacted archive\n");
+        err = NuTest(pArchive);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: compacted verify failed (err=%d)\n", err);
+            goto failed;
+        }
+
+        /* now change the survivor, which is rebuilt and compacted */
+        if (Test_AddComment(pArchive) != 0)
+            goto failed;
+        if (Test_MasterCount(pArchive, kNumEntries-2) != 0)
+            goto failed;
+        err = NuTest(pArchive);
+        if (err != kNuErrNone) {
+            fprintf(stderr, "ERROR: rebuilt verify failed (err=%d)\n", err);
+            goto failed;
+        }
+    }
+
+    /*
+     * Add some files in one go.
+     */
+    if (Test_AddFiles(pArchive, kNumEntries-2 +2) != 0)
+        goto failed;
+
+    /*
+     * Make sure files with holes in them come out right.
+     */
+    if (Test_ExtractSparse(pArchive) != 0)
+        goto failed;
+
+    /*
+     * That's all, folks...
+     */
+    NuClose(pArchive);
+    pArchive = NULL;
+
+    printf("... removing '%s'\n", kTestArchive);
+    cc = unlink(kTestArchive);
+    if (cc < 0) {
+        perror("unlink kTestArchive");
+        goto failed;
+    }
+
+
+leave:
+    if (pArchive != NULL) {
+        NuAbort(pArchive);
+        NuClose(pArchive);
+    }
+    return result;
+
+failed:
+    result = -1;
+    goto leave;
+}
+
+
+/*
+ * Crank away.
+ */
+int main(void)
+{
+    int32_t major, minor, bug;
+    const char* pBuildDate;
+    const char* pBuildFlags;
+    int cc;
+
+    (void) NuGetVersion(&major, &minor, &bug, &pBuildDate, &pBuildFlags);
+    printf("Using NuFX library v%d.%d.%d, built on or after\n"
+           "  %s with [%s]\n\n",
+        major, minor, bug, pBuildDate, pBuildFlags);
+
+    if (NuSetGlobalErrorMessageHandler(ErrorMessageHandler) ==
+        kNuInvalidCallback)
+    {
+        fprintf(stderr, "ERROR: can't set the global message handler");
+        exit(1);
     }
 
     printf("... starting tests\n");
 
-    cc = DoTests();
+    cc = DoTests(kPassPlain);
+    if (cc == 0) {
+        printf("... repeating tests with best-of compression\n");
+        cc = DoTests(kPassBestOf);
+    }
+    if (cc == 0) {
+        printf("... repeating tests with a compression policy\n");
+        cc = DoTests(kPassPolicy);
+    }
 
     printf("... tests ended, %s\n", cc == 0 ? "SUCCESS" : "FAILURE");
     exit(cc != 0);
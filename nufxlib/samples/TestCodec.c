@@ -0,0 +1,376 @@
+/*
+ * NuFX archive manipulation library
+ * Copyright (C) 2000-2007 by Andy McFadden, All Rights Reserved.
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the BSD License, see the file COPYING.LIB.
+ *
+ * Test the buffer-to-buffer compression calls.  Each available format
+ * gets a few different kinds of data pushed through NuCompressBuffer and
+ * back out through NuExpandBuffer.
+ *
+ * The tests are run twice, the second time with a context whose codec
+ * state was inherited from the first through the codec pool.  Then the
+ * per-codec effort settings are exercised, and the formats that can use
+ * worker threads are tried on a larger buffer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "NufxLib.h"
+#include "Common.h"
+
+#define kTestBufSize    (96 * 1024)     /* bigger than kNuGenCompBufSize */
+#define kTestBigSize    (1024 * 1024 + 4321)    /* several worker blocks */
+#define kTestWorkers    4
+
+/*
+ * Formats to try.  The ones that aren't compiled in are skipped.
+ */
+static const struct {
+    NuThreadFormat  format;
+    NuFeature       feature;
+    const char*     name;
+} gFormats[] = {
+    { kNuThreadFormatHuffmanSQ,     kNuFeatureCompressSQ,       "SQ" },
+    { kNuThreadFormatLZW1,          kNuFeatureCompressLZW,      "LZW/1" },
+    { kNuThreadFormatLZW2,          kNuFeatureCompressLZW,      "LZW/2" },
+    { kNuThreadFormatLZC12,         kNuFeatureCompressLZC,      "LZC12" },
+    { kNuThreadFormatLZC16,         kNuFeatureCompressLZC,      "LZC16" },
+    { kNuThreadFormatDeflate,       kNuFeatureCompressDeflate,  "deflate" },
+    { kNuThreadFormatBzip2,         kNuFeatureCompressBzip2,    "bzip2" },
+};
+
+
+/*
+ * Fill a buffer with test data.  "style" 0 is highly compressible, 1 is
+ * text-like, 2 is pseudo-random.
+ */
+static void FillBuffer(uint8_t* buf, uint32_t len, int style)
+{
+    uint32_t seed = 12345;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        switch (style) {
+        case 0:
+            buf[i] = (i & 0x0fff) < 0x0800 ? 0x00 : (uint8_t) (i >> 12);
+            break;
+        case 1:
+            buf[i] = "the quick brown fox\r"[(i * 7 + i / 31) % 20];
+            break;
+        default:
+            seed = seed * 1103515245 + 12345;
+            buf[i] = (uint8_t) (seed >> 16);
+            break;
+        }
+    }
+}
+
+/*
+ * Compress and expand one buffer, and confirm that it came back intact.
+ */
+static int TestOne(NuCodecContext* pContext, int idx, const uint8_t* srcBuf,
+    uint32_t srcLen, uint8_t* compBuf, uint32_t compBufLen, uint8_t* expBuf)
+{
+    NuError err;
+    uint32_t compLen;
+    uint16_t compCrc, expCrc;
+
+    err = NuCompressBuffer(pContext, gFormats[idx].format, srcBuf, srcLen,
+            compBuf, compBufLen, &compLen, &compCrc);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: %s compress of %u bytes failed (err=%d)\n",
+            gFormats[idx].name, srcLen, err);
+        return -1;
+    }
+
+    memset(expBuf, 0xcc, srcLen);
+    err = NuExpandBuffer(pContext, gFormats[idx].format, compBuf, compLen,
+            expBuf, srcLen, &expCrc);
+    if (err != kNuErrNone) {
+        fprintf(stderr, "ERROR: %s expand of %u bytes failed (err=%d)\n",
+            gFormats[idx].name, compLen, err);
+        return -1;
+    }
+
+    if (memcmp(srcBuf, expBuf, srcLen) != 0) {
+        fprintf(stderr, "ERROR: %s data mismatch (len=%u)\n",
+            gFormats[idx].name, srcLen);
+        return -1;
+    }
+    if (compCrc != expCrc) {
+        fprintf(stderr, "ERROR: %s CRC mismatch (0x%04x vs 0x%04x)\n",
+            gFormats[idx].name, compCrc, expCrc);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Confirm that a too-small output buffer is reported as such.
+ */
+static int TestOverrun(NuCodecContext* pContext, const uint8_t* srcBuf,
+    uint32_t srcLen, uint8_t* compBuf)
+{
+    NuError err;
+    uint32_t compLen;
+
+    err = NuCompressBuffer(pContext, kNuThreadFormatLZW2, srcBuf, srcLen,
+            compBuf, 16, &compLen, NULL);
+    if (err != kNuErrBufferOverrun) {
+        fprintf(stderr, "ERROR: expected overrun, got err=%d\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Run all formats through a context.
+ */
+static int TestAll(NuCodecContext* pContext, uint8_t* srcBuf,
+    uint8_t* compBuf, uint32_t compBufLen, uint8_t* expBuf)
+{
+    static const uint32_t kLengths[] = { 1, 17, 4096, 32768, kTestBufSize };
+    int idx, style, len;
+
+    for (idx = 0; idx < (int) NELEM(gFormats); idx++) {
+        if (NuTestFeature(gFormats[idx].feature) != kNuErrNone) {
+            printf("  %-8s (not available)\n", gFormats[idx].name);
+            continue;
+        }
+
+        for (style = 0; style < 3; style++) {
+            for (len = 0; len < (int) NELEM(kLengths); len++) {
+                FillBuffer(srcBuf, kLengths[len], style);
+                if (TestOne(pContext, idx, srcBuf, kLengths[len], compBuf,
+                        compBufLen, expBuf) != 0)
+                {
+                    return -1;
+                }
+            }
+        }
+        printf("  %-8s OK\n", gFormats[idx].name);
+    }
+
+    FillBuffer(srcBuf, kTestBufSize, 2);
+    return TestOverrun(pContext, srcBuf, kTestBufSize, compBuf);
+}
+
+
+/*
+ * Try some non-default effort settings.  Each one is applied, the format
+ * it affects is run through a few buffers, and the default is restored.
+ */
+static int TestLevels(NuCodecContext* pContext, uint8_t* srcBuf,
+    uint8_t* compBuf, uint32_t compBufLen, uint8_t* expBuf)
+{
+    static const struct {
+        NuValueID   ident;
+        NuValue     value;
+        NuValue     dflt;
+        int         idx;                /* index into gFormats */
+    } kSettings[] = {
+        { kNuValueDeflateLevel,     1,  9,  5 },
+        { kNuValueDeflateStrategy,  kNuDeflateStrategyHuffman,
+                                    kNuDeflateStrategyDefault, 5 },
+        { kNuValueDeflateStrategy,  kNuDeflateStrategyRLE,
+                                    kNuDeflateStrategyDefault, 5 },
+        { kNuValueBzip2BlockSize,   1,  8,  6 },
+        { kNuValueLZCBits,          12, 16, 4 },
+    };
+    int i, style, result;
+
+    for (i = 0; i < (int) NELEM(kSettings); i++) {
+        int idx = kSettings[i].idx;
+
+        if (NuTestFeature(gFormats[idx].feature) != kNuErrNone)
+            continue;
+        if (NuSetCodecValue(pContext, kSettings[i].ident,
+                kSettings[i].value) != kNuErrNone)
+        {
+            fprintf(stderr, "ERROR: unable to set value %d to %u\n",
+                kSettings[i].ident, kSettings[i].value);
+            return -1;
+        }
+
+        result = 0;
+        for (style = 0; style < 3 && result == 0; style++) {
+            FillBuffer(srcBuf, kTestBufSize, style);
+            result = TestOne(pContext, idx, srcBuf, kTestBufSize, compBuf,
+                        compBufLen, expBuf);
+        }
+
+        (void) NuSetCodecValue(pContext, kSettings[i].ident,
+                kSettings[i].dflt);
+        if (result != 0)
+            return -1;
+        printf("  %-8s OK (value %d = %u)\n", gFormats[idx].name,
+            kSettings[i].ident, kSettings[i].value);
+    }
+
+    /* out-of-range values must be rejected */
+    if (NuSetCodecValue(pContext, kNuValueDeflateLevel, 10) == kNuErrNone ||
+        NuSetCodecValue(pContext, kNuValueLZCBits, 17) == kNuErrNone)
+    {
+        fprintf(stderr, "ERROR: bad effort value was accepted\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Compress a large buffer with and without worker threads, and make sure
+ * both versions expand to the original with the same CRC, with and
+ * without worker threads.
+ */
+static int TestWorkers(NuCodecContext* pContext, NuThreadFormat format,
+    const char* name)
+{
+    NuError err;
+    uint8_t* srcBuf = NULL;
+    uint8_t* compBuf = NULL;
+    uint8_t* expBuf = NULL;
+    uint32_t compBufLen = kTestBigSize + kTestBigSize / 8;
+    uint32_t compLen[2];
+    uint16_t compCrc[2], expCrc;
+    int pass, expPass, style, result = -1;
+
+    srcBuf = malloc(kTestBigSize);
+    compBuf = malloc(compBufLen);
+    expBuf = malloc(kTestBigSize);
+    if (srcBuf == NULL || compBuf == NULL || expBuf == NULL)
+        goto bail;
+
+    for (style = 0; style < 3; style++) {
+        FillBuffer(srcBuf, kTestBigSize, style);
+
+        for (pass = 0; pass < 2; pass++) {
+            (void) NuSetCodecValue(pContext, kNuValueWorkerThreads,
+                    pass == 0 ? 1 : kTestWorkers);
+
+            err = NuCompressBuffer(pContext, format, srcBuf, kTestBigSize,
+                    compBuf, compBufLen, &compLen[pass], &compCrc[pass]);
+            if (err != kNuErrNone) {
+                fprintf(stderr, "ERROR: %s compress with %d workers failed "
+                    "(err=%d)\n", name, pass == 0 ? 1 : kTestWorkers, err);
+                goto bail;
+            }
+
+            for (expPass = 0; expPass < 2; expPass++) {
+                (void) NuSetCodecValue(pContext, kNuValueWorkerThreads,
+                        expPass == 0 ? 1 : kTestWorkers);
+
+                memset(expBuf, 0xcc, kTestBigSize);
+                err = NuExpandBuffer(pContext, format, compBuf, compLen[pass],
+                        expBuf, kTestBigSize, &expCrc);
+                if (err != kNuErrNone) {
+                    fprintf(stderr, "ERROR: %s expand failed (err=%d)\n",
+                        name, err);
+                    goto bail;
+                }
+                if (memcmp(srcBuf, expBuf, kTestBigSize) != 0) {
+                    fprintf(stderr, "ERROR: %s data mismatch with workers\n",
+                        name);
+                    goto bail;
+                }
+                if (expCrc != compCrc[pass]) {
+                    fprintf(stderr,
+                        "ERROR: %s CRC mismatch (0x%04x vs 0x%04x)\n",
+                        name, compCrc[pass], expCrc);
+                    goto bail;
+                }
+            }
+        }
+
+        if (compCrc[0] != compCrc[1]) {
+            fprintf(stderr, "ERROR: %s combined CRC is wrong (0x%04x vs "
+                "0x%04x)\n", name, compCrc[1], compCrc[0]);
+            goto bail;
+        }
+    }
+
+    printf("  %-8s OK (%d workers)\n", name, kTestWorkers);
+    result = 0;
+
+bail:
+    (void) NuSetCodecValue(pContext, kNuValueWorkerThreads, 1);
+    free(srcBuf);
+    free(compBuf);
+    free(expBuf);
+    return result;
+}
+
+
+/*
+ * Run all the tests.
+ */
+int main(void)
+{
+    NuCodecContext* pContext = NULL;
+    uint8_t* srcBuf = NULL;
+    uint8_t* compBuf = NULL;
+    uint8_t* expBuf = NULL;
+    uint32_t compBufLen = kTestBufSize * 2;
+    int result = -1;
+
+    srcBuf = malloc(kTestBufSize);
+    compBuf = malloc(compBufLen);
+    expBuf = malloc(kTestBufSize);
+    if (srcBuf == NULL || compBuf == NULL || expBuf == NULL)
+        goto bail;
+
+    if (NuSetCodecPoolLimit(1) != kNuErrNone) {
+        fprintf(stderr, "ERROR: unable to enable codec pool\n");
+        goto bail;
+    }
+
+    if (NuCreateCodecContext(&pContext) != kNuErrNone) {
+        fprintf(stderr, "ERROR: unable to create codec context\n");
+        goto bail;
+    }
+    if (TestAll(pContext, srcBuf, compBuf, compBufLen, expBuf) != 0)
+        goto bail;
+
+    /* do it again, with the state left behind by the first context */
+    NuFreeCodecContext(pContext);
+    pContext = NULL;
+    if (NuCreateCodecContext(&pContext) != kNuErrNone) {
+        fprintf(stderr, "ERROR: unable to create codec context\n");
+        goto bail;
+    }
+    printf("Pooled:\n");
+    if (TestAll(pContext, srcBuf, compBuf, compBufLen, expBuf) != 0)
+        goto bail;
+
+    printf("Levels:\n");
+    if (TestLevels(pContext, srcBuf, compBuf, compBufLen, expBuf) != 0)
+        goto bail;
+
+    printf("Workers:\n");
+    if (NuTestFeature(kNuFeatureCompressDeflate) == kNuErrNone &&
+        TestWorkers(pContext, kNuThreadFormatDeflate, "deflate") != 0)
+    {
+        goto bail;
+    }
+    if (NuTestFeature(kNuFeatureCompressBzip2) == kNuErrNone &&
+        TestWorkers(pContext, kNuThreadFormatBzip2, "bzip2") != 0)
+    {
+        goto bail;
+    }
+
+    printf("Codec tests passed.\n");
+    result = 0;
+
+bail:
+    if (pContext != NULL)
+        NuFreeCodecContext(pContext);
+    (void) NuSetCodecPoolLimit(0);
+    free(srcBuf);
+    free(compBuf);
+    free(expBuf);
+    return result != 0;
+}
@@ -65,6 +65,8 @@ bail:
                         flushStatus);
                 }
                 NuAbort(pArchive);
+            } else if (NState_GetModCompressPolicy(pState)) {
+                ShowCompressPolicyStats(pArchive);
             }
         } else {
             NuAbort(pArchive);
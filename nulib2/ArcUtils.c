@@ -249,7 +249,22 @@ NuResult SelectionFilter(NuArchive* pArchive, void* vproposal)
     (void) NuGetExtraData(pArchive, (void**) &pState);
     Assert(pState != NULL);
 
+    /* if another worker ran into trouble, stop */
+    if (NState_GetJobsActive(pState)) {
+        Boolean aborted;
+
+        LockSharedState();
+        aborted = NState_GetJobsAborted(pState);
+        UnlockSharedState();
+        if (aborted)
+            return kNuAbort;
+    }
+
     if (IsSpecified(pState, selProposal->pRecord)) {
+        /* with "-j", another worker may be handling this one */
+        if (!NState_ClaimRecord(pState, selProposal->pRecord->recordIdx))
+            return kNuSkip;
+
         NState_IncMatchCount(pState);
 
         /* we don't get progress notifications for delete, so do it here */
@@ -290,6 +305,47 @@ void PrintPercentage(uint32_t total, uint32_t progress)
     printf("%3d%%", perc);
 }
 
+/*
+ * Show progress while several workers are extracting or testing.  Their
+ * percentage lines would overwrite each other, so we just print a line
+ * when each file is finished.  Call with the shared state locked.
+ */
+static void ShowJobProgress(const NuProgressData* pProgress)
+{
+    const char* resultStr;
+    const char* actionStr;
+    Boolean eolConv = false;
+
+    switch (pProgress->state) {
+    case kNuProgressDone:
+        resultStr = "DONE";
+        break;
+    case kNuProgressSkipped:
+        resultStr = "SKIP";
+        break;
+    case kNuProgressAborted:
+        resultStr = "CNCL";
+        break;
+    case kNuProgressFailed:
+        resultStr = "FAIL";
+        break;
+    default:
+        return;
+    }
+
+    if (pProgress->operation == kNuOpTest) {
+        actionStr = "verifying ";
+    } else {
+        actionStr = "extracting";
+        if (pProgress->expand.convertEOL == kNuConvertOn)
+            eolConv = true;
+    }
+
+    printf("%s %s%c %s\n", resultStr, actionStr, eolConv ? '+' : ' ',
+        pProgress->pathnameUNI);
+    fflush(stdout);
+}
+
 /*
  * Show our progress, unless we're expanding to a pipe.  Invoked as a
  * callback by nufxlib.
@@ -310,6 +366,13 @@ NuResult ProgressUpdater(NuArchive* pArchive, void* vProgress)
     if (NState_GetSuppressOutput(pState))
         return kNuOK;
 
+    if (NState_GetJobsActive(pState)) {
+        LockSharedState();
+        ShowJobProgress(pProgress);
+        UnlockSharedState();
+        return kNuOK;
+    }
+
     percStr = NULL;
     showName = false;
     eolConv = false;
@@ -487,11 +550,13 @@ static NuResult HandleReplaceExisting(NulibState* pState, NuArchive* pArchive,
         case 'A':
             (void) NuSetValue(pArchive, kNuValueHandleExisting,
                     kNuAlwaysOverwrite);
+            NState_SetJobHandleExisting(pState, kNuAlwaysOverwrite);
             result = kNuOverwrite;
             goto bail;
         case 'N':
             (void) NuSetValue(pArchive, kNuValueHandleExisting,
                     kNuNeverOverwrite);
+            NState_SetJobHandleExisting(pState, kNuNeverOverwrite);
             result = kNuSkip;
             goto bail;
         case 'r':
@@ -649,6 +714,14 @@ NuResult ErrorHandler(NuArchive* pArchive, void* vErrorStatus)
     /* default action is to abort the current operation */
     result = kNuAbort;
 
+    /*
+     * With "-j", only one worker gets to talk to the user at a time.  If
+     * the user told another worker to stop, don't ask again.
+     */
+    LockSharedState();
+    if (NState_GetJobsAborted(pState))
+        goto bail;
+
     /*
      * When extracting, the error handler callback gets invoked for several
      * different problems because we might want to rename the file.  Also,
@@ -663,7 +736,18 @@ NuResult ErrorHandler(NuArchive* pArchive, void* vErrorStatus)
      */
     if (pErrorStatus->operation == kNuOpExtract) {
         if (pErrorStatus->err == kNuErrFileExists) {
-            result = HandleReplaceExisting(pState, pArchive, pErrorStatus);
+            /* another worker may have been told "[A]ll" or "[N]one" */
+            switch (NState_GetJobHandleExisting(pState)) {
+            case kNuAlwaysOverwrite:
+                result = kNuOverwrite;
+                break;
+            case kNuNeverOverwrite:
+                result = kNuSkip;
+                break;
+            default:
+                result = HandleReplaceExisting(pState, pArchive, pErrorStatus);
+                break;
+            }
         } else if (pErrorStatus->err == kNuErrNotNewer) {
             /* if we were expecting this, it's okay */
             if (NState_GetModFreshen(pState) || NState_GetModUpdate(pState)) {
@@ -702,6 +786,10 @@ NuResult ErrorHandler(NuArchive* pArchive, void* vErrorStatus)
         }
     }
 
+bail:
+    if (result == kNuAbort && NState_GetJobsActive(pState))
+        NState_SetJobsAborted(pState);
+    UnlockSharedState();
     return result;
 }
 
@@ -847,6 +935,14 @@ NuError OpenArchiveReadOnly(NulibState* pState)
     err = NuSetValue(pArchive, kNuValueHandleBadMac, true);
     BailError(err);
 
+    /* keep the expander fed while we're extracting or testing */
+    err = NuSetValue(pArchive, kNuValueReadAhead, true);
+    BailError(err);
+
+    /* let small files be written in batches */
+    err = NuSetValue(pArchive, kNuValueOutputQueueLimit, 8 * 1024 * 1024);
+    BailError(err);
+
 /*
     DBUG(("--- enabling 'mask dataless' mode\n"));
     err = NuSetValue(pArchive, kNuValueMaskDataless, true);
@@ -877,6 +973,247 @@ bail:
 }
 
 
+/*
+ * ===========================================================================
+ *      Compression policy
+ * ===========================================================================
+ */
+
+#define kMaxPolicyRules     64
+#define kPolicyLineLen      256
+
+static const struct {
+    const char* name;
+    NuValue     value;
+} gPolicyCompressNames[] = {
+    { "none",       kNuCompressNone },
+    { "sq",         kNuCompressSQ },
+    { "lzw1",       kNuCompressLZW1 },
+    { "lzw2",       kNuCompressLZW2 },
+    { "lzc12",      kNuCompressLZC12 },
+    { "lzc16",      kNuCompressLZC16 },
+    { "deflate",    kNuCompressDeflate },
+    { "bzip2",      kNuCompressBzip2 },
+    { "best",       kNuCompressBest },
+};
+
+/*
+ * Parse a number.  A leading '$' means hex, like ProDOS types usually
+ * are written.
+ *
+ * Returns a pointer to the character after the number, or NULL if it
+ * wasn't a number.
+ */
+static const char* ParsePolicyNumber(const char* str, uint32_t* pVal)
+{
+    char* end;
+
+    if (*str == '$')
+        *pVal = strtoul(str+1, &end, 16);
+    else
+        *pVal = strtoul(str, &end, 10);
+    if (end == str || (end == str+1 && *str == '$'))
+        return NULL;
+    return end;
+}
+
+/*
+ * Parse a range: "*", "val", "lo-hi", or "lo-*".
+ */
+static Boolean ParsePolicyRange(const char* str, uint32_t* pMin,
+    uint32_t* pMax)
+{
+    if (strcmp(str, "*") == 0) {
+        *pMin = 0;
+        *pMax = kNuPolicyAny;
+        return true;
+    }
+
+    str = ParsePolicyNumber(str, pMin);
+    if (str == NULL)
+        return false;
+    if (*str == '\0') {
+        *pMax = *pMin;
+        return true;
+    }
+    if (*str++ != '-')
+        return false;
+    if (strcmp(str, "*") == 0) {
+        *pMax = kNuPolicyAny;
+        return true;
+    }
+    str = ParsePolicyNumber(str, pMax);
+    return (str != NULL && *str == '\0' && *pMin <= *pMax);
+}
+
+/*
+ * Parse one line of a policy file, which looks like this:
+ *
+ *   type auxtype kind length compression
+ *
+ * e.g. "$e0 * * * none" or "* * rsrc 0-1023 lzw2".
+ */
+static Boolean ParsePolicyLine(char* line, NuPolicyRule* pRule)
+{
+    static const char* kSep = " \t\r\n";
+    char* fields[5];
+    const char* cp;
+    int i;
+
+    for (i = 0; i < NELEM(fields); i++) {
+        fields[i] = strtok(i == 0 ? line : NULL, kSep);
+        if (fields[i] == NULL)
+            return false;
+    }
+    if (strtok(NULL, kSep) != NULL)
+        return false;
+
+    if (strcmp(fields[0], "*") == 0) {
+        pRule->fileType = kNuPolicyAny;
+    } else {
+        cp = ParsePolicyNumber(fields[0], &pRule->fileType);
+        if (cp == NULL || *cp != '\0')
+            return false;
+    }
+
+    if (!ParsePolicyRange(fields[1], &pRule->extraTypeMin,
+            &pRule->extraTypeMax))
+    {
+        return false;
+    }
+
+    if (strcmp(fields[2], "*") == 0)
+        pRule->threadKind = kNuPolicyAny;
+    else if (strcasecmp(fields[2], "data") == 0)
+        pRule->threadKind = kNuThreadKindDataFork;
+    else if (strcasecmp(fields[2], "rsrc") == 0)
+        pRule->threadKind = kNuThreadKindRsrcFork;
+    else if (strcasecmp(fields[2], "disk") == 0)
+        pRule->threadKind = kNuThreadKindDiskImage;
+    else
+        return false;
+
+    if (!ParsePolicyRange(fields[3], &pRule->lenMin, &pRule->lenMax))
+        return false;
+
+    for (i = 0; i < NELEM(gPolicyCompressNames); i++) {
+        if (strcasecmp(fields[4], gPolicyCompressNames[i].name) == 0) {
+            pRule->compression = gPolicyCompressNames[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Load a set of compression policy rules from a file, and hand them to
+ * the archive.  Blank lines and lines starting with '#' are ignored.
+ */
+static NuError LoadCompressPolicy(NuArchive* pArchive, const char* filename)
+{
+    NuError err = kNuErrNone;
+    NuPolicyRule* rules = NULL;
+    FILE* fp = NULL;
+    char line[kPolicyLineLen];
+    char* cp;
+    int numRules = 0, lineNum = 0;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        err = errno ? errno : kNuErrFileOpen;
+        ReportError(err, "unable to open policy file '%s'", filename);
+        goto bail;
+    }
+
+    rules = Malloc(kMaxPolicyRules * sizeof(*rules));
+    if (rules == NULL) {
+        err = kNuErrMalloc;
+        goto bail;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineNum++;
+        for (cp = line; *cp == ' ' || *cp == '\t'; cp++)
+            ;
+        if (*cp == '#' || *cp == '\r' || *cp == '\n' || *cp == '\0')
+            continue;
+
+        if (numRules == kMaxPolicyRules) {
+            err = kNuErrSyntax;
+            ReportError(err, "%s: too many rules (max %d)", filename,
+                kMaxPolicyRules);
+            goto bail;
+        }
+        if (!ParsePolicyLine(cp, &rules[numRules])) {
+            err = kNuErrSyntax;
+            ReportError(err, "%s:%d: bad policy rule", filename, lineNum);
+            goto bail;
+        }
+        numRules++;
+    }
+
+    if (numRules == 0) {
+        err = kNuErrSyntax;
+        ReportError(err, "%s: no policy rules found", filename);
+        goto bail;
+    }
+
+    err = NuSetCompressPolicy(pArchive, rules, numRules);
+
+bail:
+    if (fp != NULL)
+        fclose(fp);
+    Free(rules);
+    return err;
+}
+
+/*
+ * Show what the compression policy did, one line per rule that matched
+ * something.
+ */
+void ShowCompressPolicyStats(NuArchive* pArchive)
+{
+    NuPolicyRule rule;
+    NuPolicyStats stats;
+    const char* compName;
+    char label[32];
+    uint32_t idx;
+    int i;
+
+    printf("Compression policy results:\n");
+    for (idx = 0; NuGetCompressPolicyStats(pArchive, idx, &rule, &stats) ==
+                                                    kNuErrNone; idx++)
+    {
+        if (stats.numThreads == 0)
+            continue;
+
+        compName = "?";
+        for (i = 0; i < NELEM(gPolicyCompressNames); i++) {
+            if (gPolicyCompressNames[i].value == rule.compression) {
+                compName = gPolicyCompressNames[i].name;
+                break;
+            }
+        }
+
+        if (NuGetCompressPolicyStats(pArchive, idx+1, NULL, NULL) !=
+                kNuErrNone)
+            sprintf(label, "default");
+        else if (rule.fileType == kNuPolicyAny)
+            sprintf(label, "rule %u (any type)", idx+1);
+        else
+            sprintf(label, "rule %u (type $%02X)", idx+1, rule.fileType);
+
+        printf("  %-20s %-7s %5u threads (%u stored), %lu -> %lu (%d%%)\n",
+            label, compName, stats.numThreads, stats.numStored,
+            (unsigned long) stats.uncompressedBytes,
+            (unsigned long) stats.compressedBytes,
+            stats.uncompressedBytes == 0 ? 100 :
+                (int) ((stats.compressedBytes * 100) /
+                        stats.uncompressedBytes));
+    }
+}
+
+
 /*
  * Open the archive in read-write mode, for purposes of adding, deleting,
  * or updating files.  We don't plan on extracting anything with this.
@@ -931,6 +1268,31 @@ NuError OpenArchiveReadWrite(NulibState* pState)
         BailError(err);
     }
 
+    /* handle "-y" flag */
+    if (NState_GetModCompressPolicy(pState)) {
+        const char* policyFile = getenv("NULIB2_POLICY");
+
+        err = NuSetValue(pArchive, kNuValueCompressPolicy, true);
+        BailError(err);
+        if (policyFile != NULL && *policyFile != '\0') {
+            err = LoadCompressPolicy(pArchive, policyFile);
+            BailError(err);
+        }
+    }
+
+    /* handle "-jN"; also used to compress in parallel when flushing */
+    err = NuSetValue(pArchive, kNuValueWorkerThreads,
+            NState_GetJobCount(pState));
+    BailError(err);
+
+    /* let the compressors get ahead of the disk */
+    err = NuSetValue(pArchive, kNuValueWriteBehind, true);
+    BailError(err);
+
+    /* and let the disk get ahead of the compressors */
+    err = NuSetValue(pArchive, kNuValueInputPrefetch, 32 * 1024 * 1024);
+    BailError(err);
+
     /* handle "-f" and "-u" flags */
     /* (BUG: if "-f" is set, creating a new archive is impossible) */
     if (NState_GetModFreshen(pState) || NState_GetModUpdate(pState)) {
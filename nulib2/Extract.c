@@ -9,6 +9,147 @@
 #include "NuLib2.h"
 
 
+/*
+ * ===========================================================================
+ *      Parallel extract and test
+ * ===========================================================================
+ */
+
+/*
+ * With "-j", each worker opens the archive for itself and runs through
+ * all of the records with the usual "bulk" extract or test call.  The
+ * selection filter hands each record to the first worker that asks for
+ * it, so a worker that's busy with a large file gets passed by the
+ * others.  Progress output and prompts go through the shared state lock.
+ */
+typedef struct ExtractJob {
+    NulibState*     pState;
+    NuError         err;
+} ExtractJob;
+
+/*
+ * Run one worker.  Called on its own thread.
+ */
+static void RunExtractJob(void* arg)
+{
+    ExtractJob* pJob = arg;
+    NuArchive* pArchive = NState_GetNuArchive(pJob->pState);
+
+    if (NState_GetCommand(pJob->pState) == kCommandTest)
+        pJob->err = NuTest(pArchive);
+    else
+        pJob->err = NuExtract(pArchive);
+
+    if (pJob->err != kNuErrNone) {
+        LockSharedState();
+        NState_SetJobsAborted(pJob->pState);
+        UnlockSharedState();
+    }
+}
+
+/*
+ * Extract or test the archive with "jobCount" workers.  "pState" has
+ * the archive open already, and becomes the first worker.
+ *
+ * Returns the first failure, not counting the workers that stopped
+ * because of it.
+ */
+static NuError RunExtractJobs(NulibState* pState, int jobCount)
+{
+    NuError err;
+    NuArchive* pArchive = NState_GetNuArchive(pState);
+    ExtractJob jobs[kMaxJobs];
+    void* jobArgs[kMaxJobs];
+    NuRecordIdx firstIdx, lastIdx;
+    NuAttr numRecords;
+    int i, numJobs;
+
+    err = NuGetAttr(pArchive, kNuAttrNumRecords, &numRecords);
+    if (err != kNuErrNone)
+        return err;
+    if ((long) numRecords < jobCount)
+        jobCount = (int) numRecords;
+    if (jobCount < 2) {
+        /* not worth the trouble */
+        if (NState_GetCommand(pState) == kCommandTest)
+            return NuTest(pArchive);
+        else
+            return NuExtract(pArchive);
+    }
+
+    err = NuGetRecordIdxByPosition(pArchive, 0, &firstIdx);
+    if (err == kNuErrNone)
+        err = NuGetRecordIdxByPosition(pArchive, numRecords-1, &lastIdx);
+    if (err == kNuErrNone)
+        err = NState_StartJobs(pState, firstIdx, lastIdx - firstIdx +1);
+    if (err != kNuErrNone) {
+        ReportError(err, "unable to set up workers");
+        return err;
+    }
+
+    jobs[0].pState = pState;
+    jobs[0].err = kNuErrNone;
+    jobArgs[0] = &jobs[0];
+    for (numJobs = 1; numJobs < jobCount; numJobs++) {
+        ExtractJob* pJob = &jobs[numJobs];
+
+        pJob->err = kNuErrNone;
+        err = NState_NewJobState(pState, numJobs+1, &pJob->pState);
+        if (err != kNuErrNone)
+            break;
+        err = OpenArchiveReadOnly(pJob->pState);
+        if (err != kNuErrNone) {
+            NState_Free(pJob->pState);
+            break;
+        }
+        jobArgs[numJobs] = pJob;
+    }
+    /* if we couldn't start as many as we wanted, go with what we have */
+    DBUG(("--- running %d workers\n", numJobs));
+
+    RunWorkers(RunExtractJob, jobArgs, numJobs);
+
+    /*
+     * Gather up the results.  Workers that stopped because somebody
+     * else failed report kNuErrAborted.
+     */
+    err = kNuErrNone;
+    for (i = 0; i < numJobs; i++) {
+        if (jobs[i].err != kNuErrNone &&
+            (err == kNuErrNone || err == kNuErrAborted))
+        {
+            err = jobs[i].err;
+        }
+        if (i > 0) {
+            NState_SetMatchCount(pState, NState_GetMatchCount(pState) +
+                NState_GetMatchCount(jobs[i].pState));
+            (void) NuClose(NState_GetNuArchive(jobs[i].pState));
+            NState_Free(jobs[i].pState);
+        }
+    }
+
+    NState_EndJobs(pState);
+    return err;
+}
+
+/*
+ * Extract or test everything, with as many workers as were asked for.
+ */
+static NuError ExtractOrTest(NulibState* pState, NuArchive* pArchive)
+{
+    long jobCount = NState_GetJobCount(pState);
+
+    /* can't open the archive again if it's on stdin */
+    if (jobCount > 1 && !IsFilenameStdin(NState_GetArchiveFilename(pState)))
+        return RunExtractJobs(pState, (int) jobCount);
+
+    if (NState_GetCommand(pState) == kCommandTest)
+        return NuTest(pArchive);
+    else
+        return NuExtract(pArchive);
+}
+
+
 /*
  * Extract all of the records from the archive, pulling out and displaying
  * comment threads.
@@ -113,7 +254,7 @@ NuError DoExtract(NulibState* pState)
      * call.  If we want comments, we need to do this one at a time.
      */
     if (!NState_GetModComments(pState)) {
-        err = NuExtract(pArchive);
+        err = ExtractOrTest(pState, pArchive);
         if (err != kNuErrNone)
             goto bail;
     } else {
@@ -165,7 +306,7 @@ NuError DoTest(NulibState* pState)
 
     NState_SetMatchCount(pState, 0);
 
-    err = NuTest(pArchive);
+    err = ExtractOrTest(pState, pArchive);
     if (err != kNuErrNone)
         goto bail;
 
@@ -27,7 +27,7 @@ typedef struct ValidCombo {
 } ValidCombo;
 
 static const ValidCombo gValidCombos[] = {
-    { kCommandAdd,              false,  true,   "ekcz0jrfu" },
+    { kCommandAdd,              false,  true,   "ekcyz0jrfu" },
     { kCommandDelete,           false,  true,   "r" },
     { kCommandExtract,          true,   false,  "beslcjrfu" },
     { kCommandExtractToPipe,    true,   false,  "blr" },
@@ -170,7 +170,8 @@ static void Usage(const NulibState* pState)
         "  -l  auto-convert text files           -ll convert CR/LF on ALL files\n"
         "  -s  stomp existing files w/o asking   -k  store files as disk images\n"
         "  -e  preserve ProDOS file types        -ee preserve types and extend names\n"
-        "  -b  force Binary II mode\n"
+        "  -b  force Binary II mode              -y  pick compression by file type\n"
+        "  -jN use N workers (extract, test, add)\n"
         );
 }
 
@@ -207,7 +208,16 @@ NuError DoHelp(const NulibState* pState)
 "  You can specify the '-z' or '-zz' flag to use \"deflate\" or \"bzip2\"\n"
 "  compression, respectively.  These work much better than ShrinkIt's LZW,\n"
 "  but the files can't be unpacked on an Apple II.  The flags will only be\n"
-"  enabled if NuLib2 was built with the necessary libraries.\n",
+"  enabled if NuLib2 was built with the necessary libraries.\n"
+"\n"
+"  The '-y' flag skips compression on file types that are compressed\n"
+"  already, like ShrinkIt archives and packed pictures.  To use your own\n"
+"  rules, put them in a file named by the NULIB2_POLICY environment\n"
+"  variable, one per line:  type auxtype kind length compression\n"
+"  e.g. \"$c0 $0001-$0002 data * none\" or \"* * * 1024-* deflate\".\n"
+"\n"
+"  With '-r', directories are added in sorted order.  Use '-jN' to read\n"
+"  and compress files with N workers, e.g. \"nulib2 -arj4 archive.shk dir\".\n",
         },
         { kCommandExtract, 'x', "extract files from an archive",
 "  Extract the specified items from the archive.  If nothing is specified,\n"
@@ -218,7 +228,11 @@ NuError DoHelp(const NulibState* pState)
 "  character, e.g. \"nulib2 -xr archive.shk doc:\".\n"
 "\n"
 "  When working with Binary II archives, the following suboptions aren't\n"
-"  allowed: -u -f -c -l -ll.\n",
+"  allowed: -u -f -c -l -ll.\n"
+"\n"
+"  A number after '-j' sets how many files are extracted at once, e.g.\n"
+"  \"nulib2 -xj4 archive.shk\".  Each worker reads the archive separately.\n"
+"  A plain '-j' junks the directory names as usual.\n",
         },
         { kCommandExtractToPipe, 'p', "extract files to pipe",
 "  Works just like '-x', but all files are written to stdout.  Useful for\n"
@@ -229,7 +243,9 @@ NuError DoHelp(const NulibState* pState)
 "  Verify the contents of an archive by extracting all files to memory and\n"
 "  verifying all CRCs.  Note that uncompressed files in archives created by\n"
 "  P8 ShrinkIt and un-SQueezed files in Binary II archives do not have any\n"
-"  sort of checksum.\n",
+"  sort of checksum.\n"
+"\n"
+"  Use '-jN' to test N files at once, e.g. \"nulib2 -ij4 archive.shk\".\n",
         },
         { kCommandDelete, 'd', "delete files from archive",
 "  Delete the named files from the archive.  If you delete all of the files,\n"
@@ -376,6 +392,39 @@ static int ProcessOptions(NulibState* pState, int argc, char* const* argv)
         }
 
         while (*cp != '\0') {
+            /*
+             * "-j" followed by a number is the number of workers to use
+             * for extract, test, and scanning directories to add.  A bare
+             * "-j" junks paths.
+             */
+            if (tolower(*cp) == 'j' && isdigit((unsigned char) *(cp+1))) {
+                Command cmd = NState_GetCommand(pState);
+                long jobs = 0;
+
+                while (isdigit((unsigned char) *(cp+1))) {
+                    cp++;
+                    if (jobs < 1000)
+                        jobs = jobs * 10 + (*cp - '0');
+                }
+                if (cmd != kCommandExtract && cmd != kCommandTest &&
+                    cmd != kCommandAdd)
+                {
+                    fprintf(stderr,
+                        "%s: The 'j%ld' modifier doesn't make sense here\n",
+                        gProgName, jobs);
+                    goto fail;
+                }
+                if (jobs < 1 || jobs > kMaxJobs) {
+                    fprintf(stderr,
+                        "%s: The number of workers must be 1-%d\n",
+                        gProgName, kMaxJobs);
+                    goto fail;
+                }
+                NState_SetJobCount(pState, jobs);
+                cp++;
+                continue;
+            }
+
             switch (tolower(*cp)) {
             case 'u': NState_SetModUpdate(pState, true);                break;
             case 'f': NState_SetModFreshen(pState, true);               break;
@@ -386,6 +435,7 @@ static int ProcessOptions(NulibState* pState, int argc, char* const* argv)
             case 'k': NState_SetModAddAsDisk(pState, true);             break;
             case 'c': NState_SetModComments(pState, true);              break;
             case 'b': NState_SetModBinaryII(pState, true);              break;
+            case 'y': NState_SetModCompressPolicy(pState, true);        break;
             case 'z':
                 if (*(cp+1) == 'z') {
                     if (NuTestFeature(kNuFeatureCompressBzip2) == kNuErrNone)
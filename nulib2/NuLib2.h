@@ -29,6 +29,9 @@
 /* for use with FormatDateShort() */
 #define kDateOutputLen    64
 
+/* upper limit for the number of workers in "-jN" */
+#define kMaxJobs            64
+
 /*
  * Function prototypes.
  */
@@ -42,6 +45,7 @@ Boolean IsFilenameStdin(const char* archiveName);
 Boolean IsSpecified(NulibState* pState, const NuRecord* pRecord);
 NuError OpenArchiveReadOnly(NulibState* pState);
 NuError OpenArchiveReadWrite(NulibState* pState);
+void ShowCompressPolicyStats(NuArchive* pArchive);
 const NuThread* GetThread(const NuRecord* pRecord, uint32_t idx);
 Boolean IsRecordReadOnly(const NuRecord* pRecord);
 
@@ -111,5 +115,11 @@ NuError AddFile(NulibState* pState, NuArchive* pArchive,
     const char* pathname);
 NuError Mkdir(const char* dir);
 NuError TestFileExistence(const char* fileName, Boolean* pIsDir);
+void LockSharedState(void);
+void UnlockSharedState(void);
+void WaitSharedState(void);
+void WakeSharedState(void);
+typedef void (*WorkerFunc)(void* arg);
+void RunWorkers(WorkerFunc func, void* const* args, int count);
 
 #endif /*NULIB2_NULIB2_H*/
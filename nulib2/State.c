@@ -33,6 +33,7 @@ NuError NState_Init(NulibState** ppState)
     (*ppState)->altSystemPathSeparator = '\0';
 #endif
     (*ppState)->programVersion = gProgramVersion;
+    (*ppState)->jobCount = 1;
 
     return kNuErrNone;
 }
@@ -69,6 +70,41 @@ NuError NState_ExtraInit(NulibState* pState)
 }
 
 
+/*
+ * Create a copy of the state for a parallel extract/test worker.  The
+ * copy gets the command-line options, but none of the buffers, data
+ * sinks, or the archive; the worker opens its own.
+ */
+NuError NState_NewJobState(NulibState* pState, int jobNumber,
+    NulibState** ppJobState)
+{
+    NulibState* pJobState;
+
+    Assert(pState != NULL);
+    Assert(pState->pJobParent == NULL);
+    Assert(ppJobState != NULL);
+
+    pJobState = Malloc(sizeof(*pJobState));
+    if (pJobState == NULL)
+        return kNuErrMalloc;
+    *pJobState = *pState;
+
+    pJobState->pArchive = NULL;
+    pJobState->renameToStr = NULL;
+    pJobState->pPipeSink = NULL;
+    pJobState->pCommentSink = NULL;
+    pJobState->matchCount = 0;
+    pJobState->tempPathnameAlloc = 0;
+    pJobState->tempPathnameBuf = NULL;
+    pJobState->pJobParent = pState;
+    pJobState->jobNumber = jobNumber;
+    pJobState->jobMap = NULL;
+
+    *ppJobState = pJobState;
+    return kNuErrNone;
+}
+
+
 /*
  * Free up the state structure and its contents.
  */
@@ -83,6 +119,7 @@ void NState_Free(NulibState* pState)
         NuFreeDataSink(pState->pPipeSink);
     if (pState->pCommentSink != NULL)
         NuFreeDataSink(pState->pCommentSink);
+    Free(pState->jobMap);
     Free(pState);
 }
 
@@ -132,6 +169,8 @@ void NState_DebugDump(const NulibState* pState)
         printf("    compressDeflate\n");
     if (pState->modCompressBzip2)
         printf("    compressBzip2\n");
+    if (pState->modCompressPolicy)
+        printf("    compressPolicy\n");
     if (pState->modComments)
         printf("    comments\n");
     if (pState->modBinaryII)
@@ -146,6 +185,8 @@ void NState_DebugDump(const NulibState* pState)
         printf("    preserveType\n");
     if (pState->modPreserveTypeExtended)
         printf("    preserveTypeExtended\n");
+    if (pState->jobCount != 1)
+        printf("    jobCount: %ld\n", pState->jobCount);
 
     printf("\n");
 }
@@ -263,6 +304,113 @@ void NState_GetTotals(NulibState* pState, long* pTotalLen, long* pTotalCompLen)
     *pTotalCompLen = pState->totalCompLen;
 }
 
+
+/*
+ * Get ready to hand records out to workers.  Records are identified by
+ * index, which is the same in every worker's view of the archive; the
+ * caller passes in the range.  The original state is worker #1.
+ */
+NuError NState_StartJobs(NulibState* pState, NuRecordIdx firstIdx,
+    long numIdx)
+{
+    Assert(pState->pJobParent == NULL);
+    Assert(pState->jobMap == NULL);
+
+    pState->jobMap = Calloc(numIdx);
+    if (pState->jobMap == NULL)
+        return kNuErrMalloc;
+    pState->jobMapFirstIdx = firstIdx;
+    pState->jobMapLen = numIdx;
+    pState->jobNumber = 1;
+    pState->jobsAborted = false;
+    pState->jobHandleExisting = 0;
+    return kNuErrNone;
+}
+
+void NState_EndJobs(NulibState* pState)
+{
+    Assert(pState->pJobParent == NULL);
+
+    Free(pState->jobMap);
+    pState->jobMap = NULL;
+    pState->jobNumber = 0;
+}
+
+Boolean NState_GetJobsActive(const NulibState* pState)
+{
+    if (pState->pJobParent != NULL)
+        pState = pState->pJobParent;
+    return (pState->jobMap != NULL);
+}
+
+/*
+ * Decide if this worker should handle the record.  The first worker to
+ * ask for a record gets it.  Workers ask about each of the threads in a
+ * record, so once a record is ours, we keep saying "yes".
+ *
+ * Always returns "true" if there's only one of us.
+ */
+Boolean NState_ClaimRecord(NulibState* pState, NuRecordIdx recordIdx)
+{
+    NulibState* pParent = pState;
+    Boolean result;
+    uint8_t* pOwner;
+
+    if (pState->pJobParent != NULL)
+        pParent = pState->pJobParent;
+    if (pParent->jobMap == NULL)
+        return true;
+
+    /* shouldn't happen; let the first worker have it */
+    if (recordIdx < pParent->jobMapFirstIdx ||
+        recordIdx - pParent->jobMapFirstIdx >= (NuRecordIdx) pParent->jobMapLen)
+    {
+        return (pState->jobNumber == 1);
+    }
+
+    LockSharedState();
+    pOwner = &pParent->jobMap[recordIdx - pParent->jobMapFirstIdx];
+    if (*pOwner == 0)
+        *pOwner = (uint8_t) pState->jobNumber;
+    result = (*pOwner == pState->jobNumber);
+    UnlockSharedState();
+
+    return result;
+}
+
+/*
+ * These, and the "handle existing" reply, are shared by all workers.
+ * Call with the shared state locked.
+ */
+Boolean NState_GetJobsAborted(const NulibState* pState)
+{
+    if (pState->pJobParent != NULL)
+        pState = pState->pJobParent;
+    return pState->jobsAborted;
+}
+
+void NState_SetJobsAborted(NulibState* pState)
+{
+    if (pState->pJobParent != NULL)
+        pState = pState->pJobParent;
+    pState->jobsAborted = true;
+}
+
+NuValue NState_GetJobHandleExisting(const NulibState* pState)
+{
+    if (pState->pJobParent != NULL)
+        pState = pState->pJobParent;
+    return pState->jobHandleExisting;
+}
+
+void NState_SetJobHandleExisting(NulibState* pState, NuValue handleExisting)
+{
+    if (pState->pJobParent != NULL)
+        pState = pState->pJobParent;
+    pState->jobHandleExisting = handleExisting;
+}
+
+
 long NState_GetTempPathnameLen(NulibState* pState)
 {
     return pState->tempPathnameAlloc;
@@ -409,6 +557,16 @@ void NState_SetModCompressBzip2(NulibState* pState, Boolean val)
     pState->modCompressBzip2 = val;
 }
 
+Boolean NState_GetModCompressPolicy(const NulibState* pState)
+{
+    return pState->modCompressPolicy;
+}
+
+void NState_SetModCompressPolicy(NulibState* pState, Boolean val)
+{
+    pState->modCompressPolicy = val;
+}
+
 Boolean NState_GetModComments(const NulibState* pState)
 {
     return pState->modComments;
@@ -489,3 +647,13 @@ void NState_SetModPreserveTypeExtended(NulibState* pState, Boolean val)
     pState->modPreserveTypeExtended = val;
 }
 
+
+long NState_GetJobCount(const NulibState* pState)
+{
+    return pState->jobCount;
+}
+
+void NState_SetJobCount(NulibState* pState, long val)
+{
+    pState->jobCount = val;
+}
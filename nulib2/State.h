@@ -58,6 +58,19 @@ typedef struct NulibState {
     long            tempPathnameAlloc;
     char*           tempPathnameBuf;
 
+    /*
+     * Parallel extract/test state.  Each worker has its own copy of the
+     * state, with "pJobParent" pointing at the original; the shared
+     * fields are only used in the original.
+     */
+    struct NulibState* pJobParent;
+    int             jobNumber;          /* 1-based; 0 if not a worker */
+    uint8_t*        jobMap;             /* which worker has each record */
+    NuRecordIdx     jobMapFirstIdx;
+    long            jobMapLen;
+    Boolean         jobsAborted;        /* a worker failed; stop the rest */
+    NuValue         jobHandleExisting;  /* "[A]ll" or "[N]one" reply */
+
     /* command-line options */
     Command         command;
     Boolean         modUpdate;
@@ -67,6 +80,7 @@ typedef struct NulibState {
     Boolean         modNoCompression;
     Boolean         modCompressDeflate;
     Boolean         modCompressBzip2;
+    Boolean         modCompressPolicy;
     Boolean         modComments;
     Boolean         modBinaryII;
     Boolean         modConvertText;
@@ -75,6 +89,7 @@ typedef struct NulibState {
     Boolean         modAddAsDisk;
     Boolean         modPreserveType;
     Boolean         modPreserveTypeExtended;
+    long            jobCount;
 
     const char*     archiveFilename;
     char* const*    filespecPointer;
@@ -83,6 +98,8 @@ typedef struct NulibState {
 
 NuError NState_Init(NulibState** ppState);
 NuError NState_ExtraInit(NulibState* pState);
+NuError NState_NewJobState(NulibState* pState, int jobNumber,
+    NulibState** ppJobState);
 void NState_Free(NulibState* pState);
 #ifdef DEBUG_MSGS
 void NState_DebugDump(const NulibState* pState);
@@ -110,6 +127,16 @@ void NState_IncMatchCount(NulibState* pState);
 void NState_AddToTotals(NulibState* pState, long len, long compLen);
 void NState_GetTotals(NulibState* pState, long* pTotalLen, long* pTotalCompLen);
 
+NuError NState_StartJobs(NulibState* pState, NuRecordIdx firstIdx,
+    long numIdx);
+void NState_EndJobs(NulibState* pState);
+Boolean NState_GetJobsActive(const NulibState* pState);
+Boolean NState_ClaimRecord(NulibState* pState, NuRecordIdx recordIdx);
+Boolean NState_GetJobsAborted(const NulibState* pState);
+void NState_SetJobsAborted(NulibState* pState);
+NuValue NState_GetJobHandleExisting(const NulibState* pState);
+void NState_SetJobHandleExisting(NulibState* pState, NuValue handleExisting);
+
 long NState_GetTempPathnameLen(NulibState* pState);
 void NState_SetTempPathnameLen(NulibState* pState, long len);
 char* NState_GetTempPathnameBuf(NulibState* pState);
@@ -137,6 +164,8 @@ Boolean NState_GetModCompressDeflate(const NulibState* pState);
 void NState_SetModCompressDeflate(NulibState* pState, Boolean val);
 Boolean NState_GetModCompressBzip2(const NulibState* pState);
 void NState_SetModCompressBzip2(NulibState* pState, Boolean val);
+Boolean NState_GetModCompressPolicy(const NulibState* pState);
+void NState_SetModCompressPolicy(NulibState* pState, Boolean val);
 Boolean NState_GetModComments(const NulibState* pState);
 void NState_SetModComments(NulibState* pState, Boolean val);
 Boolean NState_GetModBinaryII(const NulibState* pState);
@@ -153,5 +182,7 @@ Boolean NState_GetModPreserveType(const NulibState* pState);
 void NState_SetModPreserveType(NulibState* pState, Boolean val);
 Boolean NState_GetModPreserveTypeExtended(const NulibState* pState);
 void NState_SetModPreserveTypeExtended(NulibState* pState, Boolean val);
+long NState_GetJobCount(const NulibState* pState);
+void NState_SetJobCount(NulibState* pState, long val);
 
 #endif /*NULIB2_STATE_H*/
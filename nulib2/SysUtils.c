@@ -11,6 +11,11 @@
 #ifdef HAVE_WINDOWS_H
 # include <windows.h>
 #endif
+#if defined(HAVE_PTHREAD)
+# include <pthread.h>
+#elif defined(_WIN32)
+# include <process.h>
+#endif
 #ifdef MAC_LIKE
 # include <sys/xattr.h>
 #endif
@@ -430,6 +435,9 @@ static void UNIXTimeToDateTime(const time_t* pWhen, NuDateTime *pDateTime)
  */
 static const int kFinderInfoSize = 32;
 
+/* file type for "we looked, and there's no Finder info" */
+#define kNoFinderTypes  ((uint32_t) -1)
+
 /*
  * Obtains the creator and file type from the Finder info block, if any,
  * and converts the types to ProDOS equivalents.
@@ -609,9 +617,13 @@ static void ReplaceFssep(char* str, char oldc, char newc, char newSubst)
 /*
  * Set the contents of a NuFileDetails structure, based on the pathname
  * and characteristics of the file.
+ *
+ * "pFinderTypes" holds the file and aux types from the Finder info, if
+ * the caller has already looked them up, or is NULL.  If the file didn't
+ * have any, the file type is kNoFinderTypes.  (Mac OS X only.)
  */
 static NuError GetFileDetails(NulibState* pState, const char* pathnameMOR,
-    struct stat* psb, NuFileDetails* pDetails)
+    struct stat* psb, const uint32_t* pFinderTypes, NuFileDetails* pDetails)
 {
     Boolean wasPreserved;
     Boolean doJunk = false;
@@ -677,8 +689,15 @@ static NuError GetFileDetails(NulibState* pState, const char* pathnameMOR,
      * Retrieve the file/aux type from the Finder info.  We want the
      * type-preservation string to take priority, so get this first.
      */
-    (void) GetTypesFromFinder(livePathStr,
-            &pDetails->fileType, &pDetails->extraType);
+    if (pFinderTypes != NULL) {
+        if (pFinderTypes[0] != kNoFinderTypes) {
+            pDetails->fileType = pFinderTypes[0];
+            pDetails->extraType = pFinderTypes[1];
+        }
+    } else {
+        (void) GetTypesFromFinder(livePathStr,
+                &pDetails->fileType, &pDetails->extraType);
+    }
 #endif
 
     /*
@@ -798,16 +817,14 @@ static NuError GetFileDetails(NulibState* pState, const char* pathnameMOR,
 
 /*
  * Do the system-independent part of the file add, including things like
- * adding comments.
+ * adding comments, once NufxLib has told us how the add went.
+ *
+ * "storageNameMOR" is the name the file was stored under, for messages.
  */
-static NuError DoAddFile(NulibState* pState, NuArchive* pArchive,
-    const char* pathname, const NuFileDetails* pDetails)
+static NuError FinishAddFile(NulibState* pState, NuArchive* pArchive,
+    const char* pathname, const char* storageNameMOR, NuError err,
+    NuRecordIdx recordIdx)
 {
-    NuError err;
-    NuRecordIdx recordIdx = 0;
-
-    err = NuAddFile(pArchive, pathname, pDetails, false, &recordIdx);
-
     if (err == kNuErrNone) {
         NState_IncMatchCount(pState);
     } else if (err == kNuErrSkipped) {
@@ -829,8 +846,7 @@ static NuError DoAddFile(NulibState* pState, NuArchive* pArchive,
             goto bail;
         }
     } else if (err == kNuErrRecordExists) {
-        printf("FAIL same filename added twice: '%s'\n",
-            NState_GetTempPathnameBuf(pState));
+        printf("FAIL same filename added twice: '%s'\n", storageNameMOR);
         goto bail_quiet;
     }
     if (err != kNuErrNone)
@@ -875,115 +891,532 @@ bail_quiet:
     return err;
 }
 
+/*
+ * Add a single file.
+ */
+static NuError DoAddFile(NulibState* pState, NuArchive* pArchive,
+    const char* pathname, const NuFileDetails* pDetails)
+{
+    NuError err;
+    NuRecordIdx recordIdx = 0;
+
+    err = NuAddFile(pArchive, pathname, pDetails, false, &recordIdx);
+    return FinishAddFile(pState, pArchive, pathname, pDetails->storageNameMOR,
+            err, recordIdx);
+}
+
 
 #if defined(UNIX_LIKE)  /* ---- UNIX --------------------------------------- */
+
+/*
+ * Recursive adds scan the whole tree before anything is added.  Each
+ * directory is read, and everything in it stat()ed, by a pool of workers
+ * ("-jN"), which take directories from a shared list and put the
+ * subdirectories they find back on it.  Once the scan is done, the
+ * results are sorted by name and added in order, so the archive comes
+ * out the same no matter how the workers got scheduled, or what order
+ * the filesystem returned the names in.
+ *
+ * Errors found during the scan are kept with the entry, and reported
+ * when the add gets to it, so failures show up in the same place they
+ * would if we'd examined each file as we went.
+ *
+ * The files are handed to NufxLib in one NuAddFiles call per tree, which
+ * is a lot cheaper than a NuAddFile call apiece when there are thousands
+ * of them.
+ */
+typedef struct ScanDir ScanDir;
+
+typedef struct ScanEntry {
+    char*       name;
+    ScanDir*    pSubdir;        /* contents, if this is a directory */
+    NuError     err;            /* kNuErrFileStat, or kNuErrInternal if
+                                   the pathname is too long */
+    Boolean     exists;
+    Boolean     isReadable;
+    Boolean     isDir;
+    mode_t      mode;
+    off_t       size;
+    time_t      mtime;
+#ifdef MAC_LIKE
+    uint32_t    finderTypes[2]; /* file/aux, or kNoFinderTypes */
+#endif
+} ScanEntry;
+
+struct ScanDir {
+    char*       pathname;
+    ScanEntry*  entries;        /* sorted by name */
+    long        numEntries;
+    NuError     err;            /* set if the directory couldn't be read */
+    ScanDir*    pNextPending;
+};
+
+typedef struct DirScan {
+    NulibState* pState;
+    ScanDir*    pPending;       /* directories waiting to be read */
+    long        numBusy;        /* directories being read right now */
+} DirScan;
+
+/* files waiting for NuAddFiles; we own the names */
+typedef struct AddBatch {
+    NuAddFileEntry* entries;
+    long        numEntries;
+    long        maxEntries;
+} AddBatch;
+
 static NuError UNIXAddFile(NulibState* pState, NuArchive* pArchive,
     const char* pathname);
+static NuError UNIXAddEntry(NulibState* pState, NuArchive* pArchive,
+    const char* pathname, const ScanEntry* pEntry, AddBatch* pBatch);
 
 /*
- * UNIX-style recursive directory descent.  Scan the contents of a directory.
- * If a subdirectory is found, follow it; otherwise, call UNIXAddFile to
- * add the file.
+ * Allocate a ScanDir for "pathname".  Returns NULL on failure.
  */
-static NuError UNIXAddDirectory(NulibState* pState, NuArchive* pArchive,
-    const char* dirName)
+static ScanDir* NewScanDir(const char* pathname)
 {
-    NuError err = kNuErrNone;
-    DIR* dirp = NULL;
+    ScanDir* pDir;
+
+    pDir = Calloc(sizeof(*pDir));
+    if (pDir == NULL)
+        return NULL;
+    pDir->pathname = strdup(pathname);
+    if (pDir->pathname == NULL) {
+        Free(pDir);
+        return NULL;
+    }
+    return pDir;
+}
+
+/*
+ * Free a ScanDir and everything below it.
+ */
+static void FreeScanDir(ScanDir* pDir)
+{
+    long i;
+
+    if (pDir == NULL)
+        return;
+
+    for (i = 0; i < pDir->numEntries; i++) {
+        Free(pDir->entries[i].name);
+        FreeScanDir(pDir->entries[i].pSubdir);
+    }
+    Free(pDir->entries);
+    Free(pDir->pathname);
+    Free(pDir);
+}
+
+static int CompareScanEntries(const void* v1, const void* v2)
+{
+    return strcmp(((const ScanEntry*) v1)->name, ((const ScanEntry*) v2)->name);
+}
+
+/*
+ * Form the pathname of "name" in "dirName", inserting an fssep if needed.
+ * "nbuf" must hold MAX_PATH_LEN bytes.
+ *
+ * Returns "false" if it doesn't fit.
+ */
+static Boolean MakeScanPathname(const char* dirName, const char* name,
+    char fssep, char* nbuf)
+{
+    int len;
+
+    len = strlen(dirName);
+    if (len + (int)strlen(name) +2 > MAX_PATH_LEN)
+        return false;
+
+    strcpy(nbuf, dirName);
+    if (dirName[len-1] != fssep)
+        nbuf[len++] = fssep;
+    strcpy(nbuf+len, name);
+    return true;
+}
+
+/*
+ * Read the contents of one directory, and examine everything in it.
+ * Readable subdirectories get a ScanDir of their own, which the caller
+ * needs to put on the pending list.
+ */
+static void ScanDirectory(DirScan* pScan, ScanDir* pDir)
+{
+    DIR* dirp;
     DIR_TYPE* entry;
+    ScanEntry* pEntry;
+    ScanEntry* newEntries;
     char nbuf[MAX_PATH_LEN];    /* malloc might be better; this soaks stack */
+    struct stat sb;
+    long maxEntries = 0;
     char fssep;
-    int len;
-
-    Assert(pState != NULL);
-    Assert(pArchive != NULL);
-    Assert(dirName != NULL);
+    int cc;
 
-    DBUG(("+++ DESCEND: '%s'\n", dirName));
+    DBUG(("+++ DESCEND: '%s'\n", pDir->pathname));
 
-    dirp = opendir(dirName);
+    dirp = opendir(pDir->pathname);
     if (dirp == NULL) {
         if (errno == ENOTDIR)
-            err = kNuErrNotDir;
+            pDir->err = kNuErrNotDir;
         else
-            err = errno ? errno : kNuErrOpenDir;
-        ReportError(err, "failed on '%s'", dirName);
-        goto bail;
+            pDir->err = errno ? errno : kNuErrOpenDir;
+        return;
     }
 
-    fssep = NState_GetSystemPathSeparator(pState);
+    fssep = NState_GetSystemPathSeparator(pScan->pState);
 
-    /* could use readdir_r, but we don't care about reentrancy here */
     while ((entry = readdir(dirp)) != NULL) {
         /* skip the dotsies */
         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
             continue;
 
-        len = strlen(dirName);
-        if (len + DIR_NAME_LEN(entry) +2 > MAX_PATH_LEN) {
+        if (pDir->numEntries == maxEntries) {
+            if (maxEntries == 0) {
+                maxEntries = 64;
+                newEntries = Malloc(maxEntries * sizeof(*pDir->entries));
+            } else {
+                maxEntries *= 2;
+                newEntries = Realloc(pDir->entries,
+                                maxEntries * sizeof(*pDir->entries));
+            }
+            if (newEntries == NULL) {
+                pDir->err = kNuErrMalloc;
+                break;
+            }
+            pDir->entries = newEntries;
+        }
+        pEntry = &pDir->entries[pDir->numEntries];
+        memset(pEntry, 0, sizeof(*pEntry));
+        pEntry->name = strdup(entry->d_name);
+        if (pEntry->name == NULL) {
+            pDir->err = kNuErrMalloc;
+            break;
+        }
+        pDir->numEntries++;
+
+        if (!MakeScanPathname(pDir->pathname, pEntry->name, fssep, nbuf)) {
+            pEntry->err = kNuErrInternal;
+            continue;
+        }
+
+        /* same checks as CheckFileStatus(), but relative to the directory */
+        pEntry->exists = true;
+        pEntry->isReadable = true;
+#if defined(HAVE_FSTATAT) && defined(HAVE_DIRFD)
+        cc = fstatat(dirfd(dirp), pEntry->name, &sb, 0);
+#else
+        cc = stat(nbuf, &sb);
+#endif
+        if (cc) {
+            if (errno == ENOENT)
+                pEntry->exists = false;
+            else
+                pEntry->err = kNuErrFileStat;
+            continue;
+        }
+        pEntry->isDir = S_ISDIR(sb.st_mode) ? true : false;
+        pEntry->mode = sb.st_mode;
+        pEntry->size = sb.st_size;
+        pEntry->mtime = sb.st_mtime;
+#if defined(HAVE_FACCESSAT) && defined(HAVE_DIRFD)
+        cc = faccessat(dirfd(dirp), pEntry->name, R_OK, 0);
+#else
+        cc = access(nbuf, R_OK);
+#endif
+        if (cc < 0)
+            pEntry->isReadable = false;
+
+        if (pEntry->isDir && pEntry->isReadable) {
+            pEntry->pSubdir = NewScanDir(nbuf);
+            if (pEntry->pSubdir == NULL) {
+                pDir->err = kNuErrMalloc;
+                break;
+            }
+        }
+#ifdef MAC_LIKE
+        if (!pEntry->isDir &&
+            GetTypesFromFinder(nbuf, &pEntry->finderTypes[0],
+                &pEntry->finderTypes[1]) != kNuErrNone)
+        {
+            pEntry->finderTypes[0] = kNoFinderTypes;
+        }
+#endif
+    }
+
+    (void)closedir(dirp);
+
+    if (pDir->numEntries > 1) {
+        qsort(pDir->entries, pDir->numEntries, sizeof(*pDir->entries),
+            CompareScanEntries);
+    }
+}
+
+/*
+ * Scanner worker.  Reads directories off the pending list until it's
+ * empty and nobody is reading a directory that might add more.
+ */
+static void ScanWorker(void* arg)
+{
+    DirScan* pScan = arg;
+    ScanDir* pDir;
+    long i;
+
+    LockSharedState();
+    while (true) {
+        while (pScan->pPending == NULL && pScan->numBusy > 0)
+            WaitSharedState();
+        pDir = pScan->pPending;
+        if (pDir == NULL)
+            break;
+        pScan->pPending = pDir->pNextPending;
+        pScan->numBusy++;
+        UnlockSharedState();
+
+        ScanDirectory(pScan, pDir);
+
+        LockSharedState();
+        for (i = 0; i < pDir->numEntries; i++) {
+            if (pDir->entries[i].pSubdir != NULL) {
+                pDir->entries[i].pSubdir->pNextPending = pScan->pPending;
+                pScan->pPending = pDir->entries[i].pSubdir;
+            }
+        }
+        pScan->numBusy--;
+        WakeSharedState();
+    }
+    UnlockSharedState();
+}
+
+/*
+ * Free the names in a batch, and the batch itself.
+ */
+static void FreeAddBatch(AddBatch* pBatch)
+{
+    long i;
+
+    for (i = 0; i < pBatch->numEntries; i++) {
+        Free((char*) pBatch->entries[i].pathnameUNI);
+        Free((char*) pBatch->entries[i].fileDetails.storageNameMOR);
+    }
+    Free(pBatch->entries);
+    memset(pBatch, 0, sizeof(*pBatch));
+}
+
+/*
+ * Queue up a file to add.  The details are copied, along with the names.
+ */
+static NuError AddToBatch(AddBatch* pBatch, const char* pathname,
+    const NuFileDetails* pDetails)
+{
+    NuAddFileEntry* pEntry;
+    NuAddFileEntry* newEntries;
+    char* pathCopy;
+    char* nameCopy;
+
+    if (pBatch->numEntries == pBatch->maxEntries) {
+        if (pBatch->maxEntries == 0) {
+            pBatch->maxEntries = 256;
+            newEntries = Malloc(pBatch->maxEntries * sizeof(*newEntries));
+        } else {
+            pBatch->maxEntries *= 2;
+            newEntries = Realloc(pBatch->entries,
+                            pBatch->maxEntries * sizeof(*newEntries));
+        }
+        if (newEntries == NULL)
+            return kNuErrMalloc;
+        pBatch->entries = newEntries;
+    }
+
+    pathCopy = strdup(pathname);
+    nameCopy = strdup(pDetails->storageNameMOR);
+    if (pathCopy == NULL || nameCopy == NULL) {
+        Free(pathCopy);
+        Free(nameCopy);
+        return kNuErrMalloc;
+    }
+
+    pEntry = &pBatch->entries[pBatch->numEntries++];
+    pEntry->pathnameUNI = pathCopy;
+    pEntry->fileDetails = *pDetails;
+    pEntry->fileDetails.storageNameMOR = nameCopy;
+    pEntry->isFromRsrcFork = false;
+    return kNuErrNone;
+}
+
+/*
+ * Add everything in the batch, and deal with the results in order.  We
+ * stop at the first failure, as we would if we'd added them one at a
+ * time.
+ */
+static NuError SubmitAddBatch(NulibState* pState, NuArchive* pArchive,
+    const AddBatch* pBatch)
+{
+    NuError err;
+    NuRecordIdx* recordIdxs = NULL;
+    NuError* results = NULL;
+    const NuAddFileEntry* pEntry;
+    long i;
+
+    if (pBatch->numEntries == 0)
+        return kNuErrNone;
+
+    recordIdxs = Malloc(pBatch->numEntries * sizeof(*recordIdxs));
+    results = Malloc(pBatch->numEntries * sizeof(*results));
+    if (recordIdxs == NULL || results == NULL) {
+        err = kNuErrMalloc;
+        ReportError(err, "unable to add files");
+        goto bail;
+    }
+
+    err = NuAddFiles(pArchive, pBatch->entries, pBatch->numEntries,
+            recordIdxs, results);
+    if (err != kNuErrNone && err != kNuErrAborted) {
+        ReportError(err, "unable to add files");
+        goto bail;
+    }
+
+    for (i = 0; i < pBatch->numEntries; i++) {
+        pEntry = &pBatch->entries[i];
+        err = FinishAddFile(pState, pArchive, pEntry->pathnameUNI,
+                pEntry->fileDetails.storageNameMOR, results[i], recordIdxs[i]);
+        if (err != kNuErrNone)
+            break;
+    }
+
+bail:
+    Free(recordIdxs);
+    Free(results);
+    return err;
+}
+
+/*
+ * Add the scanned contents of a directory, in order.
+ */
+static NuError AddScannedDirectory(NulibState* pState, NuArchive* pArchive,
+    const ScanDir* pDir, AddBatch* pBatch)
+{
+    NuError err = kNuErrNone;
+    const ScanEntry* pEntry;
+    char nbuf[MAX_PATH_LEN];    /* malloc might be better; this soaks stack */
+    char fssep;
+    long i;
+
+    if (pDir->err != kNuErrNone) {
+        err = pDir->err;
+        ReportError(err, "failed on '%s'", pDir->pathname);
+        goto bail;
+    }
+
+    fssep = NState_GetSystemPathSeparator(pState);
+
+    for (i = 0; i < pDir->numEntries; i++) {
+        pEntry = &pDir->entries[i];
+
+        if (!MakeScanPathname(pDir->pathname, pEntry->name, fssep, nbuf)) {
             err = kNuErrInternal;
             ReportError(err, "Filename exceeds %d bytes: %s%c%s",
-                MAX_PATH_LEN, dirName, fssep, entry->d_name);
+                MAX_PATH_LEN, pDir->pathname, fssep, pEntry->name);
             goto bail;
         }
 
-        /* form the new name, inserting an fssep if needed */
-        strcpy(nbuf, dirName);
-        if (dirName[len-1] != fssep)
-            nbuf[len++] = fssep;
-        strcpy(nbuf+len, entry->d_name);
-
-        err = UNIXAddFile(pState, pArchive, nbuf);
+        err = UNIXAddEntry(pState, pArchive, nbuf, pEntry, pBatch);
         if (err != kNuErrNone)
             goto bail;
     }
 
 bail:
-    if (dirp != NULL)
-        (void)closedir(dirp);
     return err;
 }
 
 /*
- * Add a file to the list we're adding to the archive.
+ * UNIX-style recursive directory descent.  Scan the whole tree under
+ * "dirName", then add everything we found.
+ */
+static NuError UNIXAddDirectory(NulibState* pState, NuArchive* pArchive,
+    const char* dirName)
+{
+    NuError err;
+    DirScan scan;
+    AddBatch batch;
+    void* args[kMaxJobs];
+    ScanDir* pRoot;
+    long jobCount;
+    int i;
+
+    Assert(pState != NULL);
+    Assert(pArchive != NULL);
+    Assert(dirName != NULL);
+
+    memset(&batch, 0, sizeof(batch));
+    pRoot = NewScanDir(dirName);
+    if (pRoot == NULL) {
+        err = kNuErrMalloc;
+        ReportError(err, "failed on '%s'", dirName);
+        goto bail;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    scan.pState = pState;
+    scan.pPending = pRoot;
+
+    jobCount = NState_GetJobCount(pState);
+    Assert(jobCount >= 1 && jobCount <= kMaxJobs);
+    for (i = 0; i < jobCount; i++)
+        args[i] = &scan;
+    RunWorkers(ScanWorker, args, jobCount);
+    Assert(scan.pPending == NULL && scan.numBusy == 0);
+
+    err = AddScannedDirectory(pState, pArchive, pRoot, &batch);
+    if (err == kNuErrNone)
+        err = SubmitAddBatch(pState, pArchive, &batch);
+
+bail:
+    FreeAddBatch(&batch);
+    FreeScanDir(pRoot);
+    return err;
+}
+
+/*
+ * Add a file that has been examined, either by the directory scan or
+ * by UNIXAddFile.
  *
  * If the file is a directory, and we allow recursing into subdirectories,
- * this calls UNIXAddDirectory.  If we don't allow recursion, this just
- * returns without an error.
+ * we add its contents.  If we don't allow recursion, this just returns
+ * without an error.
  *
- * Returns with an error if the file doesn't exist or isn't readable.
+ * If "pBatch" is non-NULL, files are added to it instead of the archive.
  */
-static NuError UNIXAddFile(NulibState* pState, NuArchive* pArchive,
-    const char* pathname)
+static NuError UNIXAddEntry(NulibState* pState, NuArchive* pArchive,
+    const char* pathname, const ScanEntry* pEntry, AddBatch* pBatch)
 {
     NuError err = kNuErrNone;
-    Boolean exists, isDir, isReadable;
     NuFileDetails details;
+    const uint32_t* pFinderTypes = NULL;
     struct stat sb;
 
-    Assert(pState != NULL);
-    Assert(pArchive != NULL);
-    Assert(pathname != NULL);
-
-    err = CheckFileStatus(pathname, &sb, &exists, &isReadable, &isDir);
-    if (err != kNuErrNone) {
+    if (pEntry->err != kNuErrNone) {
+        err = pEntry->err;
         ReportError(err, "unexpected error while examining '%s'", pathname);
         goto bail;
     }
 
-    if (!exists) {
+    if (!pEntry->exists) {
         err = kNuErrFileNotFound;
         ReportError(err, "couldn't find '%s'", pathname);
         goto bail;
     }
-    if (!isReadable) {
+    if (!pEntry->isReadable) {
         ReportError(kNuErrNone, "file '%s' isn't readable", pathname);
         err = kNuErrFileNotReadable;
         goto bail;
     }
-    if (isDir) {
-        if (NState_GetModRecurse(pState))
-            err = UNIXAddDirectory(pState, pArchive, pathname);
+    if (pEntry->isDir) {
+        if (NState_GetModRecurse(pState)) {
+            if (pEntry->pSubdir != NULL) {
+                Assert(pBatch != NULL);
+                err = AddScannedDirectory(pState, pArchive, pEntry->pSubdir,
+                        pBatch);
+            } else
+                err = UNIXAddDirectory(pState, pArchive, pathname);
+        }
         goto bail_quiet;
     }
 
@@ -994,13 +1427,29 @@ static NuError UNIXAddFile(NulibState* pState, NuArchive* pArchive,
      */
     DBUG(("+++ ADD '%s'\n", pathname));
 
-    err = GetFileDetails(pState, pathname, &sb, &details);
+    memset(&sb, 0, sizeof(sb));
+    sb.st_mode = pEntry->mode;
+    sb.st_size = pEntry->size;
+    sb.st_mtime = pEntry->mtime;
+#ifdef MAC_LIKE
+    /* the scan looked them up; UNIXAddFile didn't (and has no name) */
+    if (pEntry->name != NULL)
+        pFinderTypes = pEntry->finderTypes;
+#endif
+
+    err = GetFileDetails(pState, pathname, &sb, pFinderTypes, &details);
     if (err != kNuErrNone)
         goto bail;
 
-    err = DoAddFile(pState, pArchive, pathname, &details);
-    if (err != kNuErrNone)
-        goto bail_quiet;
+    if (pBatch != NULL) {
+        err = AddToBatch(pBatch, pathname, &details);
+        if (err != kNuErrNone)
+            goto bail;
+    } else {
+        err = DoAddFile(pState, pArchive, pathname, &details);
+        if (err != kNuErrNone)
+            goto bail_quiet;
+    }
 
 bail:
     if (err != kNuErrNone)
@@ -1009,6 +1458,35 @@ bail_quiet:
     return err;
 }
 
+/*
+ * Add a file to the list we're adding to the archive.
+ *
+ * Returns with an error if the file doesn't exist or isn't readable.
+ */
+static NuError UNIXAddFile(NulibState* pState, NuArchive* pArchive,
+    const char* pathname)
+{
+    NuError err;
+    ScanEntry entry;
+    struct stat sb;
+
+    Assert(pState != NULL);
+    Assert(pArchive != NULL);
+    Assert(pathname != NULL);
+
+    memset(&entry, 0, sizeof(entry));
+    entry.err = CheckFileStatus(pathname, &sb, &entry.exists,
+                    &entry.isReadable, &entry.isDir);
+    if (entry.err == kNuErrNone && entry.exists) {
+        entry.mode = sb.st_mode;
+        entry.size = sb.st_size;
+        entry.mtime = sb.st_mtime;
+    }
+
+    err = UNIXAddEntry(pState, pArchive, pathname, &entry, NULL);
+    return err;
+}
+
 #elif defined(WINDOWS_LIKE) /* ---- Windows -------------------------------- */
 
 /*
@@ -1221,7 +1699,7 @@ static NuError Win32AddFile(NulibState* pState, NuArchive* pArchive,
      */
     DBUG(("+++ ADD '%s'\n", pathname));
 
-    err = GetFileDetails(pState, pathname, &sb, &details);
+    err = GetFileDetails(pState, pathname, &sb, NULL, &details);
     if (err != kNuErrNone)
         goto bail;
 
@@ -1332,3 +1810,156 @@ bail:
     return err;
 }
 
+
+
+/*
+ * ===========================================================================
+ *      Worker threads
+ * ===========================================================================
+ */
+
+/*
+ * Lock for the state shared by parallel extract/test workers, which
+ * includes the console.  Without thread support the workers run one
+ * after another, so this does nothing.
+ */
+#if defined(HAVE_PTHREAD)
+static pthread_mutex_t gSharedStateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gSharedStateCond = PTHREAD_COND_INITIALIZER;
+#elif defined(_WIN32)
+static SRWLOCK gSharedStateLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE gSharedStateCond = CONDITION_VARIABLE_INIT;
+#endif
+
+void LockSharedState(void)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_mutex_lock(&gSharedStateLock);
+#elif defined(_WIN32)
+    AcquireSRWLockExclusive(&gSharedStateLock);
+#endif
+}
+
+void UnlockSharedState(void)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_mutex_unlock(&gSharedStateLock);
+#elif defined(_WIN32)
+    ReleaseSRWLockExclusive(&gSharedStateLock);
+#endif
+}
+
+/*
+ * Wait for another worker to call WakeSharedState().  The lock must be
+ * held; it's released while we wait, and held again when we return.
+ *
+ * Without thread support, only one worker runs at a time, so there's
+ * nobody to wait for.  Callers must not wait for work that only a
+ * worker that hasn't started yet could do.
+ */
+void WaitSharedState(void)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_cond_wait(&gSharedStateCond, &gSharedStateLock);
+#elif defined(_WIN32)
+    (void) SleepConditionVariableSRW(&gSharedStateCond, &gSharedStateLock,
+            INFINITE, 0);
+#endif
+}
+
+/*
+ * Wake up every worker sitting in WaitSharedState().
+ */
+void WakeSharedState(void)
+{
+#if defined(HAVE_PTHREAD)
+    (void) pthread_cond_broadcast(&gSharedStateCond);
+#elif defined(_WIN32)
+    WakeAllConditionVariable(&gSharedStateCond);
+#endif
+}
+
+typedef struct WorkerStart {
+    WorkerFunc      func;
+    void*           arg;
+    Boolean         running;
+#if defined(HAVE_PTHREAD)
+    pthread_t       thread;
+#elif defined(_WIN32)
+    HANDLE          thread;
+#endif
+} WorkerStart;
+
+#if defined(HAVE_PTHREAD)
+static void* WorkerMain(void* arg)
+{
+    WorkerStart* pStart = arg;
+
+    (*pStart->func)(pStart->arg);
+    return NULL;
+}
+#elif defined(_WIN32)
+static unsigned __stdcall WorkerMain(void* arg)
+{
+    WorkerStart* pStart = arg;
+
+    (*pStart->func)(pStart->arg);
+    return 0;
+}
+#endif
+
+/*
+ * Call "func" once for each of the "count" entries in "args", in parallel,
+ * and wait for them all to finish.  The first one runs on the caller's
+ * thread.  If a thread can't be started, or we don't have thread support,
+ * the function is called directly instead.
+ */
+void RunWorkers(WorkerFunc func, void* const* args, int count)
+{
+    WorkerStart* starts;
+    int i;
+
+    Assert(func != NULL);
+    Assert(count > 0);
+
+    starts = Calloc(count * sizeof(*starts));
+    if (starts == NULL) {
+        for (i = 0; i < count; i++)
+            (*func)(args[i]);
+        return;
+    }
+
+    for (i = 1; i < count; i++) {
+        starts[i].func = func;
+        starts[i].arg = args[i];
+#if defined(HAVE_PTHREAD)
+        if (pthread_create(&starts[i].thread, NULL, WorkerMain,
+                &starts[i]) == 0)
+        {
+            starts[i].running = true;
+        }
+#elif defined(_WIN32)
+        starts[i].thread = (HANDLE) _beginthreadex(NULL, 0, WorkerMain,
+                            &starts[i], 0, NULL);
+        if (starts[i].thread != NULL)
+            starts[i].running = true;
+#endif
+    }
+
+    (*func)(args[0]);
+
+    for (i = 1; i < count; i++) {
+        if (!starts[i].running) {
+            (*func)(args[i]);
+            continue;
+        }
+#if defined(HAVE_PTHREAD)
+        (void) pthread_join(starts[i].thread, NULL);
+#elif defined(_WIN32)
+        (void) WaitForSingleObject(starts[i].thread, INFINITE);
+        CloseHandle(starts[i].thread);
+#endif
+    }
+
+    Free(starts);
+}